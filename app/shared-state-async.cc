@@ -39,15 +39,43 @@
 
 static CrashStackTrace gCrashStackTrace;
 
+/// Stopped on SIGINT and SIGTERM by peer operation
+static IOContext* gPeerIoContext = nullptr;
+static void stopPeer(int) { gPeerIoContext->stop(); }
+
 int main(int argc, char* argv[])
 {
+	const auto peerUsageFun = [&]()
+	{
+		std::cerr << "Usage: " << argv[0] << " peer"
+		          << " [IDLE-TIMEOUT [SYNC-CONCURRENCY [LISTEN-BACKLOG"
+		          << " [MAX-HANDLERS [THREADS]]]]]" << std::endl
+		          << "  IDLE-TIMEOUT      seconds before closing an idle peer"
+		          << " connection, default "
+		          << SharedState::DEFAULT_CONNECTION_IDLE_TIMEOUT.count()
+		          << std::endl
+		          << "  SYNC-CONCURRENCY  peers synced in parallel, default "
+		          << SharedState::DEFAULT_SYNC_CONCURRENCY << std::endl
+		          << "  LISTEN-BACKLOG    pending incoming connections, default "
+		          << ListeningSocket::DEFAULT_LISTEN_BACKLOG << std::endl
+		          << "  MAX-HANDLERS      incoming connections served at once,"
+		          << " default "
+		          << SharedStateCli::DEFAULT_MAX_REQ_SYNC_HANDLERS << std::endl
+		          << "  THREADS           threads serving incoming connections,"
+		          << " default 0 to serve them in the main thread" << std::endl;
+	};
+
 	const auto usageFun = [&]()
 	{
 		std::cerr << "Usage: " << argv[0] << " OPERATION [ARGUMENTS]"
 		          << std::endl
 		          << "Supported operations: "
 		             "discover, dump, get, insert, peer, register, sync"
+		          << std::endl
+		          << "Set SHARED_STATE_IO_BACKEND=io_uring in the environment "
+		             "to use io_uring instead of epoll"
 		          << std::endl;
+		peerUsageFun();
 	};
 
 	if(argc < 2)
@@ -65,7 +93,14 @@ int main(int argc, char* argv[])
 	}
 
 	std::task<SharedStateCli::NoReturn> pendingTask;
-	auto ioContext = IOContext::setup();
+	/* io_uring saves most of the syscalls, but it is not available on every
+	 * kernel so it must be explicitely requested */
+	const char* ioBackendEnv = getenv("SHARED_STATE_IO_BACKEND");
+	const auto ioBackend =
+	        ioBackendEnv && std::string(ioBackendEnv) == "io_uring" ?
+	            IOContext::Backend::IO_URING : IOContext::Backend::EPOLL;
+
+	auto ioContext = IOContext::setup(ioBackend);
 	SharedStateCli sharedState(*ioContext);
 
 	auto mainRun = [&](auto&& pTask)
@@ -80,11 +115,47 @@ int main(int argc, char* argv[])
 
 	if(operationName == "peer")
 	{
+		if(argc > 7)
+		{
+			peerUsageFun();
+			return -EINVAL;
+		}
+
 		/* We expect write failures, expecially on sockets, to occur but we want
 		 * to handle them where the error occurs rather than in a SIGPIPE
 		 * handler */
 		signal(SIGPIPE, SIG_IGN);
-		mainRun(sharedState.peer());
+
+		const std::chrono::seconds connectionIdleTimeout = argc > 2 ?
+		            std::chrono::seconds(std::stoul(argv[2])) :
+		            SharedState::DEFAULT_CONNECTION_IDLE_TIMEOUT;
+		const std::size_t syncConcurrency = argc > 3 ?
+		            std::stoul(argv[3]) :
+		            SharedState::DEFAULT_SYNC_CONCURRENCY;
+		const int listenBacklog = argc > 4 ?
+		            std::stoi(argv[4]) :
+		            ListeningSocket::DEFAULT_LISTEN_BACKLOG;
+		const std::size_t maxReqSyncHandlers = argc > 5 ?
+		            std::stoul(argv[5]) :
+		            SharedStateCli::DEFAULT_MAX_REQ_SYNC_HANDLERS;
+		const std::size_t reqSyncThreads = argc > 6 ?
+		            std::stoul(argv[6]) : 0;
+
+		/* Let request serving threads finish their round before exiting, so
+		 * none of them is interrupted while modifying the state */
+		gPeerIoContext = ioContext.get();
+		signal(SIGINT, stopPeer);
+		signal(SIGTERM, stopPeer);
+
+		mainRun(sharedState.peer(
+		            connectionIdleTimeout, syncConcurrency, listenBacklog,
+		            maxReqSyncHandlers, reqSyncThreads ));
+
+		/* Suspended coroutines still own their descriptors, so exit without
+		 * destroying the IOContext */
+		sharedState.stopReqSyncThreads();
+		RS_INFO("Stopped");
+		exit(0);
 	}
 
 	if(argc < 3)
@@ -132,10 +203,11 @@ int main(int argc, char* argv[])
 
 	if(operationName == "register")
 	{
-		if(argc != 6)
+		if(argc != 6 && argc != 7)
 		{
 			std::cerr << "Usage: " << argv[0] << " " << argv[1]
 			          << " DATA-TYPE TYPE-SCOPE UPDATE-INTERVAL BLEACH-TTL"
+			          << " [MAX-MESSAGE-SIZE]"
 			          << std::endl;
 			return -EINVAL;
 		}
@@ -143,9 +215,13 @@ int main(int argc, char* argv[])
 		const std::string typeSope(argv[3]);
 		const std::chrono::seconds updateInterval(std::stoul(argv[4]));
 		const std::chrono::seconds bleachTTL(std::stoul(argv[5]));
+		const uint64_t maxMessageSize = argc == 7 ?
+		            std::stoull(argv[6]) :
+		            SharedState::DEFAULT_TYPE_MAX_MESSAGE_SIZE;
 
 		mainRun(sharedState.registerDataType(
-		            dataTypeName, typeSope, updateInterval, bleachTTL ));
+		            dataTypeName, typeSope, updateInterval, bleachTTL,
+		            maxMessageSize ));
 	}
 
 	std::cerr << "Unsupported operation: " << operationName << std::endl;
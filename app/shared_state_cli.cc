@@ -25,6 +25,9 @@
 #include <iterator>
 #include <string>
 #include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
 
 #include <serialiser/rsserializable.h>
 #include <serialiser/rstypeserializer.h>
@@ -63,9 +66,11 @@ std::task<NoReturn> SharedStateCli::insert(const std::string& typeName)
 		auto& entry = tState[member.name.GetString()];
 		entry.mAuthor = authorPlaceOlder();
 		// Take in account merge being conservative
-		entry.mTtl = mTypeConf[typeName].mBleachTTL +
-		        mTypeConf[typeName].mUpdateInterval + std::chrono::seconds(1);
+		entry.setTtl( mTypeConf[typeName].mBleachTTL +
+		              mTypeConf[typeName].mUpdateInterval +
+		              std::chrono::seconds(1) );
 		entry.mData.CopyFrom(member.value, entry.mData.GetAllocator());
+		entry.invalidateEncodedData();
 	}
 
 	co_await SharedState::syncWithPeer(typeName, localInstanceAddr());
@@ -136,123 +141,220 @@ std::task<NoReturn> SharedStateCli::get(const std::string& typeName)
 }
 
 std::task<NoReturn> SharedStateCli::acceptReqSyncConnectionsLoop(
-        ListeningSocket& listener )
+        std::shared_ptr<ReqSyncListener> listener )
 {
+	std::vector<std::shared_ptr<AsyncSocket>> sockets;
 	while(true)
 	{
-		auto socket = co_await listener.accept();
-
-		/* Going out of scope the returned task is destroyed, we need to
-		 * detach the coroutine otherwise it will be abruptly stopped too before
-		 * finishing the job */
-		std::error_condition reqSyncErr;
-		bool tSuccess = co_await
-		        SharedState::handleReqSyncConnection(socket, &reqSyncErr);
+		/* Over the limit leave further connections waiting in the listen
+		 * backlog until some handler is done */
+		co_await ReqSyncHandlerSlot{*listener};
+
+		sockets.clear();
+		std::error_condition acceptErr;
+		const bool acceptOk = co_await listener->mSocket->acceptPending(
+		            sockets, listener->mMaxHandlers - listener->mHandlers,
+		            &acceptErr );
+
+		/* Since WIRE_PROTO_VERSION_PERSISTENT a connection may stay open
+		 * waiting for further requests, and anyway we want to serve all
+		 * neighbours in parallel, so handle each connection in its own
+		 * coroutine. Going out of scope the returned task is destroyed, we
+		 * need to detach the coroutine otherwise it will be abruptly stopped
+		 * too before finishing the job */
+		for(auto& socket: sockets)
+		{
+			++listener->mHandlers;
+			serveReqSyncConnection(std::move(socket), listener).detach();
+		}
+
+		/* Running out of file descriptors or similar, give handlers some
+		 * time to release resources instead of spinning */
+		if(!acceptOk) RS_UNLIKELY
+		{
+			RS_WARN("Failure accepting connections: ", acceptErr);
+			co_await SleepOperation(
+			            listener->mSocket->getIOContext(),
+			            std::chrono::steady_clock::now() +
+			                std::chrono::milliseconds(100) );
+		}
 	}
 }
 
+std::task<bool> SharedStateCli::serveReqSyncConnection(
+        std::shared_ptr<AsyncSocket> socket,
+        std::shared_ptr<ReqSyncListener> listener )
+{
+	/* Error bubbling storage must live as long as the detached coroutine */
+	std::error_condition reqSyncErr;
+	bool tSuccess = co_await
+	        SharedState::handleReqSyncConnection(socket, &reqSyncErr);
+	RS_DBG3( tSuccess ? "Success" : "Failure",
+	         " handling sync connection error: ", reqSyncErr );
+
+	--listener->mHandlers;
+	if(listener->mAcceptLoopWaiter)
+		std::exchange(listener->mAcceptLoopWaiter, nullptr).resume();
+
+	co_return tSuccess;
+}
+
+void SharedStateCli::reqSyncThreadMain(
+        IOContext& ioContext, int listenBacklog, std::size_t maxHandlers )
+{
+	ioContext.setRunLock(mStateLock);
+
+	auto listener = std::make_shared<ReqSyncListener>();
+	listener->mMaxHandlers = maxHandlers;
+	listener->mSocket = ListeningSocket::setupListener(
+	            SharedState::TCP_PORT, ioContext, listenBacklog, true );
+
+	RS_INFO( "Listening on TCP port: ", SharedState::TCP_PORT, " ",
+	         *listener->mSocket );
+
+	/* The accept loop runs until the first suspension before run() takes
+	 * the lock, so take it here as handlers may start touching the state */
+	auto acceptConnectionsTask = acceptReqSyncConnectionsLoop(listener);
+	{
+		std::lock_guard<std::mutex> tLock(mStateLock);
+		acceptConnectionsTask.resume();
+	}
+
+	ioContext.run();
+
+	/* Handlers still pending keep the listener alive, but the accept loop
+	 * frame goes away with its task, they must not resume it anymore */
+	listener->mAcceptLoopWaiter = nullptr;
+}
+
+void SharedStateCli::stopReqSyncThreads()
+{
+	for(auto& ioContext: mReqSyncIoContexts) ioContext->stop();
+	for(auto& thread: mReqSyncThreads) thread.join();
+	mReqSyncThreads.clear();
+}
+
 std::task<NoReturn> SharedStateCli::bleachDataLoop()
 {
 	/* Do bleach in it's own loop so bleaching is done regularly even if other
 	 * operations slow down or hang up temporarly.
-	 * That bleaching happens regurarly is fundamental for the network
-	 * functioning. */
-	std::chrono::steady_clock::time_point lastBleachCompletedTS =
-	        std::chrono::steady_clock::now();
-	std::error_condition tErr;
-	auto asyncTimer = AsyncTimer::create(mIoContext, &tErr);
-
-	while( asyncTimer && !tErr &&
-	       co_await asyncTimer->wait(
-	           std::chrono::seconds(0), std::chrono::milliseconds(999), &tErr) )
+	 * Entries expiry is absolute so even if we happen to be called less then
+	 * once per second TTLs sent to other nodes are not affected. */
+	PeriodicTimer bleachTimer(mIoContext, std::chrono::seconds(1));
+	while(true)
 	{
-		loadRegisteredTypes();
+		co_await bleachTimer.tick();
 
-		/* If the process has been very busy we might end up being called
-		 * less then once per second, if that dealy become noticeable it can be
-		 * problematic for the whole network so take in account how much time
-		 * has passed since last complete bleach */
-		const auto elapsedTimeSinceLastBleach =
-		        std::chrono::steady_clock::now() - lastBleachCompletedTS;
-		const auto bleachTimes =
-		        elapsedTimeSinceLastBleach > std::chrono::seconds(1) ?
-		        elapsedTimeSinceLastBleach : std::chrono::seconds(1);
+		loadRegisteredTypes();
 
 		for(auto&& [typeName, typeConf]: std::as_const(mTypeConf))
-			bleach( typeName,
-			        std::chrono::duration_cast<std::chrono::seconds>(bleachTimes) );
-		lastBleachCompletedTS = std::chrono::steady_clock::now();
+			bleach(typeName);
 	}
-
-	rs_error_bubble_or_exit(tErr, nullptr, "Bleach timer wait failed");
 }
 
 
-std::task<NoReturn> SharedStateCli::peer()
+std::task<NoReturn> SharedStateCli::peer(
+        std::chrono::seconds connectionIdleTimeout,
+        std::size_t syncConcurrency, int listenBacklog,
+        std::size_t maxReqSyncHandlers, std::size_t reqSyncThreads )
 {
 	isPeer = true;
+	setConnectionIdleTimeout(connectionIdleTimeout);
+	setSyncConcurrency(syncConcurrency);
+	maxReqSyncHandlers = std::max<std::size_t>(1, maxReqSyncHandlers);
 
 	loadRegisteredTypes();
 
-	auto listener = ListeningSocket::setupListener(
-	            SharedState::TCP_PORT, mIoContext );
+	auto listener = std::make_shared<ReqSyncListener>();
+	std::task<NoReturn> acceptConnectionsTask;
+	if(reqSyncThreads)
+	{
+		/* From now on the state is owned by whichever thread holds the lock,
+		 * let run() resume us holding it before starting the other threads */
+		mIoContext.setRunLock(mStateLock);
+		co_await YieldOperation(mIoContext);
+		mIsStateShared = true;
+
+		/* Each thread gets its share of handlers and its own listener, the
+		 * kernel spreads incoming connections among them */
+		const auto threadMaxHandlers = std::max<std::size_t>(
+		            1, maxReqSyncHandlers / reqSyncThreads );
+		for(std::size_t i = 0; i < reqSyncThreads; ++i)
+		{
+			auto& ioContext = mReqSyncIoContexts.emplace_back(
+			            IOContext::setup(mIoContext.getBackend()) );
+			mReqSyncThreads.emplace_back(
+			            &SharedStateCli::reqSyncThreadMain, this,
+			            std::ref(*ioContext), listenBacklog,
+			            threadMaxHandlers );
+		}
+	}
+	else
+	{
+		listener->mMaxHandlers = maxReqSyncHandlers;
+		listener->mSocket = ListeningSocket::setupListener(
+		            SharedState::TCP_PORT, mIoContext, listenBacklog );
 
-	RS_INFO("Listening on TCP port: ", SharedState::TCP_PORT, " ", *listener);
+		RS_INFO( "Listening on TCP port: ", SharedState::TCP_PORT, " ",
+		         *listener->mSocket );
 
-	auto acceptConnectionsTask = acceptReqSyncConnectionsLoop(*listener);
-	acceptConnectionsTask.resume();
+		acceptConnectionsTask = acceptReqSyncConnectionsLoop(listener);
+		acceptConnectionsTask.resume();
+	}
 
 	auto bleachDataTask = SharedStateCli::bleachDataLoop();
 	bleachDataTask.resume();
 
-	std::error_condition tErr;
-	auto asyncTimer = AsyncTimer::create(mIoContext, &tErr);
-
-	while( asyncTimer && !tErr &&
-	      co_await asyncTimer->wait(
-	          std::chrono::seconds(0),
-	          std::chrono::milliseconds(999), &tErr) )
+	/* Ticks don't drift with time spent syncing, and when a round takes
+	 * longer than a tick, types which got due meanwhile are synced on the
+	 * next one instead of being skipped */
+	PeriodicTimer syncTimer(mIoContext, std::chrono::seconds(1));
+	auto lastRound = std::chrono::time_point_cast<std::chrono::seconds>(
+	            std::chrono::steady_clock::now() ).time_since_epoch().count();
+	while(true)
 	{
-		/* TODO: Evaluate how much time skew, due to not accouinting for
-		 * time spent during syncing, might affect data propagation
-		 * correctness and convergence. If it causes problems in real
-		 * networks adjust timer wait at each iteration depending on how
-		 * much time is elapsed during the iteration */
+		const auto elapsedTicks = co_await syncTimer.tick();
+		if(elapsedTicks > 1) RS_UNLIKELY
+			RS_INFO( "Sync round took longer than expected, missed ",
+			         elapsedTicks - 1, " ticks" );
 
 		loadRegisteredTypes();
 
+		std::error_condition idleErr;
+		if(!co_await closeIdleConnections(&idleErr)) RS_UNLIKELY
+			RS_WARN("Failure closing idle connections: ", idleErr);
+
 		const auto tNow = std::chrono::time_point_cast<std::chrono::seconds>(
-		            std::chrono::steady_clock::now() );
+		            std::chrono::steady_clock::now() ).time_since_epoch().count();
 		std::vector<std::string> shouldSyncTypes;
 		for(auto&& [typeName, typeConf]: std::as_const(mTypeConf))
 		{
-			if( tNow.time_since_epoch().count() %
-			        typeConf.mUpdateInterval.count() ) RS_LIKELY
+			// Due if a multiple of the interval passed since last round
+			const auto tInterval = typeConf.mUpdateInterval.count();
+			if( tInterval <= 0 ||
+			        tNow / tInterval == lastRound / tInterval ) RS_LIKELY
 			    continue;
 
 			shouldSyncTypes.push_back(typeName);
 		}
+		lastRound = tNow;
 		if(shouldSyncTypes.empty()) continue;
 
 		std::vector<sockaddr_storage> peersAddresses;
 		co_await getCandidatesNeighbours(peersAddresses, mIoContext);
 
-		for(auto&& typeName: std::as_const(shouldSyncTypes))
-		{
-			for(auto&& peerAddress : std::as_const(peersAddresses))
-			{
-				std::error_condition errInfo;
-				bool peerSynced = co_await
-				        SharedState::syncWithPeer(
-				            typeName, peerAddress, &errInfo );
-				RS_DBG3( peerSynced ? "Success" : "Failure",
-				         " synchronizing data type: ",  typeName,
-				         " with peer: ", peerAddress, " error: ", errInfo );
-			}
-		}
+		/* All due data types are synchronized together with each peer, so
+		 * connection, handshake and statistics overhead is payed once, and
+		 * peers are synchronized concurrently so the round lasts as long as
+		 * the slowest peer takes */
+		auto results = co_await SharedState::syncWithPeers(
+		            shouldSyncTypes, peersAddresses );
+		for([[maybe_unused]] auto&& result: std::as_const(results))
+			RS_DBG3( result.mSuccess ? "Success" : "Failure",
+			         " synchronizing ", shouldSyncTypes.size(),
+			         " data types with peer: ", result.mPeer,
+			         " error: ", result.mError );
 	}
-
-	exit(tErr.value());
 }
 
 
@@ -280,48 +382,42 @@ std::task<NoReturn> SharedStateCli::sync(
 {
 	std::vector<sockaddr_storage> peerAddresses;
 
-	// First to get local instance state
-	peerAddresses.push_back(SharedState::localInstanceAddr());
-
 	/* Peers weren't specified let's discover potential peers */
 	if(pPeerAddresses.empty())
 	{
-		std::vector<sockaddr_storage> discoveredPeersAddresses;
 		std::error_condition mErr;
 		if(! co_await SharedState::getCandidatesNeighbours(
-		        discoveredPeersAddresses, mIoContext, &mErr ))
+		        peerAddresses, mIoContext, &mErr ))
 		{
 			RS_FATAL("Failure discovering peers ", mErr);
 			exit(mErr.value());
 		}
-
-		peerAddresses.insert(
-		            peerAddresses.end(),
-		            discoveredPeersAddresses.begin(),
-		            discoveredPeersAddresses.end() );
 	}
-	else
-		peerAddresses.insert(
-		            peerAddresses.end(),
-		            pPeerAddresses.begin(),
-		            pPeerAddresses.end() );
-
-	// Last to sync collected changes back to local instance
-	peerAddresses.push_back(SharedState::localInstanceAddr());
+	else peerAddresses = pPeerAddresses;
 
 	int retval = 0;
-	for(auto&& peerAddress: std::as_const(peerAddresses))
+	auto reportResult = [&retval](const PeerSyncResult& result)
 	{
-		std::error_condition errInfo;
-		bool peerSynced = co_await
-		        syncWithPeer(dataTypeName, peerAddress, &errInfo);
-		if(!peerSynced)
-		{
-			RS_INFO( "Failure syncronizing with peer: ", peerAddress,
-			         " error: ", errInfo );
-			retval = errInfo.value();
-		}
-	}
+		if(result.mSuccess) return;
+		RS_INFO( "Failure syncronizing with peer: ", result.mPeer,
+		         " error: ", result.mError );
+		retval = result.mError.value();
+	};
+
+	std::vector<std::string> typeNames(1, dataTypeName);
+	std::vector<sockaddr_storage> localInstance(
+	            1, SharedState::localInstanceAddr() );
+
+	// First to get local instance state
+	for(auto&& result: co_await syncWithPeers(typeNames, localInstance))
+		reportResult(result);
+
+	for(auto&& result: co_await syncWithPeers(typeNames, peerAddresses))
+		reportResult(result);
+
+	// Last to sync collected changes back to local instance
+	for(auto&& result: co_await syncWithPeers(typeNames, localInstance))
+		reportResult(result);
 
 	if(retval)
 		RS_ERR("Some errors occurred, see previous messages for details");
@@ -330,8 +426,10 @@ std::task<NoReturn> SharedStateCli::sync(
 
 std::task<NoReturn> SharedStateCli::registerDataType(
         const std::string& typeName, const std::string& typeSope,
-        std::chrono::seconds updateInterval, std::chrono::seconds TTL )
+        std::chrono::seconds updateInterval, std::chrono::seconds TTL,
+        uint64_t maxMessageSize )
 {
-	SharedState::registerDataType(typeName, typeSope, updateInterval, TTL);
+	SharedState::registerDataType(
+	            typeName, typeSope, updateInterval, TTL, maxMessageSize );
 	exit(0);
 }
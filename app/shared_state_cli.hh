@@ -21,6 +21,8 @@
 
 #pragma once
 
+#include <thread>
+
 #include "sharedstate.hh"
 #include "io_context.hh"
 
@@ -53,11 +55,39 @@ struct SharedStateCli: SharedState
 	 * can be considered as a remove equivalent for most types */
 	std::task<NoReturn> insert(const std::string& typeName);
 
-	std::task<NoReturn> peer();
+	/** Run as peer, serving and periodically synchronizing all data types
+	 * @param connectionIdleTimeout close connections to peers unused for
+	 *	this long
+	 * @param syncConcurrency maximum number of peers synchronized at same
+	 *	time
+	 * @param listenBacklog maximum number of connections waiting to be
+	 *	accepted
+	 * @param maxReqSyncHandlers maximum number of incoming connections served
+	 *	at same time
+	 * @param reqSyncThreads if not zero incoming connections are accepted and
+	 *	served by this many threads, each with its own listener and IOContext,
+	 *	@see mStateLock, stopReqSyncThreads */
+	std::task<NoReturn> peer(
+	        std::chrono::seconds connectionIdleTimeout =
+	            DEFAULT_CONNECTION_IDLE_TIMEOUT,
+	        std::size_t syncConcurrency = DEFAULT_SYNC_CONCURRENCY,
+	        int listenBacklog = ListeningSocket::DEFAULT_LISTEN_BACKLOG,
+	        std::size_t maxReqSyncHandlers = DEFAULT_MAX_REQ_SYNC_HANDLERS,
+	        std::size_t reqSyncThreads = 0 );
+
+	/** Stop the threads started by peer() and wait for them to finish, each
+	 * stops at the end of its current round, releasing mStateLock. The caller
+	 * must not hold it */
+	void stopReqSyncThreads();
+
+	/** Default maximum number of incoming connections served at same time,
+	 * persistent connections count while idle too */
+	static constexpr std::size_t DEFAULT_MAX_REQ_SYNC_HANDLERS = 64;
 
 	std::task<NoReturn> registerDataType(
 	        const std::string& typeName, const std::string& typeSope,
-	        std::chrono::seconds updateInterval, std::chrono::seconds TTL );
+	        std::chrono::seconds updateInterval, std::chrono::seconds TTL,
+	        uint64_t maxMessageSize = DEFAULT_TYPE_MAX_MESSAGE_SIZE );
 
 	/**
 	 * @param peerAddresses address to sync with, if empty an attempt to
@@ -67,6 +97,50 @@ struct SharedStateCli: SharedState
 	                          const std::vector<sockaddr_storage>& peerAddresses );
 
 protected:
-	std::task<NoReturn> acceptReqSyncConnectionsLoop(ListeningSocket& listener);
+	/** Listening socket and the incoming connections it is serving, shared
+	 * with the detached handlers as they may outlive the accept loop */
+	struct ReqSyncListener
+	{
+		std::shared_ptr<ListeningSocket> mSocket;
+
+		/// Incoming connections being served
+		std::size_t mHandlers = 0;
+		std::size_t mMaxHandlers = DEFAULT_MAX_REQ_SYNC_HANDLERS;
+
+		/// Accept loop waiting for an handler to finish
+		std::coroutine_handle<> mAcceptLoopWaiter;
+	};
+
+	std::task<NoReturn> acceptReqSyncConnectionsLoop(
+	        std::shared_ptr<ReqSyncListener> listener );
+
+	/** Handle a connection in a detached coroutine, @see
+	 * acceptReqSyncConnectionsLoop */
+	std::task<bool> serveReqSyncConnection(
+	        std::shared_ptr<AsyncSocket> socket,
+	        std::shared_ptr<ReqSyncListener> listener );
+
+	/** Body of each thread started by peer(), accept and serve incoming
+	 * connections on its own IOContext and SO_REUSEPORT listener, until
+	 * the IOContext is stopped */
+	void reqSyncThreadMain(
+	        IOContext& ioContext, int listenBacklog, std::size_t maxHandlers );
+
+	/** IOContexts of the threads started by peer(), they outlive the threads
+	 * as descriptors of connections still being served are left open */
+	std::vector<std::unique_ptr<IOContext>> mReqSyncIoContexts;
+	std::vector<std::thread> mReqSyncThreads;
+
+	/// Awaiting it suspends the accept loop while handlers are at the limit
+	struct ReqSyncHandlerSlot
+	{
+		ReqSyncListener& mListener;
+
+		bool await_ready() const noexcept
+		{ return mListener.mHandlers < mListener.mMaxHandlers; }
+		void await_suspend(std::coroutine_handle<> acceptLoop)
+		{ mListener.mAcceptLoopWaiter = acceptLoop; }
+		void await_resume() const noexcept {}
+	};
 	std::task<NoReturn> bleachDataLoop();
 };
@@ -31,13 +31,13 @@ class ListeningSocket;
  * @brief Implements an asynchronous Socket Accept Operation
  * 
  */
-class AcceptOperation : public AwaitableSyscall<AcceptOperation, int>
+class [[nodiscard]] AcceptOperation : public AwaitableSyscall<AcceptOperation, int>
 {
 public:
 	explicit AcceptOperation(
 	        ListeningSocket& socket,
 	        std::error_condition* ec = nullptr );
-	~AcceptOperation();
 
 	int syscall();
+	bool prepareSqe(io_uring_sqe& sqe);
 };
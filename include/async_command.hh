@@ -28,6 +28,8 @@
 
 #include "async_file_descriptor.hh"
 #include "io_context.hh"
+#include "read_operation.hh"
+#include "write_operation.hh"
 
 #include <util/rsdebug.h>
 #include <util/rsdebuglevel1.h>
@@ -95,10 +97,10 @@ public:
 		}
 	};
 
-	std::task<ssize_t> readStdOut(
+	[[nodiscard]] ReadOp readStdOut(
 	        uint8_t* buffer, std::size_t len,
 	        std::error_condition* errbub = nullptr );
-	std::task<ssize_t> writeStdIn(
+	[[nodiscard]] WriteOp writeStdIn(
 	        const uint8_t *buffer, std::size_t len,
 	        std::error_condition* errbub = nullptr );
 	inline pid_t getPid() const { return mProcessId; }
@@ -22,14 +22,19 @@
  */
 #pragma once
 
+#include <chrono>
 #include <memory>
+#include <mutex>
 #include <queue>
+#include <vector>
 #include <fcntl.h>
+#include <sys/epoll.h>
 #include <system_error>
 #include <ostream>
 
 #include "task.hh"
 #include "epoll_events_to_string.hh"
+#include "io_uring.hh"
 
 #include <util/rsdebug.h>
 #include <util/stacktrace.h>
@@ -55,53 +60,115 @@ public:
 		}
 	}
 
-	/**
-	 * @param events optional epoll events flags, just used for debugging
-	 */
-	bool resumePendingOps(uint32_t events)
+	/** Operation waiting for the descriptor to become ready, IOContext calls
+	 * onReady() which either completes it resuming the awaiting coroutine or
+	 * puts it back in the pending queue */
+	class PendingOperation
 	{
-		auto numPending = mPendigOps.size();
-		RS_DBG2(*this, " numPending: ", numPending);
+	public:
+		virtual void onReady() = 0;
 
-		if(!numPending)
-		{
-			RS_DBG2( *this,
-			         " attempt to resume pending operations on descriptor which"
-					 " have none due: ", epoll_events_to_string(events) );
-			return false;
-		}
+	protected:
+		~PendingOperation() = default;
+	};
 
-		/* Iterate at most numPending times to avoid re-looping on coroutines
-		 * that needs to wait again and are re-appended on the pending queue
-		 */
-		for(; numPending > 0; --numPending, mPendigOps.pop())
-			mPendigOps.front().resume();
-
-		return true;
+	/// Readiness an operation waits for
+	enum class OpDirection : uint8_t
+	{
+		INPUT,
+		OUTPUT
+	};
+
+	/** Resume operations waiting for the readiness reported by epoll events,
+	 * errors and hangups resume operations in both directions so they can
+	 * notice it
+	 * @return false if there was no operation to resume */
+	bool resumePendingOps(uint32_t events)
+	{
+		constexpr uint32_t bothDirections = EPOLLERR | EPOLLHUP;
+		bool resumed = false;
+		if(events & (EPOLLIN | EPOLLPRI | EPOLLRDHUP | bothDirections))
+			resumed = resumeQueue(mInputOps) || resumed;
+		if(events & (EPOLLOUT | bothDirections))
+			resumed = resumeQueue(mOutputOps) || resumed;
+
+		if(!resumed)
+			RS_DBG3( *this, " no pending operations due: ",
+			         epoll_events_to_string(events) );
+		return resumed;
 	}
 
-	void addPendingOp(std::coroutine_handle<> op)
+	void addPendingOp(PendingOperation& op, OpDirection direction);
+
+	inline bool hasPendingOps() const
 	{
-		mPendigOps.push(op);
-		RS_DBG2(*this, " numPending: ", mPendigOps.size());
+		return !mInputOps.empty() || !mOutputOps.empty() ||
+		        !mInFlightOps.empty();
 	}
 
-	inline uint32_t getIoState() const { return mIoState; }
-	inline uint32_t setIoState(uint32_t state)
+	/** @return true if some operation would notice deadline expiration
+	 * only if IOContext intervenes */
+	inline bool isAwaitingDeadline() const
 	{
-		RS_DBG4(state);
-		mIoState = state;
-		return mIoState;
+		return !mInputOps.empty() || !mOutputOps.empty() ||
+		        (!mInFlightOps.empty() && !mInFlightCancelled);
 	}
 
-	inline uint32_t getNextIoState() const { return mNextIOState; }
-	inline uint32_t setNextIoState(uint32_t state)
+	/** @return io_uring operations on this descriptor are submitted to, or
+	 * nullptr if IOContext uses epoll */
+	inline IoUring* getIoUring() const { return mIoUring; }
+
+	/** Let coroutines of other IOContexts sharing the run lock go on while
+	 * doing something which touches only data owned by the awaiting
+	 * coroutine, like syscalls on its buffers. Does nothing unless
+	 * IOContext::run() is holding the lock. Nothing may be co_awaited while
+	 * it is alive
+	 * @see IOContext::setRunLock */
+	class RunUnlock
 	{
-		RS_DBG4(state);
-		mNextIOState = state;
-		return mNextIOState;
+	public:
+		explicit RunUnlock(const AsyncFileDescriptor& aFD):
+		    RunUnlock(aFD.mRunLock) {}
+
+		/// @param runLock as held by IOContext::run(), may be nullptr
+		explicit RunUnlock(std::unique_lock<std::mutex>* runLock):
+		    mLock(runLock && runLock->owns_lock() ? runLock : nullptr)
+		{ if(mLock) mLock->unlock(); }
+
+		~RunUnlock() { if(mLock) mLock->lock(); }
+
+		RunUnlock(const RunUnlock&) = delete;
+
+	private:
+		std::unique_lock<std::mutex>* const mLock;
+	};
+
+	/// Operations submitted to io_uring and not completed yet
+	void addInFlightOp(UringCompletion* op);
+	void removeInFlightOp(UringCompletion* op)
+	{
+		std::erase(mInFlightOps, op);
+		if(mInFlightOps.empty()) mInFlightCancelled = false;
 	}
 
+	/// Means operations may wait forever
+	static constexpr auto NO_DEADLINE =
+	        std::chrono::steady_clock::time_point::max();
+
+	/** Operations on this descriptor still waiting at deadline are taken out
+	 * of the pending queue by IOContext and fail with std::errc::timed_out,
+	 * the same happens to operations which would need to wait after it.
+	 * Pass NO_DEADLINE to wait forever again */
+	inline void setDeadline(std::chrono::steady_clock::time_point deadline)
+	{ mDeadline = deadline; }
+	inline std::chrono::steady_clock::time_point getDeadline() const
+	{ return mDeadline; }
+
+	inline bool isDeadlineExpired(
+	        std::chrono::steady_clock::time_point now =
+	            std::chrono::steady_clock::now() ) const
+	{ return mDeadline != NO_DEADLINE && now >= mDeadline; }
+
 	inline int getFD() const { return mFD; }
 	inline IOContext& getIOContext() const { return mIOContext; }
 
@@ -128,17 +195,44 @@ protected:
 	IOContext& mIOContext;
 
 private:
-	uint32_t mIoState = 0;
-	uint32_t mNextIOState = 0;
-
-	/**
-	 * @brief Keep pending operation in a queue.
-	 * The new operation queuing works very well in our case, but I
-	 * haven't reasoned enough if it would work also in other protocols
-	 * or with multiple threads. In particular shared-state protocol
-	 * is question-answer so on the same socket/file read and write
-	 * never happen at same time, and are always in order one after
-	 * another, this is not guaranted for every protocol but for now I
-	 * got no time to think more on this */
-	std::queue<std::coroutine_handle<>> mPendigOps;
+	/// @see IOContext::markWaiting
+	bool mIsMarkedWaiting = false;
+
+	std::chrono::steady_clock::time_point mDeadline = NO_DEADLINE;
+
+	IoUring* mIoUring = nullptr;
+
+	/// Run lock as held by IOContext::run(), @see RunUnlock
+	std::unique_lock<std::mutex>* mRunLock = nullptr;
+
+	/** Few operations at time are in flight on the same descriptor, a vector
+	 * is cheaper then any fancier container */
+	std::vector<UringCompletion*> mInFlightOps;
+
+	/// Cancellation of in flight operations already requested to the kernel
+	bool mInFlightCancelled = false;
+
+	/** Operations waiting for the descriptor to become readable or writable,
+	 * separated so one coroutine can be receiving while another one is
+	 * sending on the same socket, and neither is resumed by events which
+	 * cannot be for it */
+	std::queue<PendingOperation*> mInputOps;
+	std::queue<PendingOperation*> mOutputOps;
+
+	static bool resumeQueue(std::queue<PendingOperation*>& ops)
+	{
+		/* Iterate at most numPending times to avoid re-looping on operations
+		 * that needs to wait again and are re-appended on the pending queue
+		 */
+		auto numPending = ops.size();
+		if(!numPending) return false;
+
+		for(; numPending > 0; --numPending)
+		{
+			PendingOperation* tOp = ops.front();
+			ops.pop();
+			tOp->onReady();
+		}
+		return true;
+	}
 };
@@ -23,10 +23,15 @@
 
 #pragma once
 
+#include <chrono>
 #include <memory>
+#include <vector>
 #include <sys/socket.h>
 
 #include "async_file_descriptor.hh"
+#include "recv_operation.hh"
+#include "send_operation.hh"
+#include "send_vector_operation.hh"
 #include "task.hh"
 
 class IOContext;
@@ -39,22 +44,59 @@ class AsyncSocket : public AsyncFileDescriptor
 public:
 	AsyncSocket(const AsyncSocket&) = delete;
 
-	std::task<ssize_t> recv(
+	/** Receive exactly len bytes, less only if the peer closed the connection.
+	 * The returned operation is meant to be co_await-ed right away, it keeps
+	 * receiving by itself without allocating a coroutine frame */
+	[[nodiscard]] RecvOperation recv(
 	        uint8_t *buffer, std::size_t len,
 	        std::error_condition* errbub = nullptr );
 
-	std::task<ssize_t> send(
+	/// Send all len bytes, @see recv
+	[[nodiscard]] SendOperation send(
 	        const uint8_t* buffer, std::size_t len,
 	        std::error_condition* errbub = nullptr );
 
+	/** Send all buffers with as few syscalls as possible, @see recv
+	 * @param iov modified while sending, must stay valid until completion
+	 * @param moreFollows hold the data in the kernel, like TCP_CORK does,
+	 *	until the next send without it, so they go out in the same segment
+	 */
+	[[nodiscard]] SendVectorOperation sendVector(
+	        std::span<iovec> iov, bool moreFollows = false,
+	        std::error_condition* errbub = nullptr );
+
 	bool getPeerAddr(
 	        sockaddr_storage& peerAddr,
 	        std::error_condition* errbub = nullptr );
 
+	/** Enable TCP keep alive probes after idleTime without traffic, so a
+	 * connection whose peer disappeared without closing it gets an error
+	 * instead of staying open forever */
+	bool setKeepAlive(
+	        std::chrono::seconds idleTime,
+	        std::error_condition* errbub = nullptr );
+
+	/** Reads shorter than this, like message header fields, receive up to this
+	 * many bytes at once and serve the following ones from memory */
+	static constexpr std::size_t READ_AHEAD_SIZE = 4096;
+
 protected:
 	friend IOContext;
 	AsyncSocket(int fd, IOContext& io_context):
 	    AsyncFileDescriptor(fd, io_context) {}
+
+private:
+	friend RecvOperation;
+
+	/** Same as recv(2) but bytes received in advance are served first, and
+	 * short reads fill the read ahead buffer, while longer ones go straight
+	 * into buffer */
+	ssize_t recvBuffered(uint8_t* buffer, std::size_t len);
+
+	/// Allocated on first short read, then reused for the socket lifetime
+	std::unique_ptr<uint8_t[]> mReadAhead;
+	std::size_t mReadAheadBegin = 0;
+	std::size_t mReadAheadEnd = 0;
 };
 
 class ConnectingSocket: public AsyncSocket
@@ -63,9 +105,13 @@ public:
 	ConnectingSocket() = delete;
 	ConnectingSocket(const ConnectingSocket&) = delete;
 
+	/** @param deadline give up connecting at this time, it is kept as the
+	 *	deadline of the returned socket @see AsyncFileDescriptor::setDeadline
+	 */
 	static std::task<std::shared_ptr<ConnectingSocket>> connect(
 	        const sockaddr_storage& address,
 	        IOContext& ioContext,
+	        std::chrono::steady_clock::time_point deadline = NO_DEADLINE,
 	        std::error_condition* errbub = nullptr );
 
 protected:
@@ -80,10 +126,32 @@ public:
 	ListeningSocket() = delete;
 	ListeningSocket(const ListeningSocket&) = delete;
 
-	std::task<std::shared_ptr<AsyncSocket>> accept();
+	/** Accept a connection, waiting for one if none is pending
+	 * @return nullptr on error */
+	std::task<std::shared_ptr<AsyncSocket>> accept(
+	        std::error_condition* errbub = nullptr );
 
+	/** Wait for a connection then accept it together with all the other
+	 * pending ones, as a single edge triggered wakeup may stand for many of
+	 * them.
+	 * @param maxSockets accept at most this many connections, the others are
+	 *	left waiting in the listen backlog
+	 * @return false on error, connections accepted before the error are
+	 *	appended to sockets anyway */
+	std::task<bool> acceptPending(
+	        std::vector<std::shared_ptr<AsyncSocket>>& sockets,
+	        std::size_t maxSockets, std::error_condition* errbub = nullptr );
+
+	static constexpr int DEFAULT_LISTEN_BACKLOG = 64;
+
+	/**
+	 * @param reusePort set SO_REUSEPORT so many listeners, each on its own
+	 *	thread and IOContext, can bind the same port, the kernel then spreads
+	 *	incoming connections among them
+	 */
 	static std::shared_ptr<ListeningSocket> setupListener(
 	        uint16_t port, IOContext& ioContext,
+	        int backlog = DEFAULT_LISTEN_BACKLOG, bool reusePort = false,
 	        std::error_condition* ec = nullptr );
 
 protected:
@@ -91,5 +159,8 @@ protected:
 	ListeningSocket(int fd, IOContext& io_context):
 	    AsyncFileDescriptor(fd, io_context) {}
 
-	static constexpr int DEFAULT_LISTEN_BACKLOG = 8;
+	/** Register an accepted socket file descriptor in the IOContext
+	 * @return nullptr on error */
+	std::shared_ptr<AsyncSocket> registerAccepted(
+	        int fd, std::error_condition* errbub );
 };
@@ -21,18 +21,68 @@
 #pragma once
 
 #include <chrono>
+#include <coroutine>
+#include <cstdint>
 #include <memory>
+#include <system_error>
 
-#include "async_file_descriptor.hh"
 #include "io_context.hh"
+#include "task.hh"
 
 #include <util/rsdebug.h>
 #include <util/rsdebuglevel1.h>
 
+/**
+ * @brief Suspend the awaiting coroutine until wakeUp, backed by IOContext
+ * timers so no file descriptor or syscall is involved
+ */
+class [[nodiscard]] SleepOperation
+{
+public:
+	SleepOperation(
+	        IOContext& ioContext,
+	        std::chrono::steady_clock::time_point wakeUp ):
+	    mIOContext(ioContext), mWakeUp(wakeUp) {}
+
+	bool await_ready() const noexcept
+	{ return std::chrono::steady_clock::now() >= mWakeUp; }
+
+	void await_suspend(std::coroutine_handle<> awaitingCoroutine)
+	{ mIOContext.addTimer(mWakeUp, awaitingCoroutine); }
+
+	void await_resume() const noexcept {}
+
+private:
+	IOContext& mIOContext;
+	const std::chrono::steady_clock::time_point mWakeUp;
+};
+
+/**
+ * @brief Suspend the awaiting coroutine until the next round of
+ * IOContext::run(), unlike a SleepOperation already due it always suspends,
+ * so the coroutine goes on holding the run lock
+ * @see IOContext::setRunLock
+ */
+class [[nodiscard]] YieldOperation
+{
+public:
+	explicit YieldOperation(IOContext& ioContext): mIOContext(ioContext) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> awaitingCoroutine)
+	{ mIOContext.addTimer(std::chrono::steady_clock::now(), awaitingCoroutine); }
+
+	void await_resume() const noexcept {}
+
+private:
+	IOContext& mIOContext;
+};
+
 /**
  * @brief Async timer
  */
-class AsyncTimer : public AsyncFileDescriptor
+class AsyncTimer
 {
 public:
 	/**
@@ -62,7 +112,37 @@ public:
 	~AsyncTimer() = default;
 
 protected:
-	friend IOContext;
-	AsyncTimer(int fd, IOContext &ioContext):
-	    AsyncFileDescriptor(fd, ioContext) {}
+	explicit AsyncTimer(IOContext& ioContext): mIOContext(ioContext) {}
+
+	IOContext& mIOContext;
+};
+
+/**
+ * @brief Timer ticking at fixed multiples of the period since creation, so
+ * time spent by the caller between ticks doesn't accumulate drift
+ */
+class PeriodicTimer
+{
+public:
+	PeriodicTimer(
+	        IOContext& ioContext, std::chrono::steady_clock::duration period ):
+	    mIOContext(ioContext), mPeriod(period),
+	    mNextTick(std::chrono::steady_clock::now() + period) {}
+
+	/**
+	 * @brief Asynchronously waits for next tick
+	 * @return number of periods elapsed since previous tick, more then one
+	 *	means the caller took so long that ticks have been missed
+	 */
+	std::task<uint64_t> tick();
+
+	inline std::chrono::steady_clock::duration period() const
+	{ return mPeriod; }
+
+	PeriodicTimer(const PeriodicTimer&) = delete;
+
+private:
+	IOContext& mIOContext;
+	const std::chrono::steady_clock::duration mPeriod;
+	std::chrono::steady_clock::time_point mNextTick;
 };
@@ -25,6 +25,7 @@
 
 #include <cerrno>
 #include <coroutine>
+#include <cstring>
 #include <memory>
 #include <type_traits>
 #include <iostream>
@@ -46,8 +47,6 @@
  * On the contrary if a valid pointer is passed, when an error occurr the
  * information about the error will be stored there for the upstream caller to
  * deal with it.
- * @tparam multiShot true if wrapped syscall may cause epoll_wait to return more
- * then once before being ready/complete, waitpid is an example of that.
  * @tparam errorValue customize value that represent failure returned by syscall
  *
  * Derived classes MUST pass themselves as SyscallOpt and implement the
@@ -59,17 +58,41 @@
  * The syscall method is where the actuall syscall must happen, on failure
  * errorValue must be returned, if more attempts are needed errno must be set to
  * EAGAIN @see shouldWait() for other errno values interpreted like EAGAIN
+ *
+ * Derived classes MAY also implement the following methods to support the
+ * io_uring backend, otherwise the operation is always performed by syscall():
+ * @code{.cpp}
+ * // Fill the submission, return false and set errno if it cannot be done
+ * bool prepareSqe(io_uring_sqe& sqe);
+ * // Optional, convert the completion result, by default negative values are
+ * // errno and cause errorValue to be returned
+ * ReturnType completeSqe(int32_t result);
+ * @endcode
+ *
+ * Derived classes which wait for the descriptor to be writable MUST declare
+ * it, otherwise they are resumed only when it becomes readable:
+ * @code{.cpp}
+ * static constexpr auto DIRECTION = AsyncFileDescriptor::OpDirection::OUTPUT;
+ * @endcode
+ *
+ * Derived classes which must transfer a whole buffer MAY declare its length,
+ * then the syscall is repeated, and the io_uring submission resubmitted, on
+ * partial transfers, without resuming the awaiting coroutine in between.
+ * Their syscall() and prepareSqe(...) must skip the first transferred() bytes
+ * of the buffer:
+ * @code{.cpp}
+ * std::size_t transferLength() const;
+ * @endcode
  */
 template < typename SyscallOp,
            typename ReturnType,
-           bool multiShot = false,
            ReturnType errorValue = -1 >
-class AwaitableSyscall
+class AwaitableSyscall : public AsyncFileDescriptor::PendingOperation
 {
 public:
 	AwaitableSyscall( AsyncFileDescriptor& afd,
 	                  std::error_condition* ec = nullptr ):
-	    mError{ec}, mAFD(afd)
+	    mAFD(afd), mError{ec}
 	{
 		/* Put static checks here and not in template class scope to avoid
 		 * invalid use of imcomplete type xxxOperation compiler errors */
@@ -77,6 +100,12 @@ public:
 		static_assert(requires(SyscallOp& op) { op.syscall(); });
 	}
 
+	/** Once awaited the operation is referenced by IOContext, or io_uring, by
+	 * address, so it must never be copied or moved. Factory functions still
+	 * return it by value thanks to guaranteed copy elision */
+	AwaitableSyscall(const AwaitableSyscall&) = delete;
+	AwaitableSyscall& operator=(const AwaitableSyscall&) = delete;
+
 	bool await_ready() const noexcept
 	{
 		RS_DBG3(mAFD);
@@ -86,88 +115,76 @@ public:
 	bool await_suspend(std::coroutine_handle<> awaitingCoroutine)
 	{
 		mAwaitingCoroutine = awaitingCoroutine;
-		mReturnValue = static_cast<SyscallOp*>(this)->syscall();
 
-		RS_DBG2( mAFD,
-		         " shouldWait(): ", shouldWait(mReturnValue, errno),
-		         " mReturnValue: ", mReturnValue,
-		         " ", rs_errno_to_condition(errno) );
+		if constexpr (SUPPORTS_URING)
+			if(IoUring* tUring = mAFD.getIoUring()) return submit(*tUring);
 
-		if(shouldWait(mReturnValue, errno))
-		{
-			/* The syscall indicated we must wait, and retry later so let's
-			 * suspend to return the control to the caller and be resumed later
-			 */
-			suspend();
-			return true;
-		}
+		/* Instantaneous success or hard failure must not suspend at all */
+		if(attempt()) return false;
 
-		if(mReturnValue == errorValue)
+		/* No point to wait if we are already late, fail without suspending */
+		if(mAFD.isDeadlineExpired()) RS_UNLIKELY
 		{
-			/* The syscall failed for other reason let's notify the caller if
-			 * possible or close the program printing an error */
-
-			RS_DBG2( "syscall failed with ret: ", mReturnValue,
-			         " errno: ", rs_errno_to_condition(errno) );
-			rs_error_bubble_or_exit(
-			            rs_errno_to_condition(errno), mError,
-			            " syscall failed" );
-
-			/* If downstream callers apparently get an error before crashing,
-			 * but print errno 0, the reason is NEVER the failed syscall
-			 * that forgot to set it but some null/dangling pointer that bubble
-			 * up, due to a missing check, undetected in the call stack, so when
-			 * an error is finally printed  the errno value it is getting got
-			 * most likely borked at some point, and is not the original from
-			 * the syscall */
+			timedOut();
+			return false;
 		}
 
-		/* Instantaneous success or hard failure must not suspend at all */
-		return false;
+		/* The syscall indicated we must wait, and retry later so let's
+		 * suspend to return the control to the caller and be resumed later */
+		suspend();
+		return true;
 	}
 
-	ReturnType await_resume()
+	/** Called by IOContext when the descriptor became ready, the syscall is
+	 * attempted again here so the awaiting coroutine is resumed only once the
+	 * whole operation is done, without bouncing to it on partial transfers or
+	 * on events another operation consumed already */
+	void onReady() override
 	{
-		if(!mDidSuspend)
-		{
-			/* Operation was completed on first attempt, without suspending,
-			 * just return the result */
-			RS_DBG2( mAFD, " completed at firts attempt mReturnValue: ",
-			         mReturnValue );
-			return mReturnValue;
-		}
+		/* IOContext resumes operations waiting past the deadline after
+		 * taking them out of the pending queue, same happens if we got
+		 * resumed by a late event */
+		if(mAFD.isDeadlineExpired()) RS_UNLIKELY timedOut();
 
-		// We had to suspend last time, so we need to attempt the syscall again
-		mReturnValue = static_cast<SyscallOp *>(this)->syscall();
-		RS_DBG2(mAFD, " syscall returns: ", mReturnValue );
-
-		if(multiShot && shouldWait(mReturnValue, errno))
+		/* Descriptors are watched edge triggered, so we may have been
+		 * notified by an event which another operation consumed already, just
+		 * wait again */
+		else if(!attempt())
 		{
-			RS_DBG1( "syscall want more waiting on resume ",
-			         "mReturnValue: ", mReturnValue,
-			         rs_errno_to_condition(errno) );
+			RS_DBG2(mAFD, " syscall want more waiting on resume");
 			suspend();
+			return;
 		}
-		else if(mReturnValue == errorValue)
-		{
-			RS_DBG1( "syscall failed on resume ",
-			         "mReturnValue: ", mReturnValue,
-			         rs_errno_to_condition(errno) );
-			rs_error_bubble_or_exit(
-			            rs_errno_to_condition(errno), mError,
-			            "syscall failed on resume" );
-		}
 
+		mAwaitingCoroutine.resume();
+	}
+
+	ReturnType await_resume()
+	{
+		if constexpr (SUPPORTS_URING) if(mDidSubmit) return completed();
+
+		RS_DBG2(mAFD, " completed mReturnValue: ", mReturnValue);
 		return mReturnValue;
 	}
 
-	void suspend()
+	/** Readiness the operation waits for, the base class must not declare a
+	 * DIRECTION itself, otherwise derived classes not declaring it would find
+	 * that one while it is still being initialized */
+	static constexpr AsyncFileDescriptor::OpDirection direction()
 	{
-		RS_DBG2(mAFD, " ", mAwaitingCoroutine.address());
-		mDidSuspend = true;
-		mAFD.addPendingOp(mAwaitingCoroutine);
+		if constexpr (requires { SyscallOp::DIRECTION; })
+			return SyscallOp::DIRECTION;
+		else return AsyncFileDescriptor::OpDirection::INPUT;
 	}
 
+	static constexpr bool SUPPORTS_URING =
+	        requires(SyscallOp& op, io_uring_sqe& sqe) { op.prepareSqe(sqe); };
+
+	/** Operations declaring the length of their buffer keep calling the
+	 * syscall until it is all transferred, or the peer closed the stream */
+	static constexpr bool TRANSFER_ALL =
+	        requires(SyscallOp& op) { op.transferLength(); };
+
 	/**
 	 * @brief errno tell we should wait or not?
 	 * @param sErrno errno as set by the previous syscall
@@ -180,13 +197,161 @@ public:
 		                                   errno == EINPROGRESS );
 	}
 
+protected:
+	/// Bytes already transferred by TRANSFER_ALL operations
+	inline std::size_t transferred() const { return mTransferred; }
+
+	AsyncFileDescriptor& mAFD;
+
 private:
-	bool mDidSuspend = false;
+	/** Call the syscall until the operation is done
+	 * @return false if we need to wait for the descriptor to be ready */
+	bool attempt()
+	{
+		while(true)
+		{
+			/* The syscall touches only buffers owned by the awaiting
+			 * coroutine, so other threads can access the shared state
+			 * meanwhile, relocking must not clobber errno */
+			ReturnType tRet;
+			int tErrno;
+			{
+				AsyncFileDescriptor::RunUnlock tUnlock(mAFD);
+				tRet = static_cast<SyscallOp*>(this)->syscall();
+				tErrno = errno;
+			}
+			errno = tErrno;
+
+			RS_DBG2( mAFD,
+			         " shouldWait(): ", shouldWait(tRet, errno),
+			         " syscall returns: ", tRet,
+			         " ", rs_errno_to_condition(errno) );
+
+			if(shouldWait(tRet, errno)) return false;
+
+			if(tRet == errorValue)
+			{
+				/* The syscall failed for other reason let's notify the caller
+				 * if possible or close the program printing an error */
+				mReturnValue = errorValue;
+				rs_error_bubble_or_exit(
+				            rs_errno_to_condition(errno), mError,
+				            " syscall failed" );
+
+				/* If downstream callers apparently get an error before
+				 * crashing, but print errno 0, the reason is NEVER the failed
+				 * syscall that forgot to set it but some null/dangling pointer
+				 * that bubble up, due to a missing check, undetected in the
+				 * call stack, so when an error is finally printed  the errno
+				 * value it is getting got most likely borked at some point,
+				 * and is not the original from the syscall */
+				return true;
+			}
+
+			if constexpr (TRANSFER_ALL)
+			{
+				mTransferred += static_cast<std::size_t>(tRet);
+				if( tRet && mTransferred <
+				        static_cast<SyscallOp*>(this)->transferLength() )
+					continue;
+				mReturnValue = static_cast<ReturnType>(mTransferred);
+			}
+			else mReturnValue = tRet;
+
+			return true;
+		}
+	}
+
+	void suspend()
+	{
+		RS_DBG2(mAFD, " ", mAwaitingCoroutine.address());
+		mAFD.addPendingOp(*this, direction());
+	}
+
+	/** Submit the operation to io_uring, the awaiting coroutine is resumed by
+	 * IOContext when it completes
+	 * @return true if the coroutine must suspend */
+	bool submit(IoUring& uring)
+	{
+		if(mAFD.isDeadlineExpired()) RS_UNLIKELY
+		{
+			timedOut();
+			return false;
+		}
+
+		auto& tSqe = mCompletion.mSqe;
+		memset(&tSqe, 0, sizeof(tSqe));
+		if(!static_cast<SyscallOp*>(this)->prepareSqe(tSqe)) RS_UNLIKELY
+		{
+			mReturnValue = errorValue;
+			rs_error_bubble_or_exit(
+			            rs_errno_to_condition(errno), mError,
+			            mAFD, " failed preparing io_uring submission" );
+			return false;
+		}
+
+		mCompletion.mTransferAll = TRANSFER_ALL;
+		if(!uring.submit(mCompletion)) RS_UNLIKELY
+		{
+			mReturnValue = errorValue;
+			rs_error_bubble_or_exit(
+			            std::errc::resource_unavailable_try_again, mError,
+			            mAFD, " io_uring submission queue full" );
+			return false;
+		}
+
+		mCompletion.mCoroutine = mAwaitingCoroutine;
+		mAFD.addInFlightOp(&mCompletion);
+		mDidSubmit = true;
+		return true;
+	}
+
+	/// Deal with io_uring completion result
+	ReturnType completed()
+	{
+		mAFD.removeInFlightOp(&mCompletion);
+		const int32_t tResult = mCompletion.mResult;
+		RS_DBG2(mAFD, " io_uring completion result: ", tResult);
+
+		/* IOContext cancels in flight operations when the deadline expires,
+		 * but the operation may have completed meanwhile */
+		if(tResult == -ECANCELED && mAFD.isDeadlineExpired()) RS_UNLIKELY
+		{
+			timedOut();
+			return mReturnValue;
+		}
+
+		if constexpr (requires(SyscallOp& op) { op.completeSqe(tResult); })
+			mReturnValue = static_cast<SyscallOp*>(this)->completeSqe(tResult);
+		else if(tResult < 0)
+		{
+			errno = -tResult;
+			mReturnValue = errorValue;
+		}
+		else mReturnValue = static_cast<ReturnType>(tResult);
+
+		if(mReturnValue == errorValue) RS_UNLIKELY
+			rs_error_bubble_or_exit(
+			            rs_errno_to_condition(errno), mError,
+			            "io_uring operation failed" );
+
+		return mReturnValue;
+	}
+
+	/// Fail because the AsyncFileDescriptor deadline expired
+	void timedOut()
+	{
+		RS_DBG1(mAFD, " deadline expired");
+		mReturnValue = errorValue;
+		rs_error_bubble_or_exit(
+		            std::errc::timed_out, mError, mAFD, " deadline expired" );
+	}
+
+	bool mDidSubmit = false;
+	UringCompletion mCompletion;
 	std::coroutine_handle<> mAwaitingCoroutine;
 
 	std::error_condition* const mError = nullptr;
 	ReturnType mReturnValue = errorValue;
-
-protected:
-	AsyncFileDescriptor& mAFD;
+	std::size_t mTransferred = 0;
 };
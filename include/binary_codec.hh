@@ -0,0 +1,97 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <util/rsjson.h>
+
+/**
+ * @brief Append compact binary representation of primitive types and JSON
+ * values to a buffer.
+ * Integers are written as LEB128 varints, so small values like TTLs and
+ * lenghts take just one or two bytes, strings are length prefixed.
+ * JSON values are written as a one byte tag followed by the value payload,
+ * objects and arrays are prefixed by their number of elements, numbers keep
+ * their exact integer or floating point representation.
+ */
+class BinaryWriter
+{
+public:
+	explicit BinaryWriter(std::vector<uint8_t>& buffer): mBuffer(buffer) {}
+
+	void writeUint8(uint8_t value) { mBuffer.push_back(value); }
+	void writeVarint(uint64_t value);
+	void writeBytes(const uint8_t* data, std::size_t len);
+
+	/// Write varint lenght followed by string bytes
+	void writeString(std::string_view str);
+
+	void writeJson(const rapidjson::Value& value);
+
+	/// @return number of bytes needed to write value as varint
+	static std::size_t varintSize(uint64_t value);
+
+private:
+	std::vector<uint8_t>& mBuffer;
+};
+
+/**
+ * @brief Read data written by BinaryWriter out of a buffer.
+ * The buffer is not copied so it must outlive the reader.
+ * All methods return false if the buffer doesn't contain enough valid data,
+ * in that case the reader state is undefined and it should be discarded.
+ */
+class BinaryReader
+{
+public:
+	BinaryReader(const uint8_t* data, std::size_t len):
+	    mCur(data), mEnd(data + len) {}
+
+	bool readUint8(uint8_t& value);
+	bool readVarint(uint64_t& value);
+	bool readString(std::string& str);
+
+	/// The view points inside the buffer, no copy happens
+	bool readStringView(std::string_view& str);
+
+	bool readJson(
+	        rapidjson::Value& value, RsJson::AllocatorType& allocator );
+
+	bool skip(std::size_t len);
+
+	inline std::size_t remaining() const { return mEnd - mCur; }
+	inline const uint8_t* current() const { return mCur; }
+
+	/** JSON values coming from the network may be nested on purpose to exhaust
+	 * the stack, refuse them past this depth */
+	static constexpr unsigned MAX_JSON_DEPTH = 64;
+
+private:
+	bool readJson(
+	        rapidjson::Value& value, RsJson::AllocatorType& allocator,
+	        unsigned depth );
+
+	const uint8_t* mCur;
+	const uint8_t* const mEnd;
+};
@@ -24,7 +24,7 @@
 
 class AsyncFileDescriptor;
 
-class CloseOperation : public AwaitableSyscall<CloseOperation, int>
+class [[nodiscard]] CloseOperation : public AwaitableSyscall<CloseOperation, int>
 {
 public:
 	CloseOperation(
@@ -32,4 +32,5 @@ public:
 	    AwaitableSyscall{afd, ec} {}
 
 	int syscall();
+	bool prepareSqe(io_uring_sqe& sqe);
 };
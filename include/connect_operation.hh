@@ -29,15 +29,19 @@ class ConnectingSocket;
 /**
  * @brief Wrap connect system call for asynchronous operation
  */
-class ConnectOperation : public AwaitableSyscall<ConnectOperation, int>
+class [[nodiscard]] ConnectOperation : public AwaitableSyscall<ConnectOperation, int>
 {
 public:
+	static constexpr auto DIRECTION =
+	        AsyncFileDescriptor::OpDirection::OUTPUT;
+
 	ConnectOperation(
 	        ConnectingSocket& pSocket, const sockaddr_storage& address,
 	        std::error_condition* ec = nullptr );
-	~ConnectOperation();
 
 	int syscall();
+	bool prepareSqe(io_uring_sqe& sqe);
+	int completeSqe(int32_t result);
 
 private:
 	sockaddr_storage mAddr;
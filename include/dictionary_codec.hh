@@ -0,0 +1,58 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+/**
+ * @brief Deflate compression with a preset dictionary.
+ * Raw deflate streams are used, without zlib header and checksum, as framing
+ * and integrity are already taken care by the transport.
+ * Strings which appear in the dictionary can be referenced since the first
+ * byte of the input, so even small inputs get good compression ratios if the
+ * dictionary resembles their content.
+ */
+class DictionaryCodec
+{
+public:
+	/** Deflate window is 32KB, dictionary bytes past it would be ignored */
+	static constexpr std::size_t MAX_DICTIONARY_SIZE = 32*1024;
+
+	/** Append compressed input to output
+	 * @param dictionary may be empty
+	 * @return false on failure, output content is undefined then */
+	static bool compress(
+	        std::span<const uint8_t> input,
+	        std::span<const uint8_t> dictionary,
+	        std::vector<uint8_t>& output );
+
+	/** Append decompressed input to output
+	 * @param dictionary must be the same used to compress
+	 * @param rawSize exact decompressed size, if input expands to more or
+	 *	less bytes decompression fails, so a malicious input cannot make us
+	 *	allocate more memory than expected
+	 * @return false on failure, output content is undefined then */
+	static bool decompress(
+	        std::span<const uint8_t> input,
+	        std::span<const uint8_t> dictionary,
+	        std::size_t rawSize, std::vector<uint8_t>& output );
+};
@@ -23,15 +23,23 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
 #include <type_traits>
+#include <vector>
 #include <fcntl.h>
 #include <sys/epoll.h>
 
 #include "task.hh"
 #include "async_file_descriptor.hh"
 #include "close_operation.hh"
+#include "io_uring.hh"
 
 #include <util/rsdebug.h>
 #include <util/stacktrace.h>
@@ -44,15 +52,58 @@
  * @note Sadly epoll doesn't work with regular files but you can wait
  * asyncronously on a lot of interesting things
  * @see https://darkcoding.net/software/linux-what-can-you-epoll/
+ *
+ * With the io_uring backend operations supporting it are submitted to the
+ * kernel instead of being attempted when epoll reports the descriptor ready,
+ * epoll is then used just to wait for io_uring completions, timers and
+ * deadlines.
  */
 class IOContext
 {
 public:
+	enum class Backend : uint8_t
+	{
+		EPOLL,
+		IO_URING
+	};
+
+	/**
+	 * @param backend if IO_URING is not supported by the kernel fall back to
+	 *	EPOLL
+	 */
 	static std::unique_ptr<IOContext> setup(
+	        Backend backend = Backend::EPOLL,
 	        std::error_condition* errbub = nullptr );
 
+	inline Backend getBackend() const
+	{ return mIoUring ? Backend::IO_URING : Backend::EPOLL; }
+
+	/// Wait for events and resume coroutines until stop() is called
 	void run();
 
+	/** Make run() return at the end of the current round, or as soon as it
+	 * starts waiting for events. Can be called from any thread and from
+	 * signal handlers. Coroutines still suspended stay so, together with
+	 * their descriptors */
+	void stop();
+
+	~IOContext();
+
+	/** Make run() hold runLock while resuming coroutines, releasing it while
+	 * waiting for events and during syscalls, @see
+	 * AsyncFileDescriptor::RunUnlock. IOContexts running on different threads
+	 * sharing the same lock run their coroutines one at time, so data
+	 * accessed by them needs no further synchronization, as long as it is
+	 * not touched out of the coroutines.
+	 * Coroutines resumed before run() don't hold it, if set meanwhile they
+	 * should let run() resume them before touching shared data
+	 * @see YieldOperation */
+	inline void setRunLock(std::mutex& runLock) { mRunLock = &runLock; }
+
+	/** @return run lock of the IOContext running on the calling thread, as
+	 * held by run(), nullptr out of run() */
+	static std::unique_lock<std::mutex>* threadRunLock();
+
 	template<class AFD_T, typename /* = AsyncFileDescriptor and derivatives */>
 	std::shared_ptr<AFD_T> registerFD(
 	        int fd, std::error_condition* errbub = nullptr );
@@ -66,13 +117,19 @@ public:
 
 	// TODO: Take a reference to an AsyncFileDescriptor instead of a pointer
 	// TODO: This methods can fail add error bubbling paramether
-    void attach(AsyncFileDescriptor* socket);
-    void attachReadonly(AsyncFileDescriptor* socket);
-    void attachWriteOnly(AsyncFileDescriptor* socket);
-    void watchRead(AsyncFileDescriptor* socket);
-    void unwatchRead(AsyncFileDescriptor* socket);
-    void watchWrite(AsyncFileDescriptor* socket);
-    void unwatchWrite(AsyncFileDescriptor* socket);
+	void attach(AsyncFileDescriptor* aFD);
+
+	/** Called by AsyncFileDescriptor when an operation starts waiting on it,
+	 * so run() has to look only at descriptors in mWaitingFD */
+	void markWaiting(AsyncFileDescriptor& aFD);
+
+	/** Resume the coroutine at wakeUp or a bit later. Timers live in a heap
+	 * and are expired using epoll_wait timeout, so they cost no file
+	 * descriptor nor syscall. The coroutine must stay suspended until then.
+	 * @see SleepOperation */
+	void addTimer(
+	        std::chrono::steady_clock::time_point wakeUp,
+	        std::coroutine_handle<> coroutine );
 
 	/// Debugging helper
 	friend std::ostream &operator<<(std::ostream& out, const IOContext& ioContext);
@@ -80,12 +137,103 @@ public:
 private:
 	static constexpr int DEFAULT_MAX_EVENTS = 20;
 
-	IOContext(int epollFD): mEpollFD(epollFD) {}
+	/** Resume operations pending on descriptors whose deadline expired, they
+	 * fail with timed out error */
+	void expireDeadlines();
+
+	/// Resume coroutines whose timer expired
+	void fireTimers();
+
+	struct ScheduledTimer
+	{
+		std::chrono::steady_clock::time_point mWakeUp;
+
+		/// Keep insertion order between timers expiring at same time
+		uint64_t mSeq;
+
+		std::coroutine_handle<> mCoroutine;
+
+		bool operator>(const ScheduledTimer& o) const
+		{ return mWakeUp > o.mWakeUp || (mWakeUp == o.mWakeUp && mSeq > o.mSeq); }
+	};
+
+	/// Min heap of timers, the first to expire on top
+	std::priority_queue<
+	    ScheduledTimer, std::vector<ScheduledTimer>,
+	    std::greater<ScheduledTimer> > mTimers;
+	uint64_t mTimersSeq = 0;
+
+	IOContext(int epollFD, int stopFD, std::unique_ptr<IoUring> ioUring):
+	    mEpollFD(epollFD), mStopFD(stopFD), mIoUring(std::move(ioUring)) {}
 
 	const int mEpollFD;
 
-	/** Map OS file descriptor to managed AsyncFileDescriptor */
-	std::map<int, std::shared_ptr<AsyncFileDescriptor>> mManagedFD;
+	/// eventfd waking up epoll_wait when stop() is called
+	const int mStopFD;
+	std::atomic<bool> mStopRequested = false;
+
+	/// @see setRunLock
+	std::mutex* mRunLock = nullptr;
+
+	/** Owns the run lock while run() is resuming coroutines, managed
+	 * descriptors point here, @see AsyncFileDescriptor::RunUnlock */
+	std::unique_lock<std::mutex> mRunLockHeld;
+
+	/// nullptr if using epoll backend
+	const std::unique_ptr<IoUring> mIoUring;
+
+	/** Resume coroutines whose io_uring operation completed, operations the
+	 * kernel refused to wait for are submitted again after polling */
+	void reapUringCompletions();
+
+	/// Managed AsyncFileDescriptor, @see mManagedFD
+	struct ManagedFD
+	{
+		std::shared_ptr<AsyncFileDescriptor> mAFD;
+
+		/** Incremented each time the slot is taken, so events still queued
+		 * for a closed descriptor are not delivered to the next one getting
+		 * the same number */
+		uint32_t mGeneration = 0;
+	};
+
+	/** Managed AsyncFileDescriptor indexed by OS file descriptor, the kernel
+	 * always hands out the lowest free number so it stays dense */
+	std::vector<ManagedFD> mManagedFD;
+	std::size_t mManagedFDCount = 0;
+
+	/** Keys of descriptors which had operations waiting since last round,
+	 * @see epollKey, markWaiting */
+	std::vector<uint64_t> mWaitingFD;
+
+	/** Closed descriptors are kept alive until the end of the round, so
+	 * events dispatch can use plain pointers even if a resumed coroutine
+	 * closes the descriptor */
+	std::vector<std::shared_ptr<AsyncFileDescriptor>> mClosedFD;
+
+	/** epoll_event::data of managed descriptors packs generation and file
+	 * descriptor, so dispatching events needs no lookup */
+	inline uint64_t epollKey(int fd) const
+	{
+		return static_cast<uint64_t>(mManagedFD[fd].mGeneration) << 32 |
+		        static_cast<uint32_t>(fd);
+	}
+
+	/// epoll_event::data of io_uring completion queue
+	static constexpr uint64_t URING_EPOLL_KEY = UINT64_MAX;
+
+	/// epoll_event::data of mStopFD
+	static constexpr uint64_t STOP_EPOLL_KEY = UINT64_MAX - 1;
+
+	/** @return nullptr if the event key is stale */
+	inline AsyncFileDescriptor* managedFD(uint64_t epollKey) const
+	{
+		const auto tFD = static_cast<uint32_t>(epollKey);
+		if(tFD >= mManagedFD.size()) RS_UNLIKELY return nullptr;
+		const auto& tManaged = mManagedFD[tFD];
+		if(tManaged.mGeneration != epollKey >> 32) RS_UNLIKELY return nullptr;
+		return tManaged.mAFD.get();
+	}
 };
 
 template<class AFD_T = AsyncFileDescriptor,
@@ -112,7 +260,15 @@ std::shared_ptr<AFD_T> IOContext::registerFD(
 
 	auto aFD = std::shared_ptr<AFD_T>(
 	            new AFD_T(fd, *this) );
-	mManagedFD[fd] = aFD;
+	aFD->mIoUring = mIoUring.get();
+	aFD->mRunLock = &mRunLockHeld;
+
+	if(static_cast<std::size_t>(fd) >= mManagedFD.size())
+		mManagedFD.resize(fd + 1);
+	auto& tManaged = mManagedFD[fd];
+	if(!tManaged.mAFD) ++mManagedFDCount;
+	tManaged.mAFD = aFD;
+	++tManaged.mGeneration;
 
 	return aFD;
 }
@@ -148,8 +304,9 @@ std::task<bool> IOContext::closeAFD(
 		co_return false;
 	}
 
-	auto fdIt = mManagedFD.find(aFD->mFD);
-	if(fdIt == mManagedFD.end()) RS_UNLIKELY
+	const int tFD = aFD->mFD;
+	if( tFD < 0 || static_cast<std::size_t>(tFD) >= mManagedFD.size() ||
+	        !mManagedFD[tFD].mAFD ) RS_UNLIKELY
 	{
 		// @see OBXIOUS PEDANTINC CHECK
 		rs_error_bubble_or_exit(
@@ -159,7 +316,7 @@ std::task<bool> IOContext::closeAFD(
 		co_return false;
 	}
 
-	if(fdIt->second != aFD) RS_UNLIKELY
+	if(mManagedFD[tFD].mAFD != aFD) RS_UNLIKELY
 	{
 		rs_error_bubble_or_exit(
 			std::errc::state_not_recoverable, nullptr, // Force exit
@@ -171,8 +328,10 @@ std::task<bool> IOContext::closeAFD(
 	/* To avoid stray events on closed socket that still live on kernel side
 	 * unsubscribe them from epoll instead of relying on epoll silently removing
 	 * them when finally closed kernel side
-	 * @see https://stackoverflow.com/a/46987706 */
-	if (epoll_ctl(mEpollFD, EPOLL_CTL_DEL, aFD->mFD, nullptr) == -1) RS_UNLIKELY
+	 * @see https://stackoverflow.com/a/46987706
+	 * With io_uring backend descriptors are not in the epoll set at all */
+	if ( !mIoUring &&
+	     epoll_ctl(mEpollFD, EPOLL_CTL_DEL, aFD->mFD, nullptr) == -1 ) RS_UNLIKELY
 	{
 		// @see OBXIOUS PEDANTINC CHECK
 		rs_error_bubble_or_exit(
@@ -196,7 +355,15 @@ std::task<bool> IOContext::closeAFD(
 	}
 
 	aFD->mFD = -1;
-	mManagedFD.erase(fdIt);
+
+	/* With io_uring backend the number might have been taken already by a
+	 * descriptor registered while the close was in flight */
+	auto& tManaged = mManagedFD[tFD];
+	if(tManaged.mAFD == aFD)
+	{
+		mClosedFD.push_back(std::move(tManaged.mAFD));
+		--mManagedFDCount;
+	}
 
 	co_return sysCloseRet == 0;
 }
@@ -0,0 +1,154 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+#pragma once
+
+#include <coroutine>
+#include <cstdint>
+#include <memory>
+#include <system_error>
+#include <linux/io_uring.h>
+
+/** Convert poll events to the endianess IORING_OP_POLL_ADD expects them in
+ * io_uring_sqe::poll32_events, which stays compatible with kernels reading
+ * just the 16 bit io_uring_sqe::poll_events */
+constexpr uint32_t uringPollEvents(uint32_t events)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (events << 16) | (events >> 16);
+#else
+	return events;
+#endif
+}
+
+/**
+ * @brief Bookkeeping of an operation submitted to IoUring, user_data of the
+ * submission points to it so the completion can resume the coroutine.
+ * A copy of the submission is kept to submit it again when the kernel
+ * returns EAGAIN instead of waiting, as it does with non-blocking pipes,
+ * or to transfer the rest of the buffer after a short read or write.
+ */
+struct UringCompletion
+{
+	std::coroutine_handle<> mCoroutine;
+	io_uring_sqe mSqe;
+	int32_t mResult = 0;
+
+	/// Resubmit on short transfers until the whole buffer is transferred
+	bool mTransferAll = false;
+	uint32_t mTransferred = 0;
+};
+
+/**
+ * @brief Minimal io_uring submission and completion queues, talking directly
+ * to the kernel with raw syscalls as liburing is not available everywhere
+ * shared-state runs, OpenWrt for example.
+ */
+class IoUring
+{
+public:
+	static constexpr unsigned DEFAULT_ENTRIES = 256;
+
+	/** @return nullptr on error, ENOSYS if the kernel doesn't support
+	 *	io_uring or it is disabled */
+	static std::unique_ptr<IoUring> setup(
+	        unsigned entries = DEFAULT_ENTRIES,
+	        std::error_condition* errbub = nullptr );
+
+	~IoUring();
+
+	/** Get a zeroed submission queue entry, it is passed to the kernel on next
+	 * submit()
+	 * @return nullptr if the queue is full even after submitting */
+	io_uring_sqe* getSqe();
+
+	/** Make room for count entries, so as many getSqe() calls which follow
+	 * don't submit in between, as linked entries must reach the kernel
+	 * together
+	 * @return false if the queue is full even after submitting */
+	bool reserveSqes(unsigned count);
+
+	/** Queue the operation prepared in completion.mSqe
+	 * @return false if the submission queue is full */
+	bool submit(UringCompletion& completion);
+
+	/** Pass queued submissions to the kernel without waiting for completions
+	 * @return false on error */
+	bool submit(std::error_condition* errbub = nullptr);
+
+	/** Call f(userData, result) for each available completion, the
+	 * completion queue is released before returning */
+	template<typename F> std::size_t reapCompletions(F&& f);
+
+	inline bool hasCompletions() const;
+
+	/// Readable when completions are available, so it can be epoll-ed
+	inline int getFD() const { return mRingFD; }
+
+	IoUring(const IoUring&) = delete;
+
+private:
+	IoUring() = default;
+
+	int mRingFD = -1;
+
+	void* mSqRingPtr = nullptr;
+	std::size_t mSqRingSize = 0;
+	void* mCqRingPtr = nullptr;
+	std::size_t mCqRingSize = 0;
+	io_uring_sqe* mSqes = nullptr;
+	std::size_t mSqesSize = 0;
+
+	unsigned* mSqHead = nullptr;
+	unsigned* mSqTail = nullptr;
+	unsigned mSqMask = 0;
+	unsigned mSqEntries = 0;
+	unsigned* mSqArray = nullptr;
+
+	unsigned* mCqHead = nullptr;
+	unsigned* mCqTail = nullptr;
+	unsigned mCqMask = 0;
+	io_uring_cqe* mCqes = nullptr;
+
+	/// Tail including entries not yet visible to the kernel
+	unsigned mSqLocalTail = 0;
+	unsigned mToSubmit = 0;
+};
+
+bool IoUring::hasCompletions() const
+{
+	return *mCqHead != __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+}
+
+template<typename F>
+std::size_t IoUring::reapCompletions(F&& f)
+{
+	unsigned tHead = *mCqHead;
+	const unsigned tTail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+
+	std::size_t numReaped = 0;
+	for(; tHead != tTail; ++tHead, ++numReaped)
+	{
+		const io_uring_cqe& tCqe = mCqes[tHead & mCqMask];
+		f(tCqe.user_data, tCqe.res);
+	}
+
+	__atomic_store_n(mCqHead, tHead, __ATOMIC_RELEASE);
+	return numReaped;
+}
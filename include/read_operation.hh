@@ -28,23 +28,25 @@
 
 class AsyncFileDescriptor;
 
-class ReadOp : public AwaitableSyscall<ReadOp, ssize_t>
+class [[nodiscard]] ReadOp : public AwaitableSyscall<ReadOp, ssize_t>
 {
 public:
 	ReadOp( AsyncFileDescriptor& afd,
 	        uint8_t* buffer, std::size_t len,
 	        std::error_condition* ec = nullptr );
-	~ReadOp();
 
 	ssize_t syscall();
+	bool prepareSqe(io_uring_sqe& sqe);
+	inline std::size_t transferLength() const { return mLen; }
 
 private:
 	uint8_t* mBuffer;
 	std::size_t mLen;
 };
 
-
-std::task<ssize_t> asyncRead(
+/** Read exactly len bytes, less only at end of file, the returned operation is
+ * meant to be co_await-ed right away */
+[[nodiscard]] ReadOp asyncRead(
         AsyncFileDescriptor& aFD,
         uint8_t* buffer, std::size_t len,
         std::error_condition* errbub = nullptr );
@@ -33,16 +33,17 @@ class AsyncSocket;
  * @brief Implements an asynchronous Socket Receive Operation
  * 
  */
-class RecvOperation : public AwaitableSyscall<RecvOperation, ssize_t>
+class [[nodiscard]] RecvOperation : public AwaitableSyscall<RecvOperation, ssize_t>
 {
 public:
 	RecvOperation(
 	        AsyncSocket& socket,
 	        uint8_t* buffer, std::size_t len,
 	        std::error_condition* ec = nullptr );
-	~RecvOperation();
 
 	ssize_t syscall();
+	bool prepareSqe(io_uring_sqe& sqe);
+	inline std::size_t transferLength() const { return mLen; }
 
 private:
 	uint8_t* mBuffer;
@@ -32,16 +32,20 @@ class AsyncSocket;
 /**
  * @brief Implements an asynchronous Socket Send Operation
  */
-class SendOperation : public AwaitableSyscall<SendOperation, ssize_t>
+class [[nodiscard]] SendOperation : public AwaitableSyscall<SendOperation, ssize_t>
 {
 public:
+	static constexpr auto DIRECTION =
+	        AsyncFileDescriptor::OpDirection::OUTPUT;
+
 	SendOperation(
 	        AsyncSocket& socket,
 	        const uint8_t* buffer, std::size_t len,
 	        std::error_condition* errbub = nullptr );
-	~SendOperation();
 
 	ssize_t syscall();
+	bool prepareSqe(io_uring_sqe& sqe);
+	inline std::size_t transferLength() const { return mLen; }
 
 private:
 	const uint8_t* mBuffer;
@@ -0,0 +1,67 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "awaitable_syscall.hh"
+
+class AsyncSocket;
+
+/**
+ * @brief Send many buffers with a single sendmsg, so message headers go out
+ * in the same segment of the payload. Partial sends are resumed from the
+ * first byte not sent yet, until all buffers are sent.
+ */
+class [[nodiscard]] SendVectorOperation :
+        public AwaitableSyscall<SendVectorOperation, ssize_t>
+{
+public:
+	static constexpr auto DIRECTION =
+	        AsyncFileDescriptor::OpDirection::OUTPUT;
+
+	/**
+	 * @param iov buffers to send, entries are modified in place while they
+	 *	get sent, so they must outlive the operation
+	 * @param flags passed to sendmsg(2), like MSG_MORE
+	 */
+	SendVectorOperation(
+	        AsyncSocket& socket, std::span<iovec> iov, int flags = 0,
+	        std::error_condition* ec = nullptr );
+
+	ssize_t syscall();
+	bool prepareSqe(io_uring_sqe& sqe);
+	inline std::size_t transferLength() const { return mLen; }
+
+	/** Skip bytes already sent from the head of msg buffers
+	 * @return true if something is left to send */
+	static bool advance(msghdr& msg, std::size_t bytes);
+
+private:
+	msghdr mMsg;
+	int mFlags;
+	std::size_t mLen = 0;
+
+	/// Bytes already skipped from mMsg buffers
+	std::size_t mAdvanced = 0;
+};
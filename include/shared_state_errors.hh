@@ -29,7 +29,8 @@
  */
 enum class SharedStateErrors : int32_t
 {
-	UNKOWN_DATA_TYPE = 2000
+	UNKOWN_DATA_TYPE = 2000,
+	HANDSHAKE_REFUSED = 2001
 };
 
 struct SharedStateErrorsCategory: std::error_category
@@ -43,6 +44,8 @@ struct SharedStateErrorsCategory: std::error_category
 		{
 		case SharedStateErrors::UNKOWN_DATA_TYPE:
 			return "Unknown data type";
+		case SharedStateErrors::HANDSHAKE_REFUSED:
+			return "Peer closed connection during handshake";
 		default:
 			return rsErrorNotInCategory(ev, name());
 		}
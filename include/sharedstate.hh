@@ -29,6 +29,13 @@
 #include <vector>
 #include <chrono>
 #include <fstream>
+#include <queue>
+#include <span>
+#include <functional>
+#include <optional>
+#include <memory>
+#include <mutex>
+#include <algorithm>
 
 #include <util/rsjson.h>
 #include <serialiser/rsserializable.h>
@@ -36,19 +43,46 @@
 #include "task.hh"
 #include "async_socket.hh"
 
+class BinaryWriter;
+class BinaryReader;
+
 struct SharedState
 {
-	explicit SharedState(IOContext& ioContext): mIoContext(ioContext) {}
+	explicit SharedState(IOContext& ioContext):
+	    mIoContext(ioContext), mInstanceEpoch(generateInstanceEpoch()) {}
 
 	static constexpr uint16_t TCP_PORT = 3490;
 
 	static constexpr uint16_t DATA_TYPE_NAME_MAX_LENGHT = 128;
 
-	/** TODO: This is being used around the code both for "distilled" data size
-	 * and full state which have a noticeable overhead so is bigger, a different
-	 * costant should be used */
+	/** Maximum lenght of a single frame, and of whole messages before
+	 * WIRE_PROTO_VERSION_CHUNKED. Since then whole messages are limited by
+	 * DataTypeConf::mMaxMessageSize instead */
 	static constexpr uint32_t DATA_MAX_LENGHT = 1024*1024; // 1MB
 
+	/** Default per data type budget of bytes a single message can carry,
+	 * @see DataTypeConf::mMaxMessageSize */
+	static constexpr uint64_t DEFAULT_TYPE_MAX_MESSAGE_SIZE = 32*1024*1024;
+
+	/** Default time after which unused connections to peers are closed,
+	 * @see WIRE_PROTO_VERSION_PERSISTENT */
+	static constexpr std::chrono::seconds DEFAULT_CONNECTION_IDLE_TIMEOUT =
+	        std::chrono::seconds(60);
+
+	/** Default maximum number of peers synchronized at same time,
+	 * @see syncWithPeers */
+	static constexpr std::size_t DEFAULT_SYNC_CONCURRENCY = 8;
+
+	/** Time allowed to a synchronization of data types without update
+	 * interval, and to handshakes, @see syncTimeout */
+	static constexpr std::chrono::seconds DEFAULT_SYNC_TIMEOUT =
+	        std::chrono::seconds(30);
+
+	/** Even data types updated very often get at least this time to
+	 * synchronize, @see syncTimeout */
+	static constexpr std::chrono::seconds MIN_SYNC_TIMEOUT =
+	        std::chrono::seconds(5);
+
 	static constexpr std::string_view SHARED_STATE_CONFIG_DIR =
 	        "/tmp/shared-state/";
 
@@ -68,6 +102,11 @@ struct SharedState
 
 		std::chrono::seconds mBleachTTL;
 
+		/** Maximum bytes a message of this type can carry, received frames
+		 * are merged as they arrive so this is a budget on the work a peer
+		 * can make us do in one sync more then on memory usage */
+		uint64_t mMaxMessageSize;
+
 		/// @see RsSerializable
 		virtual void
 		serial_process(RsGenericSerializer::SerializeJob j,
@@ -79,10 +118,12 @@ struct SharedState
 		 * declaration wasn't enough to make them visible to it */
 		DataTypeConf(): mName(), mScope(),
 		    mUpdateInterval(std::chrono::seconds::zero()),
-		    mBleachTTL(std::chrono::seconds::zero()) {}
+		    mBleachTTL(std::chrono::seconds::zero()),
+		    mMaxMessageSize(DEFAULT_TYPE_MAX_MESSAGE_SIZE) {}
 		DataTypeConf(const DataTypeConf& st):
 		    mName(st.mName), mScope(st.mScope),
-		    mUpdateInterval(st.mUpdateInterval), mBleachTTL(st.mBleachTTL)
+		    mUpdateInterval(st.mUpdateInterval), mBleachTTL(st.mBleachTTL),
+		    mMaxMessageSize(st.mMaxMessageSize)
 		{}
 	};
 
@@ -126,31 +167,75 @@ struct SharedState
 
 	struct StateEntry : RsSerializable
 	{
-		StateEntry(): mAuthor(), mTtl(std::chrono::seconds::zero()), mData() {}
+		StateEntry():
+		    mAuthor(), mExpiry(), mData(), mChangeSeq(0) {}
 
 		StateEntry(const StateEntry& st):
-		    mAuthor(st.mAuthor), mTtl(st.mTtl)
+		    mAuthor(st.mAuthor), mExpiry(st.mExpiry),
+		    mChangeSeq(st.mChangeSeq), mEncodedData(st.mEncodedData)
 		{ mData.CopyFrom(st.mData, mData.GetAllocator()); }
 
 		/// Entry author
 		std::string mAuthor;
 
-		/// Remaining time to live
-		std::chrono::seconds mTtl;
+		/** Absolute time at which the entry expires, on the wire and on
+		 * serialization the remaining time to live is used instead, because
+		 * monotonic clocks of different nodes are not comparable */
+		std::chrono::steady_clock::time_point mExpiry;
 
 		/// Entry data
 		RsJson mData;
 
+		/** Local change sequence number at which the entry has been last
+		 * inserted or updated, never leaves this node */
+		uint64_t mChangeSeq;
+
+		/** @return remaining time to live rounded down to seconds, so an
+		 * entry sent back by a peer never looks fresher than ours */
+		std::chrono::seconds ttl(
+		        std::chrono::steady_clock::time_point now =
+		        std::chrono::steady_clock::now() ) const
+		{
+			return std::max(
+			            std::chrono::duration_cast<std::chrono::seconds>(
+			                mExpiry - now ),
+			            std::chrono::seconds::zero() );
+		}
+
+		void setTtl(
+		        std::chrono::seconds ttl,
+		        std::chrono::steady_clock::time_point now =
+		        std::chrono::steady_clock::now() )
+		{ mExpiry = now + ttl; }
+
+		/** @return mData encoded with BinaryWriter::writeJson, computed on
+		 * first use then cached, so serving many peers doesn't encode the
+		 * same data again and again */
+		const std::vector<uint8_t>& encodedData() const;
+
+		/** Must be called after modifying mData in place. Merge replaces
+		 * entries data as a whole so it doesn't need it */
+		void invalidateEncodedData() { mEncodedData.clear(); }
+
+		/** Replace mData decoding it from BinaryWriter::writeJson encoding,
+		 * which is kept as encodedData() cache.
+		 * @return false if the encoding is invalid */
+		bool decodeData(std::span<const uint8_t> encodedData);
+
 		/// @see RsSerializable
 		virtual void
 		serial_process( RsGenericSerializer::SerializeJob j,
 		                RsGenericSerializer::SerializeContext &ctx );
+
+		/** Cache for encodedData(), empty if not computed yet as valid
+		 * encoding is never empty */
+		mutable std::vector<uint8_t> mEncodedData;
 	};
 
-	/** @return number of significative changes in the state, -1 on error */
+	/** Remove expired entries, only entries due to expiry are touched.
+	 * @return number of significative changes in the state, -1 on error */
 	ssize_t bleach(
 	    const std::string& dataTypeName,
-	    std::chrono::seconds times = std::chrono::seconds(1),
 	    std::error_condition* errbub = nullptr );
 
 	/** @return number of significative changes in the state, -1 on error */
@@ -161,10 +246,13 @@ struct SharedState
 	    std::error_condition* errbub = nullptr );
 
 	/**
+	 * @param ioContext hooks are waited on it, must be the one running the
+	 *	calling coroutine
 	 * @return returns false if error occurred, true otherwise
 	 */
 	std::task<bool> notifyHooks(
-	        const std::string& typeName, std::error_condition* errbub = nullptr );
+	        const std::string& typeName, IOContext& ioContext,
+	        std::error_condition* errbub = nullptr );
 
 	/**
 	 * @return returns false if error occurred, true otherwise
@@ -173,7 +261,44 @@ struct SharedState
 	        std::string dataTypeName, const sockaddr_storage& peerAddr,
 	        std::error_condition* errbub = nullptr );
 
-	/**
+	/** Synchronize many data types with the peer, since
+	 * WIRE_PROTO_VERSION_BATCH in a single batch, giving up after the
+	 * longest syncTimeout of them
+	 * @return returns false if error occurred, true otherwise */
+	std::task<bool> syncWithPeer(
+	        std::vector<std::string> dataTypeNames,
+	        const sockaddr_storage& peerAddr,
+	        std::error_condition* errbub = nullptr );
+
+	/** Synchronize many data types with the peer, if still in progress at
+	 * deadline give up with std::errc::timed_out error
+	 * @return returns false if error occurred, true otherwise */
+	std::task<bool> syncWithPeer(
+	        std::vector<std::string> dataTypeNames,
+	        const sockaddr_storage& peerAddr,
+	        std::chrono::steady_clock::time_point deadline,
+	        std::error_condition* errbub = nullptr );
+
+	/// Outcome of synchronizing with one of many peers
+	struct PeerSyncResult
+	{
+		sockaddr_storage mPeer;
+		bool mSuccess = false;
+		std::error_condition mError;
+	};
+
+	/** Synchronize the data types with many peers concurrently, at most
+	 * mSyncConcurrency at time, so a slow or unreachable peer doesn't delay
+	 * the others. Returns when all of them are done.
+	 * @return per peer results in the same order as peerAddresses */
+	std::task<std::vector<PeerSyncResult>> syncWithPeers(
+	        std::vector<std::string> dataTypeNames,
+	        std::vector<sockaddr_storage> peerAddresses );
+
+	/** Serve synchronization requests coming from the connection. Handshake
+	 * must complete within DEFAULT_SYNC_TIMEOUT, each batch of requests
+	 * within the longest syncTimeout of requested data types, persistent
+	 * connections can stay idle for mConnectionIdleTimeout between batches
 	 * @return returns false if error occurred, true otherwise
 	 */
 	std::task<bool> handleReqSyncConnection(
@@ -193,8 +318,29 @@ struct SharedState
 	bool registerDataType(
 	        const std::string& typeName, const std::string& typeScope,
 	        std::chrono::seconds updateInterval, std::chrono::seconds ttl,
+	        uint64_t maxMessageSize = DEFAULT_TYPE_MAX_MESSAGE_SIZE,
 	        std::error_condition* errbub = nullptr );
 
+	/** Close pooled connections unused for longer then
+	 * mConnectionIdleTimeout
+	 * @return false if error occurred, true otherwise */
+	std::task<bool> closeIdleConnections(
+	        std::error_condition* errbub = nullptr );
+
+	void setConnectionIdleTimeout(std::chrono::seconds idleTimeout)
+	{ mConnectionIdleTimeout = idleTimeout; }
+
+	void setSyncConcurrency(std::size_t syncConcurrency)
+	{ mSyncConcurrency = std::max<std::size_t>(1, syncConcurrency); }
+
+	/** Speak at most the given wire protocol version, both as client and as
+	 * server, to behave like an older node */
+	void setMaxWireProtoVersion(uint32_t maxVersion)
+	{
+		mMaxWireProtoVersion = std::clamp(
+		            maxVersion, WIRE_PROTO_VERSION_JSON, WIRE_PROTO_VERSION );
+	}
+
 
 	/**** TEMPORARY STUFF */
 	static const sockaddr_storage& localInstanceAddr();
@@ -203,7 +349,135 @@ private:
 	static constexpr std::string_view SHARED_STATE_GET_CANDIDATES_CMD =
 	        "shared-state-async-discover";
 
-	static constexpr uint32_t WIRE_PROTO_VERSION = 1;
+	/** Wire protocol version in which state slices are encoded as RsJson text,
+	 * still spoken to keep talking with older peers */
+	static constexpr uint32_t WIRE_PROTO_VERSION_JSON = 1;
+
+	/** Wire protocol version in which state slices are encoded with
+	 * BinaryWriter, @see NetworkMessage */
+	static constexpr uint32_t WIRE_PROTO_VERSION_BINARY = 2;
+
+	/** Wire protocol version in which peers exchange their instance epoch
+	 * during handshake, and send each other just entries changed since last
+	 * successful synchronization, @see PeerSyncCursor */
+	static constexpr uint32_t WIRE_PROTO_VERSION_DELTA = 3;
+
+	/** Wire protocol version in which, when no sync cursor is available,
+	 * peers compare state digests before exchanging entries,
+	 * @see BINARY_DIGEST_FORMAT */
+	static constexpr uint32_t WIRE_PROTO_VERSION_DIGEST = 4;
+
+	/** Wire protocol version in which message data is sent as a sequence of
+	 * frames, so the sender can stream it without knowing the total size in
+	 * advance, @see NetworkMessage */
+	static constexpr uint32_t WIRE_PROTO_VERSION_CHUNKED = 5;
+
+	/** Wire protocol version in which, after the instance epoch, peers
+	 * exchange the optional features they support, only those supported by
+	 * both are then used, @see WIRE_FEATURE_COMPRESSION */
+	static constexpr uint32_t WIRE_PROTO_VERSION_FEATURES = 6;
+
+	/** Wire protocol version in which the connection is kept open after a
+	 * synchronization, the client can send further requests on it without
+	 * connecting and handshaking again, and closes it when idle,
+	 * @see PeerConnection */
+	static constexpr uint32_t WIRE_PROTO_VERSION_PERSISTENT = 7;
+
+	/** Wire protocol version in which the client sends the requests for all
+	 * the data types to synchronize in a batch, terminated by a zero lenght
+	 * type name, then the server answers all of them, @see TypeExchange */
+	static constexpr uint32_t WIRE_PROTO_VERSION_BATCH = 8;
+
+	/** Highest wire protocol version we speak, during handshake peers agree on
+	 * the highest version both support */
+	static constexpr uint32_t WIRE_PROTO_VERSION = WIRE_PROTO_VERSION_BATCH;
+
+	/** State slice frames can be compressed with a dictionary trained on the
+	 * sender state of the same data type,
+	 * @see BINARY_COMPRESSED_FORMAT, BINARY_DICTIONARY_FORMAT */
+	static constexpr uint32_t WIRE_FEATURE_COMPRESSION = 1 << 0;
+
+	/// Optional features we offer during handshake
+	static constexpr uint32_t WIRE_FEATURES_SUPPORTED = WIRE_FEATURE_COMPRESSION;
+
+	/** Older peers just close the connection if they get a wire protocol
+	 * version they don't know, after that happens we talk to them with
+	 * WIRE_PROTO_VERSION_JSON for a while, then attempt again with the newest
+	 * version in case they have been upgraded */
+	static constexpr std::chrono::minutes LEGACY_PEER_REPROBE_INTERVAL =
+	        std::chrono::minutes(30);
+
+	/** First byte of binary encoded state slices */
+	static constexpr uint8_t BINARY_SLICE_FORMAT = 1;
+
+	/** Binary message containing per bucket digests of the sender state
+	 * instead of entries, see NetworkMessage::fromStateDigest */
+	static constexpr uint8_t BINARY_DIGEST_FORMAT = 2;
+
+	/** Answer to a BINARY_DIGEST_FORMAT message, containing the buckets whose
+	 * digest differ and the answerer entries in those buckets */
+	static constexpr uint8_t BINARY_DIGEST_REPLY_FORMAT = 3;
+
+	/** Compressed frame, on receiving it is replaced by the decompressed one
+	 * | 1 byte |   8 bytes LE  |  varint  |                 |
+	 * | format | dictionary id | raw size | deflate stream  |
+	 * Dictionary id 0 means no dictionary */
+	static constexpr uint8_t BINARY_COMPRESSED_FORMAT = 4;
+
+	/** Frame carrying a dictionary, sent before the first frame compressed
+	 * with it to a peer which haven't got it yet
+	 * | 1 byte |   8 bytes LE  |                  |
+	 * | format | dictionary id | dictionary bytes |
+	 */
+	static constexpr uint8_t BINARY_DICTIONARY_FORMAT = 5;
+
+	/** Average number of entries per digest bucket, an entry changed on one
+	 * side cause the whole bucket to be transferred */
+	static constexpr uint32_t DIGEST_BUCKET_ENTRIES = 8;
+
+	/** Keep digest message size at bay (32KB) on very big states */
+	static constexpr uint32_t DIGEST_MAX_BUCKETS = 4096;
+
+	/** When streaming a state slice, a frame is flushed to the socket as soon
+	 * as it grows past this size. Frames always contain whole entries, so
+	 * a frame might be bigger if a single entry is */
+	static constexpr std::size_t MESSAGE_FRAME_SIZE = 64*1024;
+
+	/** Below this size compressing a frame is not worth the CPU time */
+	static constexpr std::size_t COMPRESSION_MIN_SIZE = 256;
+
+	/** Sending raw bytes gets cheaper as the link gets faster, so the
+	 * compression threshold grows by this many bytes per each Mbit/s of
+	 * extimated upload bandwidth */
+	static constexpr std::size_t COMPRESSION_BYTES_PER_MBIT = 64;
+
+	/** On links faster then this compressing on embedded devices takes more
+	 * time than it saves */
+	static constexpr uint32_t COMPRESSION_MAX_BW_MBS = 400;
+
+	/** @return minimum frame size worth compressing at the given upload
+	 * bandwidth, 0 meaning unknown */
+	static std::size_t compressionThreshold(uint32_t upBwMbs);
+
+	/** Dictionaries are trained on recurring strings of the data type state
+	 * up to this size, they are sent once to each peer so keep them small */
+	static constexpr std::size_t DICTIONARY_MAX_SIZE = 16*1024;
+
+	/** Retrain a data type dictionary at most this often, and only if the
+	 * state changed meanwhile as each new dictionary must be sent again to
+	 * every peer */
+	static constexpr std::chrono::hours DICTIONARY_RETRAIN_INTERVAL =
+	        std::chrono::hours(1);
+
+	/** Dictionaries received from peers are forgotten after being unused this
+	 * long, longer than PEER_SYNC_CURSOR_MAX_AGE so peers forget to have
+	 * sent us a dictionary before we drop it */
+	static constexpr std::chrono::hours PEER_DICTIONARY_MAX_AGE =
+	        std::chrono::hours(2);
+
+	/** Hard limit on dictionaries received from each peer kept in memory,
+	 * peers send at most one per data type */
+	static constexpr std::size_t PEER_DICTIONARIES_MAX = 16;
 
 	static inline constexpr auto MbitPerSec(auto bytes, auto microseconds)
 	{
@@ -213,37 +487,480 @@ private:
 		return std::max<decltype(bytes)>(1, (bytes<<3)/microseconds);
 	}
 
+	/** Connection parameters agreed with the peer during handshake */
+	struct WireSession
+	{
+		/** Before the handshake the version proposed by the client, after the
+		 * handshake the version agreed by both peers */
+		uint32_t mProtoVersion = WIRE_PROTO_VERSION;
+
+		/** Peer instance epoch, exchanged since WIRE_PROTO_VERSION_DELTA,
+		 * 0 if unknown */
+		uint64_t mPeerEpoch = 0;
+
+		/** Optional features supported by both peers, exchanged since
+		 * WIRE_PROTO_VERSION_FEATURES */
+		uint32_t mFeatures = 0;
+	};
+
 	/** The message format on the wire is:
 	* |     1 byte       |           |   4 bytes   |      |
 	* | type name lenght | type name | data lenght | data |
+	*
+	* Since WIRE_PROTO_VERSION_BINARY data is encoded as:
+	* | 1 byte |  varint  |         |
+	* | format | #entries | entries |
+	*
+	* Each entry being:
+	* |   string  |   varint   |     varint    |   varint    |           |
+	* | entry key | author ref | TTL (seconds) | data lenght | JSON data |
+	*
+	* Strings are varint lenght prefixed, JSON data is written with
+	* BinaryWriter::writeJson. Author ref 0 is followed by author string which
+	* gets next index in the message authors dictionary, starting from 1,
+	* subsequent entries by the same author refer to it just by index.
+	*
+	* Since WIRE_PROTO_VERSION_CHUNKED data lenght is replaced by a sequence
+	* of frames terminated by a zero lenght frame:
+	* |     1 byte       |           |   4 bytes   |       |     |   4 bytes  |
+	* | type name lenght | type name | frame lenght| frame | ... |      0     |
+	*
+	* Each frame of a state slice is a self contained binary state slice, with
+	* its own authors dictionary, so the data is a concatenation of slices.
 	*/
 	struct NetworkMessage
 	{
 		std::string mTypeName;
 		std::vector<uint8_t> mData;
 
-		void fromStateSlice(std::map<StateKey, StateEntry>& stateSlice);
-		void toStateSlice(std::map<StateKey, StateEntry>& stateSLice) const;
+		/** Write into mData a self contained binary slice of the entries
+		 * accepted by filter, starting after lastKey or from the beginning if
+		 * it is empty, stopping as soon as the slice grows past maxSize.
+		 * @param lastKey updated to the last written entry key
+		 * @param numEntries optional storage for the number of written entries
+		 * @return true if entries are left to be written */
+		bool fromStateSliceChunk(
+		        const std::map<StateKey, StateEntry>& stateSlice,
+		        const std::function<bool(const StateKey&, const StateEntry&)>&
+		            filter,
+		        std::optional<StateKey>& lastKey, std::size_t maxSize,
+		        uint64_t* numEntries = nullptr );
+
+		/**
+		 * @param sinceChangeSeq include only entries with greater
+		 * StateEntry::mChangeSeq, supported only since WIRE_PROTO_VERSION_DELTA
+		 * older versions always get the whole slice
+		 */
+		void fromStateSlice(
+		        std::map<StateKey, StateEntry>& stateSlice,
+		        uint32_t wireProtoVersion, uint64_t sinceChangeSeq = 0 );
+
+		/** @return false if mData is not a valid state slice */
+		bool toStateSlice(
+		        std::map<StateKey, StateEntry>& stateSLice,
+		        uint32_t wireProtoVersion,
+		        std::error_condition* errbub = nullptr ) const;
+
+		/** Digest message layout:
+		 * | 1 byte |  varint  |                                |
+		 * | format | #buckets | bucket digests 8 bytes LE each |
+		 */
+		void fromStateDigest(
+		        const std::map<StateKey, StateEntry>& stateSlice,
+		        uint32_t bucketsNum );
+
+		/** @return false if mData is not a valid digest message */
+		bool toStateDigest(
+		        std::vector<uint64_t>& digests,
+		        std::error_condition* errbub = nullptr ) const;
+
+		/** Digest reply message layout:
+		 * | 1 byte |  varint  |            |  varint  |         |
+		 * | format | #buckets | bucket ids | #entries | entries |
+		 */
+		void fromDigestReply(
+		        const std::map<StateKey, StateEntry>& stateSlice,
+		        const std::vector<uint32_t>& buckets, uint32_t bucketsNum );
+
+		/** @return false if mData is not a valid digest reply */
+		bool toDigestReply(
+		        std::map<StateKey, StateEntry>& stateSlice,
+		        std::vector<uint32_t>& buckets, uint32_t bucketsNum,
+		        std::error_condition* errbub = nullptr ) const;
+
+		/** @return first byte of binary messages, 0 if empty */
+		uint8_t binaryFormat() const { return mData.empty() ? 0 : mData[0]; }
+
+		/** Decode binary slice entries one at time without materializing
+		 * them, for each entry calls
+		 * visitor(key, author, ttl, encodedData) with views pointing into
+		 * mData, the visitor returning false aborts decoding.
+		 * @return false if the slice is invalid or decoding was aborted */
+		template<typename Visitor>
+		bool visitSliceEntries(
+		        BinaryReader& reader, const Visitor& visitor,
+		        std::error_condition* errbub ) const;
+
+		/** Read the differing buckets list of a BINARY_DIGEST_REPLY_FORMAT
+		 * message, after it the reader is positioned at the slice entries */
+		bool readDigestReplyBuckets(
+		        BinaryReader& reader, std::vector<uint32_t>& buckets,
+		        uint32_t bucketsNum, std::error_condition* errbub ) const;
+
+	private:
+		template<typename Filter>
+		static void writeSliceEntries(
+		        BinaryWriter& writer,
+		        const std::map<StateKey, StateEntry>& stateSlice,
+		        const Filter& filter );
+
+		/** Write one slice entry, authors already in authorsDict are written
+		 * just by index, new ones are added to it */
+		static void writeSliceEntry(
+		        BinaryWriter& writer, const StateKey& key,
+		        const StateEntry& stateEntry,
+		        std::map<std::string_view, uint64_t>& authorsDict,
+		        std::chrono::steady_clock::time_point now );
+
+		bool readSliceEntries(
+		        BinaryReader& reader, std::map<StateKey, StateEntry>& stateSlice,
+		        std::error_condition* errbub ) const;
 	};
 
-	static std::task<bool> clientHandShake(
-	        AsyncSocket& pSocket, NetworkStats& netStats,
-	        std::error_condition* errbub = nullptr );
+	/** @return number of digest buckets to use for a state of given size,
+	 * always a power of two */
+	static uint32_t digestBucketsFor(std::size_t stateSize);
+
+	/** @return digest bucket the given key belongs to */
+	static uint32_t digestBucket(const StateKey& key, uint32_t bucketsNum);
+
+	/** Compute per bucket digests, each being the sum of its entries digest.
+	 * TTL is excluded from entries digest as it is different on each node
+	 * due to bleaching, refreshed TTLs are propagated by delta sync anyway */
+	static void computeDigests(
+	        const std::map<StateKey, StateEntry>& stateSlice,
+	        uint32_t bucketsNum, std::vector<uint64_t>& digests );
+
+	/** Since WIRE_PROTO_VERSION_DELTA server answer and client confirmation
+	 * are followed by their 8 bytes instance epoch */
+	std::task<bool> clientHandShake(
+	        AsyncSocket& pSocket, WireSession& wireSession,
+	        NetworkStats& netStats, std::error_condition* errbub = nullptr );
+
+	std::task<bool> serverHandShake(
+	        AsyncSocket& pSocket, WireSession& wireSession,
+	        NetworkStats& netStats, std::error_condition* errbub = nullptr );
+
+	/** Bookkeeping of a data type synchronization. The exchange is split in
+	 * steps so many data types can go through each step in a batch:
+	 * the client sends its request, either a digest or the entries changed
+	 * since last synchronization, the server answers, and if digest buckets
+	 * differed the client completes the exchange sending its entries in them
+	 */
+	struct TypeExchange
+	{
+		std::string mTypeName;
+
+		/// The exchange started with a digest instead of entries
+		bool mIsDigest = false;
+		uint32_t mDigestBuckets = 0;
+		std::vector<uint32_t> mMismatchingBuckets;
+
+		uint64_t mSentChangeSeq = 0;
+		uint64_t mPreMergeChangeSeq = 0;
+		uint64_t mPostMergeChangeSeq = 0;
+
+		/// @see MergeSession::mAssignedChangeSeqs
+		uint64_t mMergedChangeSeqs = 0;
+
+		/// Significative changes merged from the peer
+		ssize_t mChanges = 0;
+	};
+
+	/** Client steps of TypeExchange
+	 * @return sent or received bytes, -1 on error */
+	std::task<ssize_t> sendSyncRequest(
+	        AsyncSocket& pSocket, TypeExchange& exchange,
+	        const WireSession& wireSession, NetworkStats& netStats,
+	        std::error_condition* errbub );
+
+	std::task<ssize_t> receiveSyncReply(
+	        AsyncSocket& pSocket, TypeExchange& exchange,
+	        const WireSession& wireSession, NetworkStats& netStats,
+	        std::chrono::steady_clock::duration& mergeTime,
+	        std::error_condition* errbub );
 
-	static std::task<bool> serverHandShake(
-	        AsyncSocket& pSocket, NetworkStats& netStats,
+	/** Called once the peer reply got received and merged, so only now the
+	 * peer cursor is advanced */
+	std::task<ssize_t> completeSync(
+	        AsyncSocket& pSocket, TypeExchange& exchange,
+	        const WireSession& wireSession, NetworkStats& netStats,
+	        std::error_condition* errbub );
+
+	/** Serve a batch of synchronization requests, or a single one before
+	 * WIRE_PROTO_VERSION_BATCH, since WIRE_PROTO_VERSION_PERSISTENT many of
+	 * them may come in sequence on the same connection.
+	 * @return received bytes, 0 if the peer closed the connection instead of
+	 *	sending a request, -1 on error */
+	std::task<ssize_t> handleSyncRequests(
+	        AsyncSocket& pSocket, WireSession& wireSession,
+	        NetworkStats& netStats, std::error_condition* errbub );
+
+	/** Server steps of TypeExchange
+	 * @return sent or received bytes, 0 if the peer closed the connection
+	 *	instead of sending a request, -1 on error. At the end of a batch
+	 *	receiveSyncRequest leaves exchange.mTypeName empty */
+	std::task<ssize_t> receiveSyncRequest(
+	        AsyncSocket& pSocket, TypeExchange& exchange,
+	        const WireSession& wireSession, NetworkStats& netStats,
+	        std::chrono::steady_clock::duration& mergeTime,
+	        std::error_condition* errbub );
+
+	std::task<ssize_t> sendSyncReply(
+	        AsyncSocket& pSocket, TypeExchange& exchange,
+	        const WireSession& wireSession, NetworkStats& netStats,
+	        std::error_condition* errbub );
+
+	std::task<ssize_t> receiveSyncCompletion(
+	        AsyncSocket& pSocket, TypeExchange& exchange,
+	        const WireSession& wireSession, NetworkStats& netStats,
+	        std::chrono::steady_clock::duration& mergeTime,
+	        std::error_condition* errbub );
+
+	/** @return wire protocol version to propose to the peer on handshake */
+	uint32_t proposedWireProtoVersion(const sockaddr_storage& peerAddr);
+
+	/** Connection to a peer kept open for later synchronizations, since
+	 * WIRE_PROTO_VERSION_PERSISTENT */
+	struct PeerConnection
+	{
+		std::shared_ptr<AsyncSocket> mSocket;
+		WireSession mWireSession;
+
+		/// Round trip time extimated during handshake
+		std::chrono::microseconds mRttExt;
+
+		std::chrono::steady_clock::time_point mLastUse;
+	};
+
+	/** Get an handshaked connection to the peer, reusing a pooled one if
+	 * available. Pooled connections are taken out of the pool while in use.
+	 * @param isReused set to true if the connection comes from the pool, in
+	 *	that case the peer might have dropped it meanwhile
+	 * @param deadline set on the returned connection, connecting and
+	 *	handshaking must complete before it too
+	 * @return nullptr on error */
+	std::task<std::shared_ptr<AsyncSocket>> peerConnection(
+	        const sockaddr_storage& peerAddr, WireSession& wireSession,
+	        NetworkStats& netStats, bool& isReused,
+	        std::chrono::steady_clock::time_point deadline,
 	        std::error_condition* errbub = nullptr );
 
-	static std::task<ssize_t> receiveNetworkMessage(
+	/** Time a synchronization of the data type is allowed to take, that is
+	 * its update interval, as the next one would be due otherwise, but at
+	 * least MIN_SYNC_TIMEOUT. DEFAULT_SYNC_TIMEOUT if the type has no
+	 * update interval or is unknown */
+	std::chrono::seconds syncTimeout(const std::string& typeName) const;
+
+	/** Put a connection which completed a synchronization back in the pool
+	 * if the agreed wire protocol version allows it, close it otherwise */
+	std::task<bool> releasePeerConnection(
+	        const sockaddr_storage& peerAddr,
+	        std::shared_ptr<AsyncSocket> pSocket,
+	        const WireSession& wireSession, const NetworkStats& netStats );
+
+	/** Bookkeeping shared by syncWithPeers workers, each of them takes the
+	 * next peer until none is left. Awaiting it suspends until all workers
+	 * are done */
+	struct SyncFanOut
+	{
+		const std::vector<std::string>& mTypeNames;
+		std::vector<PeerSyncResult>& mResults;
+		std::size_t mNextPeer = 0;
+		std::size_t mRunningWorkers = 0;
+		std::coroutine_handle<> mJoiner = nullptr;
+
+		bool await_ready() const noexcept { return !mRunningWorkers; }
+		void await_suspend(std::coroutine_handle<> joiner) { mJoiner = joiner; }
+		void await_resume() const noexcept {}
+	};
+
+	std::task<void> syncFanOutWorker(SyncFanOut& fanOut);
+
+	/** Same peer may show up as IPv4 or IPv4 mapped IPv6, differently from
+	 * peerSyncCursorKey port is kept as it is part of the destination */
+	static std::string peerConnectionKey(const sockaddr_storage& peerAddr);
+
+	/** Keep track of which changes have already been delivered to a peer, so
+	 * on next synchronization we can send just newer changes.
+	 * The peer instance epoch changes each time the peer restarts, loosing
+	 * its state, in that case all known cursors are invalid, and a full
+	 * synchronization happens. */
+	struct PeerSyncCursor
+	{
+		uint64_t mPeerEpoch = 0;
+
+		/** Per data type, highest local change sequence number delivered to
+		 * the peer */
+		std::map<std::string, uint64_t> mDeliveredChangeSeq;
+
+		/** Per data type, id of our dictionary the peer already got */
+		std::map<std::string, uint64_t> mDeliveredDictionary;
+
+		/** Last upload bandwidth extimation toward the peer, to decide about
+		 * compression before a new extimation is available */
+		uint32_t mUpBwMbsExt = 0;
+
+		std::chrono::steady_clock::time_point mLastUpdate;
+	};
+
+	/** Cursors not updated for this long are forgotten, if the peer shows up
+	 * again a full synchronization happens */
+	static constexpr std::chrono::minutes PEER_SYNC_CURSOR_MAX_AGE =
+	        std::chrono::minutes(30);
+
+	/** A TTL increase by less then this is considered jitter due to bleaching
+	 * happening at different times on different nodes, so it doesn't get a
+	 * new change sequence number and is not propagated as a change */
+	static constexpr std::chrono::seconds MIN_PROPAGATED_TTL_INCREASE =
+	        std::chrono::seconds(2);
+
+	/** @return highest change sequence number of the given type delivered to
+	 * the peer or 0 if unknown */
+	uint64_t deliveredChangeSeq(
+	        const sockaddr_storage& peerAddr, const WireSession& wireSession,
+	        const std::string& dataTypeName );
+
+	void setDeliveredChangeSeq(
+	        const sockaddr_storage& peerAddr, const WireSession& wireSession,
+	        const std::string& dataTypeName, uint64_t changeSeq );
+
+	/** @return the peer cursor, nullptr if unknown or outdated */
+	PeerSyncCursor* peerSyncCursor(
+	        const sockaddr_storage& peerAddr, const WireSession& wireSession );
+
+	/** Get the peer cursor for updating it, creating it if needed, and
+	 * resetting it if the peer restarted since last update. Forget outdated
+	 * cursors of other peers too.
+	 * @return nullptr if the peer epoch is unknown */
+	PeerSyncCursor* touchPeerSyncCursor(
+	        const sockaddr_storage& peerAddr, const WireSession& wireSession );
+
+	/** Entries just merged from a peer obviously doesn't need to be sent back
+	 * to it, if nothing else changed before and during the merge, advance the
+	 * peer cursor to include them.
+	 * @param mergedChangeSeqs change sequence numbers assigned by the merge,
+	 *	if less than postMergeChangeSeq - preMergeChangeSeq other changes got
+	 *	merged meanwhile and the cursor is left alone */
+	void skipMergedChanges(
+	        const sockaddr_storage& peerAddr, const WireSession& wireSession,
+	        const std::string& dataTypeName,
+	        uint64_t preMergeChangeSeq, uint64_t postMergeChangeSeq,
+	        uint64_t mergedChangeSeqs );
+
+	/** @return current change sequence number of the given data type */
+	uint64_t typeChangeSeq(const std::string& dataTypeName) const;
+
+	static std::string peerSyncCursorKey(const sockaddr_storage& peerAddr);
+
+	static uint64_t generateInstanceEpoch();
+
+	/** Called for each received frame, with just that frame in mData,
+	 * returning false aborts receiving, it is in charge of reporting the
+	 * error then */
+	using FrameHandler = std::function<bool(NetworkMessage& frame)>;
+
+	/** Receive a message, since WIRE_PROTO_VERSION_CHUNKED its total size is
+	 * limited by receiving data type DataTypeConf::mMaxMessageSize.
+	 * @param onFrame if passed each frame is handed to it as soon as it is
+	 *	received instead of accumulating the whole message in memory, only
+	 *	since WIRE_PROTO_VERSION_CHUNKED, older versions ignore it
+	 * @return total received bytes, 0 if the peer closed the connection
+	 *	before the message started, -1 on error. Since
+	 *	WIRE_PROTO_VERSION_BATCH netMsg.mTypeName is left empty when the end
+	 *	of a batch is received */
+	std::task<ssize_t> receiveNetworkMessage(
 	        AsyncSocket& socket, NetworkMessage& netMsg,
-	        NetworkStats& netStats,
-	        std::error_condition* errbub = nullptr );
+	        const WireSession& wireSession, NetworkStats& netStats,
+	        FrameHandler onFrame, std::error_condition* errbub = nullptr );
 
 	static std::task<ssize_t> sendNetworkMessage(
 	        AsyncSocket& socket, const NetworkMessage& netMsg,
-	        NetworkStats& netStats,
+	        const WireSession& wireSession, NetworkStats& netStats,
 	        std::error_condition* errbub = nullptr );
 
+	using SliceFilter = std::function<bool(const StateKey&, const StateEntry&)>;
+
+	/** Send the entries accepted by filter. Since WIRE_PROTO_VERSION_CHUNKED
+	 * the slice is serialized one frame at time while sending, so no full
+	 * size buffer is needed, older versions get the whole slice in one go.
+	 * Before WIRE_PROTO_VERSION_BINARY the filter is ignored.
+	 * If WIRE_FEATURE_COMPRESSION has been agreed, frames bigger then
+	 * compressionThreshold are compressed with the data type dictionary.
+	 * @param leadingFrame optional frame sent before the slice frames,
+	 *	supported only since WIRE_PROTO_VERSION_CHUNKED
+	 * @return total sent bytes, -1 on error */
+	std::task<ssize_t> sendStateSlice(
+	        AsyncSocket& socket, const std::string& typeName,
+	        std::map<StateKey, StateEntry>& stateSlice, SliceFilter filter,
+	        const WireSession& wireSession, NetworkStats& netStats,
+	        std::vector<uint8_t> leadingFrame = {},
+	        std::error_condition* errbub = nullptr );
+
+	/** Send a message in WIRE_PROTO_VERSION_CHUNKED framing, nextFrame
+	 * is called to fill each frame and returns false after the last one
+	 * @return total sent bytes, -1 on error */
+	static std::task<ssize_t> sendFramedMessage(
+	        AsyncSocket& socket, const std::string& typeName,
+	        std::function<bool(std::vector<uint8_t>& frame)> nextFrame,
+	        NetworkStats& netStats, std::error_condition* errbub );
+
+	/** Replace a received BINARY_COMPRESSED_FORMAT frame, found at
+	 * frameOffset in netMsg.mData, with its decompressed content, or store a
+	 * BINARY_DICTIONARY_FORMAT frame removing it, other frames are left
+	 * untouched.
+	 * @return false if the frame is invalid */
+	bool unwrapFrame(
+	        NetworkMessage& netMsg, std::size_t frameOffset,
+	        const sockaddr_storage& peerAddr, const WireSession& wireSession,
+	        std::error_condition* errbub );
+
+	/** Compression dictionary trained on a data type state */
+	struct TypeDictionary
+	{
+		/// Hash of the dictionary content, 0 if no dictionary is available
+		uint64_t mId = 0;
+
+		/** Shared so frames being sent keep using it even if the dictionary
+		 * get retrained meanwhile */
+		std::shared_ptr<const std::vector<uint8_t>> mData;
+
+		uint64_t mTrainedChangeSeq = 0;
+		std::chrono::steady_clock::time_point mTrainedAt;
+	};
+
+	/** @return the data type dictionary, training it if missing or
+	 * outdated, @see DICTIONARY_RETRAIN_INTERVAL */
+	const TypeDictionary& typeDictionary(const std::string& dataTypeName);
+
+	/** Fill dictionary with the strings recurring most in the state, keys,
+	 * authors, JSON member names and string values, encoded as on the wire.
+	 * Deflate finds matches closer to the data cheaper, so most valuable
+	 * strings are placed at the end */
+	static void trainDictionary(
+	        const std::map<StateKey, StateEntry>& stateSlice,
+	        std::vector<uint8_t>& dictionary );
+
+	static uint64_t dictionaryId(std::span<const uint8_t> dictionary);
+
+	/** Wait for the receiver to acknowledge total received bytes and
+	 * extimate upload bandwidth
+	 * @return false on failure or acknowledge mismatch */
+	static std::task<bool> waitSendAck(
+	        AsyncSocket& socket, ssize_t totalSentBytes,
+	        std::chrono::steady_clock::time_point sendBTP,
+	        NetworkStats& netStats, std::error_condition* errbub );
+
 	static constexpr std::string_view SHARED_STATE_DATA_DIR =
 	        "/tmp/shared-state/";
 
@@ -275,8 +992,188 @@ protected:
 	/// Shared state data types loaded configurations
 	std::map<std::string, DataTypeConf> mTypeConf;
 
+	/** Peers which refused our newest wire protocol version, mapped to the
+	 * time that happened, @see LEGACY_PEER_REPROBE_INTERVAL */
+	std::map<std::string, std::chrono::steady_clock::time_point> mLegacyPeers;
+
+	/** Per data type monotonically increasing change sequence number, each
+	 * inserted or updated entry get the next one */
+	std::map<std::string, uint64_t> mStatesChangeSeq;
+
+	/** Entries keys ordered by expiry, so bleaching doesn't need to scan the
+	 * whole state. Updating an entry expiry doesn't remove the old record,
+	 * when outdated records surface they are just discarded */
+	using ExpiryQueue = std::priority_queue<
+	    std::pair<std::chrono::steady_clock::time_point, StateKey>,
+	    std::vector<std::pair<std::chrono::steady_clock::time_point, StateKey>>,
+	    std::greater<> >;
+
+	/// Per data type expiry queues
+	std::map<std::string, ExpiryQueue> mExpiryQueues;
+
+	/** Entry to be merged, data can be still encoded, if so it get decoded
+	 * only if it needs to be stored */
+	struct IncomingEntry
+	{
+		std::string_view mAuthor;
+		std::chrono::steady_clock::time_point mExpiry;
+		std::span<const uint8_t> mEncodedData;
+
+		/// Already decoded entry if available
+		const StateEntry* mDecoded = nullptr;
+
+		/** Same as mDecoded when nobody else needs it, so its data can be
+		 * moved into the state instead of being copied */
+		StateEntry* mDecodedOwned = nullptr;
+	};
+
+	/// Bookkeeping of an ongoing merge into a data type state
+	struct MergeSession
+	{
+		std::map<StateKey, StateEntry>* mState = nullptr;
+		uint64_t* mChangeSeq = nullptr;
+		ExpiryQueue* mExpiryQueue = nullptr;
+		std::string mOwnAuthor;
+		bool mIsRemote = false;
+		sockaddr_storage mPeerAddr;
+		std::chrono::steady_clock::time_point mNow;
+
+		ssize_t mAllChanges = 0;
+		ssize_t mSignificantChanges = 0;
+
+		/** Change sequence numbers assigned by this session, others may be
+		 * assigned meanwhile by merges running while mStateLock is released
+		 * or the merging coroutine is suspended */
+		uint64_t mAssignedChangeSeqs = 0;
+	};
+
+	bool setupMergeSession(
+	        MergeSession& mergeSession, const std::string& dataTypeName,
+	        const sockaddr_storage& peerAddr, std::error_condition* errbub );
+
+	/** Look up again the data type state a merge session points to, needed
+	 * after releasing mStateLock as the type might have been unregistered
+	 * meanwhile, @see setupMergeSession */
+	bool bindMergeSession(
+	        MergeSession& mergeSession, const std::string& dataTypeName,
+	        std::error_condition* errbub );
+
+	/** Decode a binary slice without holding mStateLock, then merge it.
+	 * Unlike merging entries as they are decoded, entries which would be
+	 * discarded get decoded too, but other threads are not stalled meanwhile
+	 * @see mergeBinaryFrame */
+	bool mergeSliceUnlocked(
+	        MergeSession& mergeSession, const NetworkMessage& frame,
+	        BinaryReader& reader, uint64_t& numEntries,
+	        std::error_condition* errbub );
+
+	/** Merge a frame of a WIRE_PROTO_VERSION_CHUNKED binary message, or a
+	 * whole binary message otherwise.
+	 * @param expectedFormat format of the first slice in the frame, updated
+	 *	to the format expected in next frames
+	 * @return false if the frame is invalid */
+	bool mergeBinaryFrame(
+	        MergeSession& mergeSession, const NetworkMessage& frame,
+	        bool isChunked, uint8_t& expectedFormat,
+	        std::vector<uint32_t>* digestReplyBuckets, uint32_t digestBucketsNum,
+	        std::error_condition* errbub );
+
+	/** @return false if the entry data is invalid */
+	bool mergeEntry(
+	        MergeSession& mergeSession, const StateKey& key,
+	        const IncomingEntry& incomingEntry );
+
+	/// @see merge
+	void mergeStateSlice(
+	        MergeSession& mergeSession,
+	        const std::map<StateKey, StateEntry>& stateSlice );
+
+	/** Merge entries straight out of a received message, without building an
+	 * intermediate state slice, entries data is decoded only if they win
+	 * against the known entry. Before WIRE_PROTO_VERSION_BINARY fall back to
+	 * toStateSlice.
+	 * @param mergeSession set up for the message data type, it is bound again
+	 *	as the caller may have been suspended since then
+	 * @param digestReplyBuckets must be passed to merge a
+	 *	BINARY_DIGEST_REPLY_FORMAT message, filled with the differing buckets
+	 * @return number of significative changes in the state, -1 on error */
+	std::task<ssize_t> mergeNetworkMessage(
+	        const NetworkMessage& networkMessage, uint32_t wireProtoVersion,
+	        MergeSession& mergeSession,
+	        std::vector<uint32_t>* digestReplyBuckets = nullptr,
+	        uint32_t digestBucketsNum = 0,
+	        std::error_condition* errbub = nullptr );
+
+	/// Peers cursors mapped by peerSyncCursorKey
+	std::map<std::string, PeerSyncCursor> mPeerSyncCursors;
+
+	/// Per data type dictionaries we compress with
+	std::map<std::string, TypeDictionary> mTypeDictionaries;
+
+	/** Dictionary received from a peer, needed to decompress its frames */
+	struct PeerDictionary
+	{
+		std::shared_ptr<const std::vector<uint8_t>> mData;
+		std::chrono::steady_clock::time_point mLastUse;
+	};
+
+	/** Dictionaries received from peers mapped by peerSyncCursorKey, then by
+	 * id, ids are chosen by the sender so a peer must never reach the
+	 * dictionaries of another, @see PEER_DICTIONARY_MAX_AGE,
+	 * PEER_DICTIONARIES_MAX */
+	std::map<std::string, std::map<uint64_t, PeerDictionary>>
+	        mPeerDictionaries;
+
+	/// Idle connections to peers mapped by peerConnectionKey
+	std::map<std::string, PeerConnection> mConnectionPool;
+
+	/** Pooled connections are closed after being unused this long, served
+	 * connections get keep alive probes after this long */
+	std::chrono::seconds mConnectionIdleTimeout =
+	        DEFAULT_CONNECTION_IDLE_TIMEOUT;
+
+	/// @see syncWithPeers
+	std::size_t mSyncConcurrency = DEFAULT_SYNC_CONCURRENCY;
+
+	/// @see setMaxWireProtoVersion
+	uint32_t mMaxWireProtoVersion = WIRE_PROTO_VERSION;
+
 	IOContext& mIoContext;
 
+	/** Incoming connections may be served by coroutines running on other
+	 * threads, each with its own IOContext, all of them use this as run lock
+	 * so the state is accessed by one thread at time.
+	 * @see IOContext::setRunLock */
+	std::mutex mStateLock;
+
+	/// Set before other threads start sharing the state
+	bool mIsStateShared = false;
+
+	/** Let other threads access the state while doing CPU intensive work
+	 * which doesn't touch it, like compressing frames. The lock is released
+	 * only if IOContext::run() on this thread is holding it, so nested in
+	 * another StateUnlock or in an AsyncFileDescriptor::RunUnlock it does
+	 * nothing. Nothing may be co_awaited while it is alive */
+	class StateUnlock
+	{
+	public:
+		explicit StateUnlock(SharedState& sharedState):
+		    mUnlock(sharedState.heldStateLock()) {}
+
+	private:
+		AsyncFileDescriptor::RunUnlock mUnlock;
+	};
+
+	/** @return run lock of the IOContext running on this thread if it is
+	 * holding mStateLock, nullptr otherwise. Debug builds exit if the state is
+	 * shared but this thread isn't running an IOContext with mStateLock as
+	 * run lock, as then the caller is touching the state without owning it */
+	std::unique_lock<std::mutex>* heldStateLock();
+
+	/** Random number identifying this instance lifetime, peers use it to
+	 * know if we have restarted since last synchronization */
+	const uint64_t mInstanceEpoch;
+
 	/** Only peer instance is in charge of notifying hooks */
 	bool isPeer = false;
 };
@@ -23,9 +23,16 @@
 #pragma once
 
 #include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include <atomic>
+#include <new>
+#include <system_error>
 
+#include <util/rsdebug.h>
+#include <util/stacktrace.h>
 #include <util/rsdebuglevel1.h>
 
 namespace std
@@ -34,6 +41,136 @@ namespace std
     struct task;
     namespace detail
     {
+        /**
+         * @brief Per thread free lists of coroutine frames grouped by size
+         * class, so in steady state creating a coroutine doesn't touch
+         * malloc. Each thread runs its own IOContext and coroutines never
+         * migrate between them, so frames are freed by the same thread which
+         * allocated them and no locking is needed.
+         */
+        class frame_pool
+        {
+        public:
+            static constexpr std::size_t GRANULARITY = 64;
+
+            /// Bigger frames are rare, they go straight to the heap
+            static constexpr std::size_t MAX_POOLED_SIZE = 4096;
+
+            /** Bound memory kept after a burst of coroutines, frames freed
+             * past it go back to the heap */
+            static constexpr std::size_t MAX_FREE_PER_CLASS = 256;
+
+            static frame_pool& local()
+            {
+                static thread_local frame_pool tPool;
+                return tPool;
+            }
+
+#ifndef NDEBUG
+            /** Debug builds put the owner pool in front of each frame, so a
+             * frame freed by another thread is caught instead of silently
+             * ending up in the wrong free list */
+            static constexpr std::size_t OWNER_TAG_SIZE =
+                    __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+#else
+            static constexpr std::size_t OWNER_TAG_SIZE = 0;
+#endif
+
+            void* allocate(std::size_t size)
+            {
+                ++mLive;
+                auto tBlock = static_cast<std::byte*>(
+                            allocateBlock(size + OWNER_TAG_SIZE) );
+#ifndef NDEBUG
+                *reinterpret_cast<frame_pool**>(tBlock) = this;
+#endif
+                return tBlock + OWNER_TAG_SIZE;
+            }
+
+            void deallocate(void* ptr, std::size_t size) noexcept
+            {
+                --mLive;
+                auto tBlock = static_cast<std::byte*>(ptr) - OWNER_TAG_SIZE;
+#ifndef NDEBUG
+                if(*reinterpret_cast<frame_pool**>(tBlock) != this) RS_UNLIKELY
+                {
+                    RS_FATAL( "Coroutine frame: ", ptr, " freed by another "
+                              "thread than the one which allocated it, "
+                              "report to developers!" );
+                    print_stacktrace();
+                    exit(static_cast<int>(std::errc::state_not_recoverable));
+                }
+#endif
+                deallocateBlock(tBlock, size + OWNER_TAG_SIZE);
+            }
+
+            /// Frames allocated and not freed yet
+            std::size_t live() const { return mLive; }
+
+            /// Allocations served from the free lists
+            uint64_t recycled() const { return mRecycled; }
+
+            ~frame_pool()
+            {
+                for(auto& tList: mFree)
+                    while(tList.mHead)
+                    {
+                        auto tBlock = tList.mHead;
+                        tList.mHead = tBlock->mNext;
+                        ::operator delete(tBlock);
+                    }
+            }
+
+        private:
+            frame_pool() = default;
+            frame_pool(const frame_pool&) = delete;
+
+            void* allocateBlock(std::size_t size)
+            {
+                if(size > MAX_POOLED_SIZE) return ::operator new(size);
+
+                auto& tList = mFree[sizeClass(size)];
+                if(!tList.mHead)
+                    return ::operator new(classSize(sizeClass(size)));
+
+                ++mRecycled;
+                auto tBlock = tList.mHead;
+                tList.mHead = tBlock->mNext;
+                --tList.mCount;
+                return tBlock;
+            }
+
+            void deallocateBlock(void* ptr, std::size_t size) noexcept
+            {
+                if(size > MAX_POOLED_SIZE) return ::operator delete(ptr);
+
+                auto& tList = mFree[sizeClass(size)];
+                if(tList.mCount >= MAX_FREE_PER_CLASS)
+                    return ::operator delete(ptr);
+
+                auto tBlock = static_cast<free_block*>(ptr);
+                tBlock->mNext = tList.mHead;
+                tList.mHead = tBlock;
+                ++tList.mCount;
+            }
+
+            static constexpr std::size_t sizeClass(std::size_t size)
+            { return size ? (size - 1) / GRANULARITY : 0; }
+            static constexpr std::size_t classSize(std::size_t sizeClass)
+            { return (sizeClass + 1) * GRANULARITY; }
+
+            struct free_block { free_block* mNext; };
+            struct free_list
+            {
+                free_block* mHead = nullptr;
+                std::size_t mCount = 0;
+            };
+
+            free_list mFree[MAX_POOLED_SIZE / GRANULARITY];
+            std::size_t mLive = 0;
+            uint64_t mRecycled = 0;
+        };
+
         template <typename T>
 
         /**
@@ -45,22 +182,33 @@ namespace std
         {
 			promise_type_base() { RS_DBG4(""); }
 			~promise_type_base() { RS_DBG4(""); }
+
+			/// Coroutine frames come from the thread frame_pool
+			static void* operator new(std::size_t size)
+			{ return frame_pool::local().allocate(size); }
+			static void operator delete(void* ptr, std::size_t size) noexcept
+			{ frame_pool::local().deallocate(ptr, size); }
+
             coroutine_handle<> waiter; // who waits on this coroutine
+            bool awaited = false; // owned by an awaiting task, don't self destroy
             task<T> get_return_object();
             suspend_always initial_suspend() { return {}; }
+            /** Transfer execution back to the waiter if it suspended, a task
+             * completing before that just returns to task::await_suspend,
+             * @see task::await_suspend */
             struct final_awaiter
             {
                 bool await_ready() noexcept { return false; }
                 void await_resume() noexcept {}
                 template <typename promise_type>
-                void await_suspend(coroutine_handle<promise_type> me) noexcept
+                coroutine_handle<> await_suspend(
+                        coroutine_handle<promise_type> me ) noexcept
                 {
-                    if (me.promise().waiter)
-                        me.promise().waiter.resume();
-                    else
-                    {
-                        me.destroy();
-                    }
+                    if (me.promise().waiter) return me.promise().waiter;
+                    if (me.promise().awaited) return noop_coroutine();
+
+                    me.destroy();
+                    return noop_coroutine();
                 }
             };
             auto final_suspend() noexcept
@@ -153,10 +301,21 @@ namespace std
 
         bool await_ready() { return false; }
         T await_resume();
-        void await_suspend(coroutine_handle<> waiter)
+        /** Run the task right away, if it completes without suspending the
+         * waiter goes on without suspending either. So long chains of tasks
+         * completing synchronously, like small sends on loopback, don't nest a
+         * native stack frame for each one, without relying on the compiler
+         * turning symmetric transfer into a tail call, which GCC doesn't do
+         * without optimizations */
+        bool await_suspend(coroutine_handle<> waiter)
         {
-            mCoroutineHandle.promise().waiter = waiter;
+            auto& tPromise = mCoroutineHandle.promise();
+            tPromise.awaited = true;
             mCoroutineHandle.resume();
+            if (mCoroutineHandle.done()) return false;
+
+            tPromise.waiter = waiter;
+            return true;
         }
         
         /**
@@ -168,6 +327,18 @@ namespace std
             mCoroutineHandle.resume();
         }
 
+        /**
+         * @brief starts the execution of the task and gives up its
+         * ownership, the coroutine frame destroys itself on completion, so
+         * the task object can go out of scope before the coroutine finish
+         */
+        void detach()
+        {
+            auto tHandle = mCoroutineHandle;
+            mCoroutineHandle = nullptr;
+            tHandle.resume();
+        }
+
     private:
         coroutine_handle<promise_type> mCoroutineHandle;
     };
@@ -28,17 +28,18 @@
 
 class AsyncCommand;
 
-class WaitpidOperation:
-        public AwaitableSyscall<WaitpidOperation, pid_t, true>
+class [[nodiscard]] WaitpidOperation:
+        public AwaitableSyscall<WaitpidOperation, pid_t>
 {
 public:
 	WaitpidOperation(
 	        AsyncCommand& afd,
 	        int* wstatus = nullptr,
 	        std::error_condition* ec = nullptr );
-	~WaitpidOperation();
 
 	pid_t syscall();
+	bool prepareSqe(io_uring_sqe& sqe);
+	pid_t completeSqe(int32_t result);
 
 private:
 	pid_t childPid() const;
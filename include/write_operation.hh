@@ -27,23 +27,28 @@
 
 #include "awaitable_syscall.hh"
 
-class WriteOp : public AwaitableSyscall<WriteOp, ssize_t>
+class [[nodiscard]] WriteOp : public AwaitableSyscall<WriteOp, ssize_t>
 {
 public:
+	static constexpr auto DIRECTION =
+	        AsyncFileDescriptor::OpDirection::OUTPUT;
+
 	WriteOp(
 	        AsyncFileDescriptor& AFD,
 	        const uint8_t* buffer, std::size_t len,
 	        std::error_condition* ec = nullptr );
-	~WriteOp();
 
 	ssize_t syscall();
+	bool prepareSqe(io_uring_sqe& sqe);
+	inline std::size_t transferLength() const { return mLen; }
 
 private:
 	const uint8_t* mBuffer = nullptr;
 	std::size_t mLen = 0;
 };
 
-std::task<ssize_t> asyncWrite(
+/// Write all len bytes, @see asyncRead
+[[nodiscard]] WriteOp asyncWrite(
         AsyncFileDescriptor& aFD,
         const uint8_t* buffer, std::size_t len,
         std::error_condition* errbub = nullptr );
@@ -30,13 +30,6 @@ AcceptOperation::AcceptOperation(
     AwaitableSyscall{socket, ec}
 {
 	RS_DBG3("");
-	mAFD.getIOContext().watchRead(&mAFD);
-}
-
-AcceptOperation::~AcceptOperation()
-{
-	RS_DBG3("");
-	mAFD.getIOContext().unwatchRead(&mAFD);
 }
 
 int AcceptOperation::syscall()
@@ -49,3 +42,10 @@ int AcceptOperation::syscall()
 
 	return accept(mAFD.getFD(), (struct sockaddr *)&their_addr, &addr_size);
 }
+
+bool AcceptOperation::prepareSqe(io_uring_sqe& sqe)
+{
+	sqe.opcode = IORING_OP_ACCEPT;
+	sqe.fd = mAFD.getFD();
+	return true;
+}
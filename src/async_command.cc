@@ -132,10 +132,10 @@ static int pidfd_open(pid_t pid, unsigned int flags)
 		tPac->mProcessId = forkRetVal;
 
 		tPac->mStdOut = ioContext.registerFD(PARENT_READ);
-		ioContext.attachReadonly(tPac->mStdOut.get());
+		ioContext.attach(tPac->mStdOut.get());
 
 		tPac->mStdIn = ioContext.registerFD(PARENT_WRITE);
-		ioContext.attachWriteOnly(tPac->mStdIn.get());
+		ioContext.attach(tPac->mStdIn.get());
 
 		// Close child ends of the pipes
 		close(CHILD_READ); close(CHILD_WRITE);
@@ -185,11 +185,11 @@ static int pidfd_open(pid_t pid, unsigned int flags)
 	return nullptr;
 }
 
-std::task<ssize_t> AsyncCommand::readStdOut(
+ReadOp AsyncCommand::readStdOut(
         uint8_t* buffer, std::size_t len, std::error_condition* errbub)
-{ co_return co_await asyncRead(*mStdOut, buffer, len, errbub); }
+{ return asyncRead(*mStdOut, buffer, len, errbub); }
 
-std::task<ssize_t> AsyncCommand::writeStdIn(
+WriteOp AsyncCommand::writeStdIn(
         const uint8_t* buffer, std::size_t len, std::error_condition* errbub )
 {
 	RS_DBG2( *mStdIn,
@@ -198,7 +198,7 @@ std::task<ssize_t> AsyncCommand::writeStdIn(
 	RS_DBG4( " buffer content: ",
 	         std::string(reinterpret_cast<const char*>(buffer), len) );
 
-	co_return co_await asyncWrite(*mStdIn, buffer, len, errbub);
+	return asyncWrite(*mStdIn, buffer, len, errbub);
 }
 
 std::task<bool> AsyncCommand::closeStdIn(std::error_condition* errbub)
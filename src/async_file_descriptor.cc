@@ -22,6 +22,22 @@
 #include <ostream>
 
 #include "async_file_descriptor.hh"
+#include "io_context.hh"
+
+void AsyncFileDescriptor::addPendingOp(
+        PendingOperation& op, OpDirection direction )
+{
+	auto& tOps = direction == OpDirection::OUTPUT ? mOutputOps : mInputOps;
+	tOps.push(&op);
+	RS_DBG2(*this, " numPending: ", tOps.size());
+	mIOContext.markWaiting(*this);
+}
+
+void AsyncFileDescriptor::addInFlightOp(UringCompletion* op)
+{
+	mInFlightOps.push_back(op);
+	mIOContext.markWaiting(*this);
+}
 
 std::ostream &operator<<(std::ostream& out, const AsyncFileDescriptor& aFD)
 {
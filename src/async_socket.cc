@@ -26,16 +26,20 @@
 #include "accept_operation.hh"
 #include "recv_operation.hh"
 #include "send_operation.hh"
+#include "send_vector_operation.hh"
 #include "io_context.hh"
 
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <iostream>
+#include <algorithm>
 #include <cerrno>
+#include <cstring>
 #include <sys/time.h>
 
 #include <util/rsnet.h>
@@ -45,8 +49,9 @@
 #include <util/rsdebuglevel1.h>
 
 std::task<std::shared_ptr<ConnectingSocket>> ConnectingSocket::connect(
-        const sockaddr_storage& address,
-        IOContext& ioContext, std::error_condition* errbub )
+        const sockaddr_storage& address, IOContext& ioContext,
+        std::chrono::steady_clock::time_point deadline,
+        std::error_condition* errbub )
 {
 	int fd = socket(PF_INET6, SOCK_STREAM, 0);
 	if(fd < 0)
@@ -57,7 +62,8 @@ std::task<std::shared_ptr<ConnectingSocket>> ConnectingSocket::connect(
 	}
 
 	auto lSocket = ioContext.registerFD<ConnectingSocket>(fd);
-	ioContext.attachWriteOnly(lSocket.get());
+	ioContext.attach(lSocket.get());
+	lSocket->setDeadline(deadline);
 
 	if(co_await ConnectOperation(*lSocket, address, errbub) == -1)
 	{
@@ -69,7 +75,8 @@ std::task<std::shared_ptr<ConnectingSocket>> ConnectingSocket::connect(
 }
 
 std::shared_ptr<ListeningSocket> ListeningSocket::setupListener(
-        uint16_t port, IOContext& ioContext, std::error_condition* ec )
+        uint16_t port, IOContext& ioContext, int backlog, bool reusePort,
+        std::error_condition* ec )
 {
 	int fd_ = socket(PF_INET6, SOCK_STREAM, 0);
 	if(fd_ < 0)
@@ -100,6 +107,15 @@ std::shared_ptr<ListeningSocket> ListeningSocket::setupListener(
 		return nullptr;
 	}
 
+	int reuseport_optval = 1;
+	if( reusePort && setsockopt( fd_, SOL_SOCKET, SO_REUSEPORT,
+	                &reuseport_optval, sizeof(reuseport_optval) ) < 0 )
+	{
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), ec, "setting SO_REUSEPORT" );
+		return nullptr;
+	}
+
 	sockaddr_in6 listenAddr;
 	memset(&listenAddr, 0, sizeof(listenAddr));
 	listenAddr.sin6_family = AF_INET6;
@@ -113,7 +129,7 @@ std::shared_ptr<ListeningSocket> ListeningSocket::setupListener(
 		return nullptr;
 	}
 
-	if( listen(fd_, DEFAULT_LISTEN_BACKLOG) < 0 )
+	if( listen(fd_, backlog) < 0 )
 	{
 		rs_error_bubble_or_exit(
 		            rs_errno_to_condition(errno), ec, "listen" );
@@ -132,20 +148,66 @@ std::shared_ptr<ListeningSocket> ListeningSocket::setupListener(
 		}
 		return nullptr;
 	}
-	ioContext.attachReadonly(lSocket.get());
-	ioContext.watchRead(lSocket.get());
+	ioContext.attach(lSocket.get());
 	return lSocket;
 }
 
-std::task<std::shared_ptr<AsyncSocket>> ListeningSocket::accept()
+std::task<std::shared_ptr<AsyncSocket>> ListeningSocket::accept(
+        std::error_condition* errbub )
 {
-	int fd = co_await AcceptOperation(*this);
-	auto rsk = mIOContext.registerFD<AsyncSocket>(fd);
+	int fd = co_await AcceptOperation(*this, errbub);
+	if(fd == -1) RS_UNLIKELY co_return nullptr;
+	co_return registerAccepted(fd, errbub);
+}
+
+std::task<bool> ListeningSocket::acceptPending(
+        std::vector<std::shared_ptr<AsyncSocket>>& sockets,
+        std::size_t maxSockets, std::error_condition* errbub )
+{
+	if(!maxSockets) RS_UNLIKELY co_return true;
+
+	auto firstSocket = co_await accept(errbub);
+	if(!firstSocket) RS_UNLIKELY co_return false;
+	sockets.push_back(std::move(firstSocket));
+
+	/* The listening socket is non-blocking so no need to go through
+	 * AcceptOperation for the others, they are either ready or not there */
+	for(std::size_t accepted = 1; accepted < maxSockets; ++accepted)
+	{
+		int fd = ::accept(mFD, nullptr, nullptr);
+		if(fd == -1)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK) RS_LIKELY break;
+
+			rs_error_bubble_or_exit(
+			            rs_errno_to_condition(errno), errbub,
+			            *this, " accept failed" );
+			co_return false;
+		}
+
+		auto tSocket = registerAccepted(fd, errbub);
+		if(!tSocket) RS_UNLIKELY co_return false;
+		sockets.push_back(std::move(tSocket));
+	}
+
+	co_return true;
+}
+
+std::shared_ptr<AsyncSocket> ListeningSocket::registerAccepted(
+        int fd, std::error_condition* errbub )
+{
+	auto rsk = mIOContext.registerFD<AsyncSocket>(fd, errbub);
+	if(!rsk) RS_UNLIKELY
+	{
+		close(fd);
+		return nullptr;
+	}
+
 	mIOContext.attach(rsk.get());
-	co_return rsk;
+	return rsk;
 }
 
-std::task<ssize_t> AsyncSocket::recv(
+RecvOperation AsyncSocket::recv(
         uint8_t* buffer, std::size_t len,
         std::error_condition* errbub )
 {
@@ -153,23 +215,10 @@ std::task<ssize_t> AsyncSocket::recv(
 	         " buffer: ", reinterpret_cast<const void*>(buffer),
 	         " len: ", len, " errbub: ", errbub );
 
-	ssize_t numReadBytes = 0;
-	ssize_t totalReadBytes = 0;
-	do
-	{
-		numReadBytes = co_await
-		        RecvOperation(
-		            *this, buffer + totalReadBytes, len - totalReadBytes, errbub );
-		if(numReadBytes == -1) RS_UNLIKELY co_return -1;
-
-		totalReadBytes += numReadBytes;
-	}
-	while(numReadBytes && totalReadBytes < len);
-
-	co_return totalReadBytes;
+	return RecvOperation(*this, buffer, len, errbub);
 }
 
-std::task<ssize_t> AsyncSocket::send(
+SendOperation AsyncSocket::send(
         const uint8_t* buffer, std::size_t len,
         std::error_condition* errbub )
 {
@@ -179,22 +228,40 @@ std::task<ssize_t> AsyncSocket::send(
 	RS_DBG4( " buffer content: ",
 	         std::string(reinterpret_cast<const char*>(buffer), len) );
 
-	ssize_t numWriteBytes = 0;
-	ssize_t totalWriteBytes = 0;
-	do
+	return SendOperation(*this, buffer, len, errbub);
+}
+
+SendVectorOperation AsyncSocket::sendVector(
+        std::span<iovec> iov, bool moreFollows, std::error_condition* errbub )
+{
+	RS_DBG2( *this, " buffers: ", iov.size(), " moreFollows: ", moreFollows,
+	         " errbub: ", errbub );
+
+	return SendVectorOperation(
+	            *this, iov, moreFollows ? MSG_MORE : 0, errbub );
+}
+
+ssize_t AsyncSocket::recvBuffered(uint8_t* buffer, std::size_t len)
+{
+	if(mReadAheadBegin == mReadAheadEnd)
 	{
-		numWriteBytes = co_await
-		        SendOperation(
-		            *this, buffer + totalWriteBytes, len - totalWriteBytes, errbub );
+		if(len >= READ_AHEAD_SIZE) return ::recv(mFD, buffer, len, 0);
 
-		if(numWriteBytes == -1) RS_UNLIKELY
-		    co_return -1;
+		if(!mReadAhead) mReadAhead.reset(new uint8_t[READ_AHEAD_SIZE]);
 
-		totalWriteBytes += numWriteBytes;
+		const ssize_t tReceived =
+		        ::recv(mFD, mReadAhead.get(), READ_AHEAD_SIZE, 0);
+		if(tReceived <= 0) return tReceived;
+
+		mReadAheadBegin = 0;
+		mReadAheadEnd = static_cast<std::size_t>(tReceived);
+		RS_DBG3(*this, " read ahead: ", tReceived, " bytes");
 	}
-	while(numWriteBytes && totalWriteBytes < len);
 
-	co_return totalWriteBytes;
+	const auto tServed = std::min(len, mReadAheadEnd - mReadAheadBegin);
+	memcpy(buffer, mReadAhead.get() + mReadAheadBegin, tServed);
+	mReadAheadBegin += tServed;
+	return static_cast<ssize_t>(tServed);
 }
 
 bool AsyncSocket::getPeerAddr(
@@ -215,3 +282,31 @@ bool AsyncSocket::getPeerAddr(
 
 	return true;
 }
+
+bool AsyncSocket::setKeepAlive(
+        std::chrono::seconds idleTime, std::error_condition* errbub )
+{
+	/* After idleTime send up to 3 probes 10 seconds apart before giving up on
+	 * the peer */
+	int keepAliveOptval = 1;
+	int keepIdleOptval = static_cast<int>(idleTime.count());
+	int keepIntvlOptval = 10;
+	int keepCntOptval = 3;
+
+	if( setsockopt( mFD, SOL_SOCKET, SO_KEEPALIVE,
+	                &keepAliveOptval, sizeof(keepAliveOptval) ) < 0 ||
+	    setsockopt( mFD, IPPROTO_TCP, TCP_KEEPIDLE,
+	                &keepIdleOptval, sizeof(keepIdleOptval) ) < 0 ||
+	    setsockopt( mFD, IPPROTO_TCP, TCP_KEEPINTVL,
+	                &keepIntvlOptval, sizeof(keepIntvlOptval) ) < 0 ||
+	    setsockopt( mFD, IPPROTO_TCP, TCP_KEEPCNT,
+	                &keepCntOptval, sizeof(keepCntOptval) ) < 0 ) RS_UNLIKELY
+	{
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), errbub,
+		            *this, " setting keep alive" );
+		return false;
+	}
+
+	return true;
+}
@@ -19,25 +19,19 @@
  * SPDX-License-Identifier: AGPL-3.0-only
  */
 
-#include <sys/timerfd.h>
-
 #include "async_timer.hh"
 #include "io_context.hh"
-#include "read_operation.hh"
 
 #include <util/rsdebug.h>
 #include <util/rsdebuglevel1.h>
 
 /*static*/ std::shared_ptr<AsyncTimer> AsyncTimer::create(
         IOContext& ioContext,
-        std::error_condition* errbub )
+        std::error_condition* /*errbub*/ )
 {
-	int timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-
-	auto timerAFD = ioContext.registerFD<AsyncTimer>(timerFD, errbub);
-	ioContext.attachReadonly(timerAFD.get());
-
-	return timerAFD;
+	/* Timers are served by IOContext so creating one cannot fail anymore,
+	 * error bubbling paramether is kept for API compatibility */
+	return std::shared_ptr<AsyncTimer>(new AsyncTimer(ioContext));
 }
 
 std::task<bool> AsyncTimer::wait(
@@ -68,25 +62,26 @@ std::task<bool> AsyncTimer::wait(
 		co_return false;
 	}
 
-	struct itimerspec tTimeSpec{};
-	tTimeSpec.it_interval.tv_sec = 0;
-	tTimeSpec.it_interval.tv_nsec = 0;
-	tTimeSpec.it_value.tv_sec = wsec.count();
-	tTimeSpec.it_value.tv_nsec = wnsec.count();
+	co_await SleepOperation(
+	            mIOContext, std::chrono::steady_clock::now() + wsec + wnsec );
 
-	if(-1 == timerfd_settime(getFD(), 0, &tTimeSpec, nullptr)) RS_UNLIKELY
-	{
-		rs_error_bubble_or_exit(
-		            rs_errno_to_condition(errno), errbub,
-		            "timerfd_settime failed" );
-		co_return false;
-	}
+	co_return true;
+}
+
+std::task<uint64_t> PeriodicTimer::tick()
+{
+	co_await SleepOperation(mIOContext, mNextTick);
+
+	/* Schedule next tick from the one just expired and not from now, so
+	 * wake up latency and caller processing time don't add up. If the
+	 * caller got too late skip the missed ticks instead of firing them all
+	 * in a burst */
+	const auto tLate = std::chrono::steady_clock::now() - mNextTick;
+	const uint64_t tElapsedPeriods = 1 + tLate / mPeriod;
+	mNextTick += mPeriod * tElapsedPeriods;
 
-	uint64_t tBuff = -1;
-	ssize_t numReadBytes = co_await ReadOp {
-	            *this,
-	            reinterpret_cast<uint8_t*>(&tBuff), sizeof(tBuff),
-	            errbub };
+	if(tElapsedPeriods > 1)
+		RS_DBG1("Missed ", tElapsedPeriods - 1, " ticks");
 
-	co_return numReadBytes == sizeof(tBuff);
+	co_return tElapsedPeriods;
 }
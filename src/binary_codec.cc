@@ -0,0 +1,282 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+
+#include <cstring>
+
+#include "binary_codec.hh"
+
+#include <util/rsdebug.h>
+#include <util/rsdebuglevel1.h>
+
+/** JSON value tags, values are part of the wire format, do not change them */
+enum class BinaryJsonTag : uint8_t
+{
+	NULL_VALUE = 0,
+	FALSE_VALUE = 1,
+	TRUE_VALUE = 2,
+	/// Followed by varint
+	UINT = 3,
+	/// Followed by varint of -(value+1)
+	NEGATIVE_INT = 4,
+	/// Followed by 8 bytes little endian IEEE 754
+	DOUBLE = 5,
+	/// Followed by varint lenght and bytes
+	STRING = 6,
+	/// Followed by varint elements count and elements
+	ARRAY = 7,
+	/// Followed by varint members count and (string name, value) pairs
+	OBJECT = 8
+};
+
+void BinaryWriter::writeVarint(uint64_t value)
+{
+	while(value >= 0x80)
+	{
+		mBuffer.push_back(static_cast<uint8_t>(value | 0x80));
+		value >>= 7;
+	}
+	mBuffer.push_back(static_cast<uint8_t>(value));
+}
+
+/*static*/ std::size_t BinaryWriter::varintSize(uint64_t value)
+{
+	std::size_t tSize = 1;
+	while(value >= 0x80) { value >>= 7; ++tSize; }
+	return tSize;
+}
+
+void BinaryWriter::writeBytes(const uint8_t* data, std::size_t len)
+{
+	mBuffer.insert(mBuffer.end(), data, data + len);
+}
+
+void BinaryWriter::writeString(std::string_view str)
+{
+	writeVarint(str.size());
+	writeBytes(reinterpret_cast<const uint8_t*>(str.data()), str.size());
+}
+
+void BinaryWriter::writeJson(const rapidjson::Value& value)
+{
+	switch(value.GetType())
+	{
+	case rapidjson::kNullType:
+		writeUint8(static_cast<uint8_t>(BinaryJsonTag::NULL_VALUE));
+		break;
+	case rapidjson::kFalseType:
+		writeUint8(static_cast<uint8_t>(BinaryJsonTag::FALSE_VALUE));
+		break;
+	case rapidjson::kTrueType:
+		writeUint8(static_cast<uint8_t>(BinaryJsonTag::TRUE_VALUE));
+		break;
+	case rapidjson::kNumberType:
+		if(value.IsUint64())
+		{
+			writeUint8(static_cast<uint8_t>(BinaryJsonTag::UINT));
+			writeVarint(value.GetUint64());
+		}
+		else if(value.IsInt64())
+		{
+			writeUint8(static_cast<uint8_t>(BinaryJsonTag::NEGATIVE_INT));
+			writeVarint(static_cast<uint64_t>(-(value.GetInt64() + 1)));
+		}
+		else
+		{
+			writeUint8(static_cast<uint8_t>(BinaryJsonTag::DOUBLE));
+			const double tDouble = value.GetDouble();
+			uint64_t tBits;
+			memcpy(&tBits, &tDouble, sizeof(tBits));
+			for(int i = 0; i < 8; ++i, tBits >>= 8)
+				writeUint8(static_cast<uint8_t>(tBits));
+		}
+		break;
+	case rapidjson::kStringType:
+		writeUint8(static_cast<uint8_t>(BinaryJsonTag::STRING));
+		writeString(std::string_view(
+		                value.GetString(), value.GetStringLength() ));
+		break;
+	case rapidjson::kArrayType:
+		writeUint8(static_cast<uint8_t>(BinaryJsonTag::ARRAY));
+		writeVarint(value.Size());
+		for(auto vIt = value.Begin(); vIt != value.End(); ++vIt)
+			writeJson(*vIt);
+		break;
+	case rapidjson::kObjectType:
+		writeUint8(static_cast<uint8_t>(BinaryJsonTag::OBJECT));
+		writeVarint(value.MemberCount());
+		for(auto mIt = value.MemberBegin(); mIt != value.MemberEnd(); ++mIt)
+		{
+			writeString(std::string_view(
+			                mIt->name.GetString(), mIt->name.GetStringLength() ));
+			writeJson(mIt->value);
+		}
+		break;
+	}
+}
+
+bool BinaryReader::readUint8(uint8_t& value)
+{
+	if(mCur >= mEnd) RS_UNLIKELY return false;
+	value = *mCur++;
+	return true;
+}
+
+bool BinaryReader::readVarint(uint64_t& value)
+{
+	value = 0;
+	for(unsigned shift = 0; shift < 64; shift += 7)
+	{
+		if(mCur >= mEnd) RS_UNLIKELY return false;
+		const uint8_t tByte = *mCur++;
+		value |= static_cast<uint64_t>(tByte & 0x7f) << shift;
+		if(!(tByte & 0x80)) return true;
+	}
+
+	RS_DBG1("Varint too long");
+	return false;
+}
+
+bool BinaryReader::readStringView(std::string_view& str)
+{
+	uint64_t tLen = 0;
+	if(!readVarint(tLen) || tLen > remaining()) RS_UNLIKELY return false;
+	str = std::string_view(reinterpret_cast<const char*>(mCur), tLen);
+	mCur += tLen;
+	return true;
+}
+
+bool BinaryReader::readString(std::string& str)
+{
+	std::string_view tView;
+	if(!readStringView(tView)) RS_UNLIKELY return false;
+	str.assign(tView);
+	return true;
+}
+
+bool BinaryReader::skip(std::size_t len)
+{
+	if(len > remaining()) RS_UNLIKELY return false;
+	mCur += len;
+	return true;
+}
+
+bool BinaryReader::readJson(
+        rapidjson::Value& value, RsJson::AllocatorType& allocator )
+{ return readJson(value, allocator, 0); }
+
+bool BinaryReader::readJson(
+        rapidjson::Value& value, RsJson::AllocatorType& allocator,
+        unsigned depth )
+{
+	if(depth > MAX_JSON_DEPTH) RS_UNLIKELY
+	{
+		RS_DBG1("JSON value nested too deep");
+		return false;
+	}
+
+	uint8_t tTag = 0;
+	if(!readUint8(tTag)) RS_UNLIKELY return false;
+
+	switch(static_cast<BinaryJsonTag>(tTag))
+	{
+	case BinaryJsonTag::NULL_VALUE: value.SetNull(); return true;
+	case BinaryJsonTag::FALSE_VALUE: value.SetBool(false); return true;
+	case BinaryJsonTag::TRUE_VALUE: value.SetBool(true); return true;
+	case BinaryJsonTag::UINT:
+	{
+		uint64_t tUint = 0;
+		if(!readVarint(tUint)) RS_UNLIKELY return false;
+		value.SetUint64(tUint);
+		return true;
+	}
+	case BinaryJsonTag::NEGATIVE_INT:
+	{
+		uint64_t tUint = 0;
+		if(!readVarint(tUint) || tUint > INT64_MAX) RS_UNLIKELY return false;
+		value.SetInt64(-static_cast<int64_t>(tUint) - 1);
+		return true;
+	}
+	case BinaryJsonTag::DOUBLE:
+	{
+		if(remaining() < 8) RS_UNLIKELY return false;
+		uint64_t tBits = 0;
+		for(int i = 0; i < 8; ++i)
+			tBits |= static_cast<uint64_t>(*mCur++) << (8*i);
+		double tDouble;
+		memcpy(&tDouble, &tBits, sizeof(tDouble));
+		value.SetDouble(tDouble);
+		return true;
+	}
+	case BinaryJsonTag::STRING:
+	{
+		std::string_view tStr;
+		if(!readStringView(tStr)) RS_UNLIKELY return false;
+		value.SetString(
+		            tStr.data(), static_cast<rapidjson::SizeType>(tStr.size()),
+		            allocator );
+		return true;
+	}
+	case BinaryJsonTag::ARRAY:
+	{
+		uint64_t tCount = 0;
+		// Each element takes at least one byte
+		if(!readVarint(tCount) || tCount > remaining()) RS_UNLIKELY
+		        return false;
+
+		value.SetArray();
+		value.Reserve(static_cast<rapidjson::SizeType>(tCount), allocator);
+		for(uint64_t i = 0; i < tCount; ++i)
+		{
+			rapidjson::Value tElement;
+			if(!readJson(tElement, allocator, depth + 1)) RS_UNLIKELY
+			        return false;
+			value.PushBack(tElement, allocator);
+		}
+		return true;
+	}
+	case BinaryJsonTag::OBJECT:
+	{
+		uint64_t tCount = 0;
+		// Each member takes at least two bytes
+		if(!readVarint(tCount) || tCount > remaining()/2) RS_UNLIKELY
+		        return false;
+
+		value.SetObject();
+		for(uint64_t i = 0; i < tCount; ++i)
+		{
+			std::string_view tName;
+			if(!readStringView(tName)) RS_UNLIKELY return false;
+
+			rapidjson::Value jName(
+			            tName.data(),
+			            static_cast<rapidjson::SizeType>(tName.size()),
+			            allocator );
+			rapidjson::Value jValue;
+			if(!readJson(jValue, allocator, depth + 1)) RS_UNLIKELY
+			        return false;
+			value.AddMember(jName, jValue, allocator);
+		}
+		return true;
+	}
+	}
+
+	RS_DBG1("Invalid JSON tag: ", static_cast<int>(tTag));
+	return false;
+}
@@ -71,3 +71,10 @@ int CloseOperation::syscall()
 	 * conventional AwaitableSyscall path */
 	return sysCloseRet;
 }
+
+bool CloseOperation::prepareSqe(io_uring_sqe& sqe)
+{
+	sqe.opcode = IORING_OP_CLOSE;
+	sqe.fd = mAFD.getFD();
+	return true;
+}
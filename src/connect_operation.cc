@@ -39,14 +39,41 @@ ConnectOperation::ConnectOperation(
     AwaitableSyscall<ConnectOperation, int>(pSocket, ec), mAddr(address)
 {
 	RS_DBG2(socket, " ", sockaddr_storage_tostring(address));
-	pSocket.getIOContext().watchWrite(&pSocket);
 };
 
+bool ConnectOperation::prepareSqe(io_uring_sqe& sqe)
+{
+	if( !sockaddr_storage_isValidNet(mAddr) ||
+	        !sockaddr_storage_ipv4_to_ipv6(mAddr) )
+	{
+		RS_ERR("Invalid address: ", sockaddr_storage_tostring(mAddr));
+		print_stacktrace();
+		errno = EINVAL;
+		return false;
+	}
+
+	sqe.opcode = IORING_OP_CONNECT;
+	sqe.fd = mAFD.getFD();
+	sqe.addr = reinterpret_cast<uint64_t>(&mAddr);
+	sqe.off = sizeof(struct sockaddr_in6);
+	return true;
+}
 
-ConnectOperation::~ConnectOperation()
+int ConnectOperation::completeSqe(int32_t result)
 {
-	RS_DBG4("");
-	mAFD.getIOContext().unwatchWrite(&mAFD);
+	/* Kernel waits for the connection to be estabilished, still a
+	 * non-blocking socket may report it that way on some versions */
+	if(result == 0 || result == -EISCONN)
+	{
+		RS_DBG1( "Successful connection to: ", sockaddr_storage_tostring(mAddr),
+		         " on: ", mAFD );
+		return 0;
+	}
+
+	RS_DBG1( "Failure connecting to: ", sockaddr_storage_tostring(mAddr),
+	         " on: ", mAFD, " with: ", rs_errno_to_condition(-result) );
+	errno = -result;
+	return -1;
 }
 
 int ConnectOperation::syscall()
@@ -0,0 +1,118 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+
+#include <zlib.h>
+
+#include "dictionary_codec.hh"
+
+#include <util/rsdebug.h>
+#include <util/rsdebuglevel1.h>
+
+/// Negative window bits select raw deflate streams
+static constexpr int DEFLATE_RAW_WINDOW_BITS = -15;
+
+/*static*/ bool DictionaryCodec::compress(
+        std::span<const uint8_t> input, std::span<const uint8_t> dictionary,
+        std::vector<uint8_t>& output )
+{
+	z_stream tStream{};
+	if( deflateInit2(
+	            &tStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+	            DEFLATE_RAW_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+		RS_UNLIKELY
+	{
+		RS_ERR("deflateInit2 failed");
+		return false;
+	}
+
+	if( !dictionary.empty() && deflateSetDictionary(
+	            &tStream, dictionary.data(),
+	            static_cast<uInt>(dictionary.size()) ) != Z_OK ) RS_UNLIKELY
+	{
+		RS_ERR("deflateSetDictionary failed");
+		deflateEnd(&tStream);
+		return false;
+	}
+
+	const auto outOffset = output.size();
+	output.resize(outOffset + deflateBound(&tStream, input.size()));
+
+	tStream.next_in = const_cast<Bytef*>(input.data());
+	tStream.avail_in = static_cast<uInt>(input.size());
+	tStream.next_out = output.data() + outOffset;
+	tStream.avail_out = static_cast<uInt>(output.size() - outOffset);
+
+	const int deflateRet = deflate(&tStream, Z_FINISH);
+	output.resize(outOffset + tStream.total_out);
+	deflateEnd(&tStream);
+
+	if(deflateRet != Z_STREAM_END) RS_UNLIKELY
+	{
+		RS_ERR("deflate failed: ", deflateRet);
+		return false;
+	}
+
+	return true;
+}
+
+/*static*/ bool DictionaryCodec::decompress(
+        std::span<const uint8_t> input, std::span<const uint8_t> dictionary,
+        std::size_t rawSize, std::vector<uint8_t>& output )
+{
+	z_stream tStream{};
+	if(inflateInit2(&tStream, DEFLATE_RAW_WINDOW_BITS) != Z_OK) RS_UNLIKELY
+	{
+		RS_ERR("inflateInit2 failed");
+		return false;
+	}
+
+	// Raw streams don't ask for the dictionary, it must be set in advance
+	if( !dictionary.empty() && inflateSetDictionary(
+	            &tStream, dictionary.data(),
+	            static_cast<uInt>(dictionary.size()) ) != Z_OK ) RS_UNLIKELY
+	{
+		RS_ERR("inflateSetDictionary failed");
+		inflateEnd(&tStream);
+		return false;
+	}
+
+	const auto outOffset = output.size();
+	output.resize(outOffset + rawSize);
+
+	tStream.next_in = const_cast<Bytef*>(input.data());
+	tStream.avail_in = static_cast<uInt>(input.size());
+	tStream.next_out = output.data() + outOffset;
+	tStream.avail_out = static_cast<uInt>(rawSize);
+
+	const int inflateRet = inflate(&tStream, Z_FINISH);
+	const bool tComplete =
+	        inflateRet == Z_STREAM_END && tStream.total_out == rawSize &&
+	        tStream.avail_in == 0;
+	inflateEnd(&tStream);
+
+	if(!tComplete) RS_UNLIKELY
+	{
+		RS_DBG1( "inflate failed: ", inflateRet, " got: ", tStream.total_out,
+		         " bytes expected: ", rawSize );
+		return false;
+	}
+
+	return true;
+}
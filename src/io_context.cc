@@ -21,24 +21,36 @@
  * SPDX-License-Identifier: AGPL-3.0-only
  */
 
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <vector>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include "io_context.hh"
 #include "async_file_descriptor.hh"
 #include "epoll_events_to_string.hh"
+#include "send_vector_operation.hh"
 
 #include <util/rsdebug.h>
 #include <util/stacktrace.h>
 #include <util/rsdebuglevel1.h>
 
+/// @see IOContext::threadRunLock
+static thread_local std::unique_lock<std::mutex>* tThreadRunLock = nullptr;
+
 
 /**
  * @brief Epoll handler and notification
  * this methods blocks until a the os rises a notification and forwards it
  * to the suspended blocksyscall.
  */
-std::unique_ptr<IOContext> IOContext::setup(std::error_condition* errc)
+std::unique_ptr<IOContext> IOContext::setup(
+        Backend backend, std::error_condition* errc )
 {
 	int epollFD = epoll_create1(0);
 	if(epollFD < 0)
@@ -49,42 +61,175 @@ std::unique_ptr<IOContext> IOContext::setup(std::error_condition* errc)
 		return nullptr;
 	}
 
-	return std::unique_ptr<IOContext>(new IOContext(epollFD));
+	std::unique_ptr<IoUring> tIoUring;
+	if(backend == Backend::IO_URING)
+	{
+		/* io_uring is often missing or disabled on embedded kernels, epoll
+		 * is always there */
+		std::error_condition uringErr;
+		tIoUring = IoUring::setup(IoUring::DEFAULT_ENTRIES, &uringErr);
+		if(!tIoUring)
+			RS_WARN( "io_uring not available: ", uringErr,
+			         " falling back to epoll" );
+	}
+
+	if(tIoUring)
+	{
+		/* Wait for io_uring completions together with everything else,
+		 * level triggered as we may not reap all of them at once */
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u64 = URING_EPOLL_KEY;
+		if(epoll_ctl(epollFD, EPOLL_CTL_ADD, tIoUring->getFD(), &ev) == -1)
+		{
+			rs_error_bubble_or_exit(
+			            rs_errno_to_condition(errno), errc,
+			            "failure adding io_uring to epoll set" );
+			close(epollFD);
+			return nullptr;
+		}
+	}
+
+	/* Level triggered, so it keeps waking epoll_wait until drained */
+	int stopFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	epoll_event stopEv;
+	stopEv.events = EPOLLIN;
+	stopEv.data.u64 = STOP_EPOLL_KEY;
+	if( stopFD < 0 ||
+	        epoll_ctl(epollFD, EPOLL_CTL_ADD, stopFD, &stopEv) == -1 )
+	{
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), errc,
+		            "failure setting up stop eventfd" );
+		if(stopFD >= 0) close(stopFD);
+		close(epollFD);
+		return nullptr;
+	}
+
+	return std::unique_ptr<IOContext>(
+	            new IOContext(epollFD, stopFD, std::move(tIoUring)) );
+}
+
+IOContext::~IOContext()
+{
+	close(mStopFD);
+	close(mEpollFD);
+}
+
+void IOContext::stop()
+{
+	/* Only async-signal-safe operations here, and errno must be preserved
+	 * for the interrupted code */
+	const int tErrno = errno;
+	mStopRequested = true;
+	const uint64_t tOne = 1;
+	[[maybe_unused]] auto tRet = write(mStopFD, &tOne, sizeof(tOne));
+	errno = tErrno;
 }
 
+/*static*/ std::unique_lock<std::mutex>* IOContext::threadRunLock()
+{ return tThreadRunLock; }
+
 void IOContext::run()
 {
+	using namespace std::chrono;
+
+	tThreadRunLock = &mRunLockHeld;
+
 	epoll_event events[DEFAULT_MAX_EVENTS];
 	for (;;)
 	{
-		RS_DBG3("Waiting epoll events");
-		auto nfds = epoll_wait(mEpollFD, events, DEFAULT_MAX_EVENTS, -1);
+		/* The run lock is held only while resuming coroutines, everything
+		 * else here touches only this IOContext */
+		if(mRunLockHeld.owns_lock()) mRunLockHeld.unlock();
+
+		if(mStopRequested.exchange(false)) RS_UNLIKELY
+		{
+			tThreadRunLock = nullptr;
+			return;
+		}
+
+		/* Only descriptors with operations waiting may need their deadline
+		 * expired, forget the others and those which got closed */
+		auto nextDeadline = AsyncFileDescriptor::NO_DEADLINE;
+		std::erase_if(mWaitingFD, [&](uint64_t tKey)
+		{
+			auto aFD = managedFD(tKey);
+			if(!aFD) return true;
+
+			if(!aFD->isAwaitingDeadline())
+			{
+				aFD->mIsMarkedWaiting = false;
+				return true;
+			}
+
+			nextDeadline = std::min(nextDeadline, aFD->getDeadline());
+			return false;
+		});
+
+		/* Wake up in time to expire the nearest deadline or timer, round up
+		 * so we don't wake up a bit too early just to go waiting again */
+		auto nextWakeUp = nextDeadline;
+		if(!mTimers.empty())
+			nextWakeUp = std::min(nextWakeUp, mTimers.top().mWakeUp);
+
+		/* Pass all operations submitted since last round to the kernel with a
+		 * single syscall, don't wait if some completed meanwhile */
+		if(mIoUring)
+		{
+			mIoUring->submit();
+			if(mIoUring->hasCompletions()) nextWakeUp = steady_clock::now();
+		}
+
+		int epollTimeout = -1;
+		if(nextWakeUp != AsyncFileDescriptor::NO_DEADLINE)
+		{
+			const auto tWait = ceil<milliseconds>(
+			            nextWakeUp - steady_clock::now() );
+			epollTimeout = static_cast<int>( std::clamp<milliseconds::rep>(
+			            tWait.count(), 0, std::numeric_limits<int>::max() ));
+		}
+
+		RS_DBG3("Waiting epoll events timeout: ", epollTimeout, "ms");
+		auto nfds = epoll_wait(mEpollFD, events, DEFAULT_MAX_EVENTS, epollTimeout);
 		if (nfds == -1)
 		{
-#if RS_DEBUG_LEVEL > 0
-			/* While running under GDB epoll_wait easily to incurr into
-			 * erro 4 EINTR Interrupted system call, due to debugging,
-			 * in that case should it should be re-attempted
+			/* epoll_wait is never restarted after a signal handler, which may
+			 * have called stop(), while running under GDB it easily incurr
+			 * into EINTR too, in both cases it should be re-attempted
 			 * @see https://stackoverflow.com/a/2253013 */
 			if(errno == EINTR)
 			{
-				RS_DBG( "epoll_wait got EINTR, probably interrupted due to "
-				        "attached debugger, retrying" );
+				RS_DBG2("epoll_wait got EINTR, retrying");
 				continue;
 			}
-#endif //  RS_DEBUG_LEVEL > 0
 			rs_error_bubble_or_exit(
 			            rs_errno_to_condition(errno), nullptr,
 			            "epoll_wait failed FD: ", mEpollFD );
 		}
 
+		if(mRunLock) mRunLockHeld = std::unique_lock<std::mutex>(*mRunLock);
+
 		for(int n = 0; n < nfds; ++n)
 		{
 			uint32_t evFlags = events[n].events;
-			int mFD = events[n].data.fd;
+			const uint64_t tKey = events[n].data.u64;
+
+			if(tKey == URING_EPOLL_KEY) continue;
+
+			if(tKey == STOP_EPOLL_KEY) RS_UNLIKELY
+			{
+				uint64_t tCount;
+				[[maybe_unused]] auto tRet =
+				        read(mStopFD, &tCount, sizeof(tCount));
+				continue;
+			}
 
-			auto findIt = mManagedFD.find(mFD);
-			if (findIt == mManagedFD.end())
+			/* Closed descriptors are kept alive in mClosedFD until the end of
+			 * the round, so a plain pointer is enough even if a resumed
+			 * coroutine closes it */
+			auto aFD = managedFD(tKey);
+			if (!aFD) RS_UNLIKELY
 			{
 				/* While testing we have been getting EPOLLERR regularly on
 				 * not-subscribed-anymore FD. For example after finish reading
@@ -94,186 +239,212 @@ void IOContext::run()
 				if(RS_DEBUG_LEVEL > 2 || evFlags != EPOLLERR)
 					RS_WARN( "Got stray epoll events: ",
 					         epoll_events_to_string(evFlags),
-					         " for FD: ", mFD,
+					         " for FD: ", static_cast<uint32_t>(tKey),
 					         " which is not subscribed (anymore)" );
 
 				continue;
 			}
 
-			/* NEED a FULL blown shared_ptr copy here, I haven't fully
-			 * understood yet why taking just a reference to it in this place
-			 * cause invalid memory read, expecially when some error occurs,
-			 * detected using valgrind */
-			auto aFD = findIt->second;
-
 			RS_DBG2(*aFD, " got epoll events: ", epoll_events_to_string(evFlags));
 
 			aFD->resumePendingOps(evFlags);
 		}
 
-		for (auto&& mEl : std::as_const(mManagedFD))
-		{
-			/* Don't need a full blown shared_ptr costly copy here just take a
-			 * reference to it */
-			auto& aFD = mEl.second;
-
-			/* New state does actually just have EPOLLIN or EPOLLOUT
-			 * EPOLLET is always needed to work with coroutines so set it always
-			 * here, maybe there is more elegant solution but I haven't thinked
-			 * about it yet */
-			auto io_state = aFD->getNextIoState() | EPOLLET;
-			if (aFD->getIoState() == io_state) continue;
-
-			epoll_event ev;
-			ev.events = io_state;
-			ev.data.fd = aFD->getFD();
-			if (epoll_ctl(mEpollFD, EPOLL_CTL_MOD, aFD->getFD(), &ev) == -1)
-			{
-				/* I have seen this happening only with standard input FD 0,
-				 * with errno 2 No such file or directory */
-				RS_ERR( "Failed to update epoll IO state for ", *aFD,
-				        " getIoState(): ",
-				        epoll_events_to_string(aFD->getIoState()),
-				        " next io_state: ",
-				        epoll_events_to_string(aFD->getNextIoState()), " ",
-				        rs_errno_to_condition(errno) );
-			}
-			aFD->setIoState(io_state);
-		}
+		if(mIoUring) reapUringCompletions();
+		if(nextDeadline <= steady_clock::now()) expireDeadlines();
+		fireTimers();
+
+		mClosedFD.clear();
 	}
 }
 
-/**
- * @brief Attaches a file descriptor to an available for "read" operations.
- *
- * @param socket
- */
-void IOContext::attach(AsyncFileDescriptor* aFD)
+void IOContext::addTimer(
+        std::chrono::steady_clock::time_point wakeUp,
+        std::coroutine_handle<> coroutine )
 {
-	/* TODO: This seems to be the exact same og IOContext::attachReadonly
-	 * check which one makes sense to keep of the two, show we add EPOLLOUT
-	 * flag here? */
+	mTimers.push(ScheduledTimer{wakeUp, mTimersSeq++, coroutine});
+	RS_DBG3("numTimers: ", mTimers.size());
+}
 
-	RS_DBG4(*socket);
+void IOContext::fireTimers()
+{
+	const auto tNow = std::chrono::steady_clock::now();
 
-    struct epoll_event ev;
-    auto io_state = EPOLLIN | EPOLLET;
-    ev.events = io_state;
-	ev.data.fd = aFD->getFD();
-	if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, aFD->getFD(), &ev) == -1)
+	/* Take expired timers out of the heap before resuming them, so a
+	 * coroutine which immediately goes to sleep again waits for next round
+	 * instead of starving the others */
+	std::vector<std::coroutine_handle<>> expired;
+	while(!mTimers.empty() && mTimers.top().mWakeUp <= tNow)
 	{
-		RS_ERR( "EPOLL_CTL_ADD failed for: ", *aFD, " ",
-		        rs_errno_to_condition(errno) );
+		expired.push_back(mTimers.top().mCoroutine);
+		mTimers.pop();
 	}
-	aFD->setIoState(io_state);
 
-	RS_DBG3("successfully attached ", *socket);
+	for(auto& coroutine: expired) coroutine.resume();
 }
 
-/**
- * @brief Attaches a file descriptor to an available for "read" operations.
- *
- * @param socket
- */
-void IOContext::attachReadonly(AsyncFileDescriptor* aFD)
+void IOContext::expireDeadlines()
 {
-	RS_DBG4("fd: ", socket->mFD);
-    struct epoll_event ev;
-    auto io_state = EPOLLIN | EPOLLET;
-    ev.events = io_state;
-	ev.data.fd = aFD->getFD();
-	if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, aFD->getFD(), &ev) == -1)
+	const auto tNow = std::chrono::steady_clock::now();
+
+	/* Resumed operations may close descriptors, so collect the expired ones
+	 * first and keep them alive until done */
+	std::vector<std::shared_ptr<AsyncFileDescriptor>> expiredFDs;
+	for (auto tKey : std::as_const(mWaitingFD))
 	{
-		RS_ERR( "EPOLL_CTL_ADD failed for: ", *aFD, " ",
-		        rs_errno_to_condition(errno) );
+		auto aFD = managedFD(tKey);
+		if(aFD && aFD->hasPendingOps() && aFD->isDeadlineExpired(tNow))
+			expiredFDs.push_back(mManagedFD[aFD->getFD()].mAFD);
 	}
 
-	aFD->setIoState(io_state);
-	RS_DBG3("successfully attached ", *socket);
-}
+	/* Operations resumed this way find the deadline expired and fail with
+	 * timed out error without attempting the syscall again */
+	for(auto& aFD: expiredFDs)
+	{
+		RS_DBG2(*aFD, " deadline expired");
 
-/**
- * @brief Attaches a file descriptor to an available for "write" operations.
- *
- * @param socket
- */
-void IOContext::attachWriteOnly(AsyncFileDescriptor* aFD)
-{
-	RS_DBG4("mFD: ", socket->mFD);
+		/* Buffers of in flight operations are in use by the kernel, so
+		 * they cannot be just abandoned, ask the kernel to cancel them, the
+		 * cancelled completion resumes them */
+		if(!aFD->mInFlightCancelled && !aFD->mInFlightOps.empty())
+		{
+			aFD->mInFlightCancelled = true;
+			for(auto tOp: std::as_const(aFD->mInFlightOps))
+			{
+				io_uring_sqe* tSqe = mIoUring->getSqe();
+				if(!tSqe) RS_UNLIKELY break;
+				tSqe->opcode = IORING_OP_ASYNC_CANCEL;
+				tSqe->addr = reinterpret_cast<uint64_t>(tOp);
+				tSqe->user_data = 0;
+			}
+		}
 
-    struct epoll_event ev;
-    auto io_state = EPOLLOUT | EPOLLET;
-    ev.events = io_state;
-	ev.data.fd = aFD->getFD();
-	if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, aFD->getFD(), &ev) == -1)
-	{
-		RS_ERR( "EPOLL_CTL_ADD failed for: ", *aFD, " ",
-		        rs_errno_to_condition(errno) );
+		aFD->resumePendingOps(EPOLLIN | EPOLLOUT);
 	}
-	aFD->setIoState(io_state);
-
-	RS_DBG3( "successfully attached ", *aFD, " for: ",
-	         epoll_events_to_string(io_state) );
 }
 
-/**
- * @brief used to update the type of epool subscription to enable reading
- *
- * @param socket
- */
-void IOContext::watchRead(AsyncFileDescriptor *socket)
+/** Skip the bytes a short read or write already transferred
+ * @return false if nothing is left to transfer */
+static bool advanceSubmission(io_uring_sqe& sqe, uint32_t transferred)
 {
-	socket->setNextIoState(socket->getNextIoState() | EPOLLIN);
-
-	RS_DBG4("mFD: ", socket->mFD,
-	        " getNewIoState() " , socket->getNewIoState() );
+	if(sqe.opcode == IORING_OP_SENDMSG)
+		return SendVectorOperation::advance(
+		            *reinterpret_cast<msghdr*>(sqe.addr), transferred );
+
+	if(transferred >= sqe.len) return false;
+	sqe.addr += transferred;
+	sqe.len -= transferred;
+	return true;
 }
 
-/**
- * @brief used to stop epool notifications for reading events
- *
- * @param socket
- */
-void IOContext::unwatchRead(AsyncFileDescriptor *socket)
+void IOContext::reapUringCompletions()
 {
-	socket->setNextIoState(socket->getNextIoState() & ~EPOLLIN);
+	/* Resume coroutines after releasing the completion queue, they may
+	 * submit more operations meanwhile */
+	std::vector<UringCompletion*> completed;
+	mIoUring->reapCompletions([&](uint64_t userData, int32_t result)
+	{
+		// Completion of cancellation requests and polls preceding retries
+		if(!userData) return;
+
+		auto tCompletion = reinterpret_cast<UringCompletion*>(userData);
+		tCompletion->mResult = result;
+		completed.push_back(tCompletion);
+	});
+
+	for(auto tCompletion: completed)
+	{
+		/* Non-blocking pipes return EAGAIN instead of waiting, poll them and
+		 * submit the operation again once ready */
+		if(tCompletion->mResult == -EAGAIN)
+		{
+			const auto tOpcode = tCompletion->mSqe.opcode;
+			const bool isOut = tOpcode == IORING_OP_WRITE ||
+			        tOpcode == IORING_OP_SEND || tOpcode == IORING_OP_SENDMSG ||
+			        tOpcode == IORING_OP_CONNECT;
+
+			/* The poll and the retry linked to it must reach the kernel in
+			 * the same submission, reserve both so queuing the retry can't
+			 * submit the poll alone */
+			if(mIoUring->reserveSqes(2)) RS_LIKELY
+			{
+				io_uring_sqe* tPoll = mIoUring->getSqe();
+				tPoll->opcode = IORING_OP_POLL_ADD;
+				tPoll->fd = tCompletion->mSqe.fd;
+				tPoll->poll32_events = uringPollEvents(isOut ? POLLOUT : POLLIN);
+				tPoll->flags = IOSQE_IO_LINK;
+				tPoll->user_data = 0;
+				mIoUring->submit(*tCompletion);
+				continue;
+			}
+		}
+
+		/* Short read or write of an operation which must transfer the whole
+		 * buffer, submit the rest without bothering the coroutine */
+		if(tCompletion->mTransferAll && tCompletion->mResult >= 0)
+		{
+			const auto tDone = static_cast<uint32_t>(tCompletion->mResult);
+			tCompletion->mTransferred += tDone;
+			if(tDone && advanceSubmission(tCompletion->mSqe, tDone))
+			{
+				if(mIoUring->submit(*tCompletion)) RS_LIKELY continue;
+				RS_WARN("io_uring queue full, returning short transfer");
+			}
 
-	RS_DBG4("mFD: ", *socket,
-	        " getNewIoState() " , socket->getNewIoState() );
+			tCompletion->mResult =
+			        static_cast<int32_t>(tCompletion->mTransferred);
+		}
+
+		tCompletion->mCoroutine.resume();
+	}
 }
 
 /**
- * @brief used to update the type of epool subscription to enable writing
+ * @brief Add a file descriptor to the epoll set for both input and output,
+ * edge triggered, so it never needs to be modified. Each event resumes only
+ * the operations waiting for that direction.
+ * @see AsyncFileDescriptor::resumePendingOps
  *
- * @param socket
+ * @param aFD
  */
-void IOContext::watchWrite(AsyncFileDescriptor *socket)
+void IOContext::attach(AsyncFileDescriptor* aFD)
 {
-	socket->setNextIoState(socket->getNextIoState() | EPOLLOUT);
+	// With io_uring backend descriptors are not in the epoll set
+	if(mIoUring) return;
+
+	RS_DBG4(*aFD);
+
+	epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.u64 = epollKey(aFD->getFD());
+	if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, aFD->getFD(), &ev) == -1)
+	{
+		RS_ERR( "EPOLL_CTL_ADD failed for: ", *aFD, " ",
+		        rs_errno_to_condition(errno) );
+	}
 
-	RS_DBG4("mFD: ", *socket,
-	        " getNewIoState() " , socket->getNewIoState() );
+	RS_DBG3("successfully attached ", *aFD);
 }
 
-/**
- * @brief used to stop epool notifications for writing events
- *
- * @param socket
- */
-void IOContext::unwatchWrite(AsyncFileDescriptor *socket)
+void IOContext::markWaiting(AsyncFileDescriptor& aFD)
 {
-	socket->setNextIoState(socket->getNextIoState() & ~EPOLLOUT);
+	if(aFD.mIsMarkedWaiting) return;
 
-	RS_DBG4("mFD: ", socket->mFD,
-	        " getNewIoState() " , socket->getNewIoState() );
+	aFD.mIsMarkedWaiting = true;
+	mWaitingFD.push_back(epollKey(aFD.mFD));
 }
 
 std::ostream &operator<<(std::ostream& out, const IOContext& ioContext)
 {
 	out << " ioContext: " << &ioContext << " epoll FD: " << ioContext.mEpollFD
-		<< " managed FDs: " << ioContext.mManagedFD.size() << " [ ";
-	for(auto& tKV : std::as_const(ioContext.mManagedFD))
-		out << "{" << tKV.first << ", " << tKV.second << "} ";
+		<< " timers: " << ioContext.mTimers.size()
+		<< " coroutine frames live: " << std::detail::frame_pool::local().live()
+		<< " recycled: " << std::detail::frame_pool::local().recycled()
+		<< " managed FDs: " << ioContext.mManagedFDCount << " [ ";
+	for(auto& tManaged : std::as_const(ioContext.mManagedFD))
+		if(tManaged.mAFD)
+			out << "{" << tManaged.mAFD->getFD() << ", " << tManaged.mAFD
+			    << "} ";
 	out << "]";
 	return out;
 }
@@ -0,0 +1,229 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "io_uring.hh"
+
+#include <util/rserrorbubbleorexit.h>
+#include <util/rsdebug.h>
+#include <util/rsdebuglevel1.h>
+
+#ifndef __NR_io_uring_setup
+#	define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#	define __NR_io_uring_enter 426
+#endif
+
+static int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned toSubmit)
+{
+	return static_cast<int>(
+	            syscall(__NR_io_uring_enter, fd, toSubmit, 0, 0, nullptr, 0) );
+}
+
+/*static*/ std::unique_ptr<IoUring> IoUring::setup(
+        unsigned entries, std::error_condition* errbub )
+{
+	io_uring_params tParams;
+	memset(&tParams, 0, sizeof(tParams));
+
+	std::unique_ptr<IoUring> tUring(new IoUring);
+	tUring->mRingFD = io_uring_setup(entries, &tParams);
+	if(tUring->mRingFD < 0)
+	{
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), errbub,
+		            "io_uring_setup failed" );
+		return nullptr;
+	}
+
+	/* Submissions get -EAGAIN instead of being retried when the socket is
+	 * not ready on kernels without fast poll, we cope with that but it would
+	 * cost more syscalls then epoll */
+	if(!(tParams.features & IORING_FEAT_FAST_POLL))
+	{
+		rs_error_bubble_or_exit(
+		            std::errc::function_not_supported, errbub,
+		            "io_uring without fast poll support" );
+		return nullptr;
+	}
+
+	tUring->mSqRingSize =
+	        tParams.sq_off.array + tParams.sq_entries * sizeof(unsigned);
+	tUring->mCqRingSize =
+	        tParams.cq_off.cqes + tParams.cq_entries * sizeof(io_uring_cqe);
+
+	const bool singleMmap = tParams.features & IORING_FEAT_SINGLE_MMAP;
+	if(singleMmap)
+		tUring->mSqRingSize = tUring->mCqRingSize =
+		        std::max(tUring->mSqRingSize, tUring->mCqRingSize);
+
+	tUring->mSqRingPtr = mmap(
+	            nullptr, tUring->mSqRingSize, PROT_READ | PROT_WRITE,
+	            MAP_SHARED | MAP_POPULATE, tUring->mRingFD, IORING_OFF_SQ_RING );
+	if(tUring->mSqRingPtr == MAP_FAILED)
+	{
+		tUring->mSqRingPtr = nullptr;
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), errbub,
+		            "mmap io_uring submission ring failed" );
+		return nullptr;
+	}
+
+	if(singleMmap) tUring->mCqRingPtr = tUring->mSqRingPtr;
+	else
+	{
+		tUring->mCqRingPtr = mmap(
+		            nullptr, tUring->mCqRingSize, PROT_READ | PROT_WRITE,
+		            MAP_SHARED | MAP_POPULATE, tUring->mRingFD,
+		            IORING_OFF_CQ_RING );
+		if(tUring->mCqRingPtr == MAP_FAILED)
+		{
+			tUring->mCqRingPtr = nullptr;
+			rs_error_bubble_or_exit(
+			            rs_errno_to_condition(errno), errbub,
+			            "mmap io_uring completion ring failed" );
+			return nullptr;
+		}
+	}
+
+	tUring->mSqesSize = tParams.sq_entries * sizeof(io_uring_sqe);
+	void* tSqes = mmap(
+	            nullptr, tUring->mSqesSize, PROT_READ | PROT_WRITE,
+	            MAP_SHARED | MAP_POPULATE, tUring->mRingFD, IORING_OFF_SQES );
+	if(tSqes == MAP_FAILED)
+	{
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), errbub,
+		            "mmap io_uring submission entries failed" );
+		return nullptr;
+	}
+	tUring->mSqes = static_cast<io_uring_sqe*>(tSqes);
+
+	auto tSqRing = static_cast<uint8_t*>(tUring->mSqRingPtr);
+	tUring->mSqHead = reinterpret_cast<unsigned*>(tSqRing + tParams.sq_off.head);
+	tUring->mSqTail = reinterpret_cast<unsigned*>(tSqRing + tParams.sq_off.tail);
+	tUring->mSqMask =
+	        *reinterpret_cast<unsigned*>(tSqRing + tParams.sq_off.ring_mask);
+	tUring->mSqEntries = tParams.sq_entries;
+	tUring->mSqArray =
+	        reinterpret_cast<unsigned*>(tSqRing + tParams.sq_off.array);
+	tUring->mSqLocalTail = *tUring->mSqTail;
+
+	auto tCqRing = static_cast<uint8_t*>(tUring->mCqRingPtr);
+	tUring->mCqHead = reinterpret_cast<unsigned*>(tCqRing + tParams.cq_off.head);
+	tUring->mCqTail = reinterpret_cast<unsigned*>(tCqRing + tParams.cq_off.tail);
+	tUring->mCqMask =
+	        *reinterpret_cast<unsigned*>(tCqRing + tParams.cq_off.ring_mask);
+	tUring->mCqes =
+	        reinterpret_cast<io_uring_cqe*>(tCqRing + tParams.cq_off.cqes);
+
+	RS_DBG1( "io_uring ready FD: ", tUring->mRingFD,
+	         " entries: ", tParams.sq_entries );
+	return tUring;
+}
+
+IoUring::~IoUring()
+{
+	if(mSqes) munmap(mSqes, mSqesSize);
+	if(mCqRingPtr && mCqRingPtr != mSqRingPtr) munmap(mCqRingPtr, mCqRingSize);
+	if(mSqRingPtr) munmap(mSqRingPtr, mSqRingSize);
+	if(mRingFD != -1) close(mRingFD);
+}
+
+bool IoUring::reserveSqes(unsigned count)
+{
+	if(mSqLocalTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) + count >
+	        mSqEntries)
+	{
+		/* Make room passing queued entries to the kernel, which consumes
+		 * them synchronously on submission */
+		std::error_condition submitErr;
+		if(!submit(&submitErr)) RS_UNLIKELY
+			RS_WARN("io_uring submission failed: ", submitErr);
+		if( mSqLocalTail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) +
+		        count > mSqEntries ) RS_UNLIKELY
+		{
+			RS_WARN("io_uring submission queue full");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+io_uring_sqe* IoUring::getSqe()
+{
+	if(!reserveSqes(1)) RS_UNLIKELY return nullptr;
+
+	const unsigned tIndex = mSqLocalTail & mSqMask;
+	io_uring_sqe* tSqe = &mSqes[tIndex];
+	memset(tSqe, 0, sizeof(*tSqe));
+	mSqArray[tIndex] = tIndex;
+
+	++mSqLocalTail;
+	++mToSubmit;
+	return tSqe;
+}
+
+bool IoUring::submit(UringCompletion& completion)
+{
+	io_uring_sqe* tSqe = getSqe();
+	if(!tSqe) RS_UNLIKELY return false;
+
+	*tSqe = completion.mSqe;
+	tSqe->user_data = reinterpret_cast<uint64_t>(&completion);
+	return true;
+}
+
+bool IoUring::submit(std::error_condition* errbub)
+{
+	if(!mToSubmit) return true;
+
+	__atomic_store_n(mSqTail, mSqLocalTail, __ATOMIC_RELEASE);
+
+	int tSubmitted = io_uring_enter(mRingFD, mToSubmit);
+	if(tSubmitted < 0)
+	{
+		/* Kernel is short on memory or completions are overflowing, entries
+		 * stay queued and are submitted on next attempt */
+		if(errno == EAGAIN || errno == EBUSY || errno == EINTR) return true;
+
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), errbub,
+		            "io_uring_enter failed" );
+		return false;
+	}
+
+	mToSubmit -= std::min(mToSubmit, static_cast<unsigned>(tSubmitted));
+	RS_DBG3("Submitted: ", tSubmitted, " still queued: ", mToSubmit);
+	return true;
+}
@@ -34,22 +34,26 @@ ReadOp::ReadOp(
         uint8_t* buffer, std::size_t len,
         std::error_condition* ec ):
     AwaitableSyscall(afd, ec), mBuffer{buffer}, mLen{len}
-{
-	afd.getIOContext().watchRead(&afd);
-}
+{}
 
-ReadOp::~ReadOp()
+ssize_t ReadOp::syscall()
 {
-	RS_DBG2(*mAFD);
-	mAFD.getIOContext().unwatchRead(&mAFD);
+	return read(mAFD.getFD(), mBuffer + transferred(), mLen - transferred());
 }
 
-ssize_t ReadOp::syscall()
+bool ReadOp::prepareSqe(io_uring_sqe& sqe)
 {
-	return read(mAFD.getFD(), mBuffer, mLen);
+	sqe.opcode = IORING_OP_READ;
+	sqe.fd = mAFD.getFD();
+	sqe.addr = reinterpret_cast<uint64_t>(mBuffer + transferred());
+	sqe.len = static_cast<uint32_t>(mLen - transferred());
+
+	// Pipes and sockets have no position, -1 means current
+	sqe.off = static_cast<uint64_t>(-1);
+	return true;
 }
 
-std::task<ssize_t> asyncRead(
+ReadOp asyncRead(
         AsyncFileDescriptor& aFD,
         uint8_t* buffer, std::size_t len,
         std::error_condition* errbub )
@@ -58,19 +62,5 @@ std::task<ssize_t> asyncRead(
 	        " buffer: ", reinterpret_cast<const void*>(buffer),
 	        " len: ", len);
 
-	ssize_t numReadBytes = 0;
-	ssize_t totalReadBytes = 0;
-	do
-	{
-		numReadBytes = co_await
-		    ReadOp{aFD, buffer + totalReadBytes, len - totalReadBytes, errbub};
-
-		if(numReadBytes == -1) RS_UNLIKELY
-		        co_return -1;
-
-		totalReadBytes += numReadBytes;
-	}
-	while(numReadBytes && totalReadBytes < len);
-
-	co_return totalReadBytes;
+	return ReadOp(aFD, buffer, len, errbub);
 }
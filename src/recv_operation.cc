@@ -32,16 +32,21 @@ RecvOperation::RecvOperation(
         uint8_t* buffer, std::size_t len,
         std::error_condition* ec ):
     AwaitableSyscall(afd, ec), mBuffer{buffer}, mLen{len}
-{
-	mAFD.getIOContext().watchRead(&mAFD);
-}
+{}
 
-RecvOperation::~RecvOperation()
+ssize_t RecvOperation::syscall()
 {
-	mAFD.getIOContext().unwatchRead(&mAFD);
+	return static_cast<AsyncSocket&>(mAFD).recvBuffered(
+	            mBuffer + transferred(), mLen - transferred() );
 }
 
-ssize_t RecvOperation::syscall()
+bool RecvOperation::prepareSqe(io_uring_sqe& sqe)
 {
-	return recv(mAFD.getFD(), mBuffer, mLen, 0);
+	/* Only syscall() fills the socket read ahead buffer, which is never called
+	 * with io_uring, so nothing is left there to be served first */
+	sqe.opcode = IORING_OP_RECV;
+	sqe.fd = mAFD.getFD();
+	sqe.addr = reinterpret_cast<uint64_t>(mBuffer + transferred());
+	sqe.len = static_cast<uint32_t>(mLen - transferred());
+	return true;
 }
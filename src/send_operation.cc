@@ -31,16 +31,19 @@ SendOperation::SendOperation(
         AsyncSocket& socket, const uint8_t* buffer, std::size_t len,
         std::error_condition* ec ):
     AwaitableSyscall{socket, ec}, mBuffer{buffer}, mLen{len}
-{
-	socket.getIOContext().watchWrite(&socket);
-}
+{}
 
-SendOperation::~SendOperation()
+ssize_t SendOperation::syscall()
 {
-	mAFD.getIOContext().unwatchWrite(&mAFD);
+	return send( mAFD.getFD(),
+	             mBuffer + transferred(), mLen - transferred(), 0 );
 }
 
-ssize_t SendOperation::syscall()
+bool SendOperation::prepareSqe(io_uring_sqe& sqe)
 {
-	return send(mAFD.getFD(), mBuffer, mLen, 0);
+	sqe.opcode = IORING_OP_SEND;
+	sqe.fd = mAFD.getFD();
+	sqe.addr = reinterpret_cast<uint64_t>(mBuffer + transferred());
+	sqe.len = static_cast<uint32_t>(mLen - transferred());
+	return true;
 }
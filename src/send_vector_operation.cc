@@ -0,0 +1,75 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+
+#include <cstring>
+
+#include "send_vector_operation.hh"
+#include "async_socket.hh"
+#include "io_context.hh"
+
+SendVectorOperation::SendVectorOperation(
+        AsyncSocket& socket, std::span<iovec> iov, int flags,
+        std::error_condition* ec ):
+    AwaitableSyscall{socket, ec}, mFlags{flags}
+{
+	memset(&mMsg, 0, sizeof(mMsg));
+	mMsg.msg_iov = iov.data();
+	mMsg.msg_iovlen = iov.size();
+	for(const auto& tIov: iov) mLen += tIov.iov_len;
+}
+
+ssize_t SendVectorOperation::syscall()
+{
+	advance(mMsg, transferred() - mAdvanced);
+	mAdvanced = transferred();
+	return sendmsg(mAFD.getFD(), &mMsg, mFlags);
+}
+
+bool SendVectorOperation::prepareSqe(io_uring_sqe& sqe)
+{
+	/* On short sends IOContext advances mMsg buffers itself before
+	 * submitting again @see advance */
+	sqe.opcode = IORING_OP_SENDMSG;
+	sqe.fd = mAFD.getFD();
+	sqe.addr = reinterpret_cast<uint64_t>(&mMsg);
+	sqe.len = 1;
+	sqe.msg_flags = static_cast<uint32_t>(mFlags);
+	return true;
+}
+
+/*static*/ bool SendVectorOperation::advance(msghdr& msg, std::size_t bytes)
+{
+	while(bytes && msg.msg_iovlen)
+	{
+		iovec& tIov = msg.msg_iov[0];
+		if(bytes < tIov.iov_len)
+		{
+			tIov.iov_base = static_cast<uint8_t*>(tIov.iov_base) + bytes;
+			tIov.iov_len -= bytes;
+			return true;
+		}
+
+		bytes -= tIov.iov_len;
+		++msg.msg_iov;
+		--msg.msg_iovlen;
+	}
+
+	return msg.msg_iovlen > 0;
+}
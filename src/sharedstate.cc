@@ -28,6 +28,9 @@
 #include <fstream>
 #include <filesystem>
 #include <deque>
+#include <random>
+#include <bit>
+#include <endian.h>
 
 #ifdef SHARED_STATE_STAT_FILE_LOCKING
 #	include <fcntl.h>
@@ -44,8 +47,12 @@
 #include "async_socket.hh"
 #include "async_command.hh"
 #include "shared_state_errors.hh"
+#include "binary_codec.hh"
+#include "dictionary_codec.hh"
+#include "io_context.hh"
 
 #include <util/rsdebug.h>
+#include <util/stacktrace.h>
 #include <util/rserrorbubbleorexit.h>
 #include <util/rsdebuglevel2.h>
 
@@ -54,23 +61,49 @@ std::task<bool> SharedState::syncWithPeer(
         std::string dataTypeName, const sockaddr_storage& peerAddr,
         std::error_condition* errbub )
 {
-	RS_DBG3(dataTypeName, " ", sockaddr_storage_tostring(peerAddr), " ", errbub);
+	std::vector<std::string> dataTypeNames(1, dataTypeName);
+	co_return co_await syncWithPeer(dataTypeNames, peerAddr, errbub);
+}
+
+std::task<bool> SharedState::syncWithPeer(
+        std::vector<std::string> dataTypeNames,
+        const sockaddr_storage& peerAddr, std::error_condition* errbub )
+{
+	auto tTimeout = std::chrono::seconds::zero();
+	for(auto&& dataTypeName: std::as_const(dataTypeNames))
+		tTimeout = std::max(tTimeout, syncTimeout(dataTypeName));
+
+	co_return co_await syncWithPeer(
+	            dataTypeNames, peerAddr,
+	            std::chrono::steady_clock::now() + tTimeout, errbub );
+}
+
+std::task<bool> SharedState::syncWithPeer(
+        std::vector<std::string> dataTypeNames,
+        const sockaddr_storage& peerAddr,
+        std::chrono::steady_clock::time_point deadline,
+        std::error_condition* errbub )
+{
+	RS_DBG3( dataTypeNames.size(), " types ",
+	         sockaddr_storage_tostring(peerAddr), " ", errbub );
 
 	constexpr bool rFAILURE = false;
 	constexpr bool rSUCCESS = true;
 
-	const auto statesIt = mStates.find(dataTypeName);
-	if(statesIt == mStates.end())
-	{
-		rs_error_bubble_or_exit( SharedStateErrors::UNKOWN_DATA_TYPE, errbub,
-		                         dataTypeName );
-		co_return rFAILURE;
-	}
-	auto& tState = statesIt->second;
+	for(auto&& dataTypeName: std::as_const(dataTypeNames))
+		if(!mStates.contains(dataTypeName))
+		{
+			rs_error_bubble_or_exit( SharedStateErrors::UNKOWN_DATA_TYPE,
+			                         errbub, dataTypeName );
+			co_return rFAILURE;
+		}
+
+	NetworkStats netStats;
+	sockaddr_storage_copy(peerAddr, netStats.mPeer);
 
-	auto tSocket = co_await ConnectingSocket::connect(
-	            peerAddr, mIoContext, errbub);
-	if(!tSocket) co_return rFAILURE;
+	std::vector<TypeExchange> exchanges(dataTypeNames.size());
+	for(std::size_t i = 0; i < exchanges.size(); ++i)
+		exchanges[i].mTypeName = dataTypeNames[i];
 
 #if 0
 	!! CAPTURING LAMBDAS THAT ARE COROUTINES BREAKS !!
@@ -98,80 +131,321 @@ do \
 while(false)
 #endif
 
-	NetworkStats netStats;
-	sockaddr_storage_copy(peerAddr, netStats.mPeer);
+	std::size_t batchBegin = 0;
+	while(batchBegin < exchanges.size())
+	{
+		WireSession wireSession;
+		bool isReused = false;
+		auto tSocket = co_await peerConnection(
+		            peerAddr, wireSession, netStats, isReused, deadline,
+		            errbub );
+		if(!tSocket) co_return rFAILURE;
+
+		/* Since WIRE_PROTO_VERSION_BATCH all data types are exchanged in a
+		 * single batch, older versions exchange one data type at time */
+		const bool isBatch =
+		        wireSession.mProtoVersion >= WIRE_PROTO_VERSION_BATCH;
+		const std::size_t batchEnd =
+		        isBatch ? exchanges.size() : batchBegin + 1;
+
+		/* The peer may have dropped a pooled connection meanwhile, in that
+		 * case the first message doesn't get acknowledged, and we attempt
+		 * again on a new connection */
+		std::error_condition reusedSendErr;
+		bool isStale = false;
+
+		using namespace std::chrono;
+		steady_clock::duration mergeTime(0);
+		ssize_t totalSent = 0;
+		ssize_t totalReceived = 0;
+		bool tOk = true;
+
+		for(auto i = batchBegin; tOk && i < batchEnd; ++i)
+		{
+			const bool mayBeStale = isReused && i == batchBegin;
+			const auto tSent = co_await sendSyncRequest(
+			            *tSocket, exchanges[i], wireSession, netStats,
+			            mayBeStale ? &reusedSendErr : errbub );
+			isStale = mayBeStale && tSent == -1;
+			tOk = tSent != -1;
+			if(tOk) totalSent += tSent;
+		}
 
-	if(!co_await SharedState::clientHandShake(
-	            *tSocket, netStats, errbub )) RS_UNLIKELY
+		if(tOk && isBatch)
+		{
+			// Zero lenght type name marks the end of the batch
+			const uint8_t batchEndMark = 0;
+			tOk = co_await tSocket->send(&batchEndMark, 1, errbub) == 1;
+			if(tOk) ++totalSent;
+		}
+
+		for(auto i = batchBegin; tOk && i < batchEnd; ++i)
+		{
+			const auto tReceived = co_await receiveSyncReply(
+			            *tSocket, exchanges[i], wireSession, netStats,
+			            mergeTime, errbub );
+			tOk = tReceived != -1;
+			if(tOk) totalReceived += tReceived;
+		}
+
+		for(auto i = batchBegin; tOk && i < batchEnd; ++i)
+		{
+			const auto tSent = co_await completeSync(
+			            *tSocket, exchanges[i], wireSession, netStats, errbub );
+			tOk = tSent != -1;
+			if(tOk) totalSent += tSent;
+		}
+
+		if(!tOk)
+		{
+			syncWithPeer_clean_socket();
+
+			if(isStale)
+			{
+				RS_DBG2( "Pooled connection to peer: ", peerAddr, " failed: ",
+				         reusedSendErr, " retrying on a new one" );
+				continue;
+			}
+
+			co_return rFAILURE;
+		}
+
+		co_await releasePeerConnection(
+		            peerAddr, tSocket, wireSession, netStats );
+
+		const auto mergeMuSecs = duration_cast<microseconds>(mergeTime);
+		RS_DBG3( "Synchronized with peer: ", peerAddr,
+		         " data types: ", batchEnd - batchBegin,
+		         " Total sent bytes: ", totalSent,
+		         " Total received bytes: ", totalReceived,
+		         " Extimated upload BW: ", netStats.mUpBwMbsExt, "Mbit/s",
+		         " Extimated download BW: ", netStats.mDownBwMbsExt, "Mbit/s",
+		         " Extimated RTT: ", netStats.mRttExt.count(), "μs",
+		         " Processing time: ", mergeMuSecs.count(), "μs" );
+
+		batchBegin = batchEnd;
+	}
+
+	if(!collectStat(netStats, errbub)) co_return rFAILURE;
+
+	bool tSuccess = rSUCCESS;
+	if(isPeer) for(auto&& exchange: std::as_const(exchanges))
+		if( exchange.mChanges > 0 &&
+		        !co_await notifyHooks(exchange.mTypeName, mIoContext, errbub) )
+			tSuccess = rFAILURE;
+
+	co_return tSuccess;
+}
+
+std::task<std::vector<SharedState::PeerSyncResult>>
+SharedState::syncWithPeers(
+        std::vector<std::string> dataTypeNames,
+        std::vector<sockaddr_storage> peerAddresses )
+{
+	std::vector<PeerSyncResult> results(peerAddresses.size());
+	for(std::size_t i = 0; i < peerAddresses.size(); ++i)
+		sockaddr_storage_copy(peerAddresses[i], results[i].mPeer);
+
+	SyncFanOut fanOut { dataTypeNames, results };
+
+	/* Workers are detached so they run concurrently, the fan out lives in
+	 * this coroutine frame which is suspended until all of them are done */
+	const auto workers = std::min(mSyncConcurrency, results.size());
+	for(std::size_t i = 0; i < workers; ++i)
 	{
-		syncWithPeer_clean_socket();
-		co_return rFAILURE;
+		++fanOut.mRunningWorkers;
+		syncFanOutWorker(fanOut).detach();
 	}
 
-	SharedState::NetworkMessage netMessage;
-	netMessage.mTypeName = dataTypeName;
-	netMessage.fromStateSlice(tState);
+	co_await fanOut;
+
+	co_return results;
+}
 
-	auto sentMessageSize = netMessage.mData.size();
-	auto totalSent = co_await
-	        SharedState::sendNetworkMessage(
-	            *tSocket, netMessage, netStats, errbub );
-	if(totalSent == -1)
+std::task<void> SharedState::syncFanOutWorker(SyncFanOut& fanOut)
+{
+	while(fanOut.mNextPeer < fanOut.mResults.size())
 	{
-		syncWithPeer_clean_socket();
-		co_return rFAILURE;
+		auto& result = fanOut.mResults[fanOut.mNextPeer++];
+		result.mSuccess = co_await syncWithPeer(
+		            fanOut.mTypeNames, result.mPeer, &result.mError );
 	}
 
-	auto totalReceived = co_await
-	        SharedState::receiveNetworkMessage(
-	            *tSocket, netMessage, netStats, errbub );
-	if(totalReceived == -1)
+	/* Last worker wakes up the joiner, after that fanOut may be gone already
+	 * so it must not be touched anymore */
+	if(!--fanOut.mRunningWorkers && fanOut.mJoiner)
+		fanOut.mJoiner.resume();
+}
+
+std::task<ssize_t> SharedState::sendSyncRequest(
+        AsyncSocket& pSocket, TypeExchange& exchange,
+        const WireSession& wireSession, NetworkStats& netStats,
+        std::error_condition* errbub )
+{
+	auto& tState = mStates[exchange.mTypeName];
+
+	exchange.mSentChangeSeq = typeChangeSeq(exchange.mTypeName);
+	const uint64_t sinceChangeSeq = deliveredChangeSeq(
+	            netStats.mPeer, wireSession, exchange.mTypeName );
+
+	/* Without a cursor we have no idea of what the peer already knows, so
+	 * instead of sending the whole state compare digests first, if we agree
+	 * already this is all we need */
+	exchange.mIsDigest =
+	        wireSession.mProtoVersion >= WIRE_PROTO_VERSION_DIGEST &&
+	        !sinceChangeSeq;
+	exchange.mDigestBuckets = digestBucketsFor(tState.size());
+
+	if(exchange.mIsDigest)
 	{
-		syncWithPeer_clean_socket();
-		co_return rFAILURE;
+		NetworkMessage netMessage;
+		netMessage.mTypeName = exchange.mTypeName;
+		netMessage.fromStateDigest(tState, exchange.mDigestBuckets);
+		co_return co_await sendNetworkMessage(
+		            pSocket, netMessage, wireSession, netStats, errbub );
 	}
 
+	/* The peer cursor is advanced only once the peer answered,
+	 * @see completeSync */
+	co_return co_await sendStateSlice(
+	            pSocket, exchange.mTypeName, tState,
+	            [sinceChangeSeq](const StateKey&, const StateEntry& stateEntry)
+	{ return !sinceChangeSeq || stateEntry.mChangeSeq > sinceChangeSeq; },
+	            wireSession, netStats, {}, errbub );
+}
+
+std::task<ssize_t> SharedState::receiveSyncReply(
+        AsyncSocket& pSocket, TypeExchange& exchange,
+        const WireSession& wireSession, NetworkStats& netStats,
+        std::chrono::steady_clock::duration& mergeTime,
+        std::error_condition* errbub )
+{
+	constexpr ssize_t rFAILURE = -1;
+
 	using namespace std::chrono;
-	const auto mergeBTP = steady_clock::now();
 
-	std::map<StateKey, StateEntry> receivedState;
-	netMessage.toStateSlice(receivedState);
+	/* Since WIRE_PROTO_VERSION_CHUNKED frames are merged as soon as they
+	 * arrive, so the whole peer state never sits in memory */
+	const bool streamMerge =
+	        wireSession.mProtoVersion >= WIRE_PROTO_VERSION_CHUNKED;
+	exchange.mPreMergeChangeSeq = typeChangeSeq(exchange.mTypeName);
+	MergeSession mergeSession;
+	if(!setupMergeSession(
+	            mergeSession, exchange.mTypeName, netStats.mPeer, errbub ))
+		RS_UNLIKELY co_return rFAILURE;
+
+	uint8_t expectedFormat = exchange.mIsDigest ?
+	            BINARY_DIGEST_REPLY_FORMAT : BINARY_SLICE_FORMAT;
+	FrameHandler onFrame = nullptr;
+	if(streamMerge) onFrame = [&](NetworkMessage& frame)
+	{
+		if(frame.mTypeName != exchange.mTypeName) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::bad_message, errbub,
+			            "Peer: ", netStats.mPeer, " sent type: ",
+			            frame.mTypeName, " expected: ", exchange.mTypeName );
+			return false;
+		}
+
+		const auto mergeBTP = steady_clock::now();
+		const bool tMerged = mergeBinaryFrame(
+		            mergeSession, frame, true, expectedFormat,
+		            exchange.mIsDigest ?
+		                &exchange.mMismatchingBuckets : nullptr,
+		            exchange.mDigestBuckets, errbub );
+		mergeTime += steady_clock::now() - mergeBTP;
+		return tMerged;
+	};
 
-	ssize_t changes = co_await merge(
-	            netMessage.mTypeName, receivedState, peerAddr, errbub);
-	if(changes == -1)
+	NetworkMessage netMessage;
+	auto totalReceived = co_await receiveNetworkMessage(
+	            pSocket, netMessage, wireSession, netStats, onFrame, errbub );
+	if(totalReceived == -1) co_return rFAILURE;
+	if(totalReceived == 0) RS_UNLIKELY
 	{
-		syncWithPeer_clean_socket();
+		rs_error_bubble_or_exit(
+		            std::errc::connection_aborted, errbub,
+		            "Peer: ", netStats.mPeer,
+		            " closed connection without answering" );
 		co_return rFAILURE;
 	}
-	const auto mergeETP = steady_clock::now();
-	const auto mergeMuSecs = duration_cast<microseconds>(mergeETP - mergeBTP);
 
-	syncWithPeer_clean_socket();
+	if(netMessage.mTypeName != exchange.mTypeName) RS_UNLIKELY
+	{
+		rs_error_bubble_or_exit(
+		            std::errc::bad_message, errbub,
+		            "Peer: ", netStats.mPeer, " sent type: ",
+		            netMessage.mTypeName, " expected: ", exchange.mTypeName );
+		co_return rFAILURE;
+	}
 
-	RS_DBG3( "Synchronized with peer: ", peerAddr,
-	         " Sent message type: ", dataTypeName,
-	         " Sent message size: ", sentMessageSize,
-	         " Received message type: ", netMessage.mTypeName,
-	         " Received message size: ", netMessage.mData.size(),
-	         " Total sent bytes: ", totalSent,
-	         " Total received bytes: ", totalReceived,
-	         " Extimated upload BW: ", netStats.mUpBwMbsExt, "Mbit/s",
-	         " Extimated download BW: ", netStats.mDownBwMbsExt, "Mbit/s",
-	         " Extimated RTT: ", netStats.mRttExt.count(), "μs",
-	         " Processing time: ", mergeMuSecs.count(), "μs" );
+	exchange.mChanges = mergeSession.mSignificantChanges;
+	if(!streamMerge)
+	{
+		const auto mergeBTP = steady_clock::now();
+		exchange.mChanges = co_await mergeNetworkMessage(
+		            netMessage, wireSession.mProtoVersion, mergeSession,
+		            exchange.mIsDigest ? &exchange.mMismatchingBuckets : nullptr,
+		            exchange.mDigestBuckets, errbub );
+		if(exchange.mChanges == -1) co_return rFAILURE;
+		mergeTime += steady_clock::now() - mergeBTP;
+	}
+	exchange.mPostMergeChangeSeq = typeChangeSeq(exchange.mTypeName);
+	exchange.mMergedChangeSeqs = mergeSession.mAssignedChangeSeqs;
 
-	if(!collectStat(netStats, errbub)) co_return rFAILURE;
+	co_return totalReceived;
+}
+
+std::task<ssize_t> SharedState::completeSync(
+        AsyncSocket& pSocket, TypeExchange& exchange,
+        const WireSession& wireSession, NetworkStats& netStats,
+        std::error_condition* errbub )
+{
+	ssize_t totalSent = 0;
 
-	if(isPeer && (changes > 0))
-		co_return co_await notifyHooks(netMessage.mTypeName, errbub);
+	if(exchange.mIsDigest)
+	{
+		/* Peer already sent its entries in the buckets we disagree on,
+		 * complete the exchange sending ours, except those just replaced by
+		 * peer ones, which got a change sequence past mPreMergeChangeSeq */
+		if(!exchange.mMismatchingBuckets.empty())
+		{
+			const uint32_t digestBuckets = exchange.mDigestBuckets;
+			const uint64_t preMergeChangeSeq = exchange.mPreMergeChangeSeq;
+			std::vector<bool> wantedBuckets(digestBuckets, false);
+			for(auto bucket: exchange.mMismatchingBuckets)
+				wantedBuckets[bucket] = true;
+			totalSent = co_await sendStateSlice(
+			            pSocket, exchange.mTypeName, mStates[exchange.mTypeName],
+			            [&wantedBuckets, digestBuckets, preMergeChangeSeq](
+			                const StateKey& key, const StateEntry& stateEntry )
+			{
+				return stateEntry.mChangeSeq <= preMergeChangeSeq &&
+				        wantedBuckets[digestBucket(key, digestBuckets)];
+			},
+			            wireSession, netStats, {}, errbub );
+			if(totalSent == -1) co_return totalSent;
+		}
+	}
 
-	co_return rSUCCESS;
+	/* Only once the reply got received and merged we know the peer accepted
+	 * what we sent, before WIRE_PROTO_VERSION_CHUNKED nothing else tells */
+	setDeliveredChangeSeq(
+	            netStats.mPeer, wireSession, exchange.mTypeName,
+	            exchange.mSentChangeSeq );
+	skipMergedChanges(
+	            netStats.mPeer, wireSession, exchange.mTypeName,
+	            exchange.mPreMergeChangeSeq, exchange.mPostMergeChangeSeq,
+	            exchange.mMergedChangeSeqs );
+
+	co_return totalSent;
 }
 
 std::task<ssize_t> SharedState::receiveNetworkMessage(
         AsyncSocket& pSocket, NetworkMessage& networkMessage,
-        NetworkStats& netStats, std::error_condition* errbub )
+        const WireSession& wireSession, NetworkStats& netStats,
+        FrameHandler onFrame, std::error_condition* errbub )
 {
 	RS_DBG3(pSocket);
 
@@ -189,10 +463,20 @@ std::task<ssize_t> SharedState::receiveNetworkMessage(
 	uint8_t dataTypeNameLenght = 0;
 	recvRet = co_await pSocket.recv(&dataTypeNameLenght, 1, errbub);
 	if(recvRet == -1) co_return rFAILURE;
+
+	/* Since WIRE_PROTO_VERSION_PERSISTENT this is how the client ends the
+	 * connection, let the caller decide if it is expected */
+	if(recvRet == 0) co_return 0;
 	totalReceivedBytes += recvRet;
 
 	RS_DBG3(pSocket, " dataTypeNameLenght: ", static_cast<int>(dataTypeNameLenght));
 
+	/* Since WIRE_PROTO_VERSION_BATCH a zero lenght type name marks the end
+	 * of a batch of requests */
+	if( !dataTypeNameLenght &&
+	        wireSession.mProtoVersion >= WIRE_PROTO_VERSION_BATCH )
+		co_return totalReceivedBytes;
+
 	if(dataTypeNameLenght < 1 || dataTypeNameLenght > DATA_TYPE_NAME_MAX_LENGHT)
 	{
 		rs_error_bubble_or_exit(
@@ -212,30 +496,106 @@ std::task<ssize_t> SharedState::receiveNetworkMessage(
 
 	RS_DBG3(pSocket, " networkMessage.mTypeName: ", networkMessage.mTypeName);
 
-	uint32_t dataLenght = 0;
-	recvRet = co_await pSocket.recv(
-	                        reinterpret_cast<uint8_t*>(&dataLenght), 4, errbub );
-	if(recvRet == -1) co_return rFAILURE;
-	totalReceivedBytes += recvRet;
-	dataLenght = ntohl(dataLenght);
+	const bool isChunked =
+	        wireSession.mProtoVersion >= WIRE_PROTO_VERSION_CHUNKED;
+	if(!isChunked) onFrame = nullptr;
 
-	if(dataLenght < 2 || dataLenght > DATA_MAX_LENGHT)
+	/* Unknown types are refused at merge time anyway, don't let them take
+	 * more then a frame */
+	uint64_t maxMessageSize = DATA_MAX_LENGHT;
+	if(isChunked)
 	{
-		rs_error_bubble_or_exit(
-		            std::errc::bad_message, errbub,
-		            pSocket, " Got data invalid lenght: ", dataLenght);
-		co_return rFAILURE;
+		const auto confIt = mTypeConf.find(networkMessage.mTypeName);
+		if(confIt != mTypeConf.end())
+			maxMessageSize = confIt->second.mMaxMessageSize;
 	}
 
-	networkMessage.mData.resize(dataLenght, 0);
-	recvRet = co_await
-	        pSocket.recv(
-	            reinterpret_cast<uint8_t*>(networkMessage.mData.data()),
-	                        dataLenght, errbub );
-	if(recvRet == -1) co_return rFAILURE;
-	totalReceivedBytes += recvRet;
+	/* Without chunking there is just one frame whose lenght is the whole
+	 * data lenght, with chunking frames are appended until the empty one,
+	 * or handed to onFrame one by one */
+	uint64_t dataLenght = 0;
+	steady_clock::duration handlingTime(0);
+	for(int frames = 0; ; ++frames)
+	{
+		uint32_t frameLenght = 0;
+		recvRet = co_await pSocket.recv(
+		            reinterpret_cast<uint8_t*>(&frameLenght), 4, errbub );
+		if(recvRet == -1) co_return rFAILURE;
+		if(recvRet != 4) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::connection_aborted, errbub,
+			            pSocket, " Connection closed in the middle of message" );
+			co_return rFAILURE;
+		}
+		totalReceivedBytes += recvRet;
+		frameLenght = ntohl(frameLenght);
+
+		if(isChunked && frameLenght == 0 && frames > 0) break;
+
+		if(frameLenght < 2 || frameLenght > DATA_MAX_LENGHT) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::bad_message, errbub,
+			            pSocket, " Got frame invalid lenght: ", frameLenght );
+			co_return rFAILURE;
+		}
+
+		if(frameLenght > maxMessageSize - dataLenght) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::message_size, errbub,
+			            pSocket, " Message of type: ", networkMessage.mTypeName,
+			            " exceeds budget of: ", maxMessageSize, " bytes" );
+			co_return rFAILURE;
+		}
+
+		if(onFrame) networkMessage.mData.clear();
+		const auto frameOffset = networkMessage.mData.size();
+		networkMessage.mData.resize(frameOffset + frameLenght, 0);
+		recvRet = co_await
+		        pSocket.recv(
+		            networkMessage.mData.data() + frameOffset,
+		            frameLenght, errbub );
+		if(recvRet == -1) co_return rFAILURE;
+		if(recvRet != frameLenght) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::connection_aborted, errbub,
+			            pSocket, " Connection closed in the middle of message" );
+			co_return rFAILURE;
+		}
+		totalReceivedBytes += recvRet;
+
+		const auto handleBTP = steady_clock::now();
+		if( isChunked &&
+		        !unwrapFrame(
+		            networkMessage, frameOffset, netStats.mPeer, wireSession,
+		            errbub ) )
+			RS_UNLIKELY co_return rFAILURE;
+
+		// Dictionary frames are consumed by unwrapFrame
+		const auto rawLenght = networkMessage.mData.size() - frameOffset;
+		if(!rawLenght) continue;
+
+		if(rawLenght > maxMessageSize - dataLenght) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::message_size, errbub,
+			            pSocket, " Message of type: ", networkMessage.mTypeName,
+			            " exceeds budget of: ", maxMessageSize, " bytes" );
+			co_return rFAILURE;
+		}
+		dataLenght += rawLenght;
+
+		if(onFrame && !onFrame(networkMessage)) RS_UNLIKELY co_return rFAILURE;
+		handlingTime += steady_clock::now() - handleBTP;
 
-	const auto recvETP = steady_clock::now();
+		if(!isChunked) break;
+	}
+
+	/* Don't let frames processing time spoil bandwidth extimation */
+	const auto recvETP = steady_clock::now() - handlingTime;
 
 	/* Acknowledge total received bytes, all tests without this worked fine
 	 * anyway, so this has been added mainly to enable the sender to extimate
@@ -261,9 +621,7 @@ std::task<ssize_t> SharedState::receiveNetworkMessage(
 		        "ignored" );
 
 
-	RS_DBG3( pSocket,
-	         " Expected data lenght: ", dataLenght,
-	         " received data bytes: ", recvRet );
+	RS_DBG3( pSocket, " received data bytes: ", dataLenght );
 
 	RS_DBG4(pSocket, " networkMessage.mData: ", networkMessage.mData);
 
@@ -271,49 +629,11 @@ std::task<ssize_t> SharedState::receiveNetworkMessage(
 	co_return totalReceivedBytes;
 }
 
-std::task<ssize_t> SharedState::sendNetworkMessage(
-        AsyncSocket& pSocket, const NetworkMessage& netMsg,
+std::task<bool> SharedState::waitSendAck(
+        AsyncSocket& pSocket, ssize_t totalSentBytes,
+        std::chrono::steady_clock::time_point sendBTP,
         NetworkStats& netStats, std::error_condition* errbub )
 {
-	RS_DBG3(pSocket, " type: ", netMsg.mTypeName, " dataLen: ", netMsg.mData.size());
-
-	ssize_t constexpr rFAILURE = -1;
-
-	ssize_t totalSentBytes = 0;
-	ssize_t sentBytes = -1;
-
-	using namespace std::chrono;
-	const auto sendBTP = steady_clock::now();
-
-	uint8_t dataTypeLen = netMsg.mTypeName.length();
-	sentBytes = co_await pSocket.send(&dataTypeLen, 1, errbub);
-	if (sentBytes == -1) RS_UNLIKELY co_return rFAILURE;
-	totalSentBytes += sentBytes;
-	RS_DBG4( pSocket, " sent dataTypeLen: ", static_cast<int>(dataTypeLen),
-	         " sentBytes: ", sentBytes );
-
-	sentBytes = co_await pSocket.send(
-	            reinterpret_cast<const uint8_t*>(netMsg.mTypeName.data()),
-	            dataTypeLen, errbub );
-	if (sentBytes == -1) co_return rFAILURE;
-	totalSentBytes += sentBytes;
-	RS_DBG4( pSocket, " sent netMsg.mTypeName: ", netMsg.mTypeName,
-	         " sentBytes: ", sentBytes);
-
-	uint32_t dataTypeLenNetOrder = htonl(netMsg.mData.size());
-	sentBytes = co_await pSocket.send(
-	    reinterpret_cast<uint8_t*>(&dataTypeLenNetOrder), 4, errbub );
-	if (sentBytes == -1) RS_UNLIKELY co_return rFAILURE;
-	totalSentBytes += sentBytes;
-	RS_DBG4( pSocket, " sent netMsg.mData.size(): ", netMsg.mData.size(),
-	         " sentBytes: ", sentBytes );
-
-	sentBytes = co_await pSocket.send(
-	            reinterpret_cast<const uint8_t*>(netMsg.mData.data()),
-	            netMsg.mData.size(), errbub );
-	if (sentBytes == -1) RS_UNLIKELY co_return rFAILURE;
-	totalSentBytes += sentBytes;
-
 	/* Wait for total received bytes acknowledge, all tests without this worked
 	 * fine anyway, so this has been added mainly to enable the sender to
 	 * extimate sending time in user space */
@@ -321,8 +641,9 @@ std::task<ssize_t> SharedState::sendNetworkMessage(
 	auto recvRet = co_await
 	        pSocket.recv(
 	            reinterpret_cast<uint8_t*>(&totalAckBytes), 4, errbub );
-	if(recvRet == -1) RS_UNLIKELY co_return rFAILURE;
+	if(recvRet == -1) RS_UNLIKELY co_return false;
 
+	using namespace std::chrono;
 	const auto ackETP = steady_clock::now();
 
 	totalAckBytes = htonl(totalAckBytes);
@@ -330,14 +651,13 @@ std::task<ssize_t> SharedState::sendNetworkMessage(
 	{
 		RS_WARN( "Peer acknowledged ", totalAckBytes,
 		         " bytes instead of ", totalSentBytes );
-		// TODO: pass peer address
 		// TODO: define proper error condition instead of abusing std::errc
 		rs_error_bubble_or_exit(
 		            std::errc::message_size, errbub,
-		            "Peer XXX acknowledge mismatch got: ",
+		            "Peer ", netStats.mPeer, " acknowledge mismatch got: ",
 		            totalAckBytes,
 		            " expected: ", totalSentBytes );
-		co_return rFAILURE;
+		co_return false;
 	}
 
 	/* RTT impact on bandwidth calculation should be usually neglegible, and for
@@ -354,106 +674,742 @@ std::task<ssize_t> SharedState::sendNetworkMessage(
 		RS_ERR( "Time must have wrapped during upload, bandwidth extimation ",
 		        " ignored" );
 
-	RS_DBG4( pSocket, " sent netMsg.mData: ", netMsg.mData);
-
-	RS_DBG3( pSocket, " Total bytes sent: ", totalSentBytes );
-	co_return totalSentBytes;
+	co_return true;
 }
 
-std::task<bool> SharedState::handleReqSyncConnection(
-        std::shared_ptr<AsyncSocket> pSocket,
+std::task<ssize_t> SharedState::sendNetworkMessage(
+        AsyncSocket& pSocket, const NetworkMessage& netMsg,
+        const WireSession& wireSession, NetworkStats& netStats,
         std::error_condition* errbub )
 {
-	auto constexpr rFAILURE = false;
-	auto constexpr rSUCCESS = true;
-
-/* !! CAPTURING LAMBDAS THAT ARE COROUTINES BREAKS !!
- * https://isocpp.github.io/CppCoreGuidelines/CppCoreGuidelines#Rcoro-capture
- * Use a macro instead even if less elegant
- */
-
-/* If there is a failure even closing a socket or terminating a child
- * process there isn't much we can do, so let downstream function report
- * the error and terminate the process */
-#define handleReqSyncConnection_clean_socket() \
-do \
-{ \
-	co_await mIoContext.closeAFD(pSocket); \
-	RS_DBG3("IOContext status after clenup: ", ioContext); \
-} \
-while(false)
-
-	NetworkStats netStats;
-	pSocket->getPeerAddr(netStats.mPeer);
+	RS_DBG3(pSocket, " type: ", netMsg.mTypeName, " dataLen: ", netMsg.mData.size());
 
-	if(!co_await SharedState::serverHandShake(
-	            *pSocket, netStats, errbub )) RS_UNLIKELY
-	{
-		handleReqSyncConnection_clean_socket();
-		co_return rFAILURE;
-	}
+	ssize_t constexpr rFAILURE = -1;
 
-	NetworkMessage networkMessage;
-	std::error_condition recvErrc;
-	auto totalReceived = co_await
-	        receiveNetworkMessage(
-	            *pSocket, networkMessage, netStats, &recvErrc );
-	if(totalReceived < 0)
+	if(wireSession.mProtoVersion >= WIRE_PROTO_VERSION_CHUNKED)
 	{
-		RS_DBG1("Got invalid data from client ", *pSocket);
-		handleReqSyncConnection_clean_socket();
-		co_return rFAILURE;
+		/* Just one frame, copying it is not a big deal as messages sent this
+		 * way are small, big ones are streamed by sendStateSlice */
+		co_return co_await sendFramedMessage(
+		            pSocket, netMsg.mTypeName,
+		            [&netMsg](std::vector<uint8_t>& frame)
+		{
+			frame = netMsg.mData;
+			return false;
+		}, netStats, errbub );
 	}
 
-	auto receivedMessageSize = networkMessage.mData.size();
+	ssize_t totalSentBytes = 0;
+	ssize_t sentBytes = -1;
 
 	using namespace std::chrono;
-	const auto mergeBTP = steady_clock::now();
+	const auto sendBTP = steady_clock::now();
+
+	/* Header and data go out with a single syscall, so the header doesn't
+	 * leave as a tiny segment on its own */
+	uint8_t dataTypeLen = netMsg.mTypeName.length();
+	uint32_t dataTypeLenNetOrder = htonl(netMsg.mData.size());
+	iovec tIov[] =
+	{
+	    { &dataTypeLen, 1 },
+	    { const_cast<char*>(netMsg.mTypeName.data()), dataTypeLen },
+	    { &dataTypeLenNetOrder, 4 },
+	    { const_cast<uint8_t*>(netMsg.mData.data()), netMsg.mData.size() }
+	};
+	sentBytes = co_await pSocket.sendVector(tIov, false, errbub);
+	if (sentBytes == -1) RS_UNLIKELY co_return rFAILURE;
+	totalSentBytes += sentBytes;
+	RS_DBG4( pSocket, " sent netMsg.mTypeName: ", netMsg.mTypeName,
+	         " netMsg.mData.size(): ", netMsg.mData.size(),
+	         " sentBytes: ", sentBytes );
 
-	std::map<StateKey, StateEntry> peerState;
-	networkMessage.toStateSlice(peerState);
+	if(!co_await waitSendAck(pSocket, totalSentBytes, sendBTP, netStats, errbub))
+		RS_UNLIKELY co_return rFAILURE;
 
-	ssize_t changes = co_await merge(
-	            networkMessage.mTypeName, peerState, netStats.mPeer, errbub );
+	RS_DBG4( pSocket, " sent netMsg.mData: ", netMsg.mData);
 
-	if(changes == -1) RS_UNLIKELY
-	{
-		handleReqSyncConnection_clean_socket();
-		co_return rFAILURE;
-	}
+	RS_DBG3( pSocket, " Total bytes sent: ", totalSentBytes );
+	co_return totalSentBytes;
+}
+
+std::task<ssize_t> SharedState::sendFramedMessage(
+        AsyncSocket& pSocket, const std::string& typeName,
+        std::function<bool(std::vector<uint8_t>& frame)> nextFrame,
+        NetworkStats& netStats, std::error_condition* errbub )
+{
+	ssize_t constexpr rFAILURE = -1;
 
-	const auto mergeETP = steady_clock::now();
-	const auto mergeMuSecs = duration_cast<microseconds>(mergeETP - mergeBTP);
+	ssize_t totalSentBytes = 0;
+	ssize_t sentBytes = -1;
 
-	networkMessage.fromStateSlice(mStates[networkMessage.mTypeName]);
+	using namespace std::chrono;
+	const auto sendBTP = steady_clock::now();
 
-	auto totalSent = co_await sendNetworkMessage(
-	            *pSocket, networkMessage, netStats, errbub );
-	if(totalSent == -1)
+	/* The type name goes out together with the first frame, and the end
+	 * marker with the last one, so a small message takes a single syscall
+	 * and no tiny segment leaves on its own */
+	uint8_t dataTypeLen = typeName.length();
+	uint32_t endMarker = 0;
+	bool endMarkerSent = false;
+
+	/* The frame buffer is reused, so serializing the next frame happens
+	 * while the kernel is still pushing the previous one on the network */
+	std::vector<uint8_t> tFrame;
+	bool moreFrames = true;
+	int numFrames = 0;
+	while(moreFrames)
 	{
-		handleReqSyncConnection_clean_socket();
-		co_return rFAILURE;
-	}
+		tFrame.clear();
+		moreFrames = nextFrame(tFrame);
 
-	RS_DBG3( "Handled sync request from peer: ", netStats.mPeer,
-	         " Received message type: ", networkMessage.mTypeName,
-	         " Received message size: ", receivedMessageSize,
-	         " Sent message size: ", networkMessage.mData.size(),
-	         " Extimated upload BW: ", netStats.mUpBwMbsExt, "Mbit/s",
-	         " Extimated download BW: ", netStats.mDownBwMbsExt, "Mbit/s",
-	         " Extimated RTT: ", netStats.mRttExt.count(), "μs",
-	         " Processing time: ", mergeMuSecs.count(), "μs"
-	         " Total sent bytes: ", totalSent,
-	         " Total received bytes: ", totalReceived );
+		/* Empty frame would be taken as end of message, it happens only if
+		 * there is nothing to send, so skip it */
+		if(tFrame.empty()) RS_UNLIKELY continue;
 
+		if(tFrame.size() > DATA_MAX_LENGHT) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::message_size, errbub,
+			            "Frame of type: ", typeName, " too big: ",
+			            tFrame.size() );
+			co_return rFAILURE;
+		}
+
+		uint32_t frameLenNetOrder = htonl(tFrame.size());
+		iovec tIov[5];
+		std::size_t tIovCnt = 0;
+		if(!numFrames)
+		{
+			tIov[tIovCnt++] = { &dataTypeLen, 1 };
+			tIov[tIovCnt++] =
+			{ const_cast<char*>(typeName.data()), dataTypeLen };
+		}
+		tIov[tIovCnt++] = { &frameLenNetOrder, 4 };
+		tIov[tIovCnt++] = { tFrame.data(), tFrame.size() };
+		if(!moreFrames)
+		{
+			tIov[tIovCnt++] = { &endMarker, 4 };
+			endMarkerSent = true;
+		}
+
+		std::span<iovec> tBuffers(tIov, tIovCnt);
+		sentBytes = co_await pSocket.sendVector(tBuffers, false, errbub);
+		if (sentBytes == -1) RS_UNLIKELY co_return rFAILURE;
+		totalSentBytes += sentBytes;
+		++numFrames;
+	}
+
+	if(!numFrames) RS_UNLIKELY
+	{
+		rs_error_bubble_or_exit(
+		            std::errc::invalid_argument, errbub,
+		            "Refusing to send empty message of type: ", typeName );
+		co_return rFAILURE;
+	}
+
+	// Last frame came out empty and has been skipped
+	if(!endMarkerSent)
+	{
+		sentBytes = co_await pSocket.send(
+		            reinterpret_cast<uint8_t*>(&endMarker), 4, errbub );
+		if (sentBytes == -1) RS_UNLIKELY co_return rFAILURE;
+		totalSentBytes += sentBytes;
+	}
+
+	if(!co_await waitSendAck(pSocket, totalSentBytes, sendBTP, netStats, errbub))
+		RS_UNLIKELY co_return rFAILURE;
+
+	RS_DBG3( pSocket, " type: ", typeName, " frames: ", numFrames,
+	         " Total bytes sent: ", totalSentBytes );
+	co_return totalSentBytes;
+}
+
+std::task<ssize_t> SharedState::sendStateSlice(
+        AsyncSocket& pSocket, const std::string& typeName,
+        std::map<StateKey, StateEntry>& stateSlice, SliceFilter filter,
+        const WireSession& wireSession, NetworkStats& netStats,
+        std::vector<uint8_t> leadingFrame, std::error_condition* errbub )
+{
+	if(wireSession.mProtoVersion < WIRE_PROTO_VERSION_CHUNKED)
+	{
+		NetworkMessage tMessage;
+		tMessage.mTypeName = typeName;
+		if(wireSession.mProtoVersion < WIRE_PROTO_VERSION_BINARY)
+			tMessage.fromStateSlice(stateSlice, wireSession.mProtoVersion);
+		else
+		{
+			std::optional<StateKey> lastKey;
+			tMessage.fromStateSliceChunk(
+			            stateSlice, filter, lastKey,
+			            std::numeric_limits<std::size_t>::max() );
+		}
+		co_return co_await sendNetworkMessage(
+		            pSocket, tMessage, wireSession, netStats, errbub );
+	}
+
+	/* Bandwidth is extimated only after the first message, so before that
+	 * rely on last extimation toward the same peer */
+	const auto tCursor = peerSyncCursor(netStats.mPeer, wireSession);
+	const bool useCompression =
+	        wireSession.mFeatures & WIRE_FEATURE_COMPRESSION;
+	const std::size_t compressThreshold = compressionThreshold(
+	            netStats.mUpBwMbsExt ? netStats.mUpBwMbsExt :
+	                                   tCursor ? tCursor->mUpBwMbsExt : 0 );
+
+	/* Hold a reference to the dictionary as it might be retrained while we
+	 * are waiting for the socket */
+	uint64_t dictionaryId = 0;
+	std::shared_ptr<const std::vector<uint8_t>> tDictionary;
+	bool dictionaryDelivered = false;
+	if(useCompression && compressThreshold != SIZE_MAX)
+	{
+		const auto& typeDict = typeDictionary(typeName);
+		dictionaryId = typeDict.mId;
+		tDictionary = typeDict.mData;
+		if(tCursor)
+		{
+			const auto dIt = tCursor->mDeliveredDictionary.find(typeName);
+			dictionaryDelivered =
+			        dIt != tCursor->mDeliveredDictionary.end() &&
+			        dIt->second == dictionaryId;
+		}
+	}
+	bool dictionarySent = false;
+	std::vector<uint8_t> pendingFrame;
+	bool sliceSent = false;
+
+	/* Frames are serialized right before being sent, entries might be
+	 * inserted or removed from the state meanwhile, so keep track of
+	 * progress by key and not by iterator which might be invalidated */
+	std::optional<StateKey> lastKey;
+	NetworkMessage tChunk;
+	bool moreFrames = true;
+	auto totalSent = co_await sendFramedMessage(
+	            pSocket, typeName,
+	            [&](std::vector<uint8_t>& frame)
+	{
+		if(!pendingFrame.empty())
+		{
+			frame.swap(pendingFrame);
+			return moreFrames;
+		}
+
+		bool tMore = true;
+		if(!leadingFrame.empty()) frame.swap(leadingFrame);
+		else
+		{
+			uint64_t chunkEntries = 0;
+			moreFrames = tChunk.fromStateSliceChunk(
+			            stateSlice, filter, lastKey, MESSAGE_FRAME_SIZE,
+			            &chunkEntries );
+			tMore = moreFrames;
+
+			/* Filter might drop all the trailing entries, an empty chunk
+			 * after the first is worth nothing, leave the frame empty so it
+			 * is skipped and just the end marker goes out */
+			if(!chunkEntries && sliceSent) return tMore;
+			frame.swap(tChunk.mData);
+			sliceSent = true;
+		}
+
+		if(!useCompression || frame.size() < compressThreshold) return tMore;
+
+		std::vector<uint8_t> tCompressed;
+		BinaryWriter tWriter(tCompressed);
+		tWriter.writeUint8(BINARY_COMPRESSED_FORMAT);
+		for(int i = 0; i < 8; ++i)
+			tWriter.writeUint8(static_cast<uint8_t>(dictionaryId >> (8*i)));
+		tWriter.writeVarint(frame.size());
+		bool compressOk = false;
+		{
+			StateUnlock tUnlock(*this);
+			compressOk = DictionaryCodec::compress(
+			            frame, dictionaryId ?
+			                std::span<const uint8_t>(*tDictionary) :
+			                std::span<const uint8_t>(), tCompressed );
+		}
+		if(!compressOk || tCompressed.size() >= frame.size()) return tMore;
+
+		frame.swap(tCompressed);
+		if(!dictionaryId || dictionaryDelivered || dictionarySent)
+			return tMore;
+
+		/* Peer need the dictionary before the first frame compressed with
+		 * it, send it and keep the compressed frame for next round */
+		pendingFrame.swap(frame);
+		frame.clear();
+		BinaryWriter dictWriter(frame);
+		dictWriter.writeUint8(BINARY_DICTIONARY_FORMAT);
+		for(int i = 0; i < 8; ++i)
+			dictWriter.writeUint8(static_cast<uint8_t>(dictionaryId >> (8*i)));
+		dictWriter.writeBytes(tDictionary->data(), tDictionary->size());
+		dictionarySent = true;
+		return true;
+	}, netStats, errbub );
+
+	/* Acknowledge is sent after all frames have been processed, so if we
+	 * get it the peer stored the dictionary successfully, if we don't it
+	 * might have forgotten it so send it again next time */
+	if(const auto sentCursor = touchPeerSyncCursor(netStats.mPeer, wireSession))
+	{
+		if(totalSent == -1) sentCursor->mDeliveredDictionary.erase(typeName);
+		else
+		{
+			if(dictionarySent)
+				sentCursor->mDeliveredDictionary[typeName] = dictionaryId;
+			if(netStats.mUpBwMbsExt)
+				sentCursor->mUpBwMbsExt = netStats.mUpBwMbsExt;
+		}
+	}
+
+	co_return totalSent;
+}
+
+
+std::task<bool> SharedState::handleReqSyncConnection(
+        std::shared_ptr<AsyncSocket> pSocket,
+        std::error_condition* errbub )
+{
+	auto constexpr rFAILURE = false;
+	auto constexpr rSUCCESS = true;
+
+/* !! CAPTURING LAMBDAS THAT ARE COROUTINES BREAKS !!
+ * https://isocpp.github.io/CppCoreGuidelines/CppCoreGuidelines#Rcoro-capture
+ * Use a macro instead even if less elegant
+ */
+
+/* If there is a failure even closing a socket or terminating a child
+ * process there isn't much we can do, so let downstream function report
+ * the error and terminate the process */
+#define handleReqSyncConnection_clean_socket() \
+do \
+{ \
+	co_await pSocket->getIOContext().closeAFD(pSocket); \
+	RS_DBG3("IOContext status after clenup: ", ioContext); \
+} \
+while(false)
+
+	using namespace std::chrono;
+
+	NetworkStats handShakeStats;
+	pSocket->getPeerAddr(handShakeStats.mPeer);
+
+	pSocket->setDeadline(steady_clock::now() + DEFAULT_SYNC_TIMEOUT);
+
+	WireSession wireSession;
+	if(!co_await SharedState::serverHandShake(
+	            *pSocket, wireSession, handShakeStats, errbub )) RS_UNLIKELY
+	{
+		handleReqSyncConnection_clean_socket();
+		co_return rFAILURE;
+	}
+
+	/* Since WIRE_PROTO_VERSION_PERSISTENT the client keeps the connection
+	 * open for next synchronizations and closes it when idle, keep alive
+	 * probes take care of clients which disappeared without closing it */
+	const bool isPersistent =
+	        wireSession.mProtoVersion >= WIRE_PROTO_VERSION_PERSISTENT;
+	if( isPersistent &&
+	        !pSocket->setKeepAlive(mConnectionIdleTimeout, errbub) ) RS_UNLIKELY
+	{
+		handleReqSyncConnection_clean_socket();
+		co_return rFAILURE;
+	}
+
+	bool tSuccess = rSUCCESS;
+	for(int requests = 0; ; ++requests)
+	{
+		/* Until the requests are received we don't know which data types are
+		 * involved, handleSyncRequests extends the deadline accordingly */
+		pSocket->setDeadline(
+		            steady_clock::now() + DEFAULT_SYNC_TIMEOUT +
+		            (requests ? mConnectionIdleTimeout : seconds::zero()) );
+
+		NetworkStats netStats(handShakeStats);
+		auto totalReceived = co_await handleSyncRequests(
+		            *pSocket, wireSession, netStats, errbub );
+		if(totalReceived == 0 && !requests) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::connection_aborted, errbub,
+			            "Peer: ", handShakeStats.mPeer,
+			            " closed connection without sending a request" );
+			totalReceived = -1;
+		}
+		if(totalReceived == -1) RS_UNLIKELY tSuccess = rFAILURE;
+		if(totalReceived <= 0 || !isPersistent) break;
+	}
+
+	RS_DBG3( "Closing connection from peer: ", handShakeStats.mPeer );
 	handleReqSyncConnection_clean_socket();
+	co_return tSuccess;
+}
+
+std::task<ssize_t> SharedState::handleSyncRequests(
+        AsyncSocket& pSocket, WireSession& wireSession,
+        NetworkStats& netStats, std::error_condition* errbub )
+{
+	constexpr ssize_t rFAILURE = -1;
+
+	/* Since WIRE_PROTO_VERSION_BATCH requests for many data types come in a
+	 * batch terminated by an empty type name, older versions send just one
+	 * request. All of them are answered after the whole batch is received */
+	const bool isBatch = wireSession.mProtoVersion >= WIRE_PROTO_VERSION_BATCH;
+
+	using namespace std::chrono;
+	steady_clock::duration mergeTime(0);
+
+	std::vector<TypeExchange> exchanges;
+	ssize_t totalReceived = 0;
+	while(true)
+	{
+		TypeExchange exchange;
+		const auto tReceived = co_await receiveSyncRequest(
+		            pSocket, exchange, wireSession, netStats, mergeTime,
+		            errbub );
+		if(tReceived == -1) co_return rFAILURE;
+		if(tReceived == 0)
+		{
+			if(!totalReceived) co_return 0;
+
+			rs_error_bubble_or_exit(
+			            std::errc::connection_aborted, errbub,
+			            "Peer: ", netStats.mPeer,
+			            " closed connection in the middle of a batch" );
+			co_return rFAILURE;
+		}
+		totalReceived += tReceived;
+
+		if(exchange.mTypeName.empty()) break;
+		exchanges.push_back(std::move(exchange));
+		if(!isBatch) break;
+	}
+
+	auto tTimeout = seconds::zero();
+	for(auto&& exchange: std::as_const(exchanges))
+		tTimeout = std::max(tTimeout, syncTimeout(exchange.mTypeName));
+	pSocket.setDeadline(steady_clock::now() + tTimeout);
+
+	ssize_t totalSent = 0;
+	for(auto& exchange: exchanges)
+	{
+		const auto tSent = co_await sendSyncReply(
+		            pSocket, exchange, wireSession, netStats, errbub );
+		if(tSent == -1) co_return rFAILURE;
+		totalSent += tSent;
+	}
+
+	for(auto& exchange: exchanges)
+	{
+		const auto tReceived = co_await receiveSyncCompletion(
+		            pSocket, exchange, wireSession, netStats, mergeTime,
+		            errbub );
+		if(tReceived == -1) co_return rFAILURE;
+		totalReceived += tReceived;
+	}
+
+	const auto mergeMuSecs = duration_cast<microseconds>(mergeTime);
+	RS_DBG3( "Handled sync request from peer: ", netStats.mPeer,
+	         " data types: ", exchanges.size(),
+	         " Extimated upload BW: ", netStats.mUpBwMbsExt, "Mbit/s",
+	         " Extimated download BW: ", netStats.mDownBwMbsExt, "Mbit/s",
+	         " Extimated RTT: ", netStats.mRttExt.count(), "μs",
+	         " Processing time: ", mergeMuSecs.count(), "μs"
+	         " Total sent bytes: ", totalSent,
+	         " Total received bytes: ", totalReceived );
 
 	if(!collectStat(netStats, errbub)) co_return rFAILURE;
 
-	if(isPeer && (changes > 0))
-		co_return co_await notifyHooks(networkMessage.mTypeName, errbub);
+	bool hooksOk = true;
+	if(isPeer) for(auto&& exchange: std::as_const(exchanges))
+		if( exchange.mChanges > 0 &&
+		        !co_await notifyHooks(
+		            exchange.mTypeName, pSocket.getIOContext(), errbub ) )
+			hooksOk = false;
+	if(!hooksOk) co_return rFAILURE;
+
+	co_return totalReceived;
+}
+
+std::task<ssize_t> SharedState::receiveSyncRequest(
+        AsyncSocket& pSocket, TypeExchange& exchange,
+        const WireSession& wireSession, NetworkStats& netStats,
+        std::chrono::steady_clock::duration& mergeTime,
+        std::error_condition* errbub )
+{
+	constexpr ssize_t rFAILURE = -1;
+
+	using namespace std::chrono;
+
+	/* Since WIRE_PROTO_VERSION_CHUNKED slices are merged as soon as frames
+	 * arrive, a digest always comes in a single frame and is handled after
+	 * receiving it */
+	const bool streamMerge =
+	        wireSession.mProtoVersion >= WIRE_PROTO_VERSION_CHUNKED;
+	bool gotDigest = false;
+	MergeSession mergeSession;
+	uint8_t expectedFormat = BINARY_SLICE_FORMAT;
+	FrameHandler onFrame = nullptr;
+	if(streamMerge) onFrame = [&](NetworkMessage& frame)
+	{
+		if(gotDigest) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::bad_message, errbub,
+			            "Peer: ", netStats.mPeer, " sent digest of type: ",
+			            frame.mTypeName, " in more then one frame" );
+			return false;
+		}
+
+		if(!mergeSession.mState)
+		{
+			if(frame.binaryFormat() == BINARY_DIGEST_FORMAT)
+			{
+				gotDigest = true;
+				return true;
+			}
+
+			exchange.mPreMergeChangeSeq = typeChangeSeq(frame.mTypeName);
+			if(!setupMergeSession(
+			            mergeSession, frame.mTypeName, netStats.mPeer, errbub ))
+				RS_UNLIKELY return false;
+		}
+
+		const auto mergeBTP = steady_clock::now();
+		const bool tMerged = mergeBinaryFrame(
+		            mergeSession, frame, true, expectedFormat, nullptr, 0,
+		            errbub );
+		mergeTime += steady_clock::now() - mergeBTP;
+		return tMerged;
+	};
+
+	NetworkMessage networkMessage;
+	std::error_condition recvErrc;
+	auto totalReceived = co_await
+	        receiveNetworkMessage(
+	            pSocket, networkMessage, wireSession, netStats, onFrame,
+	            &recvErrc );
+	if(totalReceived < 0)
+	{
+		RS_DBG1("Got invalid data from client ", pSocket, " ", recvErrc);
+		co_return rFAILURE;
+	}
+
+	// Connection or batch end
+	if(totalReceived == 0 || networkMessage.mTypeName.empty())
+		co_return totalReceived;
+
+	exchange.mTypeName = networkMessage.mTypeName;
+
+	if( gotDigest || ( !streamMerge &&
+	        wireSession.mProtoVersion >= WIRE_PROTO_VERSION_DIGEST &&
+	        networkMessage.binaryFormat() == BINARY_DIGEST_FORMAT ) )
+	{
+		exchange.mIsDigest = true;
+
+		const auto statesIt = mStates.find(exchange.mTypeName);
+		if(statesIt == mStates.end()) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit( SharedStateErrors::UNKOWN_DATA_TYPE,
+			                         errbub, exchange.mTypeName );
+			co_return rFAILURE;
+		}
+
+		std::vector<uint64_t> peerDigests;
+		if(!networkMessage.toStateDigest(peerDigests, errbub)) RS_UNLIKELY
+		        co_return rFAILURE;
+
+		exchange.mDigestBuckets = static_cast<uint32_t>(peerDigests.size());
+		std::vector<uint64_t> ownDigests;
+		computeDigests(statesIt->second, exchange.mDigestBuckets, ownDigests);
+
+		for(uint32_t i = 0; i < exchange.mDigestBuckets; ++i)
+			if(peerDigests[i] != ownDigests[i])
+				exchange.mMismatchingBuckets.push_back(i);
+
+		RS_DBG3( "Peer: ", netStats.mPeer, " type: ", exchange.mTypeName, " ",
+		         exchange.mMismatchingBuckets.size(), " of ",
+		         exchange.mDigestBuckets, " digest buckets differ" );
+
+		co_return totalReceived;
+	}
+
+	exchange.mChanges = mergeSession.mSignificantChanges;
+	if(!streamMerge)
+	{
+		const auto mergeBTP = steady_clock::now();
+		exchange.mPreMergeChangeSeq = typeChangeSeq(exchange.mTypeName);
+		if(!setupMergeSession(
+		            mergeSession, exchange.mTypeName, netStats.mPeer, errbub ))
+			RS_UNLIKELY co_return rFAILURE;
+		exchange.mChanges = co_await mergeNetworkMessage(
+		            networkMessage, wireSession.mProtoVersion, mergeSession,
+		            nullptr, 0, errbub );
+		if(exchange.mChanges == -1) RS_UNLIKELY co_return rFAILURE;
+		mergeTime += steady_clock::now() - mergeBTP;
+	}
+
+	exchange.mPostMergeChangeSeq = typeChangeSeq(exchange.mTypeName);
+	exchange.mMergedChangeSeqs = mergeSession.mAssignedChangeSeqs;
+	skipMergedChanges(
+	            netStats.mPeer, wireSession, exchange.mTypeName,
+	            exchange.mPreMergeChangeSeq, exchange.mPostMergeChangeSeq,
+	            exchange.mMergedChangeSeqs );
+
+	co_return totalReceived;
+}
+
+std::task<ssize_t> SharedState::sendSyncReply(
+        AsyncSocket& pSocket, TypeExchange& exchange,
+        const WireSession& wireSession, NetworkStats& netStats,
+        std::error_condition* errbub )
+{
+	constexpr ssize_t rFAILURE = -1;
+
+	auto& tState = mStates[exchange.mTypeName];
+	exchange.mSentChangeSeq = typeChangeSeq(exchange.mTypeName);
+
+	ssize_t totalSent = -1;
+	if(!exchange.mIsDigest)
+	{
+		const uint64_t sinceChangeSeq = deliveredChangeSeq(
+		            netStats.mPeer, wireSession, exchange.mTypeName );
+		totalSent = co_await sendStateSlice(
+		            pSocket, exchange.mTypeName, tState,
+		            [sinceChangeSeq](const StateKey&, const StateEntry& stateEntry)
+		{ return !sinceChangeSeq || stateEntry.mChangeSeq > sinceChangeSeq; },
+		            wireSession, netStats, {}, errbub );
+	}
+	else if(wireSession.mProtoVersion < WIRE_PROTO_VERSION_CHUNKED)
+	{
+		NetworkMessage networkMessage;
+		networkMessage.mTypeName = exchange.mTypeName;
+		networkMessage.fromDigestReply(
+		            tState, exchange.mMismatchingBuckets,
+		            exchange.mDigestBuckets );
+		totalSent = co_await sendNetworkMessage(
+		            pSocket, networkMessage, wireSession, netStats, errbub );
+	}
+	else
+	{
+		/* Buckets list goes in the first frame, followed by the entries
+		 * streamed frame by frame */
+		const uint32_t bucketsNum = exchange.mDigestBuckets;
+		NetworkMessage bucketsFrame;
+		bucketsFrame.fromDigestReply(
+		            {}, exchange.mMismatchingBuckets, bucketsNum );
+
+		std::vector<bool> wantedBuckets(bucketsNum, false);
+		for(auto bucket: exchange.mMismatchingBuckets)
+			wantedBuckets[bucket] = true;
+		totalSent = co_await sendStateSlice(
+		            pSocket, exchange.mTypeName, tState,
+		            [&wantedBuckets, bucketsNum](
+		                const StateKey& key, const StateEntry& )
+		{ return wantedBuckets[digestBucket(key, bucketsNum)]; },
+		            wireSession, netStats, std::move(bucketsFrame.mData),
+		            errbub );
+	}
+	if(totalSent == -1) RS_UNLIKELY co_return rFAILURE;
+
+	/* With differing digest buckets the peer entries in them are still to be
+	 * received, @see receiveSyncCompletion */
+	if(!exchange.mIsDigest || exchange.mMismatchingBuckets.empty())
+		setDeliveredChangeSeq(
+		            netStats.mPeer, wireSession, exchange.mTypeName,
+		            exchange.mSentChangeSeq );
+
+	co_return totalSent;
+}
+
+std::task<ssize_t> SharedState::receiveSyncCompletion(
+        AsyncSocket& pSocket, TypeExchange& exchange,
+        const WireSession& wireSession, NetworkStats& netStats,
+        std::chrono::steady_clock::duration& mergeTime,
+        std::error_condition* errbub )
+{
+	constexpr ssize_t rFAILURE = -1;
+
+	if(!exchange.mIsDigest || exchange.mMismatchingBuckets.empty())
+		co_return 0;
+
+	using namespace std::chrono;
+
+	exchange.mPreMergeChangeSeq = typeChangeSeq(exchange.mTypeName);
+	const bool streamMerge =
+	        wireSession.mProtoVersion >= WIRE_PROTO_VERSION_CHUNKED;
+	MergeSession mergeSession;
+	if(!setupMergeSession(
+	            mergeSession, exchange.mTypeName, netStats.mPeer, errbub ))
+		RS_UNLIKELY co_return rFAILURE;
+
+	uint8_t expectedFormat = BINARY_SLICE_FORMAT;
+	FrameHandler onFrame = nullptr;
+	if(streamMerge) onFrame = [&](NetworkMessage& frame)
+	{
+		if(frame.mTypeName != exchange.mTypeName) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::bad_message, errbub,
+			            "Peer: ", netStats.mPeer, " sent type: ",
+			            frame.mTypeName, " expected: ", exchange.mTypeName );
+			return false;
+		}
+
+		const auto mergeBTP = steady_clock::now();
+		const bool tMerged = mergeBinaryFrame(
+		            mergeSession, frame, true, expectedFormat,
+		            nullptr, 0, errbub );
+		mergeTime += steady_clock::now() - mergeBTP;
+		return tMerged;
+	};
+
+	NetworkMessage networkMessage;
+	auto totalReceived = co_await receiveNetworkMessage(
+	            pSocket, networkMessage, wireSession, netStats, onFrame,
+	            errbub );
+	if(totalReceived == -1) RS_UNLIKELY co_return rFAILURE;
+	if(totalReceived == 0) RS_UNLIKELY
+	{
+		rs_error_bubble_or_exit(
+		            std::errc::connection_aborted, errbub,
+		            "Peer: ", netStats.mPeer,
+		            " closed connection before sending its entries" );
+		co_return rFAILURE;
+	}
+
+	if(networkMessage.mTypeName != exchange.mTypeName) RS_UNLIKELY
+	{
+		rs_error_bubble_or_exit(
+		            std::errc::bad_message, errbub,
+		            "Peer: ", netStats.mPeer, " sent type: ",
+		            networkMessage.mTypeName, " expected: ",
+		            exchange.mTypeName );
+		co_return rFAILURE;
+	}
 
-	co_return rSUCCESS;
+	exchange.mChanges = mergeSession.mSignificantChanges;
+	if(!streamMerge)
+	{
+		const auto mergeBTP = steady_clock::now();
+		exchange.mChanges = co_await mergeNetworkMessage(
+		            networkMessage, wireSession.mProtoVersion, mergeSession,
+		            nullptr, 0, errbub );
+		if(exchange.mChanges == -1) RS_UNLIKELY co_return rFAILURE;
+		mergeTime += steady_clock::now() - mergeBTP;
+	}
+	exchange.mPostMergeChangeSeq = typeChangeSeq(exchange.mTypeName);
+	exchange.mMergedChangeSeqs = mergeSession.mAssignedChangeSeqs;
+
+	setDeliveredChangeSeq(
+	            netStats.mPeer, wireSession, exchange.mTypeName,
+	            exchange.mSentChangeSeq );
+	skipMergedChanges(
+	            netStats.mPeer, wireSession, exchange.mTypeName,
+	            exchange.mPreMergeChangeSeq, exchange.mPostMergeChangeSeq,
+	            exchange.mMergedChangeSeqs );
+
+	co_return totalReceived;
 }
 
 std::task<bool> SharedState::getCandidatesNeighbours(
@@ -508,34 +1464,56 @@ std::task<bool> SharedState::getCandidatesNeighbours(
 	co_return true;
 }
 
-/*static*/ std::task<bool> SharedState::serverHandShake(
-        AsyncSocket& pSocket, NetworkStats& netStats, std::error_condition* errbub )
+std::task<bool> SharedState::serverHandShake(
+        AsyncSocket& pSocket, WireSession& wireSession, NetworkStats& netStats,
+        std::error_condition* errbub )
 {
 	uint32_t wireProtoVer = 0;
 	auto recvRet = co_await pSocket.recv(
 	        reinterpret_cast<uint8_t*>(&wireProtoVer), 4, errbub );
 	if(recvRet == -1) RS_UNLIKELY co_return false;
+	if(recvRet != 4) RS_UNLIKELY
+	{
+		rs_error_bubble_or_exit(
+		            std::errc::connection_aborted, errbub,
+		            "Peer ", netStats.mPeer,
+		            " closed connection before sending wire protocol version" );
+		co_return false;
+	}
 
-	wireProtoVer = htonl(wireProtoVer);
-	if(WIRE_PROTO_VERSION != wireProtoVer) RS_UNLIKELY
+	wireProtoVer = ntohl(wireProtoVer);
+	if(wireProtoVer < WIRE_PROTO_VERSION_JSON) RS_UNLIKELY
 	{
-		// TODO: pass peer address
 		// TODO: define proper error condition instead of abusing std::errc
 		rs_error_bubble_or_exit(
 		            std::errc::protocol_error, errbub,
-		            "Peer XXX wire protocol version mismatch got: ",
-		            wireProtoVer, " expected: ", WIRE_PROTO_VERSION );
+		            "Peer ", netStats.mPeer,
+		            " sent invalid wire protocol version: ", wireProtoVer );
 		co_return false;
 	}
 
+	/* Newer peers can talk older versions too, so answer with the highest
+	 * version both of us support and let the client decide if it is fine */
+	wireSession.mProtoVersion = std::min(wireProtoVer, mMaxWireProtoVersion);
+
 	/* Wire proto handshake is very very lightweight it seems acceptable to
 	 * interact a bit longer to extimate RTT more precisely on both sides */
 
 	using namespace std::chrono;
 	const auto verBTP = steady_clock::now();
-	wireProtoVer = htonl(WIRE_PROTO_VERSION);
-	auto sendRet = co_await pSocket.send(
-	            reinterpret_cast<const uint8_t*>(&wireProtoVer), 4, errbub );
+	wireProtoVer = htonl(wireSession.mProtoVersion);
+	uint64_t ownEpoch = htobe64(mInstanceEpoch);
+	uint32_t ownFeatures = htonl(WIRE_FEATURES_SUPPORTED);
+	iovec tIov[3];
+	std::size_t tIovCnt = 0;
+	tIov[tIovCnt++] = { &wireProtoVer, 4 };
+	if(wireSession.mProtoVersion >= WIRE_PROTO_VERSION_DELTA)
+		tIov[tIovCnt++] = { &ownEpoch, 8 };
+	if(wireSession.mProtoVersion >= WIRE_PROTO_VERSION_FEATURES)
+		tIov[tIovCnt++] = { &ownFeatures, 4 };
+
+	std::span<iovec> tBuffers(tIov, tIovCnt);
+	auto sendRet = co_await pSocket.sendVector(tBuffers, false, errbub);
 	if(sendRet == -1) RS_UNLIKELY co_return false;
 
 	recvRet = co_await pSocket.recv(
@@ -543,13 +1521,62 @@ std::task<bool> SharedState::getCandidatesNeighbours(
 	if(recvRet == -1) RS_UNLIKELY co_return false;
 
 	const auto verETP = steady_clock::now();
+
+	wireProtoVer = ntohl(wireProtoVer);
+	if(recvRet != 4 || wireProtoVer != wireSession.mProtoVersion) RS_UNLIKELY
+	{
+		// TODO: define proper error condition instead of abusing std::errc
+		rs_error_bubble_or_exit(
+		            std::errc::protocol_error, errbub,
+		            "Peer ", netStats.mPeer,
+		            " didn't confirm wire protocol version: ",
+		            wireSession.mProtoVersion );
+		co_return false;
+	}
+
+	if(wireSession.mProtoVersion >= WIRE_PROTO_VERSION_DELTA)
+	{
+		uint64_t netOrderEpoch = 0;
+		recvRet = co_await pSocket.recv(
+		        reinterpret_cast<uint8_t*>(&netOrderEpoch), 8, errbub );
+		if(recvRet == -1) RS_UNLIKELY co_return false;
+		if(recvRet != 8) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::connection_aborted, errbub,
+			            "Peer ", netStats.mPeer,
+			            " closed connection before sending instance epoch" );
+			co_return false;
+		}
+		wireSession.mPeerEpoch = be64toh(netOrderEpoch);
+	}
+
+	if(wireSession.mProtoVersion >= WIRE_PROTO_VERSION_FEATURES)
+	{
+		uint32_t netOrderFeatures = 0;
+		recvRet = co_await pSocket.recv(
+		        reinterpret_cast<uint8_t*>(&netOrderFeatures), 4, errbub );
+		if(recvRet == -1) RS_UNLIKELY co_return false;
+		if(recvRet != 4) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::connection_aborted, errbub,
+			            "Peer ", netStats.mPeer,
+			            " closed connection before sending features" );
+			co_return false;
+		}
+		wireSession.mFeatures =
+		        ntohl(netOrderFeatures) & WIRE_FEATURES_SUPPORTED;
+	}
+
 	netStats.mRttExt = duration_cast<microseconds>(verETP - verBTP);
 
 	co_return true;
 }
 
-/*static*/ std::task<bool> SharedState::clientHandShake(
-        AsyncSocket& pSocket, NetworkStats& netStats, std::error_condition* errbub )
+std::task<bool> SharedState::clientHandShake(
+        AsyncSocket& pSocket, WireSession& wireSession, NetworkStats& netStats,
+        std::error_condition* errbub )
 {
 	/* Wire proto handshake seems an acceptable interacion to extimate RTT on
 	 * both sides */
@@ -557,7 +1584,7 @@ std::task<bool> SharedState::getCandidatesNeighbours(
 	using namespace std::chrono;
 	const auto verBTP = steady_clock::now();
 
-	uint32_t wireProtoVer = htonl(WIRE_PROTO_VERSION);
+	uint32_t wireProtoVer = htonl(wireSession.mProtoVersion);
 
 	auto sendRet = co_await pSocket.send(
 	            reinterpret_cast<const uint8_t*>(&wireProtoVer), 4, errbub );
@@ -569,20 +1596,82 @@ std::task<bool> SharedState::getCandidatesNeighbours(
 
 	const auto verETP = steady_clock::now();
 
-	wireProtoVer = htonl(wireProtoVer);
-	if(WIRE_PROTO_VERSION != wireProtoVer) RS_UNLIKELY
+	/* Older peers close the connection without answering when they don't
+	 * support the proposed version, report it properly so the caller can
+	 * attempt again with an older version */
+	if(recvRet != 4) RS_UNLIKELY
 	{
-		// TODO: pass peer address
-		// TODO: define proper error condition instead of abusing std::errc
 		rs_error_bubble_or_exit(
-		            std::errc::protocol_error, errbub,
-		            "Peer XXX wire protocol version mismatch got: ",
-		            wireProtoVer, " expected: ", WIRE_PROTO_VERSION );
+		            SharedStateErrors::HANDSHAKE_REFUSED, errbub,
+		            "Peer ", netStats.mPeer, " refused wire protocol version: ",
+		            wireSession.mProtoVersion );
 		co_return false;
 	}
 
-	sendRet = co_await pSocket.send(
-	            reinterpret_cast<const uint8_t*>(&wireProtoVer), 4, errbub );
+	wireProtoVer = ntohl(wireProtoVer);
+	if( wireProtoVer < WIRE_PROTO_VERSION_JSON ||
+	        wireProtoVer > wireSession.mProtoVersion ) RS_UNLIKELY
+	{
+		// TODO: define proper error condition instead of abusing std::errc
+		rs_error_bubble_or_exit(
+		            std::errc::protocol_error, errbub,
+		            "Peer ", netStats.mPeer,
+		            " wire protocol version mismatch got: ", wireProtoVer,
+		            " proposed: ", wireSession.mProtoVersion );
+		co_return false;
+	}
+	wireSession.mProtoVersion = wireProtoVer;
+
+	if(wireSession.mProtoVersion >= WIRE_PROTO_VERSION_DELTA)
+	{
+		uint64_t netOrderEpoch = 0;
+		recvRet = co_await pSocket.recv(
+		        reinterpret_cast<uint8_t*>(&netOrderEpoch), 8, errbub );
+		if(recvRet == -1) RS_UNLIKELY co_return false;
+		if(recvRet != 8) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::connection_aborted, errbub,
+			            "Peer ", netStats.mPeer,
+			            " closed connection before sending instance epoch" );
+			co_return false;
+		}
+		wireSession.mPeerEpoch = be64toh(netOrderEpoch);
+	}
+
+	if(wireSession.mProtoVersion >= WIRE_PROTO_VERSION_FEATURES)
+	{
+		uint32_t netOrderFeatures = 0;
+		recvRet = co_await pSocket.recv(
+		        reinterpret_cast<uint8_t*>(&netOrderFeatures), 4, errbub );
+		if(recvRet == -1) RS_UNLIKELY co_return false;
+		if(recvRet != 4) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::connection_aborted, errbub,
+			            "Peer ", netStats.mPeer,
+			            " closed connection before sending features" );
+			co_return false;
+		}
+		wireSession.mFeatures =
+		        ntohl(netOrderFeatures) & WIRE_FEATURES_SUPPORTED;
+	}
+
+	/* The first request is sent right after the handshake, let the kernel
+	 * hold the confirmation so they go out together */
+	wireProtoVer = htonl(wireProtoVer);
+	uint64_t ownEpoch = htobe64(mInstanceEpoch);
+	uint32_t ownFeatures = htonl(WIRE_FEATURES_SUPPORTED);
+	iovec tIov[3];
+	std::size_t tIovCnt = 0;
+	tIov[tIovCnt++] = { &wireProtoVer, 4 };
+	if(wireSession.mProtoVersion >= WIRE_PROTO_VERSION_DELTA)
+		tIov[tIovCnt++] = { &ownEpoch, 8 };
+	if(wireSession.mProtoVersion >= WIRE_PROTO_VERSION_FEATURES)
+		tIov[tIovCnt++] = { &ownFeatures, 4 };
+
+	std::span<iovec> tBuffers(tIov, tIovCnt);
+	sendRet = co_await pSocket.sendVector(tBuffers, true, errbub);
 	if(sendRet == -1) RS_UNLIKELY co_return false;
 
 	netStats.mRttExt = duration_cast<microseconds>(verETP - verBTP);
@@ -590,6 +1679,259 @@ std::task<bool> SharedState::getCandidatesNeighbours(
 	co_return true;
 }
 
+uint32_t SharedState::proposedWireProtoVersion(const sockaddr_storage& peerAddr)
+{
+	const auto legacyIt = mLegacyPeers.find(
+	            sockaddr_storage_iptostring(peerAddr) );
+	if(legacyIt == mLegacyPeers.end()) RS_LIKELY return mMaxWireProtoVersion;
+
+	if( std::chrono::steady_clock::now() - legacyIt->second >
+	        LEGACY_PEER_REPROBE_INTERVAL )
+	{
+		mLegacyPeers.erase(legacyIt);
+		return mMaxWireProtoVersion;
+	}
+
+	return WIRE_PROTO_VERSION_JSON;
+}
+
+std::task<std::shared_ptr<AsyncSocket>> SharedState::peerConnection(
+        const sockaddr_storage& peerAddr, WireSession& wireSession,
+        NetworkStats& netStats, bool& isReused,
+        std::chrono::steady_clock::time_point deadline,
+        std::error_condition* errbub )
+{
+	const auto poolIt = mConnectionPool.find(peerConnectionKey(peerAddr));
+	if(poolIt != mConnectionPool.end())
+	{
+		auto tSocket = std::move(poolIt->second.mSocket);
+		wireSession = poolIt->second.mWireSession;
+		netStats.mRttExt = poolIt->second.mRttExt;
+		mConnectionPool.erase(poolIt);
+
+		RS_DBG3("Reusing pooled connection to peer: ", peerAddr, " ", *tSocket);
+		tSocket->setDeadline(deadline);
+		isReused = true;
+		co_return tSocket;
+	}
+
+	isReused = false;
+	std::shared_ptr<AsyncSocket> tSocket = co_await ConnectingSocket::connect(
+	            peerAddr, mIoContext, deadline, errbub );
+	if(!tSocket) co_return nullptr;
+
+	wireSession = WireSession();
+	wireSession.mProtoVersion = proposedWireProtoVersion(peerAddr);
+
+	std::error_condition handShakeErr;
+	if(!co_await SharedState::clientHandShake(
+	            *tSocket, wireSession, netStats, &handShakeErr )) RS_UNLIKELY
+	{
+		co_await mIoContext.closeAFD(tSocket);
+
+		if( handShakeErr == SharedStateErrors::HANDSHAKE_REFUSED &&
+		        wireSession.mProtoVersion > WIRE_PROTO_VERSION_JSON )
+		{
+			RS_INFO( "Peer: ", peerAddr, " refused wire protocol version: ",
+			         wireSession.mProtoVersion, " retrying with: ",
+			         WIRE_PROTO_VERSION_JSON );
+			mLegacyPeers[sockaddr_storage_iptostring(peerAddr)] =
+			        std::chrono::steady_clock::now();
+			co_return co_await peerConnection(
+			            peerAddr, wireSession, netStats, isReused, deadline,
+			            errbub );
+		}
+
+		rs_error_bubble_or_exit(
+		            handShakeErr, errbub,
+		            "Handshake with peer: ", peerAddr, " failed" );
+		co_return nullptr;
+	}
+
+	co_return tSocket;
+}
+
+std::task<bool> SharedState::releasePeerConnection(
+        const sockaddr_storage& peerAddr, std::shared_ptr<AsyncSocket> pSocket,
+        const WireSession& wireSession, const NetworkStats& netStats )
+{
+	if(wireSession.mProtoVersion < WIRE_PROTO_VERSION_PERSISTENT)
+		co_return co_await mIoContext.closeAFD(pSocket);
+
+	/* Keep at most one idle connection per peer, if another one got pooled
+	 * meanwhile keep the newest */
+	auto& pooled = mConnectionPool[peerConnectionKey(peerAddr)];
+	auto oldSocket = std::move(pooled.mSocket);
+
+	// Idle pooled connections have nothing to wait for
+	pSocket->setDeadline(AsyncFileDescriptor::NO_DEADLINE);
+
+	pooled.mSocket = std::move(pSocket);
+	pooled.mWireSession = wireSession;
+	pooled.mRttExt = netStats.mRttExt;
+	pooled.mLastUse = std::chrono::steady_clock::now();
+
+	if(oldSocket) co_return co_await mIoContext.closeAFD(oldSocket);
+	co_return true;
+}
+
+std::task<bool> SharedState::closeIdleConnections(std::error_condition* errbub)
+{
+	const auto tNow = std::chrono::steady_clock::now();
+
+	/* Take idle connections out of the pool before closing them, as the pool
+	 * may change while we wait for closing to complete */
+	std::vector<std::shared_ptr<AsyncSocket>> idleSockets;
+	for(auto poolIt = mConnectionPool.begin(); poolIt != mConnectionPool.end();)
+	{
+		if(tNow - poolIt->second.mLastUse > mConnectionIdleTimeout)
+		{
+			RS_DBG3("Closing idle connection to peer: ", poolIt->first);
+			idleSockets.push_back(std::move(poolIt->second.mSocket));
+			poolIt = mConnectionPool.erase(poolIt);
+		}
+		else ++poolIt;
+	}
+
+	bool tSuccess = true;
+	for(auto& idleSocket: idleSockets)
+		tSuccess = co_await mIoContext.closeAFD(idleSocket, errbub) && tSuccess;
+
+	co_return tSuccess;
+}
+
+std::chrono::seconds SharedState::syncTimeout(
+        const std::string& typeName ) const
+{
+	const auto confIt = mTypeConf.find(typeName);
+	if( confIt == mTypeConf.end() ||
+	        confIt->second.mUpdateInterval <= std::chrono::seconds::zero() )
+		return DEFAULT_SYNC_TIMEOUT;
+
+	return std::max(MIN_SYNC_TIMEOUT, confIt->second.mUpdateInterval);
+}
+
+/*static*/ std::string SharedState::peerConnectionKey(
+        const sockaddr_storage& peerAddr )
+{
+	sockaddr_storage tAddr;
+	sockaddr_storage_copy(peerAddr, tAddr);
+	sockaddr_storage_ipv4_to_ipv6(tAddr);
+	return sockaddr_storage_tostring(tAddr);
+}
+
+/*static*/ std::string SharedState::peerSyncCursorKey(
+        const sockaddr_storage& peerAddr )
+{
+	/* Same peer may show up as IPv4 or IPv4 mapped IPv6 depending on the
+	 * socket, and with a random source port when connecting to us */
+	sockaddr_storage tAddr;
+	sockaddr_storage_copy(peerAddr, tAddr);
+	sockaddr_storage_ipv4_to_ipv6(tAddr);
+	return sockaddr_storage_iptostring(tAddr);
+}
+
+/*static*/ uint64_t SharedState::generateInstanceEpoch()
+{
+	std::random_device tRandom;
+	std::uniform_int_distribution<uint64_t> tDist(
+	            1, std::numeric_limits<uint64_t>::max() );
+	return tDist(tRandom);
+}
+
+uint64_t SharedState::typeChangeSeq(const std::string& dataTypeName) const
+{
+	const auto seqIt = mStatesChangeSeq.find(dataTypeName);
+	return seqIt == mStatesChangeSeq.end() ? 0 : seqIt->second;
+}
+
+uint64_t SharedState::deliveredChangeSeq(
+        const sockaddr_storage& peerAddr, const WireSession& wireSession,
+        const std::string& dataTypeName )
+{
+	const auto tCursor = peerSyncCursor(peerAddr, wireSession);
+	if(!tCursor) return 0;
+
+	const auto seqIt = tCursor->mDeliveredChangeSeq.find(dataTypeName);
+	if(seqIt == tCursor->mDeliveredChangeSeq.end()) return 0;
+
+	/* Our own change sequence restart from zero only if the data type got
+	 * unregistered and registered again, don't trust the cursor then */
+	if(seqIt->second > typeChangeSeq(dataTypeName)) RS_UNLIKELY return 0;
+
+	return seqIt->second;
+}
+
+void SharedState::setDeliveredChangeSeq(
+        const sockaddr_storage& peerAddr, const WireSession& wireSession,
+        const std::string& dataTypeName, uint64_t changeSeq )
+{
+	const auto tCursor = touchPeerSyncCursor(peerAddr, wireSession);
+	if(!tCursor) return;
+
+	/* Concurrent synchronizations with the same peer may complete out of
+	 * order, never move the cursor backward */
+	auto& tSeq = tCursor->mDeliveredChangeSeq[dataTypeName];
+	tSeq = std::max(tSeq, changeSeq);
+}
+
+SharedState::PeerSyncCursor* SharedState::peerSyncCursor(
+        const sockaddr_storage& peerAddr, const WireSession& wireSession )
+{
+	if(!wireSession.mPeerEpoch) return nullptr;
+
+	const auto cursorIt = mPeerSyncCursors.find(peerSyncCursorKey(peerAddr));
+	if( cursorIt == mPeerSyncCursors.end() ||
+	        cursorIt->second.mPeerEpoch != wireSession.mPeerEpoch )
+		return nullptr;
+
+	return &cursorIt->second;
+}
+
+SharedState::PeerSyncCursor* SharedState::touchPeerSyncCursor(
+        const sockaddr_storage& peerAddr, const WireSession& wireSession )
+{
+	if(!wireSession.mPeerEpoch) return nullptr;
+
+	using namespace std::chrono;
+	const auto tNow = steady_clock::now();
+
+	std::erase_if(mPeerSyncCursors, [&](const auto& item)
+	{ return tNow - item.second.mLastUpdate > PEER_SYNC_CURSOR_MAX_AGE; });
+
+	auto& tCursor = mPeerSyncCursors[peerSyncCursorKey(peerAddr)];
+	if(tCursor.mPeerEpoch != wireSession.mPeerEpoch)
+	{
+		RS_DBG2( "Peer: ", peerAddr, " new instance epoch: ",
+		         wireSession.mPeerEpoch, " forget previous sync cursors" );
+		tCursor.mPeerEpoch = wireSession.mPeerEpoch;
+		tCursor.mDeliveredChangeSeq.clear();
+		tCursor.mDeliveredDictionary.clear();
+	}
+
+	tCursor.mLastUpdate = tNow;
+	return &tCursor;
+}
+
+void SharedState::skipMergedChanges(
+        const sockaddr_storage& peerAddr, const WireSession& wireSession,
+        const std::string& dataTypeName,
+        uint64_t preMergeChangeSeq, uint64_t postMergeChangeSeq,
+        uint64_t mergedChangeSeqs )
+{
+	if(postMergeChangeSeq == preMergeChangeSeq) return;
+
+	/* Entries merged meanwhile from other peers, or local ones, got change
+	 * sequence numbers in the same range, but were never sent to this peer */
+	if(postMergeChangeSeq - preMergeChangeSeq != mergedChangeSeqs) return;
+
+	if( deliveredChangeSeq(peerAddr, wireSession, dataTypeName) !=
+	        preMergeChangeSeq ) return;
+
+	setDeliveredChangeSeq(
+	            peerAddr, wireSession, dataTypeName, postMergeChangeSeq );
+}
+
 /*static*/ bool SharedState::collectStat(
         NetworkStats& netStat,
         std::error_condition* errbub )
@@ -657,295 +1999,1227 @@ std::task<bool> SharedState::getCandidatesNeighbours(
 			peerStats.pop_front();
 	}
 
-	std::ofstream statsFileWriteStream(
-	            statPath, std::ios::out | std::ios::trunc );
-	if(statsFileWriteStream.is_open())
+	std::ofstream statsFileWriteStream(
+	            statPath, std::ios::out | std::ios::trunc );
+	if(statsFileWriteStream.is_open())
+	{
+		RsGenericSerializer::SerializeJob j(RsGenericSerializer::TO_JSON);
+		RsGenericSerializer::SerializeContext ctx;
+		RS_SERIAL_PROCESS(stats);
+		if(ctx.mOk) statsFileWriteStream << ctx.mJson << std::endl;
+		statsFileWriteStream.close();
+	}
+	else rs_error_bubble_or_exit(std::errc::io_error, errbub, statPath);
+
+#ifdef SHARED_STATE_STAT_FILE_LOCKING
+	flockRet = flock(openRet, LOCK_UN);
+	if(flockRet == -1) RS_UNLIKELY
+	{
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), errbub,
+		            "Failure releasing lock on network statistics file: ",
+		            statPath );
+		return false;
+	}
+	if(close(openRet) == -1)
+	{
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), errbub,
+		            "Failure closing network statistics file: ",
+		            statPath );
+		return false;
+	}
+#endif // def SHARED_STATE_STAT_FILE_LOCKING
+
+	return true;
+}
+
+bool SharedState::registerDataType(
+        const std::string& typeName, const std::string& typeScope,
+        std::chrono::seconds updateInterval, std::chrono::seconds TTL,
+        uint64_t maxMessageSize, std::error_condition* errbub )
+{
+	if(typeName.empty())
+	{
+		rs_error_bubble_or_exit(
+		            std::errc::invalid_argument, errbub,
+		            "empty type name" );
+		return false;
+	}
+
+	if(typeName.size() > DATA_TYPE_NAME_MAX_LENGHT)
+	{
+		rs_error_bubble_or_exit(
+		            std::errc::invalid_argument, errbub,
+		            "type name too long" );
+		return false;
+	}
+
+
+	const std::string tConfigPath(
+	            std::string(SHARED_STATE_CONFIG_DIR) +
+	            std::string(SHARED_STATE_CONFIG_FILE_NAME) );
+
+	std::error_condition loadErr;
+	if(!loadRegisteredTypes(&loadErr))
+	{
+		RS_INFO( "Config file: ", tConfigPath,
+		         " corrupted or non-existent, creating a new one" );
+
+		namespace fs = std::filesystem;
+		const fs::path confPath(SHARED_STATE_CONFIG_DIR);
+		std::error_code confDirErr;
+		fs::create_directory(confPath, confDirErr);
+		if(confDirErr)
+		{
+			rs_error_bubble_or_exit(
+			            confDirErr.default_error_condition(), errbub,
+			            "Failure creating config directory" );
+			return false;
+		}
+	}
+
+	auto&& tConf = mTypeConf[typeName];
+	tConf.mName = typeName;
+	tConf.mBleachTTL = TTL;
+	tConf.mScope = typeScope;
+	tConf.mUpdateInterval = updateInterval;
+	tConf.mMaxMessageSize = maxMessageSize;
+	// TODO: use inizializer list costructor
+
+	RsGenericSerializer::SerializeJob j(RsGenericSerializer::TO_JSON);
+	RsGenericSerializer::SerializeContext ctx;
+	RS_SERIAL_PROCESS(mTypeConf);
+
+	std::ofstream confFileWriteStream(
+	            tConfigPath, std::ios::out | std::ios::trunc );
+	if(!confFileWriteStream.is_open())
+	{
+		RS_ERR("Failure opening config file:", tConfigPath, " for writing");
+		rs_error_bubble_or_exit(std::errc::io_error, errbub);
+		return false;
+	}
+	confFileWriteStream << ctx.mJson << std::endl;
+
+	return ctx.mOk;
+}
+
+
+bool SharedState::loadRegisteredTypes(std::error_condition* errbub)
+{
+	const std::string tConfigPath(
+	            std::string(SHARED_STATE_CONFIG_DIR) +
+	            std::string(SHARED_STATE_CONFIG_FILE_NAME) );
+
+	std::ifstream confFileReadStream(tConfigPath);
+	if(!confFileReadStream.is_open())
+	{
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), errbub,
+		            "Failure opening config file for reading: ", tConfigPath );
+		return false;
+	}
+	rapidjson::IStreamWrapper jStream(confFileReadStream);
+
+	RsGenericSerializer::SerializeJob j(RsGenericSerializer::FROM_JSON);
+	RsGenericSerializer::SerializeContext ctx;
+	ctx.mJson.ParseStream(jStream);
+
+	if(ctx.mJson.HasParseError())
+	{
+		rs_error_bubble_or_exit(
+		            rs_errno_to_condition(errno), errbub,
+		            "Corrupted type config file:", tConfigPath );
+		return false;
+	}
+
+	/* RsTypeSerializer print an error message and then clear the map if it is
+	 * not empty before FROM_JSON, so let's do it and avoid the error message
+	 * @see https://github.com/libremesh/lime-packages/issues/1081 */
+	mTypeConf.clear();
+	RS_SERIAL_PROCESS(mTypeConf);
+
+	// Create empty states for new types, do nothing if already presents
+	for(auto&& [typeName, _]: mTypeConf) mStates[typeName];
+
+	// Remove states for types that are not registered anymore
+	for(auto sIt = mStates.begin(); sIt != mStates.end();)
+		if(mTypeConf.find(sIt->first) == mTypeConf.end())
+		{
+			mExpiryQueues.erase(sIt->first);
+			mTypeDictionaries.erase(sIt->first);
+			sIt = mStates.erase(sIt);
+		}
+		else ++sIt;
+
+	return ctx.mOk;
+}
+
+void SharedState::StateEntry::serial_process(
+        RsGenericSerializer::SerializeJob j,
+        RsGenericSerializer::SerializeContext& ctx)
+{
+	RS_SERIAL_PROCESS(mAuthor);
+
+	using namespace std::chrono;
+	const auto tNow = steady_clock::now();
+	seconds::rep tTtl = ttl(tNow).count();
+	RsTypeSerializer::serial_process(j, ctx, tTtl, "mTtl");
+	if( j == RsGenericSerializer::FROM_JSON ||
+	        j == RsGenericSerializer::DESERIALIZE )
+		setTtl(seconds(tTtl), tNow);
+
+	RS_SERIAL_PROCESS(mData);
+}
+
+
+const std::vector<uint8_t>& SharedState::StateEntry::encodedData() const
+{
+	if(mEncodedData.empty()) BinaryWriter(mEncodedData).writeJson(mData);
+	return mEncodedData;
+}
+
+bool SharedState::StateEntry::decodeData(std::span<const uint8_t> encodedData)
+{
+	mEncodedData.clear();
+
+	BinaryReader dataReader(encodedData.data(), encodedData.size());
+	if( !dataReader.readJson(mData, mData.GetAllocator()) ||
+	        dataReader.remaining() ) RS_UNLIKELY return false;
+
+	/* Received encoding is exactly what we would produce, keep it so
+	 * forwarding the entry to other peers costs just a copy */
+	mEncodedData.assign(encodedData.begin(), encodedData.end());
+	return true;
+}
+
+/*static*/ const sockaddr_storage& SharedState::localInstanceAddr()
+{
+	static sockaddr_storage lAddr{};
+	static bool mInitialized = false;
+	if(!mInitialized)
+	{
+		sockaddr_storage_ipv4_aton(lAddr, "127.0.0.1");
+		sockaddr_storage_setport(lAddr, TCP_PORT);
+		mInitialized = true;
+	}
+
+	return lAddr;
+}
+
+bool SharedState::setupMergeSession(
+        MergeSession& mergeSession, const std::string& dataTypeName,
+        const sockaddr_storage& peerAddr, std::error_condition* errbub )
+{
+	if(!bindMergeSession(mergeSession, dataTypeName, errbub)) return false;
+
+	mergeSession.mOwnAuthor = authorPlaceOlder();
+	mergeSession.mIsRemote = !sockaddr_storage_isLoopbackNet(peerAddr);
+	sockaddr_storage_copy(peerAddr, mergeSession.mPeerAddr);
+	mergeSession.mNow = std::chrono::steady_clock::now();
+	return true;
+}
+
+bool SharedState::bindMergeSession(
+        MergeSession& mergeSession, const std::string& dataTypeName,
+        std::error_condition* errbub )
+{
+	const auto statesIt = mStates.find(dataTypeName);
+	if(statesIt == mStates.end())
+	{
+		rs_error_bubble_or_exit( SharedStateErrors::UNKOWN_DATA_TYPE, errbub,
+		                         dataTypeName );
+		return false;
+	}
+
+	mergeSession.mState = &statesIt->second;
+	mergeSession.mChangeSeq = &mStatesChangeSeq[dataTypeName];
+	mergeSession.mExpiryQueue = &mExpiryQueues[dataTypeName];
+	return true;
+}
+
+bool SharedState::mergeEntry(
+        MergeSession& ms, const StateKey& stateKey,
+        const IncomingEntry& sliceEntry )
+{
+	if(sliceEntry.mExpiry <= ms.mNow) RS_UNLIKELY return true;
+
+	auto& tState = *ms.mState;
+
+	/* Decode into a temporary entry, so on invalid data the state is left
+	 * untouched */
+	const auto decodeSliceEntry = [&](StateEntry& tEntry)
+	{
+		if(sliceEntry.mDecodedOwned)
+		{
+			tEntry.mData.Swap(sliceEntry.mDecodedOwned->mData);
+			tEntry.mEncodedData.swap(sliceEntry.mDecodedOwned->mEncodedData);
+			return true;
+		}
+		if(sliceEntry.mDecoded)
+		{
+			tEntry.mData.CopyFrom(
+			            sliceEntry.mDecoded->mData, tEntry.mData.GetAllocator() );
+			tEntry.mEncodedData = sliceEntry.mDecoded->mEncodedData;
+			return true;
+		}
+		return tEntry.decodeData(sliceEntry.mEncodedData);
+	};
+
+	const auto knownEntryIt = tState.find(stateKey);
+	if(knownEntryIt == tState.end()) RS_UNLIKELY
+	{
+		StateEntry tEntry;
+		if(!decodeSliceEntry(tEntry)) RS_UNLIKELY return false;
+
+		auto& newEntry = tState.emplace(stateKey, StateEntry()).first->second;
+		newEntry.mData.Swap(tEntry.mData);
+		newEntry.mEncodedData.swap(tEntry.mEncodedData);
+		newEntry.mAuthor = sliceEntry.mAuthor;
+		newEntry.mExpiry = sliceEntry.mExpiry;
+		newEntry.mChangeSeq = ++*ms.mChangeSeq;
+		++ms.mAssignedChangeSeqs;
+		ms.mExpiryQueue->emplace(newEntry.mExpiry, stateKey);
+		++ms.mSignificantChanges; ++ms.mAllChanges;
+		RS_DBG4("Inserted new entry with key: ", stateKey);
+		return true;
+	}
+	auto& knownEntry = knownEntryIt->second;
+	const bool ownAuthorship = knownEntry.mAuthor == ms.mOwnAuthor;
+
+	/* When receiving data authored by this node from remote nodes with
+	 * higher TTL then our own, something fishy is happening.
+	 * Ignore the remote entry and print a warning.
+	 * Instead when the data is received from the CLI if some own authored
+	 * record have higher TTL its normal and overwriting is accepted.
+	 * TTLs travel rounded down to seconds, while network latency adds up
+	 * on top, so allow one second tolerance before complaining */
+	if( ms.mIsRemote && ownAuthorship &&
+	        sliceEntry.mExpiry >
+	        knownEntry.mExpiry + std::chrono::seconds(1) ) RS_UNLIKELY
+	{
+		RS_WARN( "Discarding received known entry: ", stateKey, " ",
+		         "authored by this node with higher TTL from remote peer: ",
+		         ms.mPeerAddr, " is remote peer ill?" );
+		return true;
+	}
+
+	// Losing entries are discarded without even looking at their data
+	if(sliceEntry.mExpiry < knownEntry.mExpiry) return true;
+
+	/* Encoding is deterministic, so comparing it is equivalent to comparing
+	 * data, without having to decode it */
+	const auto& knownData = knownEntry.encodedData();
+	const auto& sliceData = sliceEntry.mDecoded ?
+	            std::span<const uint8_t>(sliceEntry.mDecoded->encodedData()) :
+	            sliceEntry.mEncodedData;
+	const bool significant = !std::equal(
+	            knownData.begin(), knownData.end(),
+	            sliceData.begin(), sliceData.end() );
+	const bool sameAuthor = knownEntry.mAuthor == sliceEntry.mAuthor;
+
+	/* Same entry we already have, usually echoed back by a peer or
+	 * received from another one with slightly different timing, just
+	 * extend the expiry without marking it as a new change, otherwise it
+	 * would bounce around the mesh forever */
+	if( !significant && sameAuthor &&
+	        sliceEntry.mExpiry - knownEntry.mExpiry <
+	        MIN_PROPAGATED_TTL_INCREASE )
+	{
+		if(sliceEntry.mExpiry > knownEntry.mExpiry)
+		{
+			knownEntry.mExpiry = sliceEntry.mExpiry;
+			ms.mExpiryQueue->emplace(knownEntry.mExpiry, stateKey);
+		}
+		return true;
+	}
+
+	RS_DBG4( "Updating entry with key: ", stateKey, " TTL: ",
+	         std::chrono::duration_cast<std::chrono::seconds>(
+	             sliceEntry.mExpiry - ms.mNow ),
+	         " > ", knownEntry.ttl(ms.mNow),
+	         " significant: ", significant? "true" : "false" );
+
+	if(significant)
+	{
+		StateEntry tEntry;
+		if(!decodeSliceEntry(tEntry)) RS_UNLIKELY return false;
+
+		/* Swapping let the old data memory be released with tEntry, while
+		 * assigning in place would keep growing the allocator pool */
+		knownEntry.mData.Swap(tEntry.mData);
+		knownEntry.mEncodedData.swap(tEntry.mEncodedData);
+		++ms.mSignificantChanges;
+	}
+	++ms.mAllChanges;
+
+	knownEntry.mAuthor = sliceEntry.mAuthor;
+	knownEntry.mExpiry = sliceEntry.mExpiry;
+	knownEntry.mChangeSeq = ++*ms.mChangeSeq;
+	++ms.mAssignedChangeSeqs;
+	ms.mExpiryQueue->emplace(knownEntry.mExpiry, stateKey);
+	return true;
+}
+
+std::task<ssize_t> SharedState::merge(
+        const std::string& dataTypeName,
+        const std::map<StateKey, StateEntry>& stateSlice,
+        const sockaddr_storage& peerAddr,
+        std::error_condition* errbub )
+{
+	constexpr ssize_t rFAILURE = -1;
+
+	RS_DBG3(dataTypeName, " slice size: ", stateSlice.size());
+
+	MergeSession mergeSession;
+	if(!setupMergeSession(mergeSession, dataTypeName, peerAddr, errbub))
+		co_return rFAILURE;
+
+	mergeStateSlice(mergeSession, stateSlice);
+
+#if RS_DEBUG_LEVEL > 1
+	RS_DBG( dataTypeName, " got ", mergeSession.mSignificantChanges,
+	        " significative changes out of ", mergeSession.mAllChanges,
+	        " input slice size: ", stateSlice.size(),
+	        " state size: ", mergeSession.mState->size() );
+#endif
+	co_return mergeSession.mSignificantChanges;
+}
+
+void SharedState::mergeStateSlice(
+        MergeSession& mergeSession,
+        const std::map<StateKey, StateEntry>& stateSlice )
+{
+	for(auto&& [stateKey, sliceEntry]: stateSlice)
+	{
+		IncomingEntry tIncoming;
+		tIncoming.mAuthor = sliceEntry.mAuthor;
+		tIncoming.mExpiry = sliceEntry.mExpiry;
+		tIncoming.mDecoded = &sliceEntry;
+		mergeEntry(mergeSession, stateKey, tIncoming);
+	}
+}
+
+std::task<ssize_t> SharedState::mergeNetworkMessage(
+        const NetworkMessage& networkMessage, uint32_t wireProtoVersion,
+        MergeSession& mergeSession,
+        std::vector<uint32_t>* digestReplyBuckets, uint32_t digestBucketsNum,
+        std::error_condition* errbub )
+{
+	constexpr ssize_t rFAILURE = -1;
+
+	if(!bindMergeSession(mergeSession, networkMessage.mTypeName, errbub))
+		RS_UNLIKELY co_return rFAILURE;
+
+	if(wireProtoVersion < WIRE_PROTO_VERSION_BINARY)
+	{
+		std::map<StateKey, StateEntry> tSlice;
+		if(!networkMessage.toStateSlice(tSlice, wireProtoVersion, errbub))
+			RS_UNLIKELY co_return rFAILURE;
+		mergeStateSlice(mergeSession, tSlice);
+		co_return mergeSession.mSignificantChanges;
+	}
+
+	uint8_t expectedFormat = digestReplyBuckets ?
+	            BINARY_DIGEST_REPLY_FORMAT : BINARY_SLICE_FORMAT;
+	if(!mergeBinaryFrame(
+	            mergeSession, networkMessage,
+	            wireProtoVersion >= WIRE_PROTO_VERSION_CHUNKED, expectedFormat,
+	            digestReplyBuckets, digestBucketsNum, errbub )) RS_UNLIKELY
+	    co_return rFAILURE;
+
+	co_return mergeSession.mSignificantChanges;
+}
+
+bool SharedState::mergeBinaryFrame(
+        MergeSession& mergeSession, const NetworkMessage& frame,
+        bool isChunked, uint8_t& expectedFormat,
+        std::vector<uint32_t>* digestReplyBuckets, uint32_t digestBucketsNum,
+        std::error_condition* errbub )
+{
+	BinaryReader tReader(frame.mData.data(), frame.mData.size());
+
+	const auto invalidSliceError = [&]()
+	{
+		rs_error_bubble_or_exit(
+		            std::errc::bad_message, errbub,
+		            "Got invalid binary state slice of type: ",
+		            frame.mTypeName,
+		            " merged: ", mergeSession.mAllChanges, " changes before "
+		            "the error" );
+		return false;
+	};
+
+	/* Frames might be merged while receiving a long message, so TTLs must be
+	 * relative to the frame arrival not to the begin of the session */
+	mergeSession.mNow = std::chrono::steady_clock::now();
+
+	/* Since WIRE_PROTO_VERSION_CHUNKED data is a concatenation of slices, one
+	 * per frame, only the first one can be a digest reply */
+	StateKey tKey;
+	uint64_t numEntries = 0;
+	do
+	{
+		uint8_t tFormat = 0;
+		tReader.readUint8(tFormat);
+		if(tFormat != expectedFormat) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::bad_message, errbub,
+			            "Got unexpected message format: ",
+			            static_cast<int>(tFormat),
+			            " of type: ", frame.mTypeName );
+			return false;
+		}
+
+		if( tFormat == BINARY_DIGEST_REPLY_FORMAT &&
+		        !frame.readDigestReplyBuckets(
+		            tReader, *digestReplyBuckets, digestBucketsNum, errbub ) )
+			RS_UNLIKELY return false;
+		expectedFormat = BINARY_SLICE_FORMAT;
+
+		/* Entries are merged as they are decoded, an invalid entry stops the
+		 * merge, but entries already merged before it are kept, as each of
+		 * them has been validated on its own */
+		const bool tValid = mIsStateShared ?
+		            mergeSliceUnlocked(
+		                mergeSession, frame, tReader, numEntries, errbub ) :
+		            frame.visitSliceEntries(
+		            tReader,
+		            [&]( std::string_view key, std::string_view author,
+		                 std::chrono::seconds ttl,
+		                 std::span<const uint8_t> encodedData )
+		{
+			++numEntries;
+			tKey.assign(key);
+
+			IncomingEntry tIncoming;
+			tIncoming.mAuthor = author;
+			tIncoming.mExpiry = mergeSession.mNow + ttl;
+			tIncoming.mEncodedData = encodedData;
+			return mergeEntry(mergeSession, tKey, tIncoming);
+		}, errbub );
+		if(!tValid) RS_UNLIKELY return invalidSliceError();
+	}
+	while(isChunked && tReader.remaining());
+
+	if(tReader.remaining()) RS_UNLIKELY return invalidSliceError();
+
+#if RS_DEBUG_LEVEL > 1
+	RS_DBG( frame.mTypeName, " got ", mergeSession.mSignificantChanges,
+	        " significative changes out of ", mergeSession.mAllChanges,
+	        " frame entries: ", numEntries,
+	        " state size: ", mergeSession.mState->size() );
+#endif
+	return true;
+}
+
+std::unique_lock<std::mutex>* SharedState::heldStateLock()
+{
+	const auto tRunLock = IOContext::threadRunLock();
+	const bool isStateLock =
+	        tRunLock && tRunLock->mutex() == &mStateLock;
+	if(isStateLock && tRunLock->owns_lock()) return tRunLock;
+
+#ifndef NDEBUG
+	/* Already released by an outer StateUnlock or RunUnlock is fine, but out
+	 * of IOContext::run() with the state lock nobody owns the state */
+	if(mIsStateShared && !isStateLock) RS_UNLIKELY
+	{
+		RS_FATAL( "Shared state touched out of a run() holding its lock, ",
+		          "report to developers!" );
+		print_stacktrace();
+		exit(static_cast<int>(std::errc::state_not_recoverable));
+	}
+#endif
+
+	return nullptr;
+}
+
+bool SharedState::mergeSliceUnlocked(
+        MergeSession& mergeSession, const NetworkMessage& frame,
+        BinaryReader& reader, uint64_t& numEntries,
+        std::error_condition* errbub )
+{
+	struct DecodedEntry
+	{
+		StateKey mKey;
+		std::string_view mAuthor;
+		std::chrono::seconds mTtl;
+		StateEntry mEntry;
+	};
+
+	/* Frame data belongs to the receiving coroutine, so views into it stay
+	 * valid while unlocked. A deque doesn't copy entries while growing */
+	std::deque<DecodedEntry> tDecoded;
+	bool tValid = false;
+	{
+		StateUnlock tUnlock(*this);
+		tValid = frame.visitSliceEntries(
+		            reader,
+		            [&]( std::string_view key, std::string_view author,
+		                 std::chrono::seconds ttl,
+		                 std::span<const uint8_t> encodedData )
+		{
+			auto& tEntry = tDecoded.emplace_back();
+			tEntry.mKey.assign(key);
+			tEntry.mAuthor = author;
+			tEntry.mTtl = ttl;
+			return tEntry.mEntry.decodeData(encodedData);
+		}, errbub );
+	}
+
+	/* Same as merging while decoding, entries preceding an invalid one are
+	 * merged anyway */
+	if(!tValid && !tDecoded.empty()) tDecoded.pop_back();
+
+	if(!bindMergeSession(mergeSession, frame.mTypeName, errbub)) RS_UNLIKELY
+	        return false;
+
+	for(auto& tEntry: tDecoded)
+	{
+		++numEntries;
+		IncomingEntry tIncoming;
+		tIncoming.mAuthor = tEntry.mAuthor;
+		tIncoming.mExpiry = mergeSession.mNow + tEntry.mTtl;
+		tIncoming.mDecoded = &tEntry.mEntry;
+		tIncoming.mDecodedOwned = &tEntry.mEntry;
+		mergeEntry(mergeSession, tEntry.mKey, tIncoming);
+	}
+
+	return tValid;
+}
+
+
+void SharedState::NetworkMessage::fromStateSlice(
+        std::map<StateKey, StateEntry>& stateSlice, uint32_t wireProtoVersion,
+        uint64_t sinceChangeSeq )
+{
+	/* !!Keep stateSlice paramather name the same as in toStateSlice */
+
+	if(wireProtoVersion < WIRE_PROTO_VERSION_BINARY)
+	{
+		RsGenericSerializer::SerializeJob j(RsGenericSerializer::TO_JSON);
+		RsGenericSerializer::SerializeContext ctx;
+		RS_SERIAL_PROCESS(stateSlice);
+
+		std::stringstream ss;
+		ss << ctx.mJson;
+		mData.assign(ss.view().begin(), ss.view().end());
+		return;
+	}
+
+	if(wireProtoVersion < WIRE_PROTO_VERSION_DELTA) sinceChangeSeq = 0;
+
+	mData.clear();
+	BinaryWriter tWriter(mData);
+	tWriter.writeUint8(BINARY_SLICE_FORMAT);
+	writeSliceEntries(
+	            tWriter, stateSlice,
+	            [=](const StateKey&, const StateEntry& stateEntry)
+	{ return !sinceChangeSeq || stateEntry.mChangeSeq > sinceChangeSeq; });
+}
+
+template<typename Filter>
+/*static*/ void SharedState::NetworkMessage::writeSliceEntries(
+        BinaryWriter& writer,
+        const std::map<StateKey, StateEntry>& stateSlice,
+        const Filter& filter )
+{
+	writer.writeVarint(
+	            std::count_if(
+	                stateSlice.begin(), stateSlice.end(),
+	                [&](const auto& item)
+	{ return filter(item.first, item.second); }) );
+
+	/* Usually there are way less authors then entries, so send each author
+	 * only once per message and then refer to it by index */
+	std::map<std::string_view, uint64_t> authorsDict;
+	const auto tNow = std::chrono::steady_clock::now();
+	for(auto&& [key, stateEntry]: stateSlice)
+		if(filter(key, stateEntry))
+			writeSliceEntry(writer, key, stateEntry, authorsDict, tNow);
+}
+
+/*static*/ void SharedState::NetworkMessage::writeSliceEntry(
+        BinaryWriter& writer, const StateKey& key,
+        const StateEntry& stateEntry,
+        std::map<std::string_view, uint64_t>& authorsDict,
+        std::chrono::steady_clock::time_point now )
+{
+	writer.writeString(key);
+
+	const auto authorsDictSize = authorsDict.size();
+	auto [authorIt, newAuthor] = authorsDict.emplace(
+	            stateEntry.mAuthor, authorsDictSize + 1 );
+	if(newAuthor)
+	{
+		writer.writeVarint(0);
+		writer.writeString(stateEntry.mAuthor);
+	}
+	else writer.writeVarint(authorIt->second);
+
+	writer.writeVarint(stateEntry.ttl(now).count());
+
+	const auto& encodedData = stateEntry.encodedData();
+	writer.writeVarint(encodedData.size());
+	writer.writeBytes(encodedData.data(), encodedData.size());
+}
+
+bool SharedState::NetworkMessage::fromStateSliceChunk(
+        const std::map<StateKey, StateEntry>& stateSlice,
+        const std::function<bool(const StateKey&, const StateEntry&)>& filter,
+        std::optional<StateKey>& lastKey, std::size_t maxSize,
+        uint64_t* numEntries )
+{
+	/* Entries count must preceed entries, write them apart and then
+	 * assemble the slice */
+	std::vector<uint8_t> tEntries;
+	BinaryWriter tEntriesWriter(tEntries);
+	std::map<std::string_view, uint64_t> authorsDict;
+	const auto tNow = std::chrono::steady_clock::now();
+
+	uint64_t tNumEntries = 0;
+	auto sIt = lastKey ?
+	            stateSlice.upper_bound(*lastKey) : stateSlice.begin();
+	for(; sIt != stateSlice.end() && tEntries.size() < maxSize; ++sIt)
+	{
+		lastKey = sIt->first;
+		if(filter && !filter(sIt->first, sIt->second)) continue;
+
+		writeSliceEntry(
+		            tEntriesWriter, sIt->first, sIt->second, authorsDict, tNow );
+		++tNumEntries;
+	}
+
+	mData.clear();
+	mData.reserve(1 + BinaryWriter::varintSize(tNumEntries) + tEntries.size());
+	BinaryWriter tWriter(mData);
+	tWriter.writeUint8(BINARY_SLICE_FORMAT);
+	tWriter.writeVarint(tNumEntries);
+	tWriter.writeBytes(tEntries.data(), tEntries.size());
+
+	if(numEntries) *numEntries = tNumEntries;
+
+	return sIt != stateSlice.end();
+}
+
+bool SharedState::NetworkMessage::toStateSlice(
+        std::map<StateKey, StateEntry>& stateSlice, uint32_t wireProtoVersion,
+        std::error_condition* errbub ) const
+{
+	/* !! Keep stateSlice paramather name the same as in fromStateSlice */
+
+	if(wireProtoVersion < WIRE_PROTO_VERSION_BINARY)
 	{
-		RsGenericSerializer::SerializeJob j(RsGenericSerializer::TO_JSON);
+		RsGenericSerializer::SerializeJob j(RsGenericSerializer::FROM_JSON);
 		RsGenericSerializer::SerializeContext ctx;
-		RS_SERIAL_PROCESS(stats);
-		if(ctx.mOk) statsFileWriteStream << ctx.mJson << std::endl;
-		statsFileWriteStream.close();
+		ctx.mJson.Parse(
+		            reinterpret_cast<const char*>(mData.data()),
+		            mData.size() );
+		RS_DBG4(ctx.mJson);
+		if(ctx.mJson.HasParseError()) RS_UNLIKELY
+		{
+			rs_error_bubble_or_exit(
+			            std::errc::bad_message, errbub,
+			            "Got invalid JSON state slice of type: ", mTypeName );
+			return false;
+		}
+		RS_SERIAL_PROCESS(stateSlice);
+		return true;
 	}
-	else rs_error_bubble_or_exit(std::errc::io_error, errbub, statPath);
 
-#ifdef SHARED_STATE_STAT_FILE_LOCKING
-	flockRet = flock(openRet, LOCK_UN);
-	if(flockRet == -1) RS_UNLIKELY
+	BinaryReader tReader(mData.data(), mData.size());
+
+	uint8_t tFormat = 0;
+	if(!tReader.readUint8(tFormat) || tFormat != BINARY_SLICE_FORMAT) RS_UNLIKELY
 	{
 		rs_error_bubble_or_exit(
-		            rs_errno_to_condition(errno), errbub,
-		            "Failure releasing lock on network statistics file: ",
-		            statPath );
+		            std::errc::bad_message, errbub,
+		            "Got invalid binary state slice of type: ", mTypeName,
+		            " header" );
 		return false;
 	}
-	if(close(openRet) == -1)
+
+	if(!readSliceEntries(tReader, stateSlice, errbub)) RS_UNLIKELY return false;
+
+	if(tReader.remaining()) RS_UNLIKELY
 	{
 		rs_error_bubble_or_exit(
-		            rs_errno_to_condition(errno), errbub,
-		            "Failure closing network statistics file: ",
-		            statPath );
+		            std::errc::bad_message, errbub,
+		            "Got invalid binary state slice of type: ", mTypeName,
+		            " trailing data" );
 		return false;
 	}
-#endif // def SHARED_STATE_STAT_FILE_LOCKING
 
 	return true;
 }
 
-bool SharedState::registerDataType(
-        const std::string& typeName, const std::string& typeScope,
-        std::chrono::seconds updateInterval, std::chrono::seconds TTL,
-        std::error_condition* errbub )
+template<typename Visitor>
+bool SharedState::NetworkMessage::visitSliceEntries(
+        BinaryReader& reader, const Visitor& visitor,
+        std::error_condition* errbub ) const
 {
-	if(typeName.empty())
-	{
-		rs_error_bubble_or_exit(
-		            std::errc::invalid_argument, errbub,
-		            "empty type name" );
-		return false;
-	}
-
-	if(typeName.size() > DATA_TYPE_NAME_MAX_LENGHT)
+	const auto invalidSliceError = [&](const char* what)
 	{
 		rs_error_bubble_or_exit(
-		            std::errc::invalid_argument, errbub,
-		            "type name too long" );
+		            std::errc::bad_message, errbub,
+		            "Got invalid binary state slice of type: ", mTypeName,
+		            " ", what );
 		return false;
-	}
-
+	};
 
-	const std::string tConfigPath(
-	            std::string(SHARED_STATE_CONFIG_DIR) +
-	            std::string(SHARED_STATE_CONFIG_FILE_NAME) );
+	uint64_t numEntries = 0;
+	if(!reader.readVarint(numEntries)) RS_UNLIKELY
+	        return invalidSliceError("entries count");
 
-	std::error_condition loadErr;
-	if(!loadRegisteredTypes(&loadErr))
+	std::vector<std::string_view> authorsDict;
+	for(uint64_t i = 0; i < numEntries; ++i)
 	{
-		RS_INFO( "Config file: ", tConfigPath,
-		         " corrupted or non-existent, creating a new one" );
+		std::string_view tKey;
+		uint64_t authorRef = 0;
+		if(!reader.readStringView(tKey) || !reader.readVarint(authorRef))
+			RS_UNLIKELY return invalidSliceError("entry key");
 
-		namespace fs = std::filesystem;
-		const fs::path confPath(SHARED_STATE_CONFIG_DIR);
-		std::error_code confDirErr;
-		fs::create_directory(confPath, confDirErr);
-		if(confDirErr)
+		if(authorRef == 0)
 		{
-			rs_error_bubble_or_exit(
-			            confDirErr.default_error_condition(), errbub,
-			            "Failure creating config directory" );
-			return false;
+			authorsDict.emplace_back();
+			if(!reader.readStringView(authorsDict.back())) RS_UNLIKELY
+			        return invalidSliceError("entry author");
+			authorRef = authorsDict.size();
 		}
+		else if(authorRef > authorsDict.size()) RS_UNLIKELY
+		    return invalidSliceError("entry author reference");
+
+		uint64_t tTtl = 0;
+		uint64_t dataLen = 0;
+		if(!reader.readVarint(tTtl) || !reader.readVarint(dataLen)) RS_UNLIKELY
+		        return invalidSliceError("entry TTL");
+
+		const uint8_t* entryData = reader.current();
+		if(!reader.skip(dataLen)) RS_UNLIKELY
+		        return invalidSliceError("entry data lenght");
+
+		if(!visitor(
+		            tKey, authorsDict[authorRef - 1],
+		            std::chrono::seconds(std::min<uint64_t>(tTtl, INT32_MAX)),
+		            std::span<const uint8_t>(entryData, dataLen) )) RS_UNLIKELY
+		    return invalidSliceError("entry data");
 	}
 
-	auto&& tConf = mTypeConf[typeName];
-	tConf.mName = typeName;
-	tConf.mBleachTTL = TTL;
-	tConf.mScope = typeScope;
-	tConf.mUpdateInterval = updateInterval;
-	// TODO: use inizializer list costructor
+	return true;
+}
 
-	RsGenericSerializer::SerializeJob j(RsGenericSerializer::TO_JSON);
-	RsGenericSerializer::SerializeContext ctx;
-	RS_SERIAL_PROCESS(mTypeConf);
+bool SharedState::NetworkMessage::readSliceEntries(
+        BinaryReader& reader, std::map<StateKey, StateEntry>& stateSlice,
+        std::error_condition* errbub ) const
+{
+	const auto tNow = std::chrono::steady_clock::now();
+	return visitSliceEntries(
+	            reader,
+	            [&]( std::string_view key, std::string_view author,
+	                 std::chrono::seconds ttl,
+	                 std::span<const uint8_t> encodedData )
+	{
+		auto& tEntry = stateSlice[StateKey(key)];
+		tEntry.mAuthor = author;
+		tEntry.setTtl(ttl, tNow);
+		return tEntry.decodeData(encodedData);
+	}, errbub );
+}
 
-	std::ofstream confFileWriteStream(
-	            tConfigPath, std::ios::out | std::ios::trunc );
-	if(!confFileWriteStream.is_open())
+void SharedState::NetworkMessage::fromStateDigest(
+        const std::map<StateKey, StateEntry>& stateSlice, uint32_t bucketsNum )
+{
+	std::vector<uint64_t> tDigests;
+	computeDigests(stateSlice, bucketsNum, tDigests);
+
+	mData.clear();
+	BinaryWriter tWriter(mData);
+	tWriter.writeUint8(BINARY_DIGEST_FORMAT);
+	tWriter.writeVarint(bucketsNum);
+	for(auto tDigest: tDigests)
+		for(int i = 0; i < 8; ++i, tDigest >>= 8)
+			tWriter.writeUint8(static_cast<uint8_t>(tDigest));
+}
+
+bool SharedState::NetworkMessage::toStateDigest(
+        std::vector<uint64_t>& digests, std::error_condition* errbub ) const
+{
+	BinaryReader tReader(mData.data(), mData.size());
+
+	uint8_t tFormat = 0;
+	uint64_t bucketsNum = 0;
+	if( !tReader.readUint8(tFormat) || tFormat != BINARY_DIGEST_FORMAT ||
+	        !tReader.readVarint(bucketsNum) ||
+	        bucketsNum < 1 || bucketsNum > DIGEST_MAX_BUCKETS ||
+	        !std::has_single_bit(bucketsNum) ||
+	        tReader.remaining() != bucketsNum*8 ) RS_UNLIKELY
 	{
-		RS_ERR("Failure opening config file:", tConfigPath, " for writing");
-		rs_error_bubble_or_exit(std::errc::io_error, errbub);
+		rs_error_bubble_or_exit(
+		            std::errc::bad_message, errbub,
+		            "Got invalid digest message of type: ", mTypeName );
 		return false;
 	}
-	confFileWriteStream << ctx.mJson << std::endl;
 
-	return ctx.mOk;
-}
+	digests.assign(bucketsNum, 0);
+	for(auto& tDigest: digests)
+		for(int i = 0; i < 8; ++i)
+		{
+			uint8_t tByte = 0;
+			tReader.readUint8(tByte);
+			tDigest |= static_cast<uint64_t>(tByte) << (8*i);
+		}
 
+	return true;
+}
 
-bool SharedState::loadRegisteredTypes(std::error_condition* errbub)
+void SharedState::NetworkMessage::fromDigestReply(
+        const std::map<StateKey, StateEntry>& stateSlice,
+        const std::vector<uint32_t>& buckets, uint32_t bucketsNum )
 {
-	const std::string tConfigPath(
-	            std::string(SHARED_STATE_CONFIG_DIR) +
-	            std::string(SHARED_STATE_CONFIG_FILE_NAME) );
+	std::vector<bool> wantedBuckets(bucketsNum, false);
+	for(auto bucket: buckets) wantedBuckets[bucket] = true;
+
+	mData.clear();
+	BinaryWriter tWriter(mData);
+	tWriter.writeUint8(BINARY_DIGEST_REPLY_FORMAT);
+	tWriter.writeVarint(buckets.size());
+	for(auto bucket: buckets) tWriter.writeVarint(bucket);
+	writeSliceEntries(
+	            tWriter, stateSlice,
+	            [&](const StateKey& key, const StateEntry&)
+	{ return wantedBuckets[digestBucket(key, bucketsNum)]; });
+}
 
-	std::ifstream confFileReadStream(tConfigPath);
-	if(!confFileReadStream.is_open())
+bool SharedState::NetworkMessage::toDigestReply(
+        std::map<StateKey, StateEntry>& stateSlice,
+        std::vector<uint32_t>& buckets, uint32_t bucketsNum,
+        std::error_condition* errbub ) const
+{
+	const auto invalidReplyError = [&](const char* what)
 	{
 		rs_error_bubble_or_exit(
-		            rs_errno_to_condition(errno), errbub,
-		            "Failure opening config file for reading: ", tConfigPath );
+		            std::errc::bad_message, errbub,
+		            "Got invalid digest reply of type: ", mTypeName,
+		            " ", what );
 		return false;
-	}
-	rapidjson::IStreamWrapper jStream(confFileReadStream);
+	};
 
-	RsGenericSerializer::SerializeJob j(RsGenericSerializer::FROM_JSON);
-	RsGenericSerializer::SerializeContext ctx;
-	ctx.mJson.ParseStream(jStream);
+	BinaryReader tReader(mData.data(), mData.size());
 
-	if(ctx.mJson.HasParseError())
+	uint8_t tFormat = 0;
+	if(!tReader.readUint8(tFormat) || tFormat != BINARY_DIGEST_REPLY_FORMAT)
+	    RS_UNLIKELY return invalidReplyError("header");
+
+	if(!readDigestReplyBuckets(tReader, buckets, bucketsNum, errbub))
+		RS_UNLIKELY return false;
+
+	if(!readSliceEntries(tReader, stateSlice, errbub)) RS_UNLIKELY return false;
+
+	if(tReader.remaining()) RS_UNLIKELY
+	        return invalidReplyError("trailing data");
+
+	return true;
+}
+
+bool SharedState::NetworkMessage::readDigestReplyBuckets(
+        BinaryReader& reader, std::vector<uint32_t>& buckets,
+        uint32_t bucketsNum, std::error_condition* errbub ) const
+{
+	const auto invalidReplyError = [&](const char* what)
 	{
 		rs_error_bubble_or_exit(
-		            rs_errno_to_condition(errno), errbub,
-		            "Corrupted type config file:", tConfigPath );
+		            std::errc::bad_message, errbub,
+		            "Got invalid digest reply of type: ", mTypeName,
+		            " ", what );
 		return false;
+	};
+
+	uint64_t numBuckets = 0;
+	if(!reader.readVarint(numBuckets) || numBuckets > bucketsNum) RS_UNLIKELY
+	        return invalidReplyError("buckets count");
+
+	buckets.clear();
+	for(uint64_t i = 0; i < numBuckets; ++i)
+	{
+		uint64_t tBucket = 0;
+		if(!reader.readVarint(tBucket) || tBucket >= bucketsNum) RS_UNLIKELY
+		        return invalidReplyError("bucket id");
+		buckets.push_back(static_cast<uint32_t>(tBucket));
 	}
 
-	/* RsTypeSerializer print an error message and then clear the map if it is
-	 * not empty before FROM_JSON, so let's do it and avoid the error message
-	 * @see https://github.com/libremesh/lime-packages/issues/1081 */
-	mTypeConf.clear();
-	RS_SERIAL_PROCESS(mTypeConf);
+	return true;
+}
 
-	// Create empty states for new types, do nothing if already presents
-	for(auto&& [typeName, _]: mTypeConf) mStates[typeName];
+/** FNV-1a is not cryptographically secure, but digests are just used to spot
+ * differences between honest peers so it is enough and very cheap */
+static inline uint64_t fnv1a64(const uint8_t* data, std::size_t len)
+{
+	uint64_t tHash = 0xcbf29ce484222325ULL;
+	for(std::size_t i = 0; i < len; ++i)
+	{
+		tHash ^= data[i];
+		tHash *= 0x100000001b3ULL;
+	}
+	return tHash;
+}
 
-	// Remove states for types that are not registered anymore
-	for(auto sIt = mStates.begin(); sIt != mStates.end();)
-		if(mTypeConf.find(sIt->first) == mTypeConf.end())
-			sIt = mStates.erase(sIt);
-		else ++sIt;
+/*static*/ uint32_t SharedState::digestBucketsFor(std::size_t stateSize)
+{
+	return std::clamp<uint32_t>(
+	            std::bit_ceil(stateSize / DIGEST_BUCKET_ENTRIES),
+	            1, DIGEST_MAX_BUCKETS );
+}
 
-	return ctx.mOk;
+/*static*/ uint32_t SharedState::digestBucket(
+        const StateKey& key, uint32_t bucketsNum )
+{
+	return static_cast<uint32_t>(
+	            fnv1a64(reinterpret_cast<const uint8_t*>(key.data()), key.size())
+	            & (bucketsNum - 1) );
 }
 
-void SharedState::StateEntry::serial_process(
-        RsGenericSerializer::SerializeJob j,
-        RsGenericSerializer::SerializeContext& ctx)
+/*static*/ void SharedState::computeDigests(
+        const std::map<StateKey, StateEntry>& stateSlice, uint32_t bucketsNum,
+        std::vector<uint64_t>& digests )
 {
-	RS_SERIAL_PROCESS(mAuthor);
+	digests.assign(bucketsNum, 0);
 
-	decltype(mTtl)::rep tTtl = mTtl.count();
-	RsTypeSerializer::serial_process(j, ctx, tTtl, "mTtl");
-	mTtl = decltype(mTtl)(tTtl);
+	std::vector<uint8_t> tBuff;
+	for(auto&& [key, stateEntry]: stateSlice)
+	{
+		tBuff.clear();
+		BinaryWriter tWriter(tBuff);
+		tWriter.writeString(key);
+		tWriter.writeString(stateEntry.mAuthor);
+		const auto& encodedData = stateEntry.encodedData();
+		tWriter.writeBytes(encodedData.data(), encodedData.size());
+
+		digests[digestBucket(key, bucketsNum)] +=
+		        fnv1a64(tBuff.data(), tBuff.size());
+	}
+}
 
-	RS_SERIAL_PROCESS(mData);
+/*static*/ std::size_t SharedState::compressionThreshold(uint32_t upBwMbs)
+{
+	if(upBwMbs >= COMPRESSION_MAX_BW_MBS) return SIZE_MAX;
+	return COMPRESSION_MIN_SIZE + upBwMbs*COMPRESSION_BYTES_PER_MBIT;
 }
 
+/*static*/ uint64_t SharedState::dictionaryId(
+        std::span<const uint8_t> dictionary )
+{
+	// 0 is reserved to mean no dictionary
+	const uint64_t tId = fnv1a64(dictionary.data(), dictionary.size());
+	return tId ? tId : 1;
+}
 
-/*static*/ const sockaddr_storage& SharedState::localInstanceAddr()
+/*static*/ void SharedState::trainDictionary(
+        const std::map<StateKey, StateEntry>& stateSlice,
+        std::vector<uint8_t>& dictionary )
 {
-	static sockaddr_storage lAddr{};
-	static bool mInitialized = false;
-	if(!mInitialized)
+	dictionary.clear();
+
+	/* Views point into the state, which is not modified meanwhile */
+	std::map<std::string_view, uint64_t> tOccurrences;
+	const auto countStrings = [&]( const auto& self,
+	        const rapidjson::Value& value, unsigned depth ) -> void
 	{
-		sockaddr_storage_ipv4_aton(lAddr, "127.0.0.1");
-		sockaddr_storage_setport(lAddr, TCP_PORT);
-		mInitialized = true;
+		if(depth > BinaryReader::MAX_JSON_DEPTH) RS_UNLIKELY return;
+
+		if(value.IsString())
+			++tOccurrences[std::string_view(
+			            value.GetString(), value.GetStringLength() )];
+		else if(value.IsObject())
+			for(auto mIt = value.MemberBegin(); mIt != value.MemberEnd(); ++mIt)
+			{
+				++tOccurrences[std::string_view(
+				            mIt->name.GetString(), mIt->name.GetStringLength() )];
+				self(self, mIt->value, depth + 1);
+			}
+		else if(value.IsArray())
+			for(auto vIt = value.Begin(); vIt != value.End(); ++vIt)
+				self(self, *vIt, depth + 1);
+	};
+
+	for(auto&& [key, stateEntry]: stateSlice)
+	{
+		++tOccurrences[key];
+		++tOccurrences[stateEntry.mAuthor];
+		countStrings(countStrings, stateEntry.mData, 0);
 	}
 
-	return lAddr;
+	/* Each occurrence of a string in the dictionary can be replaced by a
+	 * short back reference, so rank them by bytes saved. Strings appearing
+	 * just once are of no help, while the shortest are not worth a back
+	 * reference */
+	std::vector<std::pair<uint64_t, std::string_view>> tCandidates;
+	for(auto&& [str, count]: tOccurrences)
+		if(count > 1 && str.size() > 2)
+			tCandidates.emplace_back(count*str.size(), str);
+	std::sort(tCandidates.begin(), tCandidates.end(), std::greater<>());
+
+	std::size_t tSize = 0;
+	std::size_t tTaken = 0;
+	for(; tTaken < tCandidates.size(); ++tTaken)
+	{
+		const auto& tStr = tCandidates[tTaken].second;
+		const auto tLen = BinaryWriter::varintSize(tStr.size()) + tStr.size();
+		if(tSize + tLen > DICTIONARY_MAX_SIZE) break;
+		tSize += tLen;
+	}
+
+	dictionary.reserve(tSize);
+	BinaryWriter tWriter(dictionary);
+	for(auto i = tTaken; i-- > 0;) tWriter.writeString(tCandidates[i].second);
 }
 
-std::task<ssize_t> SharedState::merge(
-        const std::string& dataTypeName,
-        const std::map<StateKey, StateEntry>& stateSlice,
-        const sockaddr_storage& peerAddr,
-        std::error_condition* errbub )
+const SharedState::TypeDictionary& SharedState::typeDictionary(
+        const std::string& dataTypeName )
 {
-	constexpr ssize_t rFAILURE = -1;
+	using namespace std::chrono;
+	const auto tNow = steady_clock::now();
+	const uint64_t tChangeSeq = typeChangeSeq(dataTypeName);
 
-	RS_DBG3(dataTypeName, " slice size: ", stateSlice.size());
+	auto& tDict = mTypeDictionaries[dataTypeName];
+	if( tDict.mData && ( tDict.mTrainedChangeSeq == tChangeSeq ||
+	        tNow - tDict.mTrainedAt < DICTIONARY_RETRAIN_INTERVAL ) )
+		return tDict;
 
+	auto tData = std::make_shared<std::vector<uint8_t>>();
 	const auto statesIt = mStates.find(dataTypeName);
-	if(statesIt == mStates.end())
+	if(statesIt != mStates.end()) trainDictionary(statesIt->second, *tData);
+	tDict.mTrainedAt = tNow;
+	tDict.mTrainedChangeSeq = tChangeSeq;
+
+	/* Retraining a state which changed just a little might give the same
+	 * dictionary, keep the old one then, so peers don't need it again */
+	const uint64_t tId = tData->empty() ? 0 : dictionaryId(*tData);
+	if(!tDict.mData || tId != tDict.mId)
 	{
-		rs_error_bubble_or_exit( SharedStateErrors::UNKOWN_DATA_TYPE, errbub,
-		                         dataTypeName );
-		co_return rFAILURE;
+		RS_DBG2( dataTypeName, " new dictionary id: ", tId,
+		         " size: ", tData->size() );
+		tDict.mId = tId;
+		tDict.mData = std::move(tData);
 	}
 
-	const auto typeUpdateInterval = mTypeConf.at(dataTypeName).mUpdateInterval;
+	return tDict;
+}
 
-	auto& tState = statesIt->second;
-	ssize_t allChanges = 0;
-	ssize_t significantChanges = 0;
-	const bool isRemote = !sockaddr_storage_isLoopbackNet(peerAddr);
+bool SharedState::unwrapFrame(
+        NetworkMessage& netMsg, std::size_t frameOffset,
+        const sockaddr_storage& peerAddr, const WireSession& wireSession,
+        std::error_condition* errbub )
+{
+	auto& tData = netMsg.mData;
+	const uint8_t tFormat = tData[frameOffset];
+	if( tFormat != BINARY_COMPRESSED_FORMAT &&
+	        tFormat != BINARY_DICTIONARY_FORMAT ) return true;
 
-	for(auto&& [stateKey, sliceEntry]: stateSlice)
+	const auto invalidFrameError = [&](const char* what)
 	{
-		const auto knownEntryIt = tState.find(stateKey);
-		if(knownEntryIt == tState.end()) RS_UNLIKELY
-		{
-			tState.emplace(stateKey, sliceEntry);
-			++significantChanges; ++allChanges;
-			RS_DBG4("Inserted new entry with key: ", stateKey);
-			continue;
-		}
-		const auto& knownEntry = knownEntryIt->second;
-		const bool ownAuthorship = knownEntry.mAuthor == authorPlaceOlder();
-
-		/* When receiving data authored by this node from remote nodes with
-		 * higher TTL then our own, something fishy is happening.
-		 * Ignore the remote entry and print a warning.
-		 * Instead when the data is received from the CLI if some own authored
-		 * record have higher TTL its normal and overwriting is accepted */
-		if( isRemote && ownAuthorship &&
-		        sliceEntry.mTtl > knownEntry.mTtl ) RS_UNLIKELY
-		{
-			RS_WARN( "Discarding received known entry: ", stateKey, " ",
-			         "authored by this node with higher TTL from remote peer: ",
-			         peerAddr, " is remote peer ill?" );
-			continue;
-		}
+		rs_error_bubble_or_exit(
+		            std::errc::bad_message, errbub,
+		            "Got invalid compressed frame of type: ", netMsg.mTypeName,
+		            " ", what );
+		return false;
+	};
 
-		/* Avoid overwrite of own entries from remotes peers when the TTL is
-		 * equal, while keep accepting it from CLI */
-		const auto minUpdateTtl = (isRemote && ownAuthorship) ?
-		            knownEntry.mTtl + std::chrono::seconds(1) : knownEntry.mTtl;
+	if(!(wireSession.mFeatures & WIRE_FEATURE_COMPRESSION)) RS_UNLIKELY
+	        return invalidFrameError("compression not agreed");
 
-		if( sliceEntry.mTtl >= knownEntry.mTtl )
-		{
-			bool significant = knownEntry.mData != sliceEntry.mData;
-			RS_DBG4( "Updating entry with key: ", stateKey, " TTL: ",
-			         sliceEntry.mTtl, " > ", knownEntry.mTtl,
-			         " significant: ", significant? "true" : "false" );
-			if(significant) ++significantChanges;
-			++allChanges;
-			tState.erase(stateKey);
-			tState.emplace(stateKey, sliceEntry);
-		}
+	BinaryReader tReader(
+	            tData.data() + frameOffset + 1, tData.size() - frameOffset - 1 );
+	uint64_t tDictId = 0;
+	for(int i = 0; i < 8; ++i)
+	{
+		uint8_t tByte = 0;
+		if(!tReader.readUint8(tByte)) RS_UNLIKELY
+		        return invalidFrameError("dictionary id");
+		tDictId |= static_cast<uint64_t>(tByte) << (8*i);
 	}
 
-#if RS_DEBUG_LEVEL > 1
-	RS_DBG( dataTypeName, " got ", significantChanges,
-	        " significative changes out of ", allChanges,
-	        " input slice size: ", stateSlice.size(),
-	        " state size: ", tState.size() );
-#endif
-	co_return significantChanges;
-}
+	using namespace std::chrono;
+	const auto tNow = steady_clock::now();
 
+	if(tFormat == BINARY_DICTIONARY_FORMAT)
+	{
+		const std::span<const uint8_t> tDictionary(
+		            tReader.current(), tReader.remaining() );
+		if( tDictionary.empty() ||
+		        tDictionary.size() > DictionaryCodec::MAX_DICTIONARY_SIZE ||
+		        dictionaryId(tDictionary) != tDictId ) RS_UNLIKELY
+		    return invalidFrameError("dictionary");
+
+		for(auto pIt = mPeerDictionaries.begin(); pIt != mPeerDictionaries.end();)
+		{
+			std::erase_if(pIt->second, [&](const auto& item)
+			{ return tNow - item.second.mLastUse > PEER_DICTIONARY_MAX_AGE; });
+			if(pIt->second.empty()) pIt = mPeerDictionaries.erase(pIt);
+			else ++pIt;
+		}
 
-void SharedState::NetworkMessage::fromStateSlice(
-        std::map<StateKey, StateEntry>& stateSlice )
-{
-	/* !!Keep stateSlice paramather name the same as in toStateSlice */
+		auto& tPeerDicts = mPeerDictionaries[peerSyncCursorKey(peerAddr)];
+		if( tPeerDicts.size() >= PEER_DICTIONARIES_MAX &&
+		        !tPeerDicts.contains(tDictId) ) RS_UNLIKELY
+		    tPeerDicts.erase(std::min_element(
+		                tPeerDicts.begin(), tPeerDicts.end(),
+		                [](const auto& a, const auto& b)
+		    { return a.second.mLastUse < b.second.mLastUse; } ));
+
+		auto& tPeerDict = tPeerDicts[tDictId];
+		tPeerDict.mData = std::make_shared<const std::vector<uint8_t>>(
+		            tDictionary.begin(), tDictionary.end() );
+		tPeerDict.mLastUse = tNow;
+
+		tData.resize(frameOffset);
+		return true;
+	}
 
-	RsGenericSerializer::SerializeJob j(RsGenericSerializer::TO_JSON);
-	RsGenericSerializer::SerializeContext ctx;
-	RS_SERIAL_PROCESS(stateSlice);
+	uint64_t rawSize = 0;
+	if( !tReader.readVarint(rawSize) ||
+	        rawSize < 2 || rawSize > DATA_MAX_LENGHT ) RS_UNLIKELY
+	    return invalidFrameError("raw size");
 
-	std::stringstream ss;
-	ss << ctx.mJson;
-	mData.assign(ss.view().begin(), ss.view().end());
-}
+	std::shared_ptr<const std::vector<uint8_t>> tDictionary;
+	if(tDictId)
+	{
+		const auto pIt = mPeerDictionaries.find(peerSyncCursorKey(peerAddr));
+		if(pIt == mPeerDictionaries.end()) RS_UNLIKELY
+		        return invalidFrameError("unknown dictionary");
+		const auto dIt = pIt->second.find(tDictId);
+		if(dIt == pIt->second.end()) RS_UNLIKELY
+		        return invalidFrameError("unknown dictionary");
+		dIt->second.mLastUse = tNow;
+		tDictionary = dIt->second.mData;
+	}
 
-void SharedState::NetworkMessage::toStateSlice(
-        std::map<StateKey, StateEntry>& stateSlice ) const
-{
-	/* !! Keep stateSlice paramather name the same as in fromStateSlice */
+	std::vector<uint8_t> tRaw;
+	bool decompressOk = false;
+	{
+		StateUnlock tUnlock(*this);
+		decompressOk = DictionaryCodec::decompress(
+		            std::span<const uint8_t>(
+		                tReader.current(), tReader.remaining() ),
+		            tDictionary ? std::span<const uint8_t>(*tDictionary) :
+		                          std::span<const uint8_t>(),
+		            rawSize, tRaw );
+	}
+	if(!decompressOk) RS_UNLIKELY return invalidFrameError("deflate stream");
 
-	RsGenericSerializer::SerializeJob j(RsGenericSerializer::FROM_JSON);
-	RsGenericSerializer::SerializeContext ctx;
-	ctx.mJson.Parse(
-	            reinterpret_cast<const char*>(mData.data()),
-	            mData.size() );
-	RS_DBG4(ctx.mJson);
-	RS_SERIAL_PROCESS(stateSlice);
+	if( tRaw[0] == BINARY_COMPRESSED_FORMAT ||
+	        tRaw[0] == BINARY_DICTIONARY_FORMAT ) RS_UNLIKELY
+	    return invalidFrameError("nested");
+
+	tData.resize(frameOffset);
+	tData.insert(tData.end(), tRaw.begin(), tRaw.end());
+	return true;
 }
 
 std::task<bool> SharedState::notifyHooks(
-        const std::string& typeName, std::error_condition* errbub )
+        const std::string& typeName, IOContext& ioContext,
+        std::error_condition* errbub )
 {
 	RS_DBG2(typeName);
 
@@ -1010,7 +3284,7 @@ std::task<bool> SharedState::notifyHooks(
 
 		std::error_condition hookErr;
 		auto hookCmd = AsyncCommand::execute(
-		            dirEntry.path(), mIoContext, &hookErr );
+		            dirEntry.path(), ioContext, &hookErr );
 		if(!hookCmd)
 		{
 			RS_ERR("Failure executing hook: ", hookPath, " ", hookErr);
@@ -1035,17 +3309,8 @@ std::task<bool> SharedState::notifyHooks(
 }
 
 ssize_t SharedState::bleach(
-        const std::string& dataTypeName, std::chrono::seconds times,
-        std::error_condition* errbub )
+        const std::string& dataTypeName, std::error_condition* errbub )
 {
-	if(times < std::chrono::seconds(1)) RS_UNLIKELY
-	{
-		rs_error_bubble_or_exit(
-		            std::errc::invalid_argument, errbub,
-		            dataTypeName );
-		return -1;
-	}
-
 	auto statesIt = mStates.find(dataTypeName);
 	if(statesIt == mStates.end()) RS_UNLIKELY
 	{
@@ -1056,11 +3321,25 @@ ssize_t SharedState::bleach(
 	}
 	auto& tState = statesIt->second;
 
-	ssize_t significativeChanges =
-	        std::erase_if(tState, [=](const auto& item)
-	{ return item.second.mTtl <= times; });
+	auto& tExpiryQueue = mExpiryQueues[dataTypeName];
+
+	const auto tNow = std::chrono::steady_clock::now();
+	ssize_t significativeChanges = 0;
+	while(!tExpiryQueue.empty() && tExpiryQueue.top().first <= tNow)
+	{
+		const auto& [tExpiry, tKey] = tExpiryQueue.top();
+
+		/* The entry might have been refreshed or replaced after this record
+		 * was queued, in that case a newer record is in the queue already */
+		const auto entryIt = tState.find(tKey);
+		if(entryIt != tState.end() && entryIt->second.mExpiry <= tNow)
+		{
+			tState.erase(entryIt);
+			++significativeChanges;
+		}
 
-	for(auto& [key, stateEntry]: tState) stateEntry.mTtl -= times;
+		tExpiryQueue.pop();
+	}
 
 	return significativeChanges;
 }
@@ -1079,6 +3358,16 @@ void SharedState::DataTypeConf::serial_process(
 	decltype(mBleachTTL)::rep tBleachTTL = mBleachTTL.count();
 	RsTypeSerializer::serial_process(j, ctx, tBleachTTL, "mBleachTTL");
 	mBleachTTL = decltype(mBleachTTL)(tBleachTTL);
+
+	/* Config files written by older versions lack it, keep the default
+	 * without marking the whole config as invalid */
+	const bool tOk = ctx.mOk;
+	RS_SERIAL_PROCESS(mMaxMessageSize);
+	if(j == RsGenericSerializer::FROM_JSON)
+	{
+		ctx.mOk = tOk;
+		if(!mMaxMessageSize) mMaxMessageSize = DEFAULT_TYPE_MAX_MESSAGE_SIZE;
+	}
 }
 
 void SharedState::NetworkStats::serial_process(
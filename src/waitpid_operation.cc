@@ -26,6 +26,7 @@
 #include "io_context.hh"
 #include "async_command.hh"
 
+#include <poll.h>
 #include <unistd.h>
 #include <sys/wait.h>
 
@@ -38,14 +39,7 @@ WaitpidOperation::WaitpidOperation(
         int* wstatus,
         std::error_condition* ec ):
     AwaitableSyscall{afd, ec}, mWstatus(wstatus)
-{
-	mAFD.getIOContext().watchRead(&mAFD);
-}
-
-WaitpidOperation::~WaitpidOperation()
-{
-	mAFD.getIOContext().unwatchRead(&mAFD);
-}
+{}
 
 pid_t WaitpidOperation::childPid() const
 {
@@ -71,3 +65,26 @@ pid_t WaitpidOperation::syscall()
 
 	return waitPidRet;
 }
+
+bool WaitpidOperation::prepareSqe(io_uring_sqe& sqe)
+{
+	/* io_uring has no waitpid, but the pidfd becomes readable when the
+	 * process terminates, poll it then reap the process */
+	sqe.opcode = IORING_OP_POLL_ADD;
+	sqe.fd = mAFD.getFD();
+	sqe.poll32_events = uringPollEvents(POLLIN);
+	return true;
+}
+
+pid_t WaitpidOperation::completeSqe(int32_t result)
+{
+	if(result < 0)
+	{
+		errno = -result;
+		return -1;
+	}
+
+	/* Process is terminated so it doesn't need waiting, but WNOHANG keeps
+	 * us from blocking if something else reaped it meanwhile */
+	return syscall();
+}
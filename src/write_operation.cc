@@ -27,31 +27,36 @@
 
 #include <unistd.h>
 
-
 WriteOp::WriteOp(
         AsyncFileDescriptor& AFD,
         const uint8_t* buffer, std::size_t len,
         std::error_condition* ec ):
     AwaitableSyscall{AFD, ec}, mBuffer{buffer}, mLen{len}
-{
-	mAFD.getIOContext().watchWrite(&mAFD);
-}
-
-WriteOp::~WriteOp()
-{
-	mAFD.getIOContext().unwatchWrite(&mAFD);
-}
+{}
 
 ssize_t WriteOp::syscall()
 {
 	ssize_t bytes_writen = write(
 	            mAFD.getFD(),
-	            reinterpret_cast<const char*>(mBuffer), mLen );
+	            reinterpret_cast<const char*>(mBuffer + transferred()),
+	            mLen - transferred() );
 
 	return bytes_writen;
 }
 
-std::task<ssize_t> asyncWrite(
+bool WriteOp::prepareSqe(io_uring_sqe& sqe)
+{
+	sqe.opcode = IORING_OP_WRITE;
+	sqe.fd = mAFD.getFD();
+	sqe.addr = reinterpret_cast<uint64_t>(mBuffer + transferred());
+	sqe.len = static_cast<uint32_t>(mLen - transferred());
+
+	// Pipes and sockets have no position, -1 means current
+	sqe.off = static_cast<uint64_t>(-1);
+	return true;
+}
+
+WriteOp asyncWrite(
         AsyncFileDescriptor& aFD,
         const uint8_t* buffer, std::size_t len,
         std::error_condition* errbub )
@@ -60,19 +65,5 @@ std::task<ssize_t> asyncWrite(
 	        " buffer: ", reinterpret_cast<const void*>(buffer),
 	        " len: ", len);
 
-	ssize_t numWriteBytes = 0;
-	ssize_t totalWriteBytes = 0;
-	do
-	{
-		numWriteBytes = co_await
-		    WriteOp{aFD, buffer + totalWriteBytes, len - totalWriteBytes, errbub};
-
-		if(numWriteBytes == -1) RS_UNLIKELY
-		    co_return -1;
-
-		totalWriteBytes += numWriteBytes;
-	}
-	while(numWriteBytes && totalWriteBytes < len);
-
-	co_return totalWriteBytes;
+	return WriteOp(aFD, buffer, len, errbub);
 }
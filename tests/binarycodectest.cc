@@ -0,0 +1,266 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+
+#include "doctest/doctest.h"
+#include "binary_codec.hh"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+TEST_CASE("varints round trip with minimal size")
+{
+  const std::vector<uint64_t> values {
+    0, 1, 127, 128, 300, 16383, 16384, UINT32_MAX,
+    uint64_t(1) << 56, UINT64_MAX };
+
+  std::vector<uint8_t> buffer;
+  BinaryWriter writer(buffer);
+  std::size_t expectedSize = 0;
+  for(auto value: values)
+  {
+    writer.writeVarint(value);
+    expectedSize += BinaryWriter::varintSize(value);
+  }
+  CHECK(buffer.size() == expectedSize);
+  CHECK(BinaryWriter::varintSize(127) == 1);
+  CHECK(BinaryWriter::varintSize(128) == 2);
+  CHECK(BinaryWriter::varintSize(UINT64_MAX) == 10);
+
+  BinaryReader reader(buffer.data(), buffer.size());
+  for(auto value: values)
+  {
+    uint64_t read = 0;
+    REQUIRE(reader.readVarint(read));
+    CHECK(read == value);
+  }
+  CHECK(reader.remaining() == 0);
+}
+
+TEST_CASE("strings round trip")
+{
+  const std::string binary("with\0zero", 9);
+  const std::string longString(1000, 'x');
+
+  std::vector<uint8_t> buffer;
+  BinaryWriter writer(buffer);
+  writer.writeString("");
+  writer.writeString("shared-state");
+  writer.writeString(binary);
+  writer.writeString(longString);
+
+  BinaryReader reader(buffer.data(), buffer.size());
+  std::string read;
+  REQUIRE(reader.readString(read));
+  CHECK(read.empty());
+  REQUIRE(reader.readString(read));
+  CHECK(read == "shared-state");
+
+  std::string_view view;
+  REQUIRE(reader.readStringView(view));
+  CHECK(view == binary);
+  // Views point inside the buffer without copying
+  CHECK(reinterpret_cast<const uint8_t*>(view.data()) > buffer.data());
+  CHECK(reinterpret_cast<const uint8_t*>(view.data()) < reader.current());
+
+  REQUIRE(reader.readString(read));
+  CHECK(read == longString);
+  CHECK(reader.remaining() == 0);
+}
+
+TEST_CASE("tagged JSON round trip")
+{
+  RsJson doc;
+  auto& allocator = doc.GetAllocator();
+  doc.SetObject();
+
+  rapidjson::Value name;
+  rapidjson::Value value;
+
+  name.SetString("null", 4, allocator);
+  value.SetNull();
+  doc.AddMember(name, value, allocator);
+
+  name.SetString("bool", 4, allocator);
+  value.SetBool(true);
+  doc.AddMember(name, value, allocator);
+
+  name.SetString("uint", 4, allocator);
+  value.SetUint64(UINT64_MAX);
+  doc.AddMember(name, value, allocator);
+
+  name.SetString("int", 3, allocator);
+  value.SetInt64(INT64_MIN);
+  doc.AddMember(name, value, allocator);
+
+  name.SetString("double", 6, allocator);
+  value.SetDouble(-0.125);
+  doc.AddMember(name, value, allocator);
+
+  rapidjson::Value array;
+  array.SetArray();
+  for(int i = -2; i < 3; ++i)
+  {
+    rapidjson::Value element;
+    element.SetInt64(i);
+    array.PushBack(element, allocator);
+  }
+  rapidjson::Value element;
+  element.SetString("last", 4, allocator);
+  array.PushBack(element, allocator);
+  name.SetString("array", 5, allocator);
+  doc.AddMember(name, array, allocator);
+
+  std::vector<uint8_t> buffer;
+  BinaryWriter writer(buffer);
+  writer.writeJson(doc);
+
+  RsJson read;
+  BinaryReader reader(buffer.data(), buffer.size());
+  REQUIRE(reader.readJson(read, read.GetAllocator()));
+  CHECK(reader.remaining() == 0);
+  CHECK(read == doc);
+
+  REQUIRE(read.IsObject());
+  CHECK(read["uint"].GetUint64() == UINT64_MAX);
+  CHECK(read["int"].GetInt64() == INT64_MIN);
+  CHECK(read["double"].GetDouble() == -0.125);
+  REQUIRE(read["array"].IsArray());
+  CHECK(read["array"].Size() == 6);
+}
+
+TEST_CASE("truncated varint is refused")
+{
+  std::vector<uint8_t> buffer;
+  BinaryWriter writer(buffer);
+  writer.writeVarint(UINT32_MAX);
+  buffer.pop_back();
+
+  BinaryReader reader(buffer.data(), buffer.size());
+  uint64_t value = 0;
+  CHECK_FALSE(reader.readVarint(value));
+
+  BinaryReader emptyReader(buffer.data(), 0);
+  CHECK_FALSE(emptyReader.readVarint(value));
+}
+
+TEST_CASE("over long varint is refused")
+{
+  // Ten bytes are enough for any uint64_t, the eleventh must not be read
+  std::vector<uint8_t> buffer(11, 0x80);
+  buffer.back() = 0x01;
+
+  BinaryReader reader(buffer.data(), buffer.size());
+  uint64_t value = 0;
+  CHECK_FALSE(reader.readVarint(value));
+}
+
+TEST_CASE("lengths and counts past the end of buffer are refused")
+{
+  std::vector<uint8_t> buffer;
+  BinaryWriter writer(buffer);
+
+  // String claiming more bytes than available
+  writer.writeVarint(10);
+  writer.writeBytes(reinterpret_cast<const uint8_t*>("short"), 5);
+  {
+    BinaryReader reader(buffer.data(), buffer.size());
+    std::string str;
+    CHECK_FALSE(reader.readString(str));
+  }
+
+  RsJson doc;
+
+  // Array announcing more elements than remaining bytes
+  buffer.clear();
+  writer.writeUint8(7); // ARRAY
+  writer.writeVarint(1000000);
+  writer.writeUint8(0);
+  {
+    BinaryReader reader(buffer.data(), buffer.size());
+    CHECK_FALSE(reader.readJson(doc, doc.GetAllocator()));
+  }
+
+  // Object announcing more members than remaining bytes
+  buffer.clear();
+  writer.writeUint8(8); // OBJECT
+  writer.writeVarint(3);
+  writer.writeString("a");
+  writer.writeUint8(0);
+  {
+    BinaryReader reader(buffer.data(), buffer.size());
+    CHECK_FALSE(reader.readJson(doc, doc.GetAllocator()));
+  }
+
+  // Double missing some of its 8 bytes
+  buffer.clear();
+  writer.writeUint8(5); // DOUBLE
+  writer.writeUint8(0);
+  writer.writeUint8(0);
+  {
+    BinaryReader reader(buffer.data(), buffer.size());
+    CHECK_FALSE(reader.readJson(doc, doc.GetAllocator()));
+  }
+
+  // Unknown tag
+  buffer.clear();
+  writer.writeUint8(0xff);
+  {
+    BinaryReader reader(buffer.data(), buffer.size());
+    CHECK_FALSE(reader.readJson(doc, doc.GetAllocator()));
+  }
+
+  // skip past the end
+  BinaryReader reader(buffer.data(), buffer.size());
+  CHECK_FALSE(reader.skip(2));
+  CHECK(reader.skip(1));
+}
+
+/// @return buffer holding depth arrays nested in each other around a null
+static std::vector<uint8_t> nestedArrays(unsigned depth)
+{
+  std::vector<uint8_t> buffer;
+  BinaryWriter writer(buffer);
+  for(unsigned i = 0; i < depth; ++i)
+  {
+    writer.writeUint8(7); // ARRAY
+    writer.writeVarint(1);
+  }
+  writer.writeUint8(0); // NULL_VALUE
+  return buffer;
+}
+
+TEST_CASE("JSON nesting past MAX_JSON_DEPTH is refused")
+{
+  RsJson doc;
+
+  auto buffer = nestedArrays(BinaryReader::MAX_JSON_DEPTH);
+  BinaryReader reader(buffer.data(), buffer.size());
+  CHECK(reader.readJson(doc, doc.GetAllocator()));
+
+  buffer = nestedArrays(BinaryReader::MAX_JSON_DEPTH + 1);
+  BinaryReader deepReader(buffer.data(), buffer.size());
+  CHECK_FALSE(deepReader.readJson(doc, doc.GetAllocator()));
+
+  // Way deeper than the limit must fail fast instead of exhausting the stack
+  buffer = nestedArrays(1000000);
+  BinaryReader hugeReader(buffer.data(), buffer.size());
+  CHECK_FALSE(hugeReader.readJson(doc, doc.GetAllocator()));
+}
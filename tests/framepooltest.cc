@@ -0,0 +1,115 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+
+
+#include "doctest/doctest.h"
+#include "task.hh"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* The pool is per thread and shared with the other tests, so these check
+ * changes against the counters found at start */
+using FramePool = std::detail::frame_pool;
+
+TEST_CASE("frame pool recycles freed frames")
+{
+  auto& pool = FramePool::local();
+  const auto liveStart = pool.live();
+  const auto recycledStart = pool.recycled();
+
+  void* frame = pool.allocate(200);
+  CHECK(pool.live() == liveStart + 1);
+  pool.deallocate(frame, 200);
+  CHECK(pool.live() == liveStart);
+
+  // Same size class must come from the free list
+  frame = pool.allocate(190);
+  CHECK(pool.recycled() == recycledStart + 1);
+  pool.deallocate(frame, 190);
+  CHECK(pool.live() == liveStart);
+}
+
+TEST_CASE("frame pool sends oversized frames to the heap")
+{
+  auto& pool = FramePool::local();
+  const auto liveStart = pool.live();
+  const auto recycledStart = pool.recycled();
+
+  constexpr std::size_t HUGE_SIZE = FramePool::MAX_POOLED_SIZE + 1;
+  for(int i = 0; i < 3; ++i)
+  {
+    void* frame = pool.allocate(HUGE_SIZE);
+    CHECK(pool.live() == liveStart + 1);
+    pool.deallocate(frame, HUGE_SIZE);
+  }
+  CHECK(pool.live() == liveStart);
+  CHECK(pool.recycled() == recycledStart);
+}
+
+TEST_CASE("frame pool keeps at most MAX_FREE_PER_CLASS frames")
+{
+  auto& pool = FramePool::local();
+  const auto liveStart = pool.live();
+
+  constexpr std::size_t FRAME_SIZE = 3000;
+  constexpr std::size_t BURST = 2 * FramePool::MAX_FREE_PER_CLASS;
+
+  std::vector<void*> frames;
+  for(std::size_t i = 0; i < BURST; ++i)
+    frames.push_back(pool.allocate(FRAME_SIZE));
+  CHECK(pool.live() == liveStart + BURST);
+  for(auto frame: frames) pool.deallocate(frame, FRAME_SIZE);
+  CHECK(pool.live() == liveStart);
+
+  // Past the cap freed frames went back to the heap
+  const auto recycledStart = pool.recycled();
+  frames.clear();
+  for(std::size_t i = 0; i < BURST; ++i)
+    frames.push_back(pool.allocate(FRAME_SIZE));
+  CHECK(pool.recycled() == recycledStart + FramePool::MAX_FREE_PER_CLASS);
+  for(auto frame: frames) pool.deallocate(frame, FRAME_SIZE);
+  CHECK(pool.live() == liveStart);
+}
+
+static std::task<int> answer(int value)
+{
+  co_return value * 2;
+}
+
+static std::task<> sumAnswers(int count, int& sum)
+{
+  for(int i = 0; i < count; ++i) sum += co_await answer(i);
+}
+
+TEST_CASE("coroutine frames go back to the pool")
+{
+  auto& pool = FramePool::local();
+  const auto liveStart = pool.live();
+  const auto recycledStart = pool.recycled();
+
+  int sum = 0;
+  sumAnswers(100, sum).detach();
+  CHECK(sum == 9900);
+  CHECK(pool.live() == liveStart);
+  // After the first answer frame every other one is recycled
+  CHECK(pool.recycled() >= recycledStart + 99);
+}
@@ -0,0 +1,244 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+
+#include "doctest/doctest.h"
+#include "io_context.hh"
+#include "io_uring.hh"
+#include "async_socket.hh"
+#include "async_timer.hh"
+#include "read_operation.hh"
+#include "write_operation.hh"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Kernels without io_uring, or with it disabled, skip these tests
+
+static std::unique_ptr<IoUring> setupUringOrSkip(unsigned entries)
+{
+  std::error_condition uringErr;
+  auto tUring = IoUring::setup(entries, &uringErr);
+  if(!tUring) MESSAGE("io_uring not available, skipping: " << uringErr.message());
+  return tUring;
+}
+
+static bool waitCompletions(IoUring& uring, int timeoutMs = 1000)
+{
+  pollfd tPfd { uring.getFD(), POLLIN, 0 };
+  return uring.hasCompletions() || poll(&tPfd, 1, timeoutMs) == 1;
+}
+
+static std::vector<uint64_t> reapAll(IoUring& uring)
+{
+  std::vector<uint64_t> userData;
+  uring.reapCompletions([&](uint64_t ud, int32_t result)
+  {
+    CHECK(result == 0);
+    userData.push_back(ud);
+  });
+  return userData;
+}
+
+TEST_CASE("io_uring submits and reaps")
+{
+  auto tUring = setupUringOrSkip(8);
+  if(!tUring) return;
+
+  UringCompletion tCompletion;
+  memset(&tCompletion.mSqe, 0, sizeof(tCompletion.mSqe));
+  tCompletion.mSqe.opcode = IORING_OP_NOP;
+  REQUIRE(tUring->submit(tCompletion));
+  REQUIRE(tUring->submit());
+
+  REQUIRE(waitCompletions(*tUring));
+  auto tReaped = reapAll(*tUring);
+  REQUIRE(tReaped.size() == 1);
+  CHECK(tReaped[0] == reinterpret_cast<uint64_t>(&tCompletion));
+  CHECK_FALSE(tUring->hasCompletions());
+}
+
+TEST_CASE("io_uring reserved entries are not submitted apart")
+{
+  auto tUring = setupUringOrSkip(4);
+  if(!tUring) return;
+
+  // Three queued entries leave no room for two more
+  for(int i = 0; i < 3; ++i)
+  {
+    io_uring_sqe* tSqe = tUring->getSqe();
+    REQUIRE(tSqe);
+    tSqe->opcode = IORING_OP_NOP;
+    tSqe->user_data = 1;
+  }
+  CHECK_FALSE(tUring->hasCompletions());
+
+  // Reserving submits the queued ones to make room, not the reserved ones
+  REQUIRE(tUring->reserveSqes(2));
+  REQUIRE(waitCompletions(*tUring));
+  CHECK(reapAll(*tUring).size() == 3);
+
+  io_uring_sqe* tPoll = tUring->getSqe();
+  REQUIRE(tPoll);
+  tPoll->opcode = IORING_OP_NOP;
+  tPoll->flags = IOSQE_IO_LINK;
+  tPoll->user_data = 2;
+  io_uring_sqe* tLinked = tUring->getSqe();
+  REQUIRE(tLinked);
+  tLinked->opcode = IORING_OP_NOP;
+  tLinked->user_data = 3;
+  CHECK_FALSE(waitCompletions(*tUring, 10));
+
+  REQUIRE(tUring->submit());
+  REQUIRE(waitCompletions(*tUring));
+  std::vector<uint64_t> tReaped;
+  while(tReaped.size() < 2 && waitCompletions(*tUring))
+    for(auto ud: reapAll(*tUring)) tReaped.push_back(ud);
+  CHECK(tReaped == std::vector<uint64_t>{2, 3});
+
+  // More than the whole ring can never be reserved
+  CHECK_FALSE(tUring->reserveSqes(5));
+}
+
+TEST_CASE("IOContext falls back to epoll without usable io_uring")
+{
+  /* IoUring::setup refuses kernels without IORING_FEAT_FAST_POLL too, the
+   * backend must follow it */
+  const bool uringUsable = !!IoUring::setup(IoUring::DEFAULT_ENTRIES);
+  auto ioContext = IOContext::setup(IOContext::Backend::IO_URING);
+  REQUIRE(ioContext);
+  CHECK( (ioContext->getBackend() == IOContext::Backend::IO_URING) ==
+         uringUsable );
+  if(!uringUsable) MESSAGE("io_uring not available, using epoll");
+}
+
+static std::task<> sendAll(
+        std::shared_ptr<AsyncSocket> socket, std::vector<uint8_t>& buffer,
+        ssize_t& sent )
+{
+  sent = co_await socket->send(buffer.data(), buffer.size());
+  co_await socket->getIOContext().closeAFD(socket);
+}
+
+static std::task<> recvAll(
+        std::shared_ptr<AsyncSocket> socket, std::vector<uint8_t>& buffer,
+        ssize_t& received )
+{
+  auto& ioContext = socket->getIOContext();
+  received = co_await socket->recv(buffer.data(), buffer.size());
+  co_await ioContext.closeAFD(socket);
+  ioContext.stop();
+}
+
+TEST_CASE("io_uring short transfers are resubmitted")
+{
+  auto ioContext = IOContext::setup(IOContext::Backend::IO_URING);
+  REQUIRE(ioContext);
+  if(ioContext->getBackend() != IOContext::Backend::IO_URING)
+  {
+    MESSAGE("io_uring not available, skipping");
+    return;
+  }
+
+  int tFDs[2];
+  REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, tFDs) == 0);
+
+  // Way more than socket buffers so the kernel transfers it in pieces
+  constexpr std::size_t BUFFER_SIZE = 4*1024*1024;
+  std::vector<uint8_t> tSendBuffer(BUFFER_SIZE);
+  for(std::size_t i = 0; i < BUFFER_SIZE; ++i)
+    tSendBuffer[i] = static_cast<uint8_t>(i * 7);
+  std::vector<uint8_t> tRecvBuffer(BUFFER_SIZE);
+
+  auto tSender = ioContext->registerFD<AsyncSocket>(tFDs[0]);
+  auto tReceiver = ioContext->registerFD<AsyncSocket>(tFDs[1]);
+  REQUIRE(tSender);
+  REQUIRE(tReceiver);
+
+  ssize_t tSent = -1;
+  ssize_t tReceived = -1;
+  recvAll(tReceiver, tRecvBuffer, tReceived).detach();
+  sendAll(tSender, tSendBuffer, tSent).detach();
+  ioContext->run();
+
+  CHECK(tSent == static_cast<ssize_t>(BUFFER_SIZE));
+  CHECK(tReceived == static_cast<ssize_t>(BUFFER_SIZE));
+  CHECK(tRecvBuffer == tSendBuffer);
+}
+
+static std::task<> readPipe(
+        std::shared_ptr<AsyncFileDescriptor> pipeOut, uint8_t* buffer,
+        std::size_t len, ssize_t& numRead )
+{
+  auto& ioContext = pipeOut->getIOContext();
+  numRead = co_await asyncRead(*pipeOut, buffer, len);
+  co_await ioContext.closeAFD(pipeOut);
+  ioContext.stop();
+}
+
+static std::task<> writePipeLater(
+        std::shared_ptr<AsyncFileDescriptor> pipeIn, const uint8_t* buffer,
+        std::size_t len, ssize_t& numWritten )
+{
+  auto& ioContext = pipeIn->getIOContext();
+  co_await SleepOperation(
+              ioContext,
+              std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(20) );
+  numWritten = co_await asyncWrite(*pipeIn, buffer, len);
+  co_await ioContext.closeAFD(pipeIn);
+}
+
+TEST_CASE("io_uring EAGAIN on pipes is retried once ready")
+{
+  auto ioContext = IOContext::setup(IOContext::Backend::IO_URING);
+  REQUIRE(ioContext);
+  if(ioContext->getBackend() != IOContext::Backend::IO_URING)
+  {
+    MESSAGE("io_uring not available, skipping");
+    return;
+  }
+
+  int tPipe[2];
+  REQUIRE(pipe(tPipe) == 0);
+
+  // Non-blocking empty pipe makes the kernel return EAGAIN to the read
+  auto tPipeOut = ioContext->registerFD<AsyncFileDescriptor>(tPipe[0]);
+  auto tPipeIn = ioContext->registerFD<AsyncFileDescriptor>(tPipe[1]);
+  REQUIRE(tPipeOut);
+  REQUIRE(tPipeIn);
+
+  const std::vector<uint8_t> tMessage { 's', 'h', 'a', 'r', 'e', 'd' };
+  std::vector<uint8_t> tRead(tMessage.size());
+  ssize_t tNumRead = -1;
+  ssize_t tNumWritten = -1;
+  readPipe(tPipeOut, tRead.data(), tRead.size(), tNumRead).detach();
+  writePipeLater(
+              tPipeIn, tMessage.data(), tMessage.size(), tNumWritten ).detach();
+  ioContext->run();
+
+  CHECK(tNumWritten == static_cast<ssize_t>(tMessage.size()));
+  CHECK(tNumRead == static_cast<ssize_t>(tMessage.size()));
+  CHECK(tRead == tMessage);
+}
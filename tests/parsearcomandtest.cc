@@ -22,46 +22,63 @@
 
 #include "doctest/doctest.h"
 #include "sharedstate.hh"
-#include "shared_state_error_code.hh"
+#include "shared_state_errors.hh"
+#include "binary_codec.hh"
+
+#include <cstdint>
+#include <string>
+#include <vector>
 
 #include <util/rsdebuglevel2.h>
 
 // Tests that don't naturally fit in the headers/.cpp files directly
 // can be placed in a tests/*.cpp file. Integration tests are a good example.
 
-TEST_CASE("return command")
+static std::vector<uint8_t> encodeComando()
 {
-  std::string completo = "comando\ndatos";
-  std::string comando = "";
-  comando = SharedState::extractCommand(completo);
-  CHECK(comando == "comando");
-  CHECK(completo == "datos");
+  const std::string completo = "comando\ndatos";
+  RsJson comando;
+  comando.SetString(
+              completo.c_str(), static_cast<rapidjson::SizeType>(completo.size()),
+              comando.GetAllocator() );
+
+  std::vector<uint8_t> encoded;
+  BinaryWriter writer(encoded);
+  writer.writeJson(comando);
+  return encoded;
 }
 
-TEST_CASE("return command overload")
+TEST_CASE("return command")
 {
-  std::string completo = "comando\ndatos";
-  std::string comando = "";
-  SharedState::extractCommand(completo,comando);
-  CHECK(comando == "comando");
-  CHECK(completo == "datos");
+  const auto encoded = encodeComando();
+  SharedState::StateEntry entry;
+  REQUIRE(entry.decodeData(encoded));
+  REQUIRE(entry.mData.IsString());
+  CHECK(std::string(entry.mData.GetString()) == "comando\ndatos");
+  CHECK(entry.encodedData() == encoded);
 }
 
 TEST_CASE("return empty string")
 {
-  std::string completo = "comandodatos";
-  std::string comando = "";
-  comando = SharedState::extractCommand(completo);
-  CHECK(comando == "");
-  CHECK(completo == "comandodatos");
+  auto encoded = encodeComando();
+  encoded.push_back(0);
+  SharedState::StateEntry entry;
+  CHECK_FALSE(entry.decodeData(encoded));
+  CHECK(entry.mEncodedData.empty());
 }
 
-TEST_CASE("return empty string")
+TEST_CASE("truncated command is refused")
+{
+  auto encoded = encodeComando();
+  encoded.pop_back();
+  SharedState::StateEntry entry;
+  CHECK_FALSE(entry.decodeData(encoded));
+}
+
+TEST_CASE("error conditions")
 {
-  std::string completo = "comandodatos";
-  std::string comando = "";
-  std::error_condition ec = SharedState::extractCommand(completo,comando);
-  CHECK(comando == "");
-  CHECK(completo == "comandodatos");
-  CHECK(ec == make_error_condition(SharedState::SharedStateErrorCode::NoCommand));
+  std::error_condition ec = SharedStateErrors::UNKOWN_DATA_TYPE;
+  CHECK(ec == make_error_condition(SharedStateErrors::UNKOWN_DATA_TYPE));
+  CHECK(ec != make_error_condition(SharedStateErrors::HANDSHAKE_REFUSED));
+  CHECK(ec.message() == "Unknown data type");
 }
@@ -0,0 +1,78 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+
+#include "doctest/doctest.h"
+#include "task.hh"
+
+#include <chrono>
+#include <cstdint>
+
+// Awaiting tasks which complete without ever suspending, like small sends
+// on loopback, must not grow the native stack
+
+static constexpr uint64_t STRESS_AWAITS = 1000000;
+
+struct StackDepth
+{
+  uintptr_t mMin = UINTPTR_MAX;
+  uintptr_t mMax = 0;
+
+  void sample()
+  {
+    volatile char tMarker = 0;
+    const auto tAddr = reinterpret_cast<uintptr_t>(&tMarker);
+    if(tAddr < mMin) mMin = tAddr;
+    if(tAddr > mMax) mMax = tAddr;
+  }
+};
+
+std::task<uint64_t> completeImmediately(uint64_t value, StackDepth& depth)
+{
+  depth.sample();
+  co_return value;
+}
+
+std::task<> awaitMany(uint64_t numAwaits, StackDepth& depth, uint64_t& sum)
+{
+  for(uint64_t i = 0; i < numAwaits; ++i)
+    sum += co_await completeImmediately(i, depth);
+}
+
+TEST_CASE("synchronously completing awaits keep constant stack depth")
+{
+  StackDepth tDepth;
+  uint64_t tSum = 0;
+
+  using namespace std::chrono;
+  const auto tStart = steady_clock::now();
+  awaitMany(STRESS_AWAITS, tDepth, tSum).detach();
+  const auto tElapsed = steady_clock::now() - tStart;
+
+  CHECK(tSum == STRESS_AWAITS * (STRESS_AWAITS - 1) / 2);
+
+  /* A child completing synchronously is not resumed from within the awaiter,
+   * await_suspend returns false and the parent goes on in the same frame */
+  CHECK(tDepth.mMax - tDepth.mMin == 0);
+
+  MESSAGE( STRESS_AWAITS << " awaits took "
+           << duration_cast<milliseconds>(tElapsed).count() << "ms "
+           << duration_cast<nanoseconds>(tElapsed).count() / STRESS_AWAITS
+           << "ns each" );
+}
@@ -0,0 +1,751 @@
+/*
+ * Shared State
+ *
+ * Copyright (C) 2024  Asociación Civil Altermundi <info@altermundi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>
+ *
+ * SPDX-License-Identifier: AGPL-3.0-only
+ */
+
+#include "doctest/doctest.h"
+#include "sharedstate.hh"
+#include "binary_codec.hh"
+#include "dictionary_codec.hh"
+#include "io_context.hh"
+#include "async_socket.hh"
+#include "async_timer.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Synchronizations over loopback between two instances in the same IOContext
+
+/// Exposes state internals to seed and inspect it
+struct TestState: SharedState
+{
+  using SharedState::SharedState;
+  using SharedState::mStates;
+  using SharedState::mTypeDictionaries;
+  using SharedState::mPeerDictionaries;
+  using SharedState::mPeerSyncCursors;
+  using SharedState::mStatesChangeSeq;
+  using SharedState::mStateLock;
+  using SharedState::mIsStateShared;
+  using SharedState::StateUnlock;
+
+  void addType(
+          const std::string& typeName,
+          uint64_t maxMessageSize = DEFAULT_TYPE_MAX_MESSAGE_SIZE )
+  {
+    auto& typeConf = mTypeConf[typeName];
+    typeConf.mName = typeName;
+    typeConf.mScope = "test";
+    typeConf.mUpdateInterval = std::chrono::seconds(60);
+    typeConf.mBleachTTL = std::chrono::seconds(3600);
+    typeConf.mMaxMessageSize = maxMessageSize;
+    mStates[typeName];
+  }
+
+  void removeType(const std::string& typeName)
+  {
+    mTypeConf.erase(typeName);
+    mStates.erase(typeName);
+  }
+
+  void addEntries(
+          const std::string& typeName, const std::string& keyPrefix,
+          int count )
+  {
+    auto& state = mStates[typeName];
+    auto& changeSeq = mStatesChangeSeq[typeName];
+    const auto now = std::chrono::steady_clock::now();
+    for(int i = 0; i < count; ++i)
+    {
+      auto& entry = state[keyPrefix + std::to_string(i)];
+      entry.mAuthor = keyPrefix + "author";
+      entry.mExpiry = now + std::chrono::seconds(3600);
+      entry.mChangeSeq = ++changeSeq;
+
+      auto& allocator = entry.mData.GetAllocator();
+      entry.mData.SetObject();
+      rapidjson::Value name;
+      rapidjson::Value value;
+      const std::string hostname = "LiMe-" + keyPrefix + std::to_string(i);
+      name.SetString("hostname", 8, allocator);
+      value.SetString(hostname.c_str(), hostname.size(), allocator);
+      entry.mData.AddMember(name, value, allocator);
+      name.SetString("links", 5, allocator);
+      value.SetInt64(i % 16);
+      entry.mData.AddMember(name, value, allocator);
+    }
+  }
+};
+
+/// WIRE_PROTO_VERSION_BINARY up to WIRE_PROTO_VERSION_BATCH
+static constexpr uint32_t OLDEST_VERSION = 2;
+static constexpr uint32_t NEWEST_VERSION = 8;
+
+static const std::string TYPE_A = "test-a";
+static const std::string TYPE_B = "test-b";
+
+/// Stops the IOContext once all the coroutines of a test are done
+struct Loopback
+{
+  explicit Loopback(IOContext& ioContext): mIoContext(ioContext) {}
+
+  void finished() { if(!--mRunning) mIoContext.stop(); }
+
+  IOContext& mIoContext;
+  int mRunning = 0;
+  int mServed = 0;
+  int mServeFailures = 0;
+};
+
+static std::task<> serveConnection(
+        TestState& server, std::shared_ptr<AsyncSocket> socket,
+        Loopback& loopback )
+{
+  std::error_condition serveErr;
+  if(co_await server.handleReqSyncConnection(socket, &serveErr))
+    ++loopback.mServed;
+  else ++loopback.mServeFailures;
+  loopback.finished();
+}
+
+/// Serve the given number of connections, then close the listener
+static std::task<> serveConnections(
+        TestState& server, std::shared_ptr<ListeningSocket> listener,
+        int connections, Loopback& loopback )
+{
+  // Don't hang forever if the client fails before connecting
+  listener->setDeadline(
+              std::chrono::steady_clock::now() + std::chrono::seconds(10) );
+  for(int i = 0; i < connections; ++i)
+  {
+    std::error_condition acceptErr;
+    auto socket = co_await listener->accept(&acceptErr);
+    if(!socket) break;
+    ++loopback.mRunning;
+    serveConnection(server, socket, loopback).detach();
+  }
+  co_await listener->getIOContext().closeAFD(listener);
+  loopback.finished();
+}
+
+static std::shared_ptr<ListeningSocket> setupLoopbackListener(
+        IOContext& ioContext, sockaddr_storage& listenAddr )
+{
+  auto listener = ListeningSocket::setupListener(0, ioContext);
+  REQUIRE(listener);
+
+  sockaddr_in6 boundAddr;
+  socklen_t boundLen = sizeof(boundAddr);
+  REQUIRE(getsockname(
+              listener->getFD(), reinterpret_cast<sockaddr*>(&boundAddr),
+              &boundLen ) == 0);
+
+  memset(&listenAddr, 0, sizeof(listenAddr));
+  auto& listenAddr4 = reinterpret_cast<sockaddr_in&>(listenAddr);
+  listenAddr4.sin_family = AF_INET;
+  listenAddr4.sin_port = boundAddr.sin6_port;
+  listenAddr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return listener;
+}
+
+static std::task<> syncTwice(
+        TestState& client, TestState& server, sockaddr_storage serverAddr,
+        Loopback& loopback, bool& firstSynced, bool& secondSynced )
+{
+  std::vector<std::string> typeNames;
+  typeNames.push_back(TYPE_A);
+  typeNames.push_back(TYPE_B);
+
+  std::error_condition syncErr;
+  firstSynced = co_await client.syncWithPeer(typeNames, serverAddr, &syncErr);
+
+  // Since WIRE_PROTO_VERSION_DELTA just these are exchanged next time
+  client.addEntries(TYPE_A, "client-late-", 10);
+  server.addEntries(TYPE_B, "server-late-", 10);
+  secondSynced = co_await client.syncWithPeer(typeNames, serverAddr, &syncErr);
+
+  client.setConnectionIdleTimeout(std::chrono::seconds(0));
+  co_await client.closeIdleConnections();
+  loopback.finished();
+}
+
+static void checkSameState(
+        TestState& client, TestState& server, const std::string& typeName,
+        std::size_t expectedSize )
+{
+  const auto& clientState = client.mStates[typeName];
+  const auto& serverState = server.mStates[typeName];
+  CHECK(clientState.size() == expectedSize);
+  REQUIRE(serverState.size() == clientState.size());
+  for(const auto& [key, entry]: clientState)
+  {
+    const auto sIt = serverState.find(key);
+    REQUIRE(sIt != serverState.end());
+    CHECK(sIt->second.mAuthor == entry.mAuthor);
+    CHECK(sIt->second.mData == entry.mData);
+  }
+}
+
+/** Synchronize two data types twice between instances speaking at most the
+ * given versions, enough entries to need many frames and compression */
+static void checkLoopbackSync(uint32_t clientVersion, uint32_t serverVersion)
+{
+  INFO("client version: " << clientVersion);
+  INFO("server version: " << serverVersion);
+
+  mkdir(std::string(SharedState::SHARED_STATE_CONFIG_DIR).c_str(), 0755);
+
+  auto ioContext = IOContext::setup();
+  REQUIRE(ioContext);
+
+  TestState client(*ioContext);
+  client.setMaxWireProtoVersion(clientVersion);
+  client.addType(TYPE_A);
+  client.addType(TYPE_B);
+  client.addEntries(TYPE_A, "client-", 3000);
+
+  TestState server(*ioContext);
+  server.setMaxWireProtoVersion(serverVersion);
+  server.addType(TYPE_A);
+  server.addType(TYPE_B);
+  server.addEntries(TYPE_A, "server-", 500);
+  server.addEntries(TYPE_B, "server-", 3000);
+
+  /* Since WIRE_PROTO_VERSION_PERSISTENT one connection serves both
+   * synchronizations, before each data type needs its own */
+  const uint32_t agreedVersion = std::min(clientVersion, serverVersion);
+  const int connections = agreedVersion >= 7 ? 1 : 4;
+
+  sockaddr_storage serverAddr;
+  auto listener = setupLoopbackListener(*ioContext, serverAddr);
+
+  Loopback loopback(*ioContext);
+  loopback.mRunning = 2;
+  bool firstSynced = false;
+  bool secondSynced = false;
+  serveConnections(server, listener, connections, loopback).detach();
+  syncTwice(
+        client, server, serverAddr, loopback, firstSynced, secondSynced
+        ).detach();
+  ioContext->run();
+
+  CHECK(firstSynced);
+  CHECK(secondSynced);
+  CHECK(loopback.mServed == connections);
+  CHECK(loopback.mServeFailures == 0);
+  checkSameState(client, server, TYPE_A, 3000 + 500 + 10);
+  checkSameState(client, server, TYPE_B, 3000 + 10);
+}
+
+TEST_CASE("loopback sync at each wire protocol version")
+{
+  for(uint32_t version = OLDEST_VERSION; version <= NEWEST_VERSION; ++version)
+    checkLoopbackSync(version, version);
+}
+
+TEST_CASE("loopback sync newer client with older server")
+{
+  for(uint32_t version = OLDEST_VERSION; version < NEWEST_VERSION; ++version)
+    checkLoopbackSync(NEWEST_VERSION, version);
+}
+
+TEST_CASE("loopback sync older client with newer server")
+{
+  for(uint32_t version = OLDEST_VERSION; version < NEWEST_VERSION; ++version)
+    checkLoopbackSync(version, NEWEST_VERSION);
+}
+
+TEST_CASE("message exceeding the data type budget is refused")
+{
+  mkdir(std::string(SharedState::SHARED_STATE_CONFIG_DIR).c_str(), 0755);
+
+  auto ioContext = IOContext::setup();
+  REQUIRE(ioContext);
+
+  TestState client(*ioContext);
+  client.addType(TYPE_A);
+  client.addType(TYPE_B);
+  client.addEntries(TYPE_A, "client-", 3000);
+
+  TestState server(*ioContext);
+  server.addType(TYPE_A, 16*1024);
+  server.addType(TYPE_B);
+
+  sockaddr_storage serverAddr;
+  auto listener = setupLoopbackListener(*ioContext, serverAddr);
+
+  Loopback loopback(*ioContext);
+  loopback.mRunning = 2;
+  bool firstSynced = true;
+  bool secondSynced = true;
+  serveConnections(server, listener, 1, loopback).detach();
+  syncTwice(
+        client, server, serverAddr, loopback, firstSynced, secondSynced
+        ).detach();
+  ioContext->run();
+
+  CHECK_FALSE(firstSynced);
+  CHECK(loopback.mServeFailures == 1);
+  CHECK(server.mStates[TYPE_A].size() < 3000);
+}
+
+/// Synchronize, then synchronize again after the server forgot the type
+static std::task<> syncThenRefused(
+        TestState& client, TestState& server, sockaddr_storage serverAddr,
+        Loopback& loopback, bool& firstSynced, bool& secondSynced )
+{
+  std::vector<std::string> typeNames;
+  typeNames.push_back(TYPE_A);
+
+  std::error_condition syncErr;
+  firstSynced = co_await client.syncWithPeer(typeNames, serverAddr, &syncErr);
+
+  client.addEntries(TYPE_A, "client-late-", 10);
+  server.removeType(TYPE_A);
+  secondSynced = co_await client.syncWithPeer(typeNames, serverAddr, &syncErr);
+
+  client.setConnectionIdleTimeout(std::chrono::seconds(0));
+  co_await client.closeIdleConnections();
+  loopback.finished();
+}
+
+TEST_CASE("peer cursor doesn't advance past a refused request")
+{
+  mkdir(std::string(SharedState::SHARED_STATE_CONFIG_DIR).c_str(), 0755);
+
+  auto ioContext = IOContext::setup();
+  REQUIRE(ioContext);
+
+  /* Since WIRE_PROTO_VERSION_CHUNKED the server acknowledges each message,
+   * before only the reply tells the request got accepted */
+  TestState client(*ioContext);
+  client.setMaxWireProtoVersion(4);
+  client.addType(TYPE_A);
+  client.addEntries(TYPE_A, "client-", 10);
+
+  TestState server(*ioContext);
+  server.addType(TYPE_A);
+
+  sockaddr_storage serverAddr;
+  auto listener = setupLoopbackListener(*ioContext, serverAddr);
+
+  Loopback loopback(*ioContext);
+  loopback.mRunning = 2;
+  bool firstSynced = false;
+  bool secondSynced = true;
+  serveConnections(server, listener, 2, loopback).detach();
+  syncThenRefused(
+        client, server, serverAddr, loopback, firstSynced, secondSynced
+        ).detach();
+  ioContext->run();
+
+  CHECK(firstSynced);
+  CHECK_FALSE(secondSynced);
+  CHECK(loopback.mServeFailures == 1);
+
+  // The refused entries must be sent again next time
+  REQUIRE(client.mPeerSyncCursors.size() == 1);
+  const auto& delivered =
+          client.mPeerSyncCursors.begin()->second.mDeliveredChangeSeq;
+  REQUIRE(delivered.contains(TYPE_A));
+  CHECK(delivered.at(TYPE_A) == 10);
+  CHECK(client.mStatesChangeSeq[TYPE_A] == 20);
+}
+
+/// @return true if IOContext::run() on this thread holds the lock
+static bool holdingRunLock()
+{
+  const auto runLock = IOContext::threadRunLock();
+  return runLock && runLock->owns_lock();
+}
+
+static std::task<> nestStateUnlocks(
+        TestState& state, IOContext& ioContext, bool& checked )
+{
+  // Let run() resume us holding the lock
+  co_await YieldOperation(ioContext);
+  state.mIsStateShared = true;
+  CHECK(holdingRunLock());
+  {
+    TestState::StateUnlock outerUnlock(state);
+    CHECK_FALSE(holdingRunLock());
+    {
+      // The lock isn't ours anymore, this must not touch it
+      TestState::StateUnlock innerUnlock(state);
+      CHECK_FALSE(holdingRunLock());
+    }
+    CHECK_FALSE(holdingRunLock());
+  }
+  CHECK(holdingRunLock());
+  state.mIsStateShared = false;
+  checked = true;
+  ioContext.stop();
+}
+
+TEST_CASE("state unlock releases only the lock held by this thread")
+{
+  auto ioContext = IOContext::setup();
+  REQUIRE(ioContext);
+  TestState state(*ioContext);
+  ioContext->setRunLock(state.mStateLock);
+
+  bool checked = false;
+  nestStateUnlocks(state, *ioContext, checked).detach();
+  ioContext->run();
+  CHECK(checked);
+  CHECK(IOContext::threadRunLock() == nullptr);
+
+  // The lock must be free again, not left locked by a nested relock
+  CHECK(state.mStateLock.try_lock());
+  state.mStateLock.unlock();
+}
+
+// Hand crafted requests, to send what a well behaving client never would
+
+static void appendUint32(std::vector<uint8_t>& buffer, uint32_t value)
+{
+  value = htonl(value);
+  const auto bytes = reinterpret_cast<const uint8_t*>(&value);
+  buffer.insert(buffer.end(), bytes, bytes + 4);
+}
+
+/** Handshake proposing WIRE_PROTO_VERSION_FEATURES, with compression unless
+ * told otherwise, and confirming it right away, followed by the header of a
+ * TYPE_A message */
+static std::vector<uint8_t> rawRequestHeader(bool compression = true)
+{
+  std::vector<uint8_t> request;
+  appendUint32(request, 6);
+  appendUint32(request, 6);
+  for(int i = 0; i < 8; ++i) request.push_back(0x5a); // epoch
+  appendUint32(request, compression ? 1 : 0); // WIRE_FEATURE_COMPRESSION
+  request.push_back(static_cast<uint8_t>(TYPE_A.size()));
+  request.insert(request.end(), TYPE_A.begin(), TYPE_A.end());
+  return request;
+}
+
+static void appendFrame(
+        std::vector<uint8_t>& request, const std::vector<uint8_t>& frame )
+{
+  appendUint32(request, static_cast<uint32_t>(frame.size()));
+  request.insert(request.end(), frame.begin(), frame.end());
+}
+
+/// @return binary slice frame with a single entry
+static std::vector<uint8_t> sliceFrame(const std::string& key)
+{
+  RsJson data;
+  data.SetObject();
+  rapidjson::Value name;
+  rapidjson::Value value;
+  name.SetString("hostname", 8, data.GetAllocator());
+  value.SetString(key.c_str(), key.size(), data.GetAllocator());
+  data.AddMember(name, value, data.GetAllocator());
+  std::vector<uint8_t> encodedData;
+  BinaryWriter dataWriter(encodedData);
+  dataWriter.writeJson(data);
+
+  std::vector<uint8_t> frame;
+  BinaryWriter writer(frame);
+  writer.writeUint8(1); // BINARY_SLICE_FORMAT
+  writer.writeVarint(1);
+  writer.writeString(key);
+  writer.writeVarint(0);
+  writer.writeString("raw-author");
+  writer.writeVarint(3600);
+  writer.writeVarint(encodedData.size());
+  writer.writeBytes(encodedData.data(), encodedData.size());
+  return frame;
+}
+
+static std::vector<uint8_t> compressedFrame(
+        uint64_t dictionaryId, const std::vector<uint8_t>& raw,
+        std::span<const uint8_t> dictionary = {} )
+{
+  std::vector<uint8_t> frame;
+  BinaryWriter writer(frame);
+  writer.writeUint8(4); // BINARY_COMPRESSED_FORMAT
+  for(int i = 0; i < 8; ++i)
+    writer.writeUint8(static_cast<uint8_t>(dictionaryId >> (8*i)));
+  writer.writeVarint(raw.size());
+  REQUIRE(DictionaryCodec::compress(raw, dictionary, frame));
+  return frame;
+}
+
+/** Connect from the given loopback address, so the server can tell apart
+ * clients running in the same process */
+static std::shared_ptr<AsyncSocket> connectFrom(
+        IOContext& ioContext, const char* sourceAddr,
+        const sockaddr_storage& serverAddr )
+{
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  REQUIRE(fd != -1);
+
+  sockaddr_in bindAddr;
+  memset(&bindAddr, 0, sizeof(bindAddr));
+  bindAddr.sin_family = AF_INET;
+  REQUIRE(inet_pton(AF_INET, sourceAddr, &bindAddr.sin_addr) == 1);
+  REQUIRE(bind(
+              fd, reinterpret_cast<const sockaddr*>(&bindAddr),
+              sizeof(bindAddr) ) == 0);
+
+  // The listener is ready so the kernel completes it without waiting
+  REQUIRE(connect(
+              fd, reinterpret_cast<const sockaddr*>(&serverAddr),
+              sizeof(sockaddr_in) ) == 0);
+
+  auto socket = ioContext.registerFD<AsyncSocket>(fd);
+  REQUIRE(socket);
+  ioContext.attach(socket.get());
+  return socket;
+}
+
+/// Send the request, then wait for the server to close the connection
+static std::task<> sendRawRequest(
+        std::shared_ptr<AsyncSocket> socket, std::vector<uint8_t> request,
+        Loopback& loopback )
+{
+  std::error_condition rawErr;
+  co_await socket->send(request.data(), request.size(), &rawErr);
+  shutdown(socket->getFD(), SHUT_WR);
+
+  uint8_t drained[64];
+  while(co_await socket->recv(drained, sizeof(drained), &rawErr) > 0);
+
+  co_await socket->getIOContext().closeAFD(socket);
+  loopback.finished();
+}
+
+/// @return true if the server refused the request
+static bool serveRawRequest(
+        TestState& server, IOContext& ioContext, const char* sourceAddr,
+        const std::vector<uint8_t>& request )
+{
+  sockaddr_storage serverAddr;
+  auto listener = setupLoopbackListener(ioContext, serverAddr);
+
+  Loopback loopback(ioContext);
+  loopback.mRunning = 2;
+  serveConnections(server, listener, 1, loopback).detach();
+  sendRawRequest(
+        connectFrom(ioContext, sourceAddr, serverAddr), request, loopback
+        ).detach();
+  ioContext.run();
+
+  CHECK(loopback.mServed + loopback.mServeFailures == 1);
+  return loopback.mServeFailures == 1;
+}
+
+TEST_CASE("compressed frame with unknown dictionary is refused")
+{
+  auto ioContext = IOContext::setup();
+  REQUIRE(ioContext);
+  TestState server(*ioContext);
+  server.addType(TYPE_A);
+
+  auto request = rawRequestHeader();
+  appendFrame(request, compressedFrame(0x1234, sliceFrame("unknown-dict")));
+  appendUint32(request, 0);
+
+  CHECK(serveRawRequest(server, *ioContext, "127.0.0.1", request));
+  CHECK_FALSE(server.mStates[TYPE_A].contains("unknown-dict"));
+}
+
+TEST_CASE("compressed frame nested in a compressed frame is refused")
+{
+  auto ioContext = IOContext::setup();
+  REQUIRE(ioContext);
+  TestState server(*ioContext);
+  server.addType(TYPE_A);
+
+  auto request = rawRequestHeader();
+  appendFrame(
+        request, compressedFrame(0, compressedFrame(0, sliceFrame("nested"))) );
+  appendUint32(request, 0);
+
+  CHECK(serveRawRequest(server, *ioContext, "127.0.0.1", request));
+  CHECK_FALSE(server.mStates[TYPE_A].contains("nested"));
+}
+
+TEST_CASE("truncated frame is refused")
+{
+  auto ioContext = IOContext::setup();
+  REQUIRE(ioContext);
+  TestState server(*ioContext);
+  server.addType(TYPE_A);
+
+  const auto frame = sliceFrame("truncated");
+  auto request = rawRequestHeader();
+  appendUint32(request, static_cast<uint32_t>(frame.size()));
+  request.insert(request.end(), frame.begin(), frame.end() - 4);
+
+  CHECK(serveRawRequest(server, *ioContext, "127.0.0.1", request));
+  CHECK_FALSE(server.mStates[TYPE_A].contains("truncated"));
+}
+
+TEST_CASE("dictionaries received from a peer are not usable by others")
+{
+  mkdir(std::string(SharedState::SHARED_STATE_CONFIG_DIR).c_str(), 0755);
+
+  auto ioContext = IOContext::setup();
+  REQUIRE(ioContext);
+
+  TestState client(*ioContext);
+  client.addType(TYPE_A);
+  client.addType(TYPE_B);
+  client.addEntries(TYPE_A, "client-", 3000);
+
+  TestState server(*ioContext);
+  server.addType(TYPE_A);
+  server.addType(TYPE_B);
+
+  sockaddr_storage serverAddr;
+  auto listener = setupLoopbackListener(*ioContext, serverAddr);
+
+  Loopback loopback(*ioContext);
+  loopback.mRunning = 2;
+  bool firstSynced = false;
+  bool secondSynced = false;
+  serveConnections(server, listener, 1, loopback).detach();
+  syncTwice(
+        client, server, serverAddr, loopback, firstSynced, secondSynced
+        ).detach();
+  ioContext->run();
+  REQUIRE(firstSynced);
+
+  const auto& dictionary = client.mTypeDictionaries[TYPE_A];
+  REQUIRE(dictionary.mId);
+  REQUIRE(dictionary.mData);
+  REQUIRE(server.mPeerDictionaries.size() == 1);
+  CHECK(server.mPeerDictionaries.begin()->second.contains(dictionary.mId));
+
+  // Another peer referring to the same dictionary id must not get it
+  auto request = rawRequestHeader();
+  appendFrame(
+        request, compressedFrame(
+            dictionary.mId, sliceFrame("other-peer"), *dictionary.mData ) );
+  appendUint32(request, 0);
+
+  CHECK(serveRawRequest(server, *ioContext, "127.0.0.2", request));
+  CHECK_FALSE(server.mStates[TYPE_A].contains("other-peer"));
+}
+
+/// @return address of a peer neither the client nor the server
+static sockaddr_storage thirdPeerAddr()
+{
+  sockaddr_storage thirdPeer;
+  memset(&thirdPeer, 0, sizeof(thirdPeer));
+  auto& thirdPeer4 = reinterpret_cast<sockaddr_in&>(thirdPeer);
+  thirdPeer4.sin_family = AF_INET;
+  inet_pton(AF_INET, "10.0.0.3", &thirdPeer4.sin_addr);
+  return thirdPeer;
+}
+
+/// @return state slice with a single entry
+static std::map<SharedState::StateKey, SharedState::StateEntry> thirdPeerSlice(
+        const std::string& key )
+{
+  std::map<SharedState::StateKey, SharedState::StateEntry> slice;
+  auto& entry = slice[key];
+  entry.mAuthor = "third-author";
+  entry.mExpiry = std::chrono::steady_clock::now() + std::chrono::hours(1);
+  entry.mData.SetObject();
+  return slice;
+}
+
+/** Send the request in two parts, merging an entry from a third peer into the
+ * server state in between, then collect the server reply */
+static std::task<> sendRequestMergingMeanwhile(
+        TestState& server, std::shared_ptr<AsyncSocket> socket,
+        std::vector<uint8_t> firstPart, std::vector<uint8_t> secondPart,
+        std::vector<uint8_t>& reply, Loopback& loopback )
+{
+  auto& ioContext = socket->getIOContext();
+  std::error_condition rawErr;
+  co_await socket->send(firstPart.data(), firstPart.size(), &rawErr);
+
+  // Let the server start merging the first frame
+  co_await SleepOperation(
+              ioContext,
+              std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(50) );
+
+  const auto thirdPeerChanges = co_await server.merge(
+              TYPE_A, thirdPeerSlice("third-peer"), thirdPeerAddr() );
+  CHECK(thirdPeerChanges == 1);
+
+  co_await socket->send(secondPart.data(), secondPart.size(), &rawErr);
+  shutdown(socket->getFD(), SHUT_WR);
+
+  uint8_t received[64];
+  ssize_t numReceived;
+  while((numReceived = co_await socket->recv(
+             received, sizeof(received), &rawErr )) > 0)
+    reply.insert(reply.end(), received, received + numReceived);
+
+  co_await ioContext.closeAFD(socket);
+  loopback.finished();
+}
+
+TEST_CASE("entries merged from another peer meanwhile are not skipped")
+{
+  auto ioContext = IOContext::setup();
+  REQUIRE(ioContext);
+  TestState server(*ioContext);
+  server.addType(TYPE_A);
+
+  // Uncompressed so the reply can be searched for keys
+  auto firstPart = rawRequestHeader(false);
+  appendFrame(firstPart, sliceFrame("raw-first"));
+  std::vector<uint8_t> secondPart;
+  appendFrame(secondPart, sliceFrame("raw-second"));
+  appendUint32(secondPart, 0);
+
+  sockaddr_storage serverAddr;
+  auto listener = setupLoopbackListener(*ioContext, serverAddr);
+
+  Loopback loopback(*ioContext);
+  loopback.mRunning = 2;
+  std::vector<uint8_t> reply;
+  serveConnections(server, listener, 1, loopback).detach();
+  sendRequestMergingMeanwhile(
+        server, connectFrom(*ioContext, "127.0.0.1", serverAddr),
+        firstPart, secondPart, reply, loopback ).detach();
+  ioContext->run();
+
+  // The raw client doesn't acknowledge the reply, so serving it fails after
+  CHECK(loopback.mServed + loopback.mServeFailures == 1);
+  CHECK(server.mStates[TYPE_A].contains("raw-second"));
+
+  /* The third peer entry got a change sequence number among those of the
+   * merged ones, but the client never got it so it must be in the reply */
+  const std::string thirdPeerKey = "third-peer";
+  CHECK(std::search(
+            reply.begin(), reply.end(),
+            thirdPeerKey.begin(), thirdPeerKey.end() ) != reply.end());
+}